@@ -21,11 +21,63 @@
 #endif
 #include "mongo_wrapper.h"
 #include "utils/inval.h"
+#include "utils/memutils.h"
 #include "utils/syscache.h"
 
 /* Length of host */
 #define HOST_LEN 256
 
+#ifdef META_DRIVER
+/* Longest {_id: value} selector whose writes can be deferred */
+#define DEFERRED_ID_MAXLEN 128
+
+/*
+ * Deferred writes are kept per connection and collection.  Within a
+ * collection, all writes to the same _id are coalesced into one entry, keyed
+ * by the raw bytes of its {_id: value} selector.
+ */
+typedef struct DeferredDocKey
+{
+	uint32		len;			/* length of the selector */
+	char		data[DEFERRED_ID_MAXLEN];	/* selector, zero padded */
+} DeferredDocKey;
+
+typedef struct DeferredDoc
+{
+	DeferredDocKey key;			/* hash key (must be first) */
+	MongoDeferredWriteKind kind;
+	BSON	   *selector;		/* {_id: value} */
+	BSON	   *doc;			/* new document, $set fields for an update,
+								 * NULL for a delete */
+	int			level;			/* subtransaction nesting level of the last
+								 * write */
+} DeferredDoc;
+
+typedef struct DeferredCollection
+{
+	char	   *database;
+	char	   *collection;
+	BSON	   *writeOptions;	/* write options of the first writer */
+	HTAB	   *docs;			/* DeferredDoc entries */
+} DeferredCollection;
+
+/*
+ * The state of a deferred document before its first write in a
+ * subtransaction, restored if the subtransaction rolls back.
+ */
+typedef struct DeferredUndo
+{
+	int			level;			/* subtransaction nesting level */
+	DeferredCollection *dc;
+	DeferredDocKey key;
+	bool		existed;		/* false if there was no entry */
+	MongoDeferredWriteKind kind;
+	BSON	   *selector;
+	BSON	   *doc;
+	int			oldlevel;
+} DeferredUndo;
+#endif
+
 /*
  * Connection cache hash table entry
  *
@@ -46,6 +98,12 @@ typedef struct ConnCacheEntry
 	bool		invalidated;	/* true if reconnect is pending */
 	uint32		server_hashvalue;	/* hash value of foreign server OID */
 	uint32		mapping_hashvalue;  /* hash value of user mapping OID */
+#ifdef META_DRIVER
+	List	   *deferred;		/* DeferredCollections with pending writes */
+	List	   *undo;			/* DeferredUndo records, oldest first */
+	mongoc_client_session_t *session;	/* remote transaction, or NULL */
+	BSON	   *session_opts;	/* options carrying the session id */
+#endif
 } ConnCacheEntry;
 
 /*
@@ -53,6 +111,37 @@ typedef struct ConnCacheEntry
  */
 static HTAB *ConnectionHash = NULL;
 
+#ifdef META_DRIVER
+/* Memory for deferred write bookkeeping, reset at transaction end */
+static MemoryContext DeferredWriteContext = NULL;
+static bool DeferredWritesPending = false;
+
+/*
+ * Deepest subtransaction nesting level that sent writes inside a MongoDB
+ * transaction, and whether such a subtransaction has rolled back.  MongoDB
+ * can't roll back part of a transaction, so the local transaction must not
+ * commit then.
+ */
+static int	RemoteWriteLevel = 0;
+static bool RemoteXactDoomed = false;
+
+static void mongo_xact_callback(XactEvent event, void *arg);
+static void mongo_subxact_callback(SubXactEvent event,
+								   SubTransactionId mySubid,
+								   SubTransactionId parentSubid, void *arg);
+static void mongo_save_undo(ConnCacheEntry *entry, DeferredCollection *dc,
+							DeferredDocKey *key, DeferredDoc *dd, int level);
+static void mongo_apply_undo(DeferredUndo *undo);
+static void mongo_free_undo(DeferredUndo *undo);
+static ConnCacheEntry *mongo_find_connection_entry(MONGO_CONN *conn);
+static void mongo_flush_entry(ConnCacheEntry *entry);
+static void mongo_discard_entry(ConnCacheEntry *entry);
+static void mongo_discard_collection(DeferredCollection *dc);
+static void mongo_begin_remote_xact(ConnCacheEntry *entry);
+static void mongo_commit_remote_xact(ConnCacheEntry *entry);
+static BSON *mongo_merge_fields(const BSON *base, const BSON *changes);
+#endif
+
 static void mongo_inval_callback(Datum arg, int cacheid, uint32 hashvalue);
 static void make_new_connection(ConnCacheEntry *entry,
 								ForeignServer *server,
@@ -101,6 +190,10 @@ mongo_get_connection(ForeignServer *server, UserMapping *user,
 									  mongo_inval_callback, (Datum) 0);
 		CacheRegisterSyscacheCallback(USERMAPPINGOID,
 									  mongo_inval_callback, (Datum) 0);
+#ifdef META_DRIVER
+		RegisterXactCallback(mongo_xact_callback, NULL);
+		RegisterSubXactCallback(mongo_subxact_callback, NULL);
+#endif
 	}
 
 	/* Create hash key for the entry.  Assume no pad bytes in key struct */
@@ -115,10 +208,24 @@ mongo_get_connection(ForeignServer *server, UserMapping *user,
 	{
 		/* Initialize new hashtable entry (key is already filled in) */
 		entry->conn = NULL;
+#ifdef META_DRIVER
+		entry->deferred = NIL;
+		entry->undo = NIL;
+		entry->session = NULL;
+		entry->session_opts = NULL;
+#endif
 	}
 
-	/* If an existing entry has invalid connection then release it */
-	if (entry->conn != NULL && entry->invalidated)
+	/*
+	 * If an existing entry has invalid connection then release it, unless
+	 * it still carries writes or a remote transaction of the current local
+	 * transaction.
+	 */
+	if (entry->conn != NULL && entry->invalidated
+#ifdef META_DRIVER
+		&& entry->deferred == NIL && entry->session == NULL
+#endif
+		)
 	{
 		elog(DEBUG3, "disconnecting mongo_fdw connection %p for option changes to take effect",
 			 entry->conn);
@@ -270,3 +377,771 @@ make_new_connection(ConnCacheEntry *entry,
 		GetSysCacheHashValue1(USERMAPPINGOID, ObjectIdGetDatum(umoid));
 #endif
 }
+
+#ifdef META_DRIVER
+/*
+ * mongo_defer_write
+ *		Queue a write to the collection given by 'opt' until the local
+ *		transaction commits.
+ *
+ * 'selector' is the {_id: value} document of the target, and may be NULL
+ * only for an insert, in which case an ObjectId is generated here.  For an
+ * update, 'doc' is the {$set: {...}} document; for a delete it is unused.
+ * Both are copied.  Writes to an _id that already has a pending write are
+ * merged into it.
+ *
+ * Returns false if the write can't be deferred, in which case the caller
+ * must send it right away.
+ */
+bool
+mongo_defer_write(MONGO_CONN *conn, MongoFdwOptions *opt, BSON *writeOptions,
+				  MongoDeferredWriteKind kind, BSON *selector, BSON *doc)
+{
+	ConnCacheEntry *entry;
+	DeferredCollection *dc = NULL;
+	DeferredDoc *dd;
+	DeferredDocKey key;
+	BSON	   *new_selector = NULL;
+	BSON	   *new_doc = NULL;
+	MemoryContext oldcxt;
+	ListCell   *lc;
+	bool		found;
+	int			level;
+
+	entry = mongo_find_connection_entry(conn);
+	if (entry == NULL)
+		return false;
+
+	if (selector != NULL && selector->len > DEFERRED_ID_MAXLEN)
+		return false;
+
+	/* Prepare the selector and the document to remember */
+	if (selector == NULL)
+	{
+		bson_oid_t	oid;
+
+		Assert(kind == DEFERRED_INSERT);
+		bson_oid_init(&oid, NULL);
+		new_selector = bson_new();
+		BSON_APPEND_OID(new_selector, "_id", &oid);
+		new_doc = bson_new();
+		BSON_APPEND_OID(new_doc, "_id", &oid);
+		bson_concat(new_doc, doc);
+	}
+	else
+	{
+		new_selector = bson_copy(selector);
+		if (kind == DEFERRED_UPDATE)
+		{
+			bson_iter_t it;
+			uint32_t	len;
+			const uint8_t *data;
+			bson_t		set;
+
+			if (!bson_iter_init_find(&it, doc, "$set") ||
+				!BSON_ITER_HOLDS_DOCUMENT(&it))
+				elog(ERROR, "unexpected update document");
+			bson_iter_document(&it, &len, &data);
+			if (!bson_init_static(&set, data, len))
+				elog(ERROR, "unexpected update document");
+			new_doc = bson_copy(&set);
+		}
+		else if (kind != DEFERRED_DELETE)
+			new_doc = bson_copy(doc);
+	}
+
+	if (DeferredWriteContext == NULL)
+		DeferredWriteContext = AllocSetContextCreate(TopMemoryContext,
+													 "mongo_fdw deferred writes",
+													 ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(DeferredWriteContext);
+
+	/* Find the buffer of the collection, creating it if needed */
+	foreach(lc, entry->deferred)
+	{
+		DeferredCollection *cur = (DeferredCollection *) lfirst(lc);
+
+		if (strcmp(cur->database, opt->svr_database) == 0 &&
+			strcmp(cur->collection, opt->collectionName) == 0)
+		{
+			dc = cur;
+			break;
+		}
+	}
+
+	if (dc == NULL)
+	{
+		HASHCTL		ctl;
+
+		dc = (DeferredCollection *) palloc0(sizeof(DeferredCollection));
+		dc->database = pstrdup(opt->svr_database);
+		dc->collection = pstrdup(opt->collectionName);
+		dc->writeOptions = writeOptions ? bson_copy(writeOptions) : NULL;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(DeferredDocKey);
+		ctl.entrysize = sizeof(DeferredDoc);
+		ctl.hcxt = DeferredWriteContext;
+		dc->docs = hash_create("mongo_fdw deferred documents", 256, &ctl,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		entry->deferred = lappend(entry->deferred, dc);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	MemSet(&key, 0, sizeof(key));
+	key.len = new_selector->len;
+	memcpy(key.data, bson_get_data(new_selector), new_selector->len);
+
+	dd = (DeferredDoc *) hash_search(dc->docs, &key, HASH_ENTER, &found);
+	DeferredWritesPending = true;
+
+	/* Remember the state to go back to if the subtransaction rolls back */
+	level = GetCurrentTransactionNestLevel();
+	if (level > 1 && (!found || dd->level < level))
+		mongo_save_undo(entry, dc, &key, found ? dd : NULL, level);
+	dd->level = level;
+
+	if (!found)
+	{
+		dd->kind = kind;
+		dd->selector = new_selector;
+		dd->doc = new_doc;
+		return true;
+	}
+
+	/* Coalesce with the pending write to the same document */
+	bson_destroy(new_selector);
+	switch (kind)
+	{
+		case DEFERRED_INSERT:
+			if (dd->kind != DEFERRED_DELETE)
+			{
+				bson_destroy(new_doc);
+				ereport(ERROR,
+						(errcode(ERRCODE_UNIQUE_VIOLATION),
+						 errmsg("duplicate _id in deferred writes to \"%s.%s\"",
+								dc->database, dc->collection)));
+			}
+			/* Re-inserting a deleted document replaces it */
+			dd->kind = DEFERRED_REPLACE;
+			dd->doc = new_doc;
+			break;
+
+		case DEFERRED_REPLACE:
+			if (dd->doc)
+				bson_destroy(dd->doc);
+			dd->kind = DEFERRED_REPLACE;
+			dd->doc = new_doc;
+			break;
+
+		case DEFERRED_UPDATE:
+			if (dd->kind == DEFERRED_DELETE)
+			{
+				/* Nothing left to update */
+				bson_destroy(new_doc);
+			}
+			else
+			{
+				BSON	   *merged = mongo_merge_fields(dd->doc, new_doc);
+
+				bson_destroy(dd->doc);
+				bson_destroy(new_doc);
+				dd->doc = merged;
+			}
+			break;
+
+		case DEFERRED_DELETE:
+			if (dd->kind == DEFERRED_INSERT)
+			{
+				/* The document never has to reach the server */
+				bson_destroy(dd->selector);
+				bson_destroy(dd->doc);
+				hash_search(dc->docs, &key, HASH_REMOVE, NULL);
+			}
+			else
+			{
+				if (dd->doc)
+					bson_destroy(dd->doc);
+				dd->kind = DEFERRED_DELETE;
+				dd->doc = NULL;
+			}
+			break;
+	}
+
+	return true;
+}
+
+/*
+ * mongo_flush_deferred_writes
+ *		Send the pending deferred writes of connection 'conn', so that queries
+ *		and other writes issued on it see them.
+ */
+void
+mongo_flush_deferred_writes(MONGO_CONN *conn)
+{
+	ConnCacheEntry *entry;
+
+	if (!DeferredWritesPending)
+		return;
+
+	entry = mongo_find_connection_entry(conn);
+	if (entry != NULL && entry->deferred != NIL)
+		mongo_flush_entry(entry);
+}
+
+/*
+ * mongo_discard_deferred_writes
+ *		Forget the pending deferred writes to one collection, for instance
+ *		because it is about to be emptied.
+ */
+void
+mongo_discard_deferred_writes(MONGO_CONN *conn, char *database,
+							  char *collection)
+{
+	ConnCacheEntry *entry;
+	ListCell   *lc;
+
+	if (!DeferredWritesPending)
+		return;
+
+	entry = mongo_find_connection_entry(conn);
+	if (entry == NULL)
+		return;
+
+	foreach(lc, entry->deferred)
+	{
+		DeferredCollection *dc = (DeferredCollection *) lfirst(lc);
+
+		if (strcmp(dc->database, database) == 0 &&
+			strcmp(dc->collection, collection) == 0)
+		{
+			ListCell   *lc_undo;
+
+			foreach(lc_undo, entry->undo)
+			{
+				DeferredUndo *undo = (DeferredUndo *) lfirst(lc_undo);
+
+				if (undo->dc == dc)
+				{
+					mongo_free_undo(undo);
+					entry->undo = foreach_delete_current(entry->undo, lc_undo);
+				}
+			}
+
+			mongo_discard_collection(dc);
+			entry->deferred = list_delete_ptr(entry->deferred, dc);
+			break;
+		}
+	}
+}
+
+/*
+ * mongo_get_session_opts
+ *		Return the options that make an operation on 'conn' part of the
+ *		remote transaction opened for deferred writes, or NULL if there is
+ *		none.
+ */
+BSON *
+mongo_get_session_opts(MONGO_CONN *conn)
+{
+	ConnCacheEntry *entry;
+
+	if (ConnectionHash == NULL)
+		return NULL;
+
+	entry = mongo_find_connection_entry(conn);
+
+	return entry ? entry->session_opts : NULL;
+}
+
+/*
+ * mongo_get_write_session_opts
+ *		Return the options that make a write sent right away on 'conn' part
+ *		of the remote transaction, which is opened here if
+ *		mongo_fdw.deferred_write_transaction is set, or NULL if there is none.
+ *
+ * Writes that could not be deferred are then committed together with the
+ * deferred ones.
+ */
+BSON *
+mongo_get_write_session_opts(MONGO_CONN *conn)
+{
+	ConnCacheEntry *entry;
+
+	entry = mongo_find_connection_entry(conn);
+	if (entry == NULL)
+		return NULL;
+
+	mongo_begin_remote_xact(entry);
+	if (entry->session)
+		RemoteWriteLevel = Max(RemoteWriteLevel,
+							   GetCurrentTransactionNestLevel());
+
+	return entry->session_opts;
+}
+
+/*
+ * mongo_find_connection_entry
+ *		Find the connection cache entry owning 'conn'.
+ */
+static ConnCacheEntry *
+mongo_find_connection_entry(MONGO_CONN *conn)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	if (ConnectionHash == NULL || conn == NULL)
+		return NULL;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn == conn)
+		{
+			hash_seq_term(&scan);
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * mongo_flush_entry
+ *		Send the deferred writes of a connection as one unordered bulk write
+ *		per collection.
+ */
+static void
+mongo_flush_entry(ConnCacheEntry *entry)
+{
+	ListCell   *lc;
+
+	mongo_begin_remote_xact(entry);
+	if (entry->session)
+		RemoteWriteLevel = Max(RemoteWriteLevel,
+							   GetCurrentTransactionNestLevel());
+
+	foreach(lc, entry->deferred)
+	{
+		DeferredCollection *dc = (DeferredCollection *) lfirst(lc);
+		HASH_SEQ_STATUS scan;
+		DeferredDoc *dd;
+		MONGO_BULK *bulk;
+		BSON	   *opts = dc->writeOptions;
+		BSON	   *update;
+
+		if (hash_get_num_entries(dc->docs) == 0)
+			continue;
+
+		/*
+		 * Operations inside a transaction can't carry their own write
+		 * concern, the transaction's applies instead.
+		 */
+		if (entry->session && opts)
+		{
+			opts = bson_new();
+			bson_copy_to_excluding_noinit(dc->writeOptions, opts,
+										  "writeConcern", NULL);
+		}
+
+		bulk = mongoBulkCreate(entry->conn, dc->database, dc->collection, opts);
+		if (opts != dc->writeOptions)
+			bson_destroy(opts);
+		if (entry->session)
+			mongoc_bulk_operation_set_client_session(bulk, entry->session);
+
+		hash_seq_init(&scan, dc->docs);
+		while ((dd = (DeferredDoc *) hash_seq_search(&scan)))
+		{
+			switch (dd->kind)
+			{
+				case DEFERRED_INSERT:
+					mongoBulkInsert(bulk, dd->doc);
+					break;
+				case DEFERRED_REPLACE:
+					mongoBulkReplace(bulk, dd->selector, dd->doc, true);
+					break;
+				case DEFERRED_UPDATE:
+					update = bson_new();
+					BSON_APPEND_DOCUMENT(update, "$set", dd->doc);
+					mongoBulkUpdate(bulk, dd->selector, update, false);
+					bson_destroy(update);
+					break;
+				case DEFERRED_DELETE:
+					mongoBulkDelete(bulk, dd->selector);
+					break;
+			}
+		}
+
+		mongoBulkExecute(bulk);
+	}
+
+	mongo_discard_entry(entry);
+}
+
+/*
+ * mongo_discard_entry
+ *		Forget all deferred writes of a connection.
+ */
+static void
+mongo_discard_entry(ConnCacheEntry *entry)
+{
+	ListCell   *lc;
+
+	foreach(lc, entry->deferred)
+		mongo_discard_collection((DeferredCollection *) lfirst(lc));
+	foreach(lc, entry->undo)
+		mongo_free_undo((DeferredUndo *) lfirst(lc));
+
+	/* The lists themselves live in DeferredWriteContext */
+	entry->deferred = NIL;
+	entry->undo = NIL;
+}
+
+/*
+ * mongo_discard_collection
+ *		Release the documents kept by one collection buffer.
+ */
+static void
+mongo_discard_collection(DeferredCollection *dc)
+{
+	HASH_SEQ_STATUS scan;
+	DeferredDoc *dd;
+
+	hash_seq_init(&scan, dc->docs);
+	while ((dd = (DeferredDoc *) hash_seq_search(&scan)))
+	{
+		bson_destroy(dd->selector);
+		if (dd->doc)
+			bson_destroy(dd->doc);
+	}
+	hash_destroy(dc->docs);
+
+	if (dc->writeOptions)
+		bson_destroy(dc->writeOptions);
+}
+
+/*
+ * mongo_begin_remote_xact
+ *		Start a MongoDB transaction on the connection if deferred writes are
+ *		to be applied atomically and none is open yet.
+ */
+static void
+mongo_begin_remote_xact(ConnCacheEntry *entry)
+{
+	bson_error_t error;
+
+	if (entry->session != NULL || !mongo_fdw_deferred_write_transaction)
+		return;
+
+	entry->session = mongoc_client_start_session(entry->conn, NULL, &error);
+	if (entry->session == NULL)
+		ereport(ERROR,
+				(errmsg("could not start MongoDB session"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+
+	if (!mongoc_client_session_start_transaction(entry->session, NULL,
+												 &error))
+		ereport(ERROR,
+				(errmsg("could not start MongoDB transaction"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+
+	entry->session_opts = bson_new();
+	if (!mongoc_client_session_append(entry->session, entry->session_opts,
+									  &error))
+		ereport(ERROR,
+				(errmsg("could not start MongoDB transaction"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+}
+
+/*
+ * mongo_commit_remote_xact
+ *		Commit the MongoDB transaction of the connection, if any.
+ */
+static void
+mongo_commit_remote_xact(ConnCacheEntry *entry)
+{
+	bson_error_t error;
+	bson_t		reply;
+	bool		r;
+
+	if (entry->session == NULL)
+		return;
+
+	r = mongoc_client_session_commit_transaction(entry->session, &reply,
+												 &error);
+	bson_destroy(&reply);
+	if (!r)
+		ereport(ERROR,
+				(errmsg("could not commit MongoDB transaction"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+
+	bson_destroy(entry->session_opts);
+	entry->session_opts = NULL;
+	mongoc_client_session_destroy(entry->session);
+	entry->session = NULL;
+}
+
+/*
+ * mongo_merge_fields
+ *		Return a copy of 'base' with the fields of 'changes' set on it.
+ */
+static BSON *
+mongo_merge_fields(const BSON *base, const BSON *changes)
+{
+	BSON	   *result = bson_new();
+	bson_iter_t it;
+
+	if (bson_iter_init(&it, base))
+	{
+		while (bson_iter_next(&it))
+		{
+			if (!bson_has_field(changes, bson_iter_key(&it)))
+				bson_append_iter(result, NULL, -1, &it);
+		}
+	}
+	bson_concat(result, changes);
+
+	return result;
+}
+
+/*
+ * mongo_xact_callback
+ *		Flush deferred writes before the local transaction commits, and drop
+ *		them if it aborts.
+ */
+static void
+mongo_xact_callback(XactEvent event, void *arg)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	switch (event)
+	{
+		case XACT_EVENT_PARALLEL_PRE_COMMIT:
+		case XACT_EVENT_PRE_COMMIT:
+			if (RemoteXactDoomed)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot commit writes to MongoDB that were rolled back to a savepoint"),
+						 errdetail("The writes were already sent inside the MongoDB transaction, which cannot roll back part of its writes.")));
+
+			hash_seq_init(&scan, ConnectionHash);
+			while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+			{
+				if (entry->deferred != NIL)
+					mongo_flush_entry(entry);
+				mongo_commit_remote_xact(entry);
+			}
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			if (DeferredWritesPending)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has deferred writes to MongoDB")));
+			return;
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PREPARE:
+			/* Everything was sent at pre-commit */
+			break;
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_ABORT:
+			hash_seq_init(&scan, ConnectionHash);
+			while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+			{
+				mongo_discard_entry(entry);
+
+				/* Destroying the session aborts its transaction */
+				if (entry->session)
+				{
+					bson_destroy(entry->session_opts);
+					entry->session_opts = NULL;
+					mongoc_client_session_destroy(entry->session);
+					entry->session = NULL;
+				}
+			}
+			break;
+	}
+
+	if (event == XACT_EVENT_PRE_COMMIT ||
+		event == XACT_EVENT_PARALLEL_PRE_COMMIT ||
+		event == XACT_EVENT_ABORT ||
+		event == XACT_EVENT_PARALLEL_ABORT)
+	{
+		DeferredWritesPending = false;
+		RemoteWriteLevel = 0;
+		RemoteXactDoomed = false;
+		if (DeferredWriteContext)
+			MemoryContextReset(DeferredWriteContext);
+	}
+}
+
+/*
+ * mongo_subxact_callback
+ *		Drop the deferred writes of a subtransaction that rolls back, and hand
+ *		those of one that commits over to its parent.
+ *
+ * Writes already sent can't be taken back.  Inside a MongoDB transaction,
+ * the local transaction is then kept from committing.
+ */
+static void
+mongo_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					   SubTransactionId parentSubid, void *arg)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+	int			level;
+
+	if (event != SUBXACT_EVENT_COMMIT_SUB && event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	level = GetCurrentTransactionNestLevel();
+
+	if (RemoteWriteLevel >= level)
+	{
+		if (event == SUBXACT_EVENT_ABORT_SUB)
+			RemoteXactDoomed = true;
+		RemoteWriteLevel = level - 1;
+	}
+
+	if (!DeferredWritesPending)
+		return;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		ListCell   *lc;
+
+		if (event == SUBXACT_EVENT_ABORT_SUB)
+		{
+			/* Restore the documents newest change first */
+			while (entry->undo != NIL)
+			{
+				DeferredUndo *undo = (DeferredUndo *) llast(entry->undo);
+
+				if (undo->level < level)
+					break;
+
+				mongo_apply_undo(undo);
+				entry->undo = list_delete_last(entry->undo);
+			}
+			continue;
+		}
+
+		/* The parent takes the writes over, down to the top level */
+		foreach(lc, entry->undo)
+		{
+			DeferredUndo *undo = (DeferredUndo *) lfirst(lc);
+
+			if (undo->level < level)
+				continue;
+
+			if (level - 1 > 1)
+				undo->level = level - 1;
+			else
+			{
+				mongo_free_undo(undo);
+				entry->undo = foreach_delete_current(entry->undo, lc);
+			}
+		}
+
+		foreach(lc, entry->deferred)
+		{
+			DeferredCollection *dc = (DeferredCollection *) lfirst(lc);
+			HASH_SEQ_STATUS doc_scan;
+			DeferredDoc *dd;
+
+			hash_seq_init(&doc_scan, dc->docs);
+			while ((dd = (DeferredDoc *) hash_seq_search(&doc_scan)))
+			{
+				if (dd->level >= level)
+					dd->level = level - 1;
+			}
+		}
+	}
+}
+
+/*
+ * mongo_save_undo
+ *		Add an undo record for the deferred document 'dd' of 'dc', before its
+ *		first write at subtransaction nesting level 'level'.  'dd' is NULL
+ *		for a document with no pending write yet.
+ */
+static void
+mongo_save_undo(ConnCacheEntry *entry, DeferredCollection *dc,
+				DeferredDocKey *key, DeferredDoc *dd, int level)
+{
+	MemoryContext oldcxt;
+	DeferredUndo *undo;
+
+	oldcxt = MemoryContextSwitchTo(DeferredWriteContext);
+
+	undo = (DeferredUndo *) palloc0(sizeof(DeferredUndo));
+	undo->level = level;
+	undo->dc = dc;
+	memcpy(&undo->key, key, sizeof(DeferredDocKey));
+	if (dd)
+	{
+		undo->existed = true;
+		undo->kind = dd->kind;
+		undo->selector = bson_copy(dd->selector);
+		undo->doc = dd->doc ? bson_copy(dd->doc) : NULL;
+		undo->oldlevel = dd->level;
+	}
+	entry->undo = lappend(entry->undo, undo);
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * mongo_apply_undo
+ *		Put a deferred document back in the state kept by 'undo', which is
+ *		released.
+ */
+static void
+mongo_apply_undo(DeferredUndo *undo)
+{
+	DeferredDoc *dd;
+	bool		found;
+
+	dd = (DeferredDoc *) hash_search(undo->dc->docs, &undo->key,
+									 undo->existed ? HASH_ENTER : HASH_FIND,
+									 &found);
+
+	if (found)
+	{
+		bson_destroy(dd->selector);
+		if (dd->doc)
+			bson_destroy(dd->doc);
+	}
+
+	if (!undo->existed)
+	{
+		if (found)
+			hash_search(undo->dc->docs, &undo->key, HASH_REMOVE, NULL);
+		return;
+	}
+
+	/* The record hands its copies over to the document */
+	dd->kind = undo->kind;
+	dd->selector = undo->selector;
+	dd->doc = undo->doc;
+	dd->level = undo->oldlevel;
+}
+
+/*
+ * mongo_free_undo
+ *		Release the documents kept by an undo record.
+ */
+static void
+mongo_free_undo(DeferredUndo *undo)
+{
+	if (undo->selector)
+		bson_destroy(undo->selector);
+	if (undo->doc)
+		bson_destroy(undo->doc);
+}
+#endif
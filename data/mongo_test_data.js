@@ -14,12 +14,16 @@ db.test_tbl2.drop();
 db.test_tbl3.drop();
 db.test_tbl4.drop();
 db.test_tbl5.drop();
+db.test_tbl6.drop();
 db.test1.drop();
 db.test2.drop();
 db.test3.drop();
 db.test4.drop();
 db.mongo_test.drop();
 db.test5.drop();
+db.mongo_test5.drop();
+db.mongo_test7.drop();
+db.mongo_test6.drop();
 // Below queries will create and insert values in collections
 db.mongo_test.insert({a : NumberInt(0), b : "mongo_test collection"});
 db.test_tbl2.insertMany([
@@ -94,3 +98,11 @@ db.test_tbl5.insertMany([
    {a: 25.09},
    {a: true}
 ]);
+db.test_tbl6.insertMany([
+   {c1: NumberInt(1), doc: {status: "open", a: {b: "x"}, tags: ["x", "y"], items: [{k: NumberInt(1)}]}},
+   {c1: NumberInt(2), doc: {status: "closed", a: [{b: "x"}], tags: ["y"], items: [{k: NumberInt(2)}]}},
+   {c1: NumberInt(3), doc: {status: "1", a: {b: "y"}}},
+   {c1: NumberInt(4), doc: ["status", "x"]},
+   {c1: NumberInt(5), doc: {status: null, tags: "x"}},
+   {c1: NumberInt(6)}
+]);
@@ -34,6 +34,12 @@ mongo_get_jointype_name(JoinType jointype)
 		case JOIN_RIGHT:
 			return "RIGHT";
 
+		case JOIN_SEMI:
+			return "SEMI";
+
+		case JOIN_ANTI:
+			return "ANTI";
+
 		default:
 			/* Shouldn't come here, but protect from buggy code. */
 			elog(ERROR, "unsupported join type %d", jointype);
@@ -18,12 +18,14 @@
 
 #if PG_VERSION_NUM >= 90300
 #include "access/htup_details.h"
+#include "access/stratnum.h"
 #endif
 #include "access/sysattr.h"
 #if PG_VERSION_NUM >= 120000
 #include "access/table.h"
 #endif
 #include "catalog/heap.h"
+#include "catalog/pg_am.h"
 #include "catalog/pg_type.h"
 #if PG_VERSION_NUM >= 130000
 #include "common/hashfn.h"
@@ -35,14 +37,21 @@
 #if PG_VERSION_NUM >= 140000
 #include "optimizer/appendinfo.h"
 #endif
+#include "optimizer/clauses.h"
 #if PG_VERSION_NUM >= 120000
 #include "optimizer/optimizer.h"
 #endif
 #if PG_VERSION_NUM < 120000
 #include "optimizer/var.h"
 #endif
+#include "optimizer/paths.h"
+#if PG_VERSION_NUM >= 160000
+#include "nodes/multibitmapset.h"
+#endif
+#include "parser/parse_agg.h"
 #include "parser/parsetree.h"
 #include "storage/ipc.h"
+#include "utils/inval.h"
 #include "utils/jsonb.h"
 #if PG_VERSION_NUM < 130000
 #include "utils/jsonapi.h"
@@ -50,6 +59,7 @@
 #include "utils/jsonfuncs.h"
 #endif
 #include "utils/rel.h"
+#include "utils/selfuncs.h"
 #include "utils/guc.h"
 #include "utils/float.h"
 #include "optimizer/tlist.h"
@@ -65,6 +75,14 @@ PG_MODULE_MAGIC;
  */
 #define CODE_VERSION   50500
 
+/* GUC variables */
+int			mongo_fdw_key_filter_limit = 1000;
+#ifdef META_DRIVER
+char	   *mongo_fdw_write_concern = NULL;
+bool		mongo_fdw_deferred_writes = false;
+bool		mongo_fdw_deferred_write_transaction = false;
+#endif
+
 extern PGDLLEXPORT void _PG_init(void);
 PG_FUNCTION_INFO_V1(mongo_fdw_handler);
 PG_FUNCTION_INFO_V1(mongo_fdw_version);
@@ -135,6 +153,10 @@ static void mongoBeginForeignInsert(ModifyTableState *mtstate,
 static void mongoEndForeignInsert(EState *estate,
 								  ResultRelInfo *resultRelInfo);
 #endif
+#if PG_VERSION_NUM >= 140000 && defined(META_DRIVER)
+static void mongoExecForeignTruncate(List *rels, DropBehavior behavior,
+									 bool restart_seqs);
+#endif
 
 static void mongoGetForeignUpperPaths(PlannerInfo *root,
 									  UpperRelationKind stage,
@@ -171,12 +193,20 @@ static void fill_tuple_slot_attr(const BSON *bsonDocument,
 							  Datum *columnValues,
 							  bool *columnNulls);
 static bool column_types_compatible(BSON_TYPE bsonType, Oid columnTypeId);
-static Datum column_value_array(BSON_ITERATOR *bsonIterator, Oid valueTypeId);
+static Datum column_value_array(BSON_ITERATOR *bsonIterator, Oid valueTypeId,
+								bool keepNulls);
 static Datum column_value(BSON_ITERATOR *bsonIterator,
 						  Oid columnTypeId,
 						  int32 columnTypeMod);
 static void mongo_free_scan_state(MongoFdwScanState *fmstate);
+static void mongo_process_query_params(ExprContext *econtext, int numParams,
+									   List *param_exprs,
+									   MongoPlanerInfo *plannerInfo);
 static void mongo_free_modify_state(MongoFdwModifyState *fmstate);
+#ifdef META_DRIVER
+static BSON *mongo_get_immediate_write_opts(MongoFdwModifyState *fmstate);
+static void mongo_discard_bulk(void *arg);
+#endif
 static int mongo_acquire_sample_rows(Relation relation,
 									 int errorLevel,
 									 HeapTuple *sampleRows,
@@ -184,6 +214,10 @@ static int mongo_acquire_sample_rows(Relation relation,
 									 double *totalRowCount,
 									 double *totalDeadRowCount);
 static void mongo_fdw_exit(int code, Datum arg);
+#ifdef META_DRIVER
+static bool mongo_write_concern_check_hook(char **newval, void **extra,
+										   GucSource source);
+#endif
 static void mongo_BsonToStringValue(StringInfo output, BSON_ITERATOR *bsIterator, BSON_TYPE bsonType);
 static void mongo_get_join_planner_info(PlannerInfo *root, RelOptInfo *scanrel, MongoPlanerInfo *plannerInfo);
 static void mongo_get_limit_info(PlannerInfo *root, MongoPlanerInfo *plannerInfo);
@@ -191,6 +225,57 @@ static bool mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel,
 								  JoinType jointype, RelOptInfo *outerrel,
 								  RelOptInfo *innerrel,
 								  JoinPathExtraData *extra);
+static bool mongo_estimate_join_cost(RelOptInfo *joinrel, RelOptInfo *outerrel,
+									 RelOptInfo *innerrel, List *restrictlist,
+									 Cost *p_startup_cost, Cost *p_total_cost);
+static List *mongo_get_useful_pathkeys_for_relation(PlannerInfo *root,
+													RelOptInfo *rel);
+static void mongo_add_paths_with_pathkeys_for_rel(PlannerInfo *root,
+												  RelOptInfo *rel,
+												  Path *epq_path,
+												  Cost startup_cost,
+												  Cost total_cost);
+static void mongo_get_sort_info(PlannerInfo *root, RelOptInfo *foreignrel,
+								List *pathkeys, MongoPlanerInfo *plannerInfo);
+static bool mongo_column_is_not_null(PlannerInfo *root, RelOptInfo *baserel,
+									 AttrNumber attnum);
+static List *mongo_get_key_filter_conds(PlannerInfo *root,
+										RelOptInfo *baserel);
+static Expr *mongo_make_key_filter(Expr *clause, Var *var, Var *column);
+static Expr *mongo_replace_var(Expr *clause, Var *column);
+static Node *mongo_replace_var_mutator(Node *node, Var *column);
+static Const *mongo_make_int_const(Oid typid, int64 value);
+static int	mongo_int64_cmp(const void *a, const void *b);
+static void mongo_add_parameterized_paths(PlannerInfo *root,
+										  RelOptInfo *baserel, List *indexes,
+										  double documentCount,
+										  int32 documentWidth);
+static bool mongo_ec_member_matches_foreign(PlannerInfo *root,
+											RelOptInfo *rel,
+											EquivalenceClass *ec,
+											EquivalenceMember *em,
+											void *arg);
+static bool mongo_param_clauses_use_index(RelOptInfo *baserel, List *clauses,
+										  List *indexes);
+static int	mongo_get_driving_rel_index(PlannerInfo *root, RelOptInfo *joinrel);
+static int	mongo_get_scan_rtindex(ForeignScan *fsplan,
+								   MongoPlanerInfo *plannerInfo);
+static bool mongo_has_finalized_aggref(Node *node);
+static void mongo_add_foreign_distinct_paths(PlannerInfo *root,
+											 RelOptInfo *input_rel,
+											 RelOptInfo *distinct_rel);
+static void mongo_add_foreign_window_paths(PlannerInfo *root,
+										   RelOptInfo *input_rel,
+										   RelOptInfo *window_rel);
+static void mongo_get_window_info(PlannerInfo *root,
+								  MongoPlanerInfo *plannerInfo);
+#ifdef META_DRIVER
+static List *foreign_table_indexes(Oid foreignTableId, Oid userid);
+static void mongo_index_cache_inval_callback(Datum arg, Oid relid);
+static char **mongo_get_remote_column_names(Oid relid, AttrNumber max_attr);
+static List *mongo_get_index_pathkeys(PlannerInfo *root, RelOptInfo *baserel,
+									  List *indexes);
+#endif
 static const char *escape_json_string(const char *string);
 #ifndef META_DRIVER
 static void bson_to_json_string(StringInfo output, BSON_ITERATOR iter,
@@ -227,6 +312,30 @@ enum FdwPathPrivateIndex
 	FdwPathPrivateHasLimit
 };
 
+/* Callback argument for mongo_ec_member_matches_foreign */
+typedef struct MongoEcMemberArg
+{
+	Expr	   *current;		/* current expr, or NULL if not yet found */
+	List	   *already_used;	/* expressions already dealt with */
+} MongoEcMemberArg;
+
+#ifdef META_DRIVER
+/*
+ * Indexes of the remote collections by foreign table OID, used to plan ordered
+ * scans.  An entry is fetched again after a relcache invalidation of its
+ * foreign table, such as caused by ALTER FOREIGN TABLE or ANALYZE.
+ */
+typedef struct MongoIndexCacheEntry
+{
+	Oid			relid;			/* hash key (must be first) */
+	bool		valid;			/* false if indexes must be fetched again */
+	MemoryContext cxt;			/* context holding indexes */
+	List	   *indexes;		/* list of MongoIndexInfo */
+} MongoIndexCacheEntry;
+
+static HTAB *IndexCacheHash = NULL;
+#endif
+
 /*
  * Library load-time initalization, sets on_proc_exit() callback for
  * backend shutdown.
@@ -234,14 +343,96 @@ enum FdwPathPrivateIndex
 void
 _PG_init(void)
 {
+	DefineCustomIntVariable("mongo_fdw.key_filter_limit",
+							"Sets the maximum number of keys in a filter derived from a join.",
+							"An IN list of up to this many constants that restricts a "
+							"column joined by equality to a foreign table column is "
+							"also applied to the remote query.  Zero disables it.",
+							&mongo_fdw_key_filter_limit,
+							1000,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 #ifdef META_DRIVER
 	/* Initialize MongoDB C driver */
 	mongoc_init();
+
+	DefineCustomStringVariable("mongo_fdw.write_concern",
+							   "Sets the write concern used for writes to MongoDB.",
+							   "Takes the same \"w=..., j=..., wtimeout=...\" list as the "
+							   "write_concern option and overrides the server-level "
+							   "option.  An empty string keeps the configured value.",
+							   &mongo_fdw_write_concern,
+							   "",
+							   PGC_USERSET,
+							   0,
+							   mongo_write_concern_check_hook,
+							   NULL,
+							   NULL);
+
+	DefineCustomBoolVariable("mongo_fdw.deferred_writes",
+							 "Keeps writes to MongoDB back until the transaction commits.",
+							 "Writes to the same _id are merged and sent as one bulk "
+							 "write per collection, before the next scan of the "
+							 "connection or at commit.",
+							 &mongo_fdw_deferred_writes,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("mongo_fdw.deferred_write_transaction",
+							 "Applies deferred writes inside a MongoDB transaction.",
+							 "The transaction is committed when the local transaction "
+							 "commits.  Requires a replica set or sharded cluster.",
+							 &mongo_fdw_deferred_write_transaction,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("mongo_fdw");
 #endif
 
 	on_proc_exit(&mongo_fdw_exit, PointerGetDatum(NULL));
 }
 
+#ifdef META_DRIVER
+/*
+ * mongo_write_concern_check_hook
+ *		Validates a new value of mongo_fdw.write_concern.
+ */
+static bool
+mongo_write_concern_check_hook(char **newval, void **extra, GucSource source)
+{
+	MongoWriteConcern wc;
+	const char *problem;
+
+	if (*newval == NULL || (*newval)[0] == '\0')
+		return true;
+
+	problem = mongo_parse_write_concern(*newval, &wc);
+	if (problem)
+	{
+		GUC_check_errdetail("%s", problem);
+		return false;
+	}
+
+	return true;
+}
+#endif
+
 /*
  * mongo_fdw_handler
  *		Creates and returns a struct with pointers to foreign table callback
@@ -283,6 +474,11 @@ mongo_fdw_handler(PG_FUNCTION_ARGS)
 	fdwRoutine->EndForeignInsert = mongoEndForeignInsert;
 #endif
 
+#if PG_VERSION_NUM >= 140000 && defined(META_DRIVER)
+	/* Support function for TRUNCATE */
+	fdwRoutine->ExecForeignTruncate = mongoExecForeignTruncate;
+#endif
+
 	/* Support functions for upper relation push-down */
 	fdwRoutine->GetForeignUpperPaths = mongoGetForeignUpperPaths;
 
@@ -336,20 +532,24 @@ mongoGetForeignRelSize(PlannerInfo *root,
 
 	/*
 	 * Identify which baserestrictinfo clauses can be sent to the remote
-	 * server and which can't.  Only the OpExpr clauses are sent to the remote
-	 * server.
+	 * server and which can't.  A boolean column, as in "WHERE column", is
+	 * tested for true.  A jsonb filter is checked locally, but MongoDB can
+	 * still apply a looser form of it.
 	 */
 	foreach(lc, baserel->baserestrictinfo)
 	{
 		RestrictInfo *ri = (RestrictInfo *) lfirst(lc);
 
-		/* Does not support "WHERE column" where column has boolean type */
-		if (IsA(ri->clause, Var))
-			fpinfo->local_conds = lappend(fpinfo->local_conds, ri);
-		else if (mongo_is_foreign_expr(root, baserel, ri->clause))
+		if (mongo_is_foreign_expr(root, baserel, ri->clause))
 			fpinfo->remote_conds = lappend(fpinfo->remote_conds, ri);
 		else
+		{
 			fpinfo->local_conds = lappend(fpinfo->local_conds, ri);
+
+			if (mongo_is_json_filter_expr(root, baserel, ri->clause))
+				fpinfo->json_filter_conds = lappend(fpinfo->json_filter_conds,
+													ri->clause);
+		}
 	}
 
 #if PG_VERSION_NUM >= 160000
@@ -387,6 +587,9 @@ mongoGetForeignRelSize(PlannerInfo *root,
 													baserel->baserestrictinfo,
 													0, JOIN_INNER, NULL);
 			baserel->rows = clamp_row_est(documentCount * rowSelectivity);
+
+			/* Parameterized paths estimate their rows from this */
+			baserel->tuples = documentCount;
 		}
 		else
 			ereport(DEBUG1,
@@ -396,26 +599,320 @@ mongoGetForeignRelSize(PlannerInfo *root,
 
 	/* Also store the options in fpinfo for further use */
 	fpinfo->options = options;
+
+	fpinfo->key_filter_conds = mongo_get_key_filter_conds(root, baserel);
+}
+
+/*
+ * mongo_get_key_filter_conds
+ *		Derive filters on the columns of a base relation from the restrictions
+ *		of the relations it is joined to by equality.
+ *
+ * A column that equals a column of another relation can only take the values
+ * that the restrictions of that relation leave.  When those are a comparison
+ * with a constant or a list of at most mongo_fdw.key_filter_limit constants,
+ * MongoDB can apply them before the documents are shipped for the join.  The
+ * core planner only does this for a single constant.
+ *
+ * The filters are implied by the join, so they are neither rechecked nor
+ * used to estimate the rows of the relation.
+ */
+static List *
+mongo_get_key_filter_conds(PlannerInfo *root, RelOptInfo *baserel)
+{
+	List	   *result = NIL;
+	ListCell   *lc;
+
+	if (mongo_fdw_key_filter_limit <= 0 || !baserel->has_eclass_joins)
+		return NIL;
+
+	foreach(lc, root->eq_classes)
+	{
+		EquivalenceClass *ec = (EquivalenceClass *) lfirst(lc);
+		Var		   *column = NULL;
+		ListCell   *lc_em;
+
+		/* Classes with a constant already give the relation a filter */
+		if (ec->ec_has_volatile || ec->ec_has_const ||
+			!bms_is_member(baserel->relid, ec->ec_relids))
+			continue;
+
+		/* Find the column of the relation in the class */
+		foreach(lc_em, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc_em);
+			Expr	   *expr = em->em_expr;
+
+			while (IsA(expr, RelabelType))
+				expr = ((RelabelType *) expr)->arg;
+
+			if (!em->em_is_child && IsA(expr, Var) &&
+				((Var *) expr)->varno == baserel->relid &&
+				((Var *) expr)->varattno > 0)
+			{
+				Var		   *var = (Var *) expr;
+
+				column = makeVar(baserel->relid, var->varattno, var->vartype,
+								 var->vartypmod, var->varcollid, 0);
+				break;
+			}
+		}
+		if (column == NULL)
+			continue;
+
+		/* Carry the restrictions of the other columns over to it */
+		foreach(lc_em, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc_em);
+			Expr	   *expr = em->em_expr;
+			Var		   *var;
+			RelOptInfo *rel;
+			ListCell   *lc_ri;
+
+			while (IsA(expr, RelabelType))
+				expr = ((RelabelType *) expr)->arg;
+
+			if (em->em_is_child || !IsA(expr, Var))
+				continue;
+
+			var = (Var *) expr;
+			if (var->varno == baserel->relid || var->varlevelsup != 0 ||
+				var->vartype != column->vartype ||
+				var->varcollid != column->varcollid ||
+				!bms_is_member(var->varno, root->all_baserels))
+				continue;
+
+			rel = find_base_rel(root, var->varno);
+			foreach(lc_ri, rel->baserestrictinfo)
+			{
+				RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc_ri);
+				Expr	   *clause;
+
+				if (rinfo->pseudoconstant)
+					continue;
+
+				clause = mongo_make_key_filter(rinfo->clause, var, column);
+				if (clause != NULL &&
+					mongo_is_foreign_expr(root, baserel, clause))
+					result = list_append_unique(result, clause);
+			}
+		}
+	}
+
+	return result;
+}
+
+/*
+ * mongo_make_key_filter
+ *		Returns the restriction clause of a column rewritten for another
+ *		column, or NULL if it can't be used as a key filter.
+ *
+ * Only a comparison with a constant and an IN list of constants are used.
+ * An IN list of distinct integers without gaps becomes a range.
+ */
+static Expr *
+mongo_make_key_filter(Expr *clause, Var *var, Var *column)
+{
+	List	   *vars = pull_var_clause((Node *) clause, PVC_RECURSE_PLACEHOLDERS);
+	ListCell   *lc;
+
+	/* The clause must restrict nothing but the given column */
+	if (vars == NIL)
+		return NULL;
+	foreach(lc, vars)
+	{
+		Var		   *v = (Var *) lfirst(lc);
+
+		if (!IsA(v, Var) || v->varno != var->varno ||
+			v->varattno != var->varattno)
+			return NULL;
+	}
+
+	if (IsA(clause, OpExpr))
+	{
+		OpExpr	   *op = (OpExpr *) clause;
+
+		if (list_length(op->args) != 2 ||
+			!(IsA(linitial(op->args), Const) || IsA(lsecond(op->args), Const)))
+			return NULL;
+	}
+	else if (IsA(clause, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) clause;
+		Const	   *arrayconst = (Const *) lsecond(saop->args);
+		ArrayType  *array;
+		Oid			elemtype;
+		int16		elmlen;
+		bool		elmbyval;
+		char		elmalign;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int64	   *keys;
+		int			nkeys = 0;
+		int			i;
+		Oid			opfamily;
+
+		if (!saop->useOr || !IsA(arrayconst, Const) ||
+			arrayconst->constisnull)
+			return NULL;
+
+		array = DatumGetArrayTypeP(arrayconst->constvalue);
+		if (ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) >
+			mongo_fdw_key_filter_limit)
+			return NULL;
+
+		/* A dense list of integer keys is sent as a range */
+		elemtype = ARR_ELEMTYPE(array);
+		if ((elemtype != INT2OID && elemtype != INT4OID &&
+			 elemtype != INT8OID) || elemtype != column->vartype)
+			return mongo_replace_var(clause, column);
+
+		opfamily = get_opclass_family(GetDefaultOpClass(elemtype,
+														BTREE_AM_OID));
+		if (get_opfamily_member(opfamily, elemtype, elemtype,
+								BTEqualStrategyNumber) != saop->opno)
+			return mongo_replace_var(clause, column);
+
+		get_typlenbyvalalign(elemtype, &elmlen, &elmbyval, &elmalign);
+		deconstruct_array(array, elemtype, elmlen, elmbyval, elmalign,
+						  &elems, &nulls, &nelems);
+
+		keys = (int64 *) palloc(sizeof(int64) * nelems);
+		for (i = 0; i < nelems; i++)
+		{
+			if (nulls[i])
+				continue;
+			if (elemtype == INT2OID)
+				keys[nkeys++] = DatumGetInt16(elems[i]);
+			else if (elemtype == INT4OID)
+				keys[nkeys++] = DatumGetInt32(elems[i]);
+			else
+				keys[nkeys++] = DatumGetInt64(elems[i]);
+		}
+		if (nkeys > 1)
+		{
+			int			ndistinct = 1;
+
+			qsort(keys, nkeys, sizeof(int64), mongo_int64_cmp);
+			for (i = 1; i < nkeys; i++)
+			{
+				if (keys[i] != keys[i - 1])
+					ndistinct++;
+			}
+
+			if (keys[nkeys - 1] - keys[0] == ndistinct - 1)
+			{
+				Expr	   *lower;
+				Expr	   *upper;
+
+				lower = make_opclause(get_opfamily_member(opfamily, elemtype,
+														  elemtype,
+														  BTGreaterEqualStrategyNumber),
+									  BOOLOID, false, (Expr *) column,
+									  (Expr *) mongo_make_int_const(elemtype,
+																	keys[0]),
+									  InvalidOid, InvalidOid);
+				upper = make_opclause(get_opfamily_member(opfamily, elemtype,
+														  elemtype,
+														  BTLessEqualStrategyNumber),
+									  BOOLOID, false, (Expr *) column,
+									  (Expr *) mongo_make_int_const(elemtype,
+																	keys[nkeys - 1]),
+									  InvalidOid, InvalidOid);
+				return make_andclause(list_make2(lower, upper));
+			}
+		}
+	}
+	else
+		return NULL;
+
+	return mongo_replace_var(clause, column);
+}
+
+/*
+ * mongo_replace_var
+ *		Returns a copy of a clause restricting a single column, with that
+ *		column replaced by the given one.
+ */
+static Expr *
+mongo_replace_var(Expr *clause, Var *column)
+{
+	return (Expr *) mongo_replace_var_mutator((Node *) clause, column);
+}
+
+static Node *
+mongo_replace_var_mutator(Node *node, Var *column)
+{
+	if (node == NULL)
+		return NULL;
+	if (IsA(node, Var))
+		return (Node *) copyObject(column);
+
+	return expression_tree_mutator(node, mongo_replace_var_mutator,
+								   (void *) column);
+}
+
+/*
+ * mongo_make_int_const
+ *		Make a constant of an integer type.
+ */
+static Const *
+mongo_make_int_const(Oid typid, int64 value)
+{
+	switch (typid)
+	{
+		case INT2OID:
+			return makeConst(INT2OID, -1, InvalidOid, sizeof(int16),
+							 Int16GetDatum((int16) value), false, true);
+		case INT4OID:
+			return makeConst(INT4OID, -1, InvalidOid, sizeof(int32),
+							 Int32GetDatum((int32) value), false, true);
+		default:
+			return makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+							 Int64GetDatum(value), false, FLOAT8PASSBYVAL);
+	}
+}
+
+/*
+ * mongo_int64_cmp
+ *		qsort comparator for int64 keys.
+ */
+static int
+mongo_int64_cmp(const void *a, const void *b)
+{
+	int64		ka = *(const int64 *) a;
+	int64		kb = *(const int64 *) b;
+
+	if (ka < kb)
+		return -1;
+	if (ka > kb)
+		return 1;
+	return 0;
 }
 
 /*
  * mongoGetForeignPaths
- *		Creates the only scan path used to execute the query.
+ *		Creates the scan paths used to execute the query.
  *
  * Note that MongoDB may decide to use an underlying index for this scan, but
  * that decision isn't deterministic or visible to us.  We therefore create a
- * single table scan path.
+ * table scan path, along with the sorted and parameterized variants of it.
  */
 static void
 mongoGetForeignPaths(PlannerInfo *root,
 					 RelOptInfo *baserel,
 					 Oid foreigntableid)
 {
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
 	Path	   *foreignPath;
 	MongoFdwOptions *options;
 	Cost		startupCost = 0.0;
 	Cost		totalCost = 0.0;
 	Oid			userid;
+	double		documentCount = 0.0;
+	int32		documentWidth = 0;
+	List	   *indexes = NIL;
 
 	/*
 	 * If the table or the server is configured to use remote estimates,
@@ -438,16 +935,14 @@ mongoGetForeignPaths(PlannerInfo *root,
 	 */
 	if (options->use_remote_estimate)
 	{
-		double 		documentCount = foreign_table_document_count(foreigntableid, userid);
+		documentCount = foreign_table_document_count(foreigntableid, userid);
 
 		if (documentCount > 0.0)
 		{
-			MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
 			double		tupleFilterCost = baserel->baserestrictcost.per_tuple;
 			double		inputRowCount;
 			double		documentSelectivity;
 			double		foreignTableSize;
-			int32		documentWidth;
 			BlockNumber pageCount;
 			double		totalDiskAccessCost;
 			double		cpuCostPerDoc;
@@ -512,116 +1007,519 @@ mongoGetForeignPaths(PlannerInfo *root,
 #endif
 												   NULL);	/* no fdw_private data */
 
-	/* Add foreign path as the only possible path */
+	/* Add foreign path as the unsorted path */
 	add_path(baserel, foreignPath);
+
+#ifdef META_DRIVER
+	/* Remote indexes are only looked at along with the remote estimates */
+	if (options->use_remote_estimate)
+	{
+		indexes = foreign_table_indexes(foreigntableid, userid);
+		fpinfo->index_pathkeys = mongo_get_index_pathkeys(root, baserel,
+														  indexes);
+	}
+#endif
+
+	if (documentCount > 0.0)
+	{
+		fpinfo->remote_estimated = true;
+		fpinfo->startup_cost = startupCost;
+		fpinfo->total_cost = totalCost;
+		fpinfo->document_count = documentCount;
+		fpinfo->document_width = documentWidth;
+		fpinfo->indexes = indexes;
+	}
+
+	/* Add paths with pathkeys */
+	mongo_add_paths_with_pathkeys_for_rel(root, baserel, NULL, startupCost,
+										  totalCost);
+
+	/*
+	 * Parameterized paths are only worth considering when the unparameterized
+	 * path has a real cost to compare them with.
+	 */
+	if (documentCount > 0.0)
+		mongo_add_parameterized_paths(root, baserel, indexes, documentCount,
+									  documentWidth);
 }
 
 /*
- * mongoGetForeignPlan
- *		Creates a foreign scan plan node for scanning the MongoDB collection.
+ * mongo_add_parameterized_paths
+ *		Add the paths that take the values of outer relations as parameters of
+ *		the remote query.
  *
- * Note that MongoDB may decide to use an underlying index for this
- * scan, but that decision isn't deterministic or visible to us.
+ * Such a path is the inner side of a nested loop, which issues a "$match" on
+ * the join columns for each outer row.  This pays off when the collection is
+ * large and has an index on the join column.
  */
-static ForeignScan *
-mongoGetForeignPlan(PlannerInfo *root,
-					RelOptInfo *foreignrel,
-					Oid foreigntableid,
-					ForeignPath *best_path,
-					List *targetList,
-					List *restrictionClauses,
-					Plan *outer_plan)
+static void
+mongo_add_parameterized_paths(PlannerInfo *root, RelOptInfo *baserel,
+							  List *indexes, double documentCount,
+							  int32 documentWidth)
 {
-	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) foreignrel->fdw_private;
-	Index		scan_relid;
-	ForeignScan *foreignScan;
-	List	   *scan_var_list;
-	List	   *fdw_scan_tlist = NIL;
-	List	   *fdw_recheck_quals = NIL;
+	List	   *ppi_list = NIL;
 	ListCell   *lc;
-	List	   *local_exprs = NIL;
-	List	   *remote_exprs = NIL;
-	List	   *plannerInfoList = NIL;
-	MongoPlanerInfo *plannerInfo = NULL;
-	RelOptInfo *scanrel = NULL;
-	bool		tlist_has_jsonb_arrow_op;
-	bool		has_limit = false;
-
-	/* Decide to execute JsonB arrow operator support in the target list. */
-	tlist_has_jsonb_arrow_op = mongo_tlist_has_jsonb_arrow_op(root, foreignrel, targetList);
 
 	/*
-	 * Get FDW private data created by mongoGetForeignUpperPaths(), if any.
+	 * Collect the parameterizations of the join clauses that can be sent to
+	 * the remote server.
 	 */
-	if (best_path->fdw_private)
-	{
-#if PG_VERSION_NUM >= 150000
-		has_limit = boolVal(list_nth(best_path->fdw_private,
-									 FdwPathPrivateHasLimit));
-#else
-		has_limit = intVal(list_nth(best_path->fdw_private,
-									FdwPathPrivateHasLimit));
-#endif
-	}
-
-#if PG_VERSION_NUM >= 90600
-	scan_var_list = pull_var_clause((Node *) foreignrel->reltarget->exprs,
-									PVC_RECURSE_PLACEHOLDERS | PVC_RECURSE_AGGREGATES);
-#else
-	scan_var_list = pull_var_clause((Node *) foreignrel->reltargetlist,
-									PVC_RECURSE_AGGREGATES,
-									PVC_RECURSE_PLACEHOLDERS);
-#endif
-
-	/* System attributes are not allowed. */
-	foreach(lc, scan_var_list)
+	foreach(lc, baserel->joininfo)
 	{
-		Var		   *var = lfirst(lc);
-		const FormData_pg_attribute *attr;
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		Relids		required_outer;
+		ParamPathInfo *param_info;
 
-		Assert(IsA(var, Var));
+		/* Check if clause can be moved to this rel */
+		if (!join_clause_is_movable_to(rinfo, baserel))
+			continue;
 
-		if (var->varattno >= 0)
+		/* See if it is safe to send to remote */
+		if (!IsA(rinfo->clause, OpExpr) ||
+			!mongo_is_foreign_expr(root, baserel, rinfo->clause))
 			continue;
-		else if	(var->varattno == SelfItemPointerAttributeNumber ||
-				 var->varattno == TableOidAttributeNumber)
+
+		/* Calculate required outer rels for the resulting path */
+		required_outer = bms_union(rinfo->clause_relids,
+								   baserel->lateral_relids);
+		required_outer = bms_del_member(required_outer, baserel->relid);
+		if (bms_is_empty(required_outer))
 			continue;
 
-#if PG_VERSION_NUM >= 120000
-		attr = SystemAttributeDefinition(var->varattno);
-#else
-		attr = SystemAttributeDefinition(var->varattno, false);
-#endif
-		ereport(ERROR,
-				(errcode(ERRCODE_FDW_COLUMN_NAME_NOT_FOUND),
-				 errmsg("system attribute \"%s\" can't be fetched from remote relation",
-						attr->attname.data)));
+		param_info = get_baserel_parampathinfo(root, baserel, required_outer);
+		Assert(param_info != NULL);
+
+		ppi_list = list_append_unique_ptr(ppi_list, param_info);
 	}
 
-	if (IS_SIMPLE_REL(foreignrel))
+	/*
+	 * The join clauses derived from equivalence classes are not in joininfo,
+	 * so generate them one member expression of the relation at a time.
+	 */
+	if (baserel->has_eclass_joins)
 	{
-		/*
-		 * For base relations, set scan_relid as the relid of the relation.
-		 */
-		scan_relid = foreignrel->relid;
+		MongoEcMemberArg arg;
 
-		/*
-		* Separate the restrictionClauses into those that can be executed remotely
-		* and those that can't.  baserestrictinfo clauses that were previously
-		* determined to be safe or unsafe are shown in fpinfo->remote_conds and
-		* fpinfo->local_conds.  Anything else in the restrictionClauses list will
-		* be a join clause, which we have to check for remote-safety.  Only the
-		* OpExpr clauses are sent to the remote server.
-		*/
-		foreach(lc, restrictionClauses)
+		arg.already_used = NIL;
+		for (;;)
 		{
-			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+			List	   *clauses;
 
-			Assert(IsA(rinfo, RestrictInfo));
+			arg.current = NULL;
+			clauses = generate_implied_equalities_for_column(root,
+															 baserel,
+															 mongo_ec_member_matches_foreign,
+															 (void *) &arg,
+															 baserel->lateral_referencers);
 
-			/* Ignore pseudoconstants, they are dealt with elsewhere */
-			if (rinfo->pseudoconstant)
-				continue;
+			/* Done if there are no more expressions in the foreign rel */
+			if (arg.current == NULL)
+			{
+				Assert(clauses == NIL);
+				break;
+			}
+
+			foreach(lc, clauses)
+			{
+				RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+				Relids		required_outer;
+				ParamPathInfo *param_info;
+
+				if (!IsA(rinfo->clause, OpExpr) ||
+					!mongo_is_foreign_expr(root, baserel, rinfo->clause))
+					continue;
+
+				required_outer = bms_union(rinfo->clause_relids,
+										   baserel->lateral_relids);
+				required_outer = bms_del_member(required_outer, baserel->relid);
+				if (bms_is_empty(required_outer))
+					continue;
+
+				param_info = get_baserel_parampathinfo(root, baserel,
+													   required_outer);
+				Assert(param_info != NULL);
+
+				ppi_list = list_append_unique_ptr(ppi_list, param_info);
+			}
+
+			/* Try again, now ignoring the expression we found this time */
+			arg.already_used = lappend(arg.already_used, arg.current);
+		}
+	}
+
+	foreach(lc, ppi_list)
+	{
+		ParamPathInfo *param_info = (ParamPathInfo *) lfirst(lc);
+		double		rows = param_info->ppi_rows;
+		double		examinedCount;
+		Cost		diskAccessCost;
+		Cost		startupCost;
+		Cost		totalCost;
+		ForeignPath *path;
+
+		/*
+		 * With an index on a join column, MongoDB fetches just the matching
+		 * documents for each outer row.  Otherwise each rescan reads the
+		 * whole collection again.
+		 */
+		if (mongo_param_clauses_use_index(baserel, param_info->ppi_clauses,
+										  indexes))
+		{
+			examinedCount = rows;
+			diskAccessCost = random_page_cost *
+				ceil(rows * documentWidth / BLCKSZ);
+		}
+		else
+		{
+			examinedCount = documentCount;
+			diskAccessCost = seq_page_cost *
+				rint(documentCount * documentWidth / BLCKSZ);
+		}
+
+		startupCost = baserel->baserestrictcost.startup +
+			MONGO_CONNECTION_COST_MULTIPLIER * seq_page_cost;
+		totalCost = startupCost + diskAccessCost +
+			cpu_tuple_cost * examinedCount +
+			(cpu_tuple_cost * MONGO_TUPLE_COST_MULTIPLIER +
+			 baserel->baserestrictcost.per_tuple) * rows;
+
+		path = create_foreignscan_path(root, baserel,
+									   NULL,	/* default pathtarget */
+									   rows,
+									   startupCost,
+									   totalCost,
+									   NIL, /* no pathkeys */
+									   param_info->ppi_req_outer,
+									   NULL,	/* no extra plan */
+									   NIL);	/* no fdw_private */
+		add_path(baserel, (Path *) path);
+	}
+}
+
+/*
+ * mongo_ec_member_matches_foreign
+ *		Callback for generate_implied_equalities_for_column, which picks the
+ *		member expressions of the foreign relation one at a time.
+ */
+static bool
+mongo_ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
+								EquivalenceClass *ec, EquivalenceMember *em,
+								void *arg)
+{
+	MongoEcMemberArg *state = (MongoEcMemberArg *) arg;
+	Expr	   *expr = em->em_expr;
+
+	/*
+	 * If we've identified what we're processing in the current scan, we only
+	 * want to match that expression.
+	 */
+	if (state->current != NULL)
+		return equal(expr, state->current);
+
+	/* Otherwise, ignore anything we've already processed. */
+	if (list_member(state->already_used, expr))
+		return false;
+
+	/* This is the new target to process. */
+	state->current = expr;
+	return true;
+}
+
+/*
+ * mongo_param_clauses_use_index
+ *		Returns true if one of the join clauses compares the leading field of a
+ *		remote index with an outer value.
+ */
+static bool
+mongo_param_clauses_use_index(RelOptInfo *baserel, List *clauses,
+							  List *indexes)
+{
+#ifdef META_DRIVER
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	char	  **colnames;
+	ListCell   *lc;
+
+	if (indexes == NIL)
+		return false;
+
+	colnames = mongo_get_remote_column_names(fpinfo->baserel_oid,
+											 baserel->max_attr);
+
+	foreach(lc, clauses)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		ListCell   *lc_var;
+
+		foreach(lc_var, pull_var_clause((Node *) rinfo->clause,
+										PVC_RECURSE_PLACEHOLDERS))
+		{
+			Var		   *var = (Var *) lfirst(lc_var);
+			ListCell   *lc_index;
+
+			if (var->varno != baserel->relid || var->varattno <= 0 ||
+				colnames[var->varattno] == NULL)
+				continue;
+
+			foreach(lc_index, indexes)
+			{
+				MongoIndexInfo *index = (MongoIndexInfo *) lfirst(lc_index);
+
+				if (strcmp(strVal(linitial(index->fields)),
+						   colnames[var->varattno]) == 0)
+					return true;
+			}
+		}
+	}
+#endif
+
+	return false;
+}
+
+/*
+ * mongo_get_useful_pathkeys_for_relation
+ *		Determine which orderings of a relation might be useful.
+ *
+ * These are the query pathkeys, when all of them can be evaluated by MongoDB,
+ * and the orderings provided by the remote indexes.
+ */
+static List *
+mongo_get_useful_pathkeys_for_relation(PlannerInfo *root, RelOptInfo *rel)
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) rel->fdw_private;
+	List	   *useful_pathkeys_list = NIL;
+	ListCell   *lc;
+
+	fpinfo->qp_is_pushdown_safe = false;
+
+	if (root->query_pathkeys != NIL)
+	{
+		bool		query_pathkeys_ok = true;
+
+		foreach(lc, root->query_pathkeys)
+		{
+			PathKey    *pathkey = (PathKey *) lfirst(lc);
+
+			if (!mongo_is_foreign_pathkey(root, rel, pathkey))
+			{
+				query_pathkeys_ok = false;
+				break;
+			}
+		}
+
+		if (query_pathkeys_ok)
+		{
+			useful_pathkeys_list = list_make1(list_copy(root->query_pathkeys));
+			fpinfo->qp_is_pushdown_safe = true;
+		}
+	}
+
+	foreach(lc, fpinfo->index_pathkeys)
+	{
+		List	   *pathkeys = (List *) lfirst(lc);
+		ListCell   *lc2;
+		bool		duplicate = false;
+
+		foreach(lc2, useful_pathkeys_list)
+		{
+			if (compare_pathkeys(pathkeys, (List *) lfirst(lc2)) == PATHKEYS_EQUAL)
+			{
+				duplicate = true;
+				break;
+			}
+		}
+
+		if (!duplicate)
+			useful_pathkeys_list = lappend(useful_pathkeys_list, pathkeys);
+	}
+
+	return useful_pathkeys_list;
+}
+
+/*
+ * mongo_add_paths_with_pathkeys_for_rel
+ *		Add sorted paths for the given relation, with the ordering done by a
+ *		"$sort" stage.
+ *
+ * The unsorted path costs are charged a small premium, so that a remote sort
+ * is only chosen when its ordering is of use.  The premium is lower when a
+ * remote index provides the ordering.
+ */
+static void
+mongo_add_paths_with_pathkeys_for_rel(PlannerInfo *root, RelOptInfo *rel,
+									  Path *epq_path, Cost startup_cost,
+									  Cost total_cost)
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) rel->fdw_private;
+	List	   *useful_pathkeys_list;
+	ListCell   *lc;
+
+	useful_pathkeys_list = mongo_get_useful_pathkeys_for_relation(root, rel);
+
+	foreach(lc, useful_pathkeys_list)
+	{
+		List	   *useful_pathkeys = lfirst(lc);
+		Path	   *sorted_epq_path;
+		Path	   *path;
+		double		sort_multiplier = MONGO_SORT_COST_MULTIPLIER;
+		ListCell   *lc2;
+
+		/* Walking an index in key order costs little more than a scan */
+		foreach(lc2, fpinfo->index_pathkeys)
+		{
+			if (pathkeys_contained_in(useful_pathkeys, (List *) lfirst(lc2)))
+			{
+				sort_multiplier = MONGO_INDEX_SORT_COST_MULTIPLIER;
+				break;
+			}
+		}
+
+		/*
+		 * The EPQ path must be at least as well sorted as the path itself, in
+		 * case it gets used as input to a mergejoin.
+		 */
+		sorted_epq_path = epq_path;
+		if (sorted_epq_path != NULL &&
+			!pathkeys_contained_in(useful_pathkeys,
+								   sorted_epq_path->pathkeys))
+			sorted_epq_path = (Path *)
+				create_sort_path(root,
+								 rel,
+								 sorted_epq_path,
+								 useful_pathkeys,
+								 -1.0);
+
+		if (IS_SIMPLE_REL(rel))
+			path = (Path *) create_foreignscan_path(root, rel,
+													NULL,	/* default pathtarget */
+													rel->rows,
+													startup_cost * sort_multiplier,
+													total_cost * sort_multiplier,
+													useful_pathkeys,
+													rel->lateral_relids,
+													sorted_epq_path,
+													NIL);	/* no fdw_private */
+		else
+			path = (Path *) create_foreign_join_path(root, rel,
+													 NULL,	/* default pathtarget */
+													 rel->rows,
+													 startup_cost * sort_multiplier,
+													 total_cost * sort_multiplier,
+													 useful_pathkeys,
+													 rel->lateral_relids,
+													 sorted_epq_path,
+													 NIL);	/* no fdw_private */
+
+		add_path(rel, path);
+	}
+}
+
+/*
+ * mongoGetForeignPlan
+ *		Creates a foreign scan plan node for scanning the MongoDB collection.
+ *
+ * Note that MongoDB may decide to use an underlying index for this
+ * scan, but that decision isn't deterministic or visible to us.
+ */
+static ForeignScan *
+mongoGetForeignPlan(PlannerInfo *root,
+					RelOptInfo *foreignrel,
+					Oid foreigntableid,
+					ForeignPath *best_path,
+					List *targetList,
+					List *restrictionClauses,
+					Plan *outer_plan)
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) foreignrel->fdw_private;
+	Index		scan_relid;
+	ForeignScan *foreignScan;
+	List	   *scan_var_list;
+	List	   *fdw_scan_tlist = NIL;
+	List	   *fdw_recheck_quals = NIL;
+	ListCell   *lc;
+	List	   *local_exprs = NIL;
+	List	   *remote_exprs = NIL;
+	List	   *params_list = NIL;
+	List	   *plannerInfoList = NIL;
+	MongoPlanerInfo *plannerInfo = NULL;
+	RelOptInfo *scanrel = NULL;
+	bool		tlist_has_jsonb_arrow_op;
+	bool		has_limit = false;
+
+	/* Decide to execute JsonB arrow operator support in the target list. */
+	tlist_has_jsonb_arrow_op = mongo_tlist_has_jsonb_arrow_op(root, foreignrel, targetList);
+
+	/*
+	 * Get FDW private data created by mongoGetForeignUpperPaths(), if any.
+	 */
+	if (best_path->fdw_private)
+	{
+#if PG_VERSION_NUM >= 150000
+		has_limit = boolVal(list_nth(best_path->fdw_private,
+									 FdwPathPrivateHasLimit));
+#else
+		has_limit = intVal(list_nth(best_path->fdw_private,
+									FdwPathPrivateHasLimit));
+#endif
+	}
+
+#if PG_VERSION_NUM >= 90600
+	scan_var_list = pull_var_clause((Node *) foreignrel->reltarget->exprs,
+									PVC_RECURSE_PLACEHOLDERS | PVC_RECURSE_AGGREGATES);
+#else
+	scan_var_list = pull_var_clause((Node *) foreignrel->reltargetlist,
+									PVC_RECURSE_AGGREGATES,
+									PVC_RECURSE_PLACEHOLDERS);
+#endif
+
+	/* System attributes are not allowed. */
+	foreach(lc, scan_var_list)
+	{
+		Var		   *var = lfirst(lc);
+		const FormData_pg_attribute *attr;
+
+		Assert(IsA(var, Var));
+
+		if (var->varattno >= 0)
+			continue;
+		else if	(var->varattno == SelfItemPointerAttributeNumber ||
+				 var->varattno == TableOidAttributeNumber)
+			continue;
+
+#if PG_VERSION_NUM >= 120000
+		attr = SystemAttributeDefinition(var->varattno);
+#else
+		attr = SystemAttributeDefinition(var->varattno, false);
+#endif
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_COLUMN_NAME_NOT_FOUND),
+				 errmsg("system attribute \"%s\" can't be fetched from remote relation",
+						attr->attname.data)));
+	}
+
+	if (IS_SIMPLE_REL(foreignrel))
+	{
+		/*
+		 * For base relations, set scan_relid as the relid of the relation.
+		 */
+		scan_relid = foreignrel->relid;
+
+		/*
+		* Separate the restrictionClauses into those that can be executed remotely
+		* and those that can't.  baserestrictinfo clauses that were previously
+		* determined to be safe or unsafe are shown in fpinfo->remote_conds and
+		* fpinfo->local_conds.  Anything else in the restrictionClauses list will
+		* be a join clause, which we have to check for remote-safety.  Only the
+		* OpExpr clauses are sent to the remote server.
+		*/
+		foreach(lc, restrictionClauses)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+			Assert(IsA(rinfo, RestrictInfo));
+
+			/* Ignore pseudoconstants, they are dealt with elsewhere */
+			if (rinfo->pseudoconstant)
+				continue;
 
 			if (list_member_ptr(fpinfo->remote_conds, rinfo))
 				remote_exprs = lappend(remote_exprs, rinfo->clause);
@@ -640,6 +1538,21 @@ mongoGetForeignPlan(PlannerInfo *root,
 		 */
 		fdw_recheck_quals = remote_exprs;
 
+		/*
+		 * The filters implied by the join need no recheck, and the jsonb
+		 * filters are checked locally anyway.
+		 */
+		remote_exprs = list_concat_copy(remote_exprs,
+										fpinfo->key_filter_conds);
+		remote_exprs = list_concat(remote_exprs, fpinfo->json_filter_conds);
+
+		/*
+		 * The values of Params and outer relation columns in the remote quals
+		 * are evaluated at execution time.  The planner replaces the outer
+		 * columns in fdw_exprs with nestloop Params.
+		 */
+		params_list = mongo_pull_param_exprs(remote_exprs, scan_relid);
+
 		/*
 		 * Build the list of columns that contain Jsonb arrow operator
 		 * to be fetched from the foreign server.
@@ -651,21 +1564,17 @@ mongoGetForeignPlan(PlannerInfo *root,
 			else
 				fdw_scan_tlist = add_to_flat_tlist(fdw_scan_tlist, foreignrel->reltarget->exprs);
 
-			foreach(lc, remote_exprs)
-			{
-				Node *node = (Node *)lfirst(lc);
-
-				fdw_scan_tlist = add_to_flat_tlist(fdw_scan_tlist,
-													pull_var_clause((Node *) node,
-																	PVC_RECURSE_PLACEHOLDERS));
-			}
-			foreach(lc, local_exprs)
+			/* Columns of outer relations are not fetched by the scan */
+			foreach(lc, list_concat(pull_var_clause((Node *) remote_exprs,
+													PVC_RECURSE_PLACEHOLDERS),
+									pull_var_clause((Node *) local_exprs,
+													PVC_RECURSE_PLACEHOLDERS)))
 			{
-				Node *node = (Node *)lfirst(lc);
+				Var		   *var = (Var *) lfirst(lc);
 
-				fdw_scan_tlist = add_to_flat_tlist(fdw_scan_tlist,
-													pull_var_clause((Node *) node,
-																	PVC_RECURSE_PLACEHOLDERS));
+				if (var->varno == scan_relid)
+					fdw_scan_tlist = add_to_flat_tlist(fdw_scan_tlist,
+													   list_make1(var));
 			}
 		}
 	}
@@ -792,21 +1701,63 @@ mongoGetForeignPlan(PlannerInfo *root,
 		plannerInfo->remote_exprs = remote_exprs;
 		plannerInfo->local_exprs = local_exprs;
 		plannerInfo->ptarget_exprs = foreignrel->reltarget->exprs;
+		plannerInfo->param_exprs = params_list;
 	}
 
 	plannerInfo->has_limit = has_limit;
 	if (has_limit)
 		mongo_get_limit_info(root, plannerInfo);
+
+	/*
+	 * A sorted path has its ordering done remotely.  When the documents are
+	 * reshaped by a target list, the sort keys must be part of it.
+	 */
+	if (best_path->path.pathkeys != NIL)
+	{
+		mongo_get_sort_info(root, foreignrel, best_path->path.pathkeys,
+							plannerInfo);
+		if (IS_SIMPLE_REL(foreignrel) && plannerInfo->tlist != NIL)
+		{
+			fdw_scan_tlist = add_to_flat_tlist(fdw_scan_tlist,
+											   plannerInfo->sort_exprs);
+			plannerInfo->tlist = fdw_scan_tlist;
+		}
+	}
 	plannerInfo->has_groupClause = (root->parse->groupClause) ? true : false;
 	plannerInfo->has_grouping_agg = (root->parse->groupClause || root->parse->groupingSets ||
 									 root->parse->hasAggs || (root->hasHavingQual && root->parse->havingQual));
 
+	/* Each grouping set is grouped by a "$group" stage of its own */
+	if (IS_UPPER_REL(foreignrel) && fpinfo->stage == UPPERREL_GROUP_AGG &&
+		root->parse->groupingSets)
+#if PG_VERSION_NUM >= 140000
+		plannerInfo->grouping_sets = expand_grouping_sets(root->parse->groupingSets,
+														  root->parse->groupDistinct,
+														  -1);
+#else
+		plannerInfo->grouping_sets = expand_grouping_sets(root->parse->groupingSets,
+														  -1);
+#endif
+
+	/* A remote DISTINCT groups the documents by all the output columns */
+	if (IS_UPPER_REL(foreignrel) && fpinfo->stage == UPPERREL_DISTINCT)
+	{
+		plannerInfo->has_groupClause = true;
+		plannerInfo->has_grouping_agg = true;
+	}
+
+	/* Pickup the windows of the window functions */
+	if (IS_UPPER_REL(foreignrel) && fpinfo->stage == UPPERREL_WINDOW)
+		mongo_get_window_info(root, plannerInfo);
+
 	/* Pickup information of JOIN relation */
 	if (IS_JOIN_REL(scanrel))
 	{
 		MongoFdwRelationInfo *f_joininfo = (MongoFdwRelationInfo *) scanrel->fdw_private;
 
 		plannerInfo->jointype = f_joininfo->jointype;
+		plannerInfo->driving_rel_index = mongo_get_driving_rel_index(root,
+																	 scanrel);
 		mongo_get_join_planner_info(root, scanrel, plannerInfo);
 	}
 
@@ -815,7 +1766,7 @@ mongoGetForeignPlan(PlannerInfo *root,
 	/* Create the foreign scan node */
 	foreignScan = make_foreignscan(targetList, local_exprs,
 								   scan_relid,
-								   NIL, /* No expressions to evaluate */
+								   params_list,
 								   plannerInfoList
 #if PG_VERSION_NUM >= 90500
 								   ,fdw_scan_tlist
@@ -843,14 +1794,7 @@ mongoExplainForeignScan(ForeignScanState *node, ExplainState *es)
 	int			rtindex;
 	Oid			userid;
 
-	if (fsplan->scan.scanrelid > 0)
-		rtindex = fsplan->scan.scanrelid;
-	else
-#if PG_VERSION_NUM >= 160000
-		rtindex = bms_next_member(fsplan->fs_base_relids, -1);
-#else
-		rtindex = bms_next_member(fsplan->fs_relids, -1);
-#endif
+	rtindex = mongo_get_scan_rtindex(fsplan, fsstate->plannerInfo);
 
 #if PG_VERSION_NUM >= 160000
 	/*
@@ -869,15 +1813,24 @@ mongoExplainForeignScan(ForeignScanState *node, ExplainState *es)
 	{
 		StringInfo join_relation_name = makeStringInfo();
 		MongoPlanerJoinInfo *join_info;
+		ListCell   *lc;
 
 		join_info = (MongoPlanerJoinInfo *)lfirst(list_head(fsstate->plannerInfo->joininfo_list));
 
-		appendStringInfo(join_relation_name, "(%s.%s) %s JOIN (%s.%s)",
-							options->svr_database,
-							join_info->outerrel_name,
-							mongo_get_jointype_name(fsstate->plannerInfo->jointype),
+		appendStringInfo(join_relation_name, "(%s.%s)",
 							options->svr_database,
-							join_info->innerel_name);
+							join_info->outerrel_name);
+
+		/* The relations of a nested join are joined in turn */
+		foreach(lc, fsstate->plannerInfo->joininfo_list)
+		{
+			join_info = (MongoPlanerJoinInfo *) lfirst(lc);
+
+			appendStringInfo(join_relation_name, " %s JOIN (%s.%s)",
+							 mongo_get_jointype_name(join_info->jointype),
+							 options->svr_database,
+							 join_info->innerel_name);
+		}
 
 		ExplainPropertyText("Foreign Namespace", join_relation_name->data, es);
 	} else {
@@ -894,6 +1847,18 @@ mongoExplainForeignScan(ForeignScanState *node, ExplainState *es)
 	{
 		char *queryDocument_str = NULL;
 
+		/*
+		 * Without ANALYZE, a query document with parameters isn't built yet.
+		 * Show it with placeholders for the parameter values.
+		 */
+		if (fsstate->queryDocument == NULL)
+		{
+			fsstate->plannerInfo->param_values = NULL;
+			fsstate->queryDocument = mongo_build_bson_query_document(estate,
+																	 node->ss.ss_ScanTupleSlot->tts_tupleDescriptor,
+																	 fsstate->plannerInfo);
+		}
+
 		queryDocument_str = bson_as_canonical_extended_json(fsstate->queryDocument, NULL);
 		ExplainPropertyText("Query document", queryDocument_str, es);
 		bson_free(queryDocument_str);
@@ -926,8 +1891,12 @@ mongoExplainForeignModify(ModifyTableState *mtstate,
 	appendStringInfo(namespaceName, "%s.%s", options->svr_database,
 					 options->collectionName);
 
-	mongo_free_options(options);
 	ExplainPropertyText("Foreign Namespace", namespaceName->data, es);
+#ifdef META_DRIVER
+	if (es->verbose && options->writeConcern)
+		ExplainPropertyText("Write Concern", options->writeConcern, es);
+#endif
+	mongo_free_options(options);
 }
 
 /*
@@ -955,41 +1924,44 @@ mongoBeginForeignScan(ForeignScanState *node, int eflags)
 	TupleTableSlot *tupleSlot = node->ss.ss_ScanTupleSlot;
 	int			rtindex;
 
+	fsstate = (MongoFdwScanState *) palloc0(sizeof(MongoFdwScanState));
+	node->fdw_state = (void *) fsstate;
+
+	/* Get information from planner */
+	plannerInfoList = fsplan->fdw_private;
+	fsstate->plannerInfo = mongo_deserialize_plannerInfoList(plannerInfoList);
+
 	/*
 	 * Identify which user to do the remote access as.  This should match what
-	 * ExecCheckPermissions() does.  In case of a join or aggregate, use the
-	 * lowest-numbered member RTE as a representative; we would get the same
-	 * result from any.
+	 * ExecCheckPermissions() does.  In case of a join or aggregate, the
+	 * relation driving the join is used, whose collection is read; we would
+	 * get the same user from any member RTE.
 	 */
+	rtindex = mongo_get_scan_rtindex(fsplan, fsstate->plannerInfo);
+	rte = exec_rt_fetch(rtindex, estate);
 #if PG_VERSION_NUM >= 160000
 	userid = OidIsValid(fsplan->checkAsUser) ? fsplan->checkAsUser : GetUserId();
-	if (fsplan->scan.scanrelid > 0)
-		rtindex = fsplan->scan.scanrelid;
-	else
-		rtindex = bms_next_member(fsplan->fs_base_relids, -1);
-	rte = exec_rt_fetch(rtindex, estate);
 #else
-	if (fsplan->scan.scanrelid > 0)
-		rtindex = fsplan->scan.scanrelid;
-	else
-		rtindex = bms_next_member(fsplan->fs_relids, -1);
-	rte = exec_rt_fetch(rtindex, estate);
 	userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
 #endif
 	options = mongo_get_options(rte->relid, userid);
 
-	fsstate = (MongoFdwScanState *) palloc0(sizeof(MongoFdwScanState));
-	node->fdw_state = (void *) fsstate;
-
-	/* Get information from planner */
-	plannerInfoList = fsplan->fdw_private;
-	fsstate->plannerInfo = mongo_deserialize_plannerInfoList(plannerInfoList);
 	fsstate->plannerInfo->rel_oid = (rte) ? rte->relid : 0;
 
-	/* Construct the BSON query document. */
-	fsstate->queryDocument = mongo_build_bson_query_document(estate,
-															 tupleSlot->tts_tupleDescriptor,
-															 fsstate->plannerInfo);
+	/*
+	 * Prepare for the evaluation of the parameters of the query document.  A
+	 * query document with parameters is built for each scan, once their
+	 * values are known.
+	 */
+	fsstate->numParams = list_length(fsplan->fdw_exprs);
+	if (fsstate->numParams > 0)
+		fsstate->param_exprs = ExecInitExprList(fsplan->fdw_exprs,
+												(PlanState *) node);
+	else
+		/* Construct the BSON query document. */
+		fsstate->queryDocument = mongo_build_bson_query_document(estate,
+																 tupleSlot->tts_tupleDescriptor,
+																 fsstate->plannerInfo);
 
 	/* If Explain with no Analyze, do nothing */
 	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
@@ -1037,12 +2009,25 @@ mongoIterateForeignScan(ForeignScanState *node)
 	else
 		is_agg = true;
 
+	/* Construct the BSON query document with the current parameter values */
+	if (fsstate->queryDocument == NULL)
+	{
+		mongo_process_query_params(node->ss.ps.ps_ExprContext,
+								   fsstate->numParams,
+								   fsstate->param_exprs,
+								   fsstate->plannerInfo);
+		fsstate->queryDocument = mongo_build_bson_query_document(node->ss.ps.state,
+																 tupleDescriptor,
+																 fsstate->plannerInfo);
+	}
+
 	/* Create cursor for collection name and set query */
 	if (mongoCursor == NULL)
 	{
 		MongoPlanerJoinInfo *join_info;
 		char *most_outerrel_name = NULL;
 		char *collection_name;
+		BSON	   *opts = NULL;
 
 		if (fsstate->plannerInfo->joininfo_list != NIL)
 		{
@@ -1053,10 +2038,16 @@ mongoIterateForeignScan(ForeignScanState *node)
 		collection_name = (most_outerrel_name) ?
 							most_outerrel_name :
 							fsstate->options->collectionName;
+
+#ifdef META_DRIVER
+		/* Reads must see the writes deferred so far */
+		mongo_flush_deferred_writes(fsstate->mongoConnection);
+		opts = mongo_get_session_opts(fsstate->mongoConnection);
+#endif
 		mongoCursor = mongoCursorCreate(fsstate->mongoConnection,
 										fsstate->options->svr_database,
 										collection_name,
-										fsstate->queryDocument, true);
+										fsstate->queryDocument, opts, true);
 
 		/* Save mongoCursor */
 		fsstate->mongoCursor = mongoCursor;
@@ -1121,7 +2112,8 @@ mongoEndForeignScan(ForeignScanState *node)
  *
  * Note that rescans in Mongo end up being notably more expensive than what the
  * planner expects them to be, since MongoDB cursors don't provide reset/rewind
- * functionality.
+ * functionality.  When parameter values have changed, as for the inner side
+ * of a nested loop, the query is issued again with the new values.
  */
 static void
 mongoReScanForeignScan(ForeignScanState *node)
@@ -1134,6 +2126,53 @@ mongoReScanForeignScan(ForeignScanState *node)
 		mongoCursorDestroy(fsstate->mongoCursor);
 		fsstate->mongoCursor = NULL;
 	}
+
+	/* Have the query document built again with the new parameter values */
+	if (fsstate->numParams > 0 && node->ss.ps.chgParam != NULL &&
+		fsstate->queryDocument)
+	{
+		bsonDestroy(fsstate->queryDocument);
+		fsstate->queryDocument = NULL;
+	}
+}
+
+/*
+ * mongo_process_query_params
+ *		Evaluate the parameters of the query document, and save their values
+ *		for building it.
+ *
+ * The values are evaluated in the per-tuple memory context, which lives for
+ * as long as we need them to build the query document.
+ */
+static void
+mongo_process_query_params(ExprContext *econtext, int numParams,
+						   List *param_exprs, MongoPlanerInfo *plannerInfo)
+{
+	MemoryContext oldcontext;
+	ListCell   *lc;
+	int			i = 0;
+
+	if (numParams == 0)
+		return;
+
+	if (plannerInfo->param_values == NULL)
+	{
+		plannerInfo->param_values = (Datum *) palloc0(sizeof(Datum) * numParams);
+		plannerInfo->param_isnulls = (bool *) palloc0(sizeof(bool) * numParams);
+	}
+
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	foreach(lc, param_exprs)
+	{
+		ExprState  *expr_state = (ExprState *) lfirst(lc);
+
+		plannerInfo->param_values[i] = ExecEvalExpr(expr_state, econtext,
+													&plannerInfo->param_isnulls[i]);
+		i++;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
 }
 
 static List *
@@ -1230,13 +2269,23 @@ mongoPlanForeignModify(PlannerInfo *root,
 	if (plan->returningLists)
 		elog(ERROR, "RETURNING is not supported by this FDW");
 
+	/*
+	 * ON CONFLICT DO UPDATE never gets here, as it needs an arbiter index
+	 * and foreign tables have none.
+	 */
+	if (plan->onConflictAction != ONCONFLICT_NONE &&
+		plan->onConflictAction != ONCONFLICT_NOTHING)
+		elog(ERROR, "unexpected ON CONFLICT specification: %d",
+			 (int) plan->onConflictAction);
+
 #if PG_VERSION_NUM < 130000
 	heap_close(rel, NoLock);
 #else
 	table_close(rel, NoLock);
 #endif
 
-	return list_make1(targetAttrs);
+	return list_make2(targetAttrs,
+					  makeInteger(plan->onConflictAction == ONCONFLICT_NOTHING));
 }
 
 /*
@@ -1294,8 +2343,23 @@ mongoBeginForeignModify(ModifyTableState *mtstate,
 	 */
 	fmstate->mongoConnection = mongo_get_connection(server, user,
 													fmstate->options);
+	fmstate->writeOptions = mongoWriteOptsCreate(fmstate->options);
 
 	fmstate->target_attrs = (List *) list_nth(fdw_private, 0);
+#ifdef META_DRIVER
+	if (mtstate->operation == CMD_INSERT)
+	{
+		fmstate->do_nothing = intVal(list_nth(fdw_private, 1)) != 0;
+		fmstate->upsert = fmstate->options->upsert;
+	}
+	fmstate->deferred = mongo_fdw_deferred_writes;
+
+	/* Throw the bulk write away if an error ends the statement first */
+	fmstate->bulk_cb.func = mongo_discard_bulk;
+	fmstate->bulk_cb.arg = (void *) fmstate;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext,
+									   &fmstate->bulk_cb);
+#endif
 
 	n_params = list_length(fmstate->target_attrs) + 1;
 	fmstate->p_flinfo = (FmgrInfo *) palloc(sizeof(FmgrInfo) * n_params);
@@ -1346,6 +2410,16 @@ mongoBeginForeignModify(ModifyTableState *mtstate,
 /*
  * mongoExecForeignInsert
  *		Insert one row into a foreign table.
+ *
+ * In upsert mode, and for INSERT ... ON CONFLICT DO NOTHING, rows that come
+ * with an _id are matched against existing documents.  Such writes are
+ * queued into an unordered bulk write that is sent every batch_size rows and
+ * at the end of the statement.  Only the reply tells whether an ON CONFLICT
+ * DO NOTHING row was inserted, so the bulk write is sent right after such a
+ * row, which is neither counted nor returned when it was skipped.
+ *
+ * With mongo_fdw.deferred_writes, the row is kept back until the transaction
+ * commits instead, except for ON CONFLICT DO NOTHING.
  */
 static TupleTableSlot *
 mongoExecForeignInsert(EState *estate,
@@ -1354,12 +2428,20 @@ mongoExecForeignInsert(EState *estate,
 					   TupleTableSlot *planSlot)
 {
 	BSON	   *bsonDoc;
+	BSON	   *selector = NULL;
+	BSON	   *writeOptions;
 	Datum		value;
 	bool		isnull = false;
+	bool		keep_id = false;
+	bool		skipped = false;
 	MongoFdwModifyState *fmstate;
 
 	fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
 
+#ifdef META_DRIVER
+	keep_id = fmstate->upsert || fmstate->do_nothing;
+#endif
+
 	bsonDoc = bsonCreate();
 
 	/* Get following parameters from slot */
@@ -1391,10 +2473,20 @@ mongoExecForeignInsert(EState *estate,
 			/*
 			 * Ignore the value of first column which is row identifier in
 			 * MongoDb (_id) and let MongoDB to insert the unique value for
-			 * that column.
+			 * that column.  When upserting, a given _id is what identifies
+			 * the document to replace, so keep it in a separate selector.
 			 */
 			if (attnum == 1)
+			{
+				if (keep_id && !isnull)
+				{
+					selector = bsonCreate();
+					append_mongo_value(selector, "_id", value, false,
+									   TupleDescAttr(slot->tts_tupleDescriptor, 0)->atttypid);
+					bsonFinish(selector);
+				}
 				continue;
+			}
 
 #if PG_VERSION_NUM < 110000
 			append_mongo_value(bsonDoc,
@@ -1413,10 +2505,89 @@ mongoExecForeignInsert(EState *estate,
 	}
 	bsonFinish(bsonDoc);
 
+#ifdef META_DRIVER
+	if (fmstate->deferred)
+	{
+		if (!fmstate->do_nothing &&
+			mongo_defer_write(fmstate->mongoConnection, fmstate->options,
+							  fmstate->writeOptions,
+							  selector ? DEFERRED_REPLACE : DEFERRED_INSERT,
+							  selector, bsonDoc))
+		{
+			if (selector)
+				bsonDestroy(selector);
+			bsonDestroy(bsonDoc);
+
+			return slot;
+		}
+
+		/* Writes sent right away must come after the deferred ones */
+		mongo_flush_deferred_writes(fmstate->mongoConnection);
+	}
+
+	if (keep_id)
+	{
+		if (fmstate->bulk == NULL)
+		{
+			writeOptions = mongo_get_immediate_write_opts(fmstate);
+			fmstate->bulk = mongoBulkCreate(fmstate->mongoConnection,
+											fmstate->options->svr_database,
+											fmstate->options->collectionName,
+											writeOptions);
+			if (writeOptions != fmstate->writeOptions)
+				bsonDestroy(writeOptions);
+		}
+
+		if (selector == NULL)
+			mongoBulkInsert(fmstate->bulk, bsonDoc);
+		else if (fmstate->do_nothing)
+		{
+			BSON	   *update;
+
+			/* Existing documents are left alone */
+			update = bsonCreate();
+			bsonAppendBson(update, "$setOnInsert", bsonDoc);
+			bsonFinish(update);
+			mongoBulkUpdate(fmstate->bulk, selector, update, true);
+			bsonDestroy(update);
+		}
+		else
+			mongoBulkReplace(fmstate->bulk, selector, bsonDoc, true);
+
+		if (++fmstate->bulk_count >= fmstate->options->batch_size ||
+			(fmstate->do_nothing && selector != NULL))
+		{
+			MONGO_BULK *bulk = fmstate->bulk;
+
+			/* Sending destroys the bulk write, even when it fails */
+			fmstate->bulk = NULL;
+			fmstate->bulk_count = 0;
+
+			/* This row is the only upsert of the bulk write */
+			if (mongoBulkExecute(bulk) == 0 &&
+				fmstate->do_nothing && selector != NULL)
+				skipped = true;
+		}
+
+		if (selector)
+			bsonDestroy(selector);
+		bsonDestroy(bsonDoc);
+
+		return skipped ? NULL : slot;
+	}
+#endif
+
 	/* Now we are ready to insert tuple/document into MongoDB */
+#ifdef META_DRIVER
+	writeOptions = mongo_get_immediate_write_opts(fmstate);
+#else
+	writeOptions = fmstate->writeOptions;
+#endif
 	mongoInsert(fmstate->mongoConnection, fmstate->options->svr_database,
-				fmstate->options->collectionName, bsonDoc);
+				fmstate->options->collectionName, bsonDoc, writeOptions);
 
+	if (writeOptions != fmstate->writeOptions)
+		bsonDestroy(writeOptions);
 	bsonDestroy(bsonDoc);
 
 	return slot;
@@ -1501,6 +2672,7 @@ mongoExecForeignUpdate(EState *estate,
 	BSON	   *document;
 	BSON	   *op = NULL;
 	BSON		set;
+	BSON	   *writeOptions;
 	MongoFdwModifyState *fmstate;
 
 	fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
@@ -1564,10 +2736,33 @@ mongoExecForeignUpdate(EState *estate,
 	}
 	bsonFinish(op);
 
+#ifdef META_DRIVER
+	if (fmstate->deferred)
+	{
+		if (mongo_defer_write(fmstate->mongoConnection, fmstate->options,
+							  fmstate->writeOptions, DEFERRED_UPDATE, op,
+							  document))
+		{
+			bsonDestroy(op);
+			bsonDestroy(document);
+
+			return slot;
+		}
+		mongo_flush_deferred_writes(fmstate->mongoConnection);
+	}
+#endif
+
 	/* We are ready to update the row into MongoDB */
+#ifdef META_DRIVER
+	writeOptions = mongo_get_immediate_write_opts(fmstate);
+#else
+	writeOptions = fmstate->writeOptions;
+#endif
 	mongoUpdate(fmstate->mongoConnection, fmstate->options->svr_database,
-				fmstate->options->collectionName, op, document);
+				fmstate->options->collectionName, op, document, writeOptions);
 
+	if (writeOptions != fmstate->writeOptions)
+		bsonDestroy(writeOptions);
 	bsonDestroy(op);
 	bsonDestroy(document);
 
@@ -1591,6 +2786,7 @@ mongoExecForeignDelete(EState *estate,
 	char	   *columnName = NULL;
 	Oid			typoid;
 	BSON	   *document;
+	BSON	   *writeOptions;
 	MongoFdwModifyState *fmstate;
 
 	fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
@@ -1616,10 +2812,32 @@ mongoExecForeignDelete(EState *estate,
 	}
 	bsonFinish(document);
 
+#ifdef META_DRIVER
+	if (fmstate->deferred)
+	{
+		if (mongo_defer_write(fmstate->mongoConnection, fmstate->options,
+							  fmstate->writeOptions, DEFERRED_DELETE,
+							  document, NULL))
+		{
+			bsonDestroy(document);
+
+			return slot;
+		}
+		mongo_flush_deferred_writes(fmstate->mongoConnection);
+	}
+#endif
+
 	/* Now we are ready to delete a single document from MongoDB */
+#ifdef META_DRIVER
+	writeOptions = mongo_get_immediate_write_opts(fmstate);
+#else
+	writeOptions = fmstate->writeOptions;
+#endif
 	mongoDelete(fmstate->mongoConnection, fmstate->options->svr_database,
-				fmstate->options->collectionName, document);
+				fmstate->options->collectionName, document, writeOptions);
 
+	if (writeOptions != fmstate->writeOptions)
+		bsonDestroy(writeOptions);
 	bsonDestroy(document);
 
 	/* Return NULL if nothing was updated on the remote end */
@@ -1638,15 +2856,116 @@ mongoEndForeignModify(EState *estate, ResultRelInfo *resultRelInfo)
 	fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
 	if (fmstate)
 	{
+#ifdef META_DRIVER
+		/* Send the upserts still queued */
+		if (fmstate->bulk && fmstate->bulk_count > 0)
+		{
+			MONGO_BULK *bulk = fmstate->bulk;
+
+			fmstate->bulk = NULL;
+			fmstate->bulk_count = 0;
+			mongoBulkExecute(bulk);
+		}
+#endif
 		if (fmstate->options)
 		{
 			mongo_free_options(fmstate->options);
 			fmstate->options = NULL;
 		}
 		mongo_free_modify_state(fmstate);
-		pfree(fmstate);
+
+		/*
+		 * The state itself goes with the executor's memory context, whose
+		 * reset callback still refers to it.
+		 */
+	}
+}
+
+#if PG_VERSION_NUM >= 140000 && defined(META_DRIVER)
+/*
+ * mongoExecForeignTruncate
+ *		Empty the collections of the given foreign tables.
+ *
+ * All relations belong to the same foreign server, so the commands are sent
+ * one after the other through a single connection.  MongoDB has no command
+ * that empties several collections at once.  CASCADE and RESTART IDENTITY
+ * have no meaning for a collection and are ignored.
+ */
+static void
+mongoExecForeignTruncate(List *rels, DropBehavior behavior, bool restart_seqs)
+{
+	MONGO_CONN *mongoConnection = NULL;
+	Oid			userid = GetUserId();
+	ListCell   *lc;
+
+	foreach(lc, rels)
+	{
+		Relation	rel = (Relation) lfirst(lc);
+		Oid			foreignTableId = RelationGetRelid(rel);
+		MongoFdwOptions *options;
+		BSON	   *writeOptions;
+		BSON	   *sessionOptions;
+
+		options = mongo_get_options(foreignTableId, userid);
+
+		if (mongoConnection == NULL)
+		{
+			ForeignTable *table = GetForeignTable(foreignTableId);
+			ForeignServer *server = GetForeignServer(table->serverid);
+			UserMapping *user = GetUserMapping(userid, server->serverid);
+
+			mongoConnection = mongo_get_connection(server, user, options);
+		}
+
+		/* Writes still kept back for the collection would be wiped anyway */
+		mongo_discard_deferred_writes(mongoConnection, options->svr_database,
+									  options->collectionName);
+
+		writeOptions = mongoWriteOptsCreate(options);
+
+		/*
+		 * Delete inside the MongoDB transaction of the local transaction, if
+		 * there is one, where the transaction's write concern applies.  A
+		 * collection can only be dropped outside of one.
+		 */
+		sessionOptions = options->truncate_drop ?
+			mongo_get_session_opts(mongoConnection) :
+			mongo_get_write_session_opts(mongoConnection);
+		if (sessionOptions)
+		{
+			BSON	   *opts = bsonCreate();
+
+			if (options->truncate_drop)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot drop collection \"%s\" inside a MongoDB transaction",
+								options->collectionName),
+						 errhint("Set option \"%s\" to \"delete\".",
+								 OPTION_NAME_TRUNCATE_MODE)));
+
+			if (writeOptions)
+			{
+				bson_copy_to_excluding_noinit(writeOptions, opts,
+											  "writeConcern", NULL);
+				bsonDestroy(writeOptions);
+			}
+			bson_concat(opts, sessionOptions);
+			writeOptions = opts;
+		}
+
+		mongoTruncate(mongoConnection, options->svr_database,
+					  options->collectionName, options->truncate_drop,
+					  writeOptions);
+
+		if (writeOptions)
+			bsonDestroy(writeOptions);
+		mongo_free_options(options);
 	}
+
+	if (mongoConnection)
+		mongo_release_connection(mongoConnection);
 }
+#endif
 
 /*
  * foreign_table_document_count
@@ -1687,6 +3006,239 @@ foreign_table_document_count(Oid foreignTableId, Oid userid)
 	return documentCount;
 }
 
+#ifdef META_DRIVER
+/*
+ * foreign_table_indexes
+ * 		Returns the indexes of the foreign collection, fetching them from the
+ * 		MongoDB server when they are not cached yet.
+ */
+static List *
+foreign_table_indexes(Oid foreignTableId, Oid userid)
+{
+	MongoIndexCacheEntry *entry;
+	bool		found;
+
+	/* First time through, initialize index cache hashtable */
+	if (IndexCacheHash == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(MongoIndexCacheEntry);
+		ctl.hcxt = CacheMemoryContext;
+		IndexCacheHash = hash_create("mongo_fdw indexes", 64, &ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(mongo_index_cache_inval_callback,
+									  (Datum) 0);
+	}
+
+	entry = hash_search(IndexCacheHash, &foreignTableId, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->valid = false;
+		entry->cxt = NULL;
+		entry->indexes = NIL;
+	}
+
+	if (!entry->valid)
+	{
+		MongoFdwOptions *options;
+		MONGO_CONN *mongoConnection;
+		ForeignServer *server;
+		UserMapping *user;
+		ForeignTable *table;
+		MemoryContext oldcxt;
+
+		table = GetForeignTable(foreignTableId);
+		server = GetForeignServer(table->serverid);
+		user = GetUserMapping(userid, server->serverid);
+		options = mongo_get_options(foreignTableId, userid);
+		mongoConnection = mongo_get_connection(server, user, options);
+
+		if (entry->cxt)
+			MemoryContextReset(entry->cxt);
+		else
+			entry->cxt = AllocSetContextCreate(CacheMemoryContext,
+											   "mongo_fdw index cache entry",
+											   ALLOCSET_SMALL_SIZES);
+
+		oldcxt = MemoryContextSwitchTo(entry->cxt);
+		entry->indexes = mongoListIndexes(mongoConnection,
+										  options->svr_database,
+										  options->collectionName);
+		MemoryContextSwitchTo(oldcxt);
+		entry->valid = true;
+
+		mongo_free_options(options);
+	}
+
+	return entry->indexes;
+}
+
+/*
+ * mongo_index_cache_inval_callback
+ *		Mark cached indexes to be fetched again after a relcache invalidation
+ *		of their foreign table.
+ */
+static void
+mongo_index_cache_inval_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS scan;
+	MongoIndexCacheEntry *entry;
+
+	hash_seq_init(&scan, IndexCacheHash);
+	while ((entry = (MongoIndexCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (relid == InvalidOid || entry->relid == relid)
+			entry->valid = false;
+	}
+}
+
+/*
+ * mongo_get_remote_column_names
+ *		Returns the remote field name of each column of a foreign table,
+ *		indexed by attribute number.  Dropped columns have no name.
+ */
+static char **
+mongo_get_remote_column_names(Oid relid, AttrNumber max_attr)
+{
+	Relation	rel;
+	TupleDesc	tupdesc;
+	char	  **colnames;
+	AttrNumber	attnum;
+
+	rel = table_open(relid, NoLock);
+	tupdesc = RelationGetDescr(rel);
+	colnames = (char **) palloc0(sizeof(char *) * (max_attr + 1));
+	for (attnum = 1; attnum <= max_attr; attnum++)
+	{
+		Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
+		List	   *options;
+		ListCell   *lc_opt;
+
+		/* Ignore dropped attributes. */
+		if (attr->attisdropped)
+			continue;
+
+		colnames[attnum] = pstrdup(NameStr(attr->attname));
+		options = GetForeignColumnOptions(relid, attnum);
+		foreach(lc_opt, options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc_opt);
+
+			if (strcmp(def->defname, "column_name") == 0)
+			{
+				colnames[attnum] = defGetString(def);
+				break;
+			}
+		}
+	}
+	table_close(rel, NoLock);
+
+	return colnames;
+}
+
+/*
+ * mongo_get_index_pathkeys
+ *		Build the pathkeys for the orderings provided by the given indexes of
+ *		a base relation.
+ *
+ * An index yields the longest prefix of its keys that maps to columns with a
+ * pushable ordering and is of some use to the query.  MongoDB stores nulls
+ * lowest in an index, so the pathkeys place nulls that way unless the column
+ * is NOT NULL.  It stores NaN lowest too, where PostgreSQL sorts it highest,
+ * so a floating-point or numeric key ends the prefix.
+ */
+static List *
+mongo_get_index_pathkeys(PlannerInfo *root, RelOptInfo *baserel, List *indexes)
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	Oid			relid = fpinfo->baserel_oid;
+	List	   *result = NIL;
+	char	  **colnames;
+	AttrNumber	attnum;
+	ListCell   *lc;
+
+	if (indexes == NIL)
+		return NIL;
+
+	colnames = mongo_get_remote_column_names(relid, baserel->max_attr);
+
+	foreach(lc, indexes)
+	{
+		MongoIndexInfo *index = (MongoIndexInfo *) lfirst(lc);
+		List	   *pathkeys = NIL;
+		ListCell   *lc_field;
+		ListCell   *lc_dir;
+
+		forboth(lc_field, index->fields, lc_dir, index->directions)
+		{
+			char	   *field = strVal(lfirst(lc_field));
+			bool		descending = (lfirst_int(lc_dir) < 0);
+			Oid			typid;
+			int32		typmod;
+			Oid			collid;
+			Oid			opclass;
+			Oid			opfamily;
+			bool		nulls_first;
+			Var		   *var;
+			EquivalenceClass *ec;
+			PathKey    *pathkey;
+
+			for (attnum = 1; attnum <= baserel->max_attr; attnum++)
+			{
+				if (colnames[attnum] && strcmp(colnames[attnum], field) == 0)
+					break;
+			}
+			if (attnum > baserel->max_attr)
+				break;
+
+			get_atttypetypmodcoll(relid, attnum, &typid, &typmod, &collid);
+			if (typid == FLOAT4OID || typid == FLOAT8OID ||
+				typid == NUMERICOID)
+				break;
+
+			opclass = GetDefaultOpClass(typid, BTREE_AM_OID);
+			if (!OidIsValid(opclass))
+				break;
+			opfamily = get_opclass_family(opclass);
+
+			/* Only an ordering that is already of interest can be useful */
+			var = makeVar(baserel->relid, attnum, typid, typmod, collid, 0);
+			ec = get_eclass_for_sort_expr(root, (Expr *) var,
+#if PG_VERSION_NUM < 160000
+										  NULL,
+#endif
+										  list_make1_oid(opfamily),
+										  get_opclass_input_type(opclass),
+										  collid, 0, baserel->relids, false);
+			if (ec == NULL)
+				break;
+
+			nulls_first = mongo_column_is_not_null(root, baserel, attnum) ?
+				descending : !descending;
+			pathkey = make_canonical_pathkey(root, ec, opfamily,
+											 descending ? BTGreaterStrategyNumber :
+											 BTLessStrategyNumber,
+											 nulls_first);
+			if (!mongo_is_foreign_pathkey(root, baserel, pathkey))
+				break;
+
+			if (!list_member_ptr(pathkeys, pathkey))
+				pathkeys = lappend(pathkeys, pathkey);
+		}
+
+		pathkeys = truncate_useless_pathkeys(root, baserel, pathkeys);
+		if (pathkeys != NIL)
+			result = lappend(result, pathkeys);
+	}
+
+	return result;
+}
+#endif
+
 /*
  * fill_tuple_slot
  *		Walks over all key/value pairs in the given document.
@@ -1814,7 +3366,7 @@ fill_tuple_slot_agg(const BSON *bsonDocument,
 		/* Fill in corresponding target value and null flag */
 		if (OidIsValid(pgArrayTypeId))
 			columnValues[targetIndex] = column_value_array(&bsonIterator,
-														 pgArrayTypeId);
+														 pgArrayTypeId, true);
 		else
 			columnValues[targetIndex] = column_value(&bsonIterator,
 													pgTypeId,
@@ -1999,7 +3551,7 @@ fill_tuple_slot_attr(const BSON *bsonDocument,
 		/* Fill in corresponding column value and null flag */
 		if (OidIsValid(columnArrayTypeId))
 			columnValues[columnIndex] = column_value_array(&bsonIterator,
-														 columnArrayTypeId);
+														 columnArrayTypeId, false);
 		else
 			columnValues[columnIndex] = column_value(&bsonIterator,
 													columnTypeId,
@@ -2112,12 +3664,15 @@ column_types_compatible(BSON_TYPE bsonType, Oid columnTypeId)
  * 		the corresponding PostgreSQL datum.
  *
  * Then, the function constructs an array datum from element datums, and
- * returns the array datum.
+ * returns the array datum.  Null elements are skipped, unless keepNulls is
+ * given, as for an array built by the aggregation pipeline.
  */
 static Datum
-column_value_array(BSON_ITERATOR *bsonIterator, Oid valueTypeId)
+column_value_array(BSON_ITERATOR *bsonIterator, Oid valueTypeId,
+				   bool keepNulls)
 {
 	Datum	   *columnValueArray = palloc(INITIAL_ARRAY_CAPACITY * sizeof(Datum));
+	bool	   *columnNullArray = palloc(INITIAL_ARRAY_CAPACITY * sizeof(bool));
 	uint32		arrayCapacity = INITIAL_ARRAY_CAPACITY;
 	uint32		arrayIndex = 0;
 	ArrayType  *columnValueObject;
@@ -2125,6 +3680,8 @@ column_value_array(BSON_ITERATOR *bsonIterator, Oid valueTypeId)
 	bool		typeByValue;
 	char		typeAlignment;
 	int16		typeLength;
+	int			dims[1];
+	int			lbs[1];
 
 	BSON_ITERATOR bsonSubIterator = {NULL, 0};
 
@@ -2133,9 +3690,11 @@ column_value_array(BSON_ITERATOR *bsonIterator, Oid valueTypeId)
 	{
 		BSON_TYPE	bsonType = bsonIterType(&bsonSubIterator);
 		bool		compatibleTypes = false;
+		bool		isNull;
 
 		compatibleTypes = column_types_compatible(bsonType, valueTypeId);
-		if (bsonType == BSON_TYPE_NULL || !compatibleTypes)
+		isNull = (bsonType == BSON_TYPE_NULL || !compatibleTypes);
+		if (isNull && !keepNulls)
 			continue;
 
 		if (arrayIndex >= arrayCapacity)
@@ -2144,26 +3703,38 @@ column_value_array(BSON_ITERATOR *bsonIterator, Oid valueTypeId)
 			arrayCapacity *= 2;
 			columnValueArray = repalloc(columnValueArray,
 										arrayCapacity * sizeof(Datum));
+			columnNullArray = repalloc(columnNullArray,
+									   arrayCapacity * sizeof(bool));
 		}
 
 		/* Use default type modifier (0) to convert column value */
-		columnValueArray[arrayIndex] = column_value(&bsonSubIterator,
-													valueTypeId, 0);
+		if (isNull)
+			columnValueArray[arrayIndex] = (Datum) 0;
+		else
+			columnValueArray[arrayIndex] = column_value(&bsonSubIterator,
+														valueTypeId, 0);
+		columnNullArray[arrayIndex] = isNull;
 		arrayIndex++;
 	}
 
 	get_typlenbyvalalign(valueTypeId, &typeLength, &typeByValue,
 						 &typeAlignment);
-	columnValueObject = construct_array(columnValueArray,
-										arrayIndex,
-										valueTypeId,
-										typeLength,
-										typeByValue,
-										typeAlignment);
+	dims[0] = arrayIndex;
+	lbs[0] = 1;
+	columnValueObject = construct_md_array(columnValueArray,
+										   columnNullArray,
+										   arrayIndex > 0 ? 1 : 0,
+										   dims,
+										   lbs,
+										   valueTypeId,
+										   typeLength,
+										   typeByValue,
+										   typeAlignment);
 
 	columnValueDatum = PointerGetDatum(columnValueObject);
 
 	pfree(columnValueArray);
+	pfree(columnNullArray);
 
 	return columnValueDatum;
 }
@@ -2712,10 +4283,70 @@ mongo_free_modify_state(MongoFdwModifyState *fmstate)
 		fmstate->mongoCursor = NULL;
 	}
 
+	if (fmstate->writeOptions)
+	{
+		bsonDestroy(fmstate->writeOptions);
+		fmstate->writeOptions = NULL;
+	}
+
+#ifdef META_DRIVER
+	mongo_discard_bulk((void *) fmstate);
+#endif
+
 	/* Release remote connection */
 	mongo_release_connection(fmstate->mongoConnection);
 }
 
+#ifdef META_DRIVER
+/*
+ * mongo_discard_bulk
+ *		Throw away the bulk write of a modify state without sending it.
+ *
+ * This is also the reset callback of the executor's memory context, so that
+ * the writes queued by a statement that fails are not kept around.
+ */
+static void
+mongo_discard_bulk(void *arg)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) arg;
+
+	if (fmstate->bulk)
+	{
+		mongoBulkDestroy(fmstate->bulk);
+		fmstate->bulk = NULL;
+		fmstate->bulk_count = 0;
+	}
+}
+
+/*
+ * mongo_get_immediate_write_opts
+ *		Return the options for a write sent right away instead of deferred.
+ *
+ * With mongo_fdw.deferred_write_transaction, the write goes into the MongoDB
+ * transaction of the local transaction, where the transaction's write concern
+ * applies.  The result is then a new document, which the caller destroys;
+ * otherwise it is fmstate->writeOptions.
+ */
+static BSON *
+mongo_get_immediate_write_opts(MongoFdwModifyState *fmstate)
+{
+	BSON	   *sessionOptions;
+	BSON	   *opts;
+
+	sessionOptions = mongo_get_write_session_opts(fmstate->mongoConnection);
+	if (sessionOptions == NULL)
+		return fmstate->writeOptions;
+
+	opts = bsonCreate();
+	if (fmstate->writeOptions)
+		bson_copy_to_excluding_noinit(fmstate->writeOptions, opts,
+									  "writeConcern", NULL);
+	bson_concat(opts, sessionOptions);
+
+	return opts;
+}
+#endif
+
 /*
  * mongoAnalyzeForeignTable
  *		Collects statistics for the given foreign table.
@@ -2866,8 +4497,17 @@ mongo_acquire_sample_rows(Relation relation,
 	}
 
 	/* Create cursor for collection name and set query */
+#ifdef META_DRIVER
+	mongo_flush_deferred_writes(mongoConnection);
+	mongoCursor = mongoCursorCreate(mongoConnection, options->svr_database,
+									options->collectionName, queryDocument,
+									mongo_get_session_opts(mongoConnection),
+									false);
+#else
 	mongoCursor = mongoCursorCreate(mongoConnection, options->svr_database,
-									options->collectionName, queryDocument, false);
+									options->collectionName, queryDocument,
+									NULL, false);
+#endif
 
 	/*
 	 * Use per-tuple memory context to prevent leak of memory used to read
@@ -3113,6 +4753,34 @@ mongoGetForeignJoinPaths(PlannerInfo *root, RelOptInfo *joinrel,
 	else
 		epq_path = NULL;
 
+	/*
+	 * The "$lookup" is driven by the outer relation.  An inner join of two
+	 * collections can be driven by either, so let the cheaper one drive it,
+	 * which is the smaller one or the one whose join key is indexed on the
+	 * other.
+	 */
+	if (jointype == JOIN_INNER &&
+		IS_SIMPLE_REL(outerrel) && IS_SIMPLE_REL(innerrel) &&
+		mongo_estimate_join_cost(joinrel, outerrel, innerrel,
+								 extra->restrictlist, &startup_cost,
+								 &total_cost))
+	{
+		Cost		swapped_startup_cost;
+		Cost		swapped_total_cost;
+
+		if (mongo_estimate_join_cost(joinrel, innerrel, outerrel,
+									 extra->restrictlist,
+									 &swapped_startup_cost,
+									 &swapped_total_cost) &&
+			swapped_total_cost < total_cost)
+		{
+			RelOptInfo *tmp = outerrel;
+
+			outerrel = innerrel;
+			innerrel = tmp;
+		}
+	}
+
 	if (!mongo_foreign_join_ok(root, joinrel, jointype, outerrel, innerrel, extra))
 	{
 		/* Free path required for EPQ if we copied one; we don't need it now */
@@ -3121,12 +4789,30 @@ mongoGetForeignJoinPaths(PlannerInfo *root, RelOptInfo *joinrel,
 		return;
 	}
 
-	/* Estimate the cost of push down */
-	rows = startup_cost = total_cost = width = 0;
+	/*
+	 * Estimate the cost of push down.  Without remote estimates for the
+	 * joining relations, the join is costed as free, like their scans.  With
+	 * them, a local join may still turn out cheaper and win.
+	 */
+	if (mongo_estimate_join_cost(joinrel, outerrel, innerrel,
+								 extra->restrictlist, &startup_cost,
+								 &total_cost))
+	{
+		rows = joinrel->rows;
+		width = joinrel->reltarget->width;
+
+		fpinfo->remote_estimated = true;
+		fpinfo->startup_cost = startup_cost;
+		fpinfo->total_cost = total_cost;
+	}
+	else
+	{
+		rows = startup_cost = total_cost = width = 0;
 
-	/* Now update this information in the joinrel */
-	joinrel->rows = rows;
-	joinrel->reltarget->width = width;
+		/* Now update this information in the joinrel */
+		joinrel->rows = rows;
+		joinrel->reltarget->width = width;
+	}
 
 	/*
 	 * Create a new join path and add it to the joinrel which represents a
@@ -3143,12 +4829,61 @@ mongoGetForeignJoinPaths(PlannerInfo *root, RelOptInfo *joinrel,
 										epq_path,
 										NIL);	/* no fdw_private */
 
-	/* Add generated path into joinrel by add_path(). */
-	add_path(joinrel, (Path *) joinpath);
+	/* Add generated path into joinrel by add_path(). */
+	add_path(joinrel, (Path *) joinpath);
+
+	/* Consider pathkeys for the join relation */
+	mongo_add_paths_with_pathkeys_for_rel(root, joinrel, epq_path, startup_cost,
+										  total_cost);
+
+	/* XXX Consider parameterized paths for the join relation */
+}
+
+/*
+ * mongo_estimate_join_cost
+ *		Estimate the cost of a join pushed down as a "$lookup" stage driven by
+ *		the given outer relation.
+ *
+ * The outer documents are read once, and for each of them the inner
+ * documents are looked up, by an index on the join key if the inner
+ * collection has one, otherwise by reading the whole collection.  Returns
+ * false if either side has no remote estimates.
+ */
+static bool
+mongo_estimate_join_cost(RelOptInfo *joinrel, RelOptInfo *outerrel,
+						 RelOptInfo *innerrel, List *restrictlist,
+						 Cost *p_startup_cost, Cost *p_total_cost)
+{
+	MongoFdwRelationInfo *fpinfo_o = (MongoFdwRelationInfo *) outerrel->fdw_private;
+	MongoFdwRelationInfo *fpinfo_i = (MongoFdwRelationInfo *) innerrel->fdw_private;
+	double		outer_rows;
+	double		matched_rows;
+	Cost		lookup_cost;
+
+	if (!fpinfo_o || !fpinfo_o->remote_estimated ||
+		!fpinfo_i || !fpinfo_i->remote_estimated ||
+		!IS_SIMPLE_REL(innerrel))
+		return false;
+
+	/* Inner documents matching an outer document */
+	outer_rows = clamp_row_est(outerrel->rows);
+	matched_rows = clamp_row_est(joinrel->rows / outer_rows);
+
+	if (mongo_param_clauses_use_index(innerrel, restrictlist,
+									  fpinfo_i->indexes))
+		lookup_cost = random_page_cost *
+			ceil(matched_rows * fpinfo_i->document_width / BLCKSZ) +
+			cpu_tuple_cost * matched_rows;
+	else
+		lookup_cost = seq_page_cost *
+			rint(fpinfo_i->document_count * fpinfo_i->document_width / BLCKSZ) +
+			cpu_tuple_cost * fpinfo_i->document_count;
 
-	/* XXX Consider pathkeys for the join relation */
+	*p_startup_cost = fpinfo_o->startup_cost;
+	*p_total_cost = fpinfo_o->total_cost + outer_rows * lookup_cost +
+		cpu_tuple_cost * MONGO_TUPLE_COST_MULTIPLIER * joinrel->rows;
 
-	/* XXX Consider parameterized paths for the join relation */
+	return true;
 }
 
 /*
@@ -3170,9 +4905,13 @@ mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	RangeTblEntry *rte;
 	char	   *colname;
 
-	/* We support pushing down only INNER, LEFT, RIGHT OUTER join */
+	/*
+	 * We support pushing down only INNER, LEFT, RIGHT OUTER join, and SEMI
+	 * and ANTI join, which keep only the outer documents.
+	 */
 	if (jointype != JOIN_INNER && jointype != JOIN_LEFT &&
-		jointype != JOIN_RIGHT)
+		jointype != JOIN_RIGHT && jointype != JOIN_SEMI &&
+		jointype != JOIN_ANTI)
 		return false;
 
 	fpinfo = (MongoFdwRelationInfo *) joinrel->fdw_private;
@@ -3192,8 +4931,15 @@ mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 		(!IS_JOIN_REL(innerrel) && !fpinfo_i->options->enable_join_pushdown))
 		return false;
 
-	/* Recursive joins can't be pushed down */
-	if (IS_JOIN_REL(outerrel) || IS_JOIN_REL(innerrel))
+	/*
+	 * A nested join is pushed down as one more "$lookup" stage on the result
+	 * of the outer join, so only left-deep join trees are supported.  The
+	 * looked up documents can not be preserved when nothing matches, hence
+	 * the outer join relation can not be the nullable side.
+	 */
+	if (IS_JOIN_REL(innerrel))
+		return false;
+	if (IS_JOIN_REL(outerrel) && jointype == JOIN_RIGHT)
 		return false;
 
 	/*
@@ -3234,8 +4980,9 @@ mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	/*
 	 * Separate restrict list into join quals and pushed-down (other) quals.
 	 *
-	 * Join quals belonging to an outer join must all be shippable, else we
-	 * cannot execute the join remotely.  Add such quals to 'joinclauses'.
+	 * Join quals belonging to an outer join or a semi join must all be
+	 * shippable, else we cannot execute the join remotely.  Add such quals
+	 * to 'joinclauses'.
 	 *
 	 * Add other quals to fpinfo->remote_conds if they are shippable, else to
 	 * fpinfo->local_conds.  In an inner join it's okay to execute conditions
@@ -3253,7 +5000,7 @@ mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 		bool		is_remote_clause = mongo_is_foreign_expr(root, joinrel,
 															 rinfo->clause);
 
-		if (IS_OUTER_JOIN(jointype) &&
+		if ((IS_OUTER_JOIN(jointype) || jointype == JOIN_SEMI) &&
 			!RINFO_IS_PUSHED_DOWN(rinfo, joinrel->relids))
 		{
 			if (!is_remote_clause)
@@ -3321,12 +5068,14 @@ mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	 * clauses or other remote clauses (remote_conds) of this relation
 	 * wherever possible. This avoids building subqueries at every join step.
 	 *
-	 * For an inner join, clauses from both the relations are added to the
-	 * other remote clauses. For LEFT and RIGHT OUTER join, the clauses from
-	 * the outer side are added to remote_conds since those can be evaluated
-	 * after the join is evaluated. The clauses from inner side are added to
-	 * the joinclauses, since they need to be evaluated while constructing the
-	 * join.
+	 * The clauses from the outer side are added to remote_conds, which are
+	 * evaluated on the outer documents before they are joined.  The clauses
+	 * from the inner side are kept in inner_remote_conds, since they need to
+	 * be evaluated while constructing the join, and are evaluated on the
+	 * inner documents before they are joined.  This holds for INNER and LEFT
+	 * OUTER join, as well as SEMI and ANTI join.  For RIGHT OUTER join, the
+	 * clauses from the inner side are added to remote_conds and those from
+	 * the outer side to the joinclauses.
 	 *
 	 * For a FULL OUTER JOIN, the other clauses from either relation can not
 	 * be added to the joinclauses or remote_conds, since each relation acts
@@ -3339,8 +5088,9 @@ mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	{
 		case JOIN_INNER:
 		case JOIN_LEFT:
-			fpinfo->joinclauses = list_concat(fpinfo->joinclauses,
-											  fpinfo_i->remote_conds);
+		case JOIN_SEMI:
+		case JOIN_ANTI:
+			fpinfo->inner_remote_conds = fpinfo_i->remote_conds;
 			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
 											   fpinfo_o->remote_conds);
 			break;
@@ -3349,6 +5099,7 @@ mongo_foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 											  fpinfo_o->remote_conds);
 			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
 											   fpinfo_i->remote_conds);
+			break;
 		default:
 			/* Should not happen, we have just checked this above */
 			elog(ERROR, "unsupported join type %d", jointype);
@@ -3387,10 +5138,6 @@ mongo_foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
 	int			i;
 	List	   *tlist = NIL;
 
-	/* We currently don't support pushing Grouping Sets. */
-	if (query->groupingSets)
-		return false;
-
 	/* Get the fpinfo of the underlying scan relation. */
 	ofpinfo = (MongoFdwRelationInfo *) fpinfo->outerrel->fdw_private;
 
@@ -3402,6 +5149,14 @@ mongo_foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
 	if (ofpinfo->local_conds)
 		return false;
 
+	/*
+	 * The "$lookup" stages of a nested join refer to the columns of the lower
+	 * inner relations through the target list, which is the grouping target
+	 * here.  Those columns may not be part of it.
+	 */
+	if (IS_JOIN_REL(fpinfo->outerrel) && IS_JOIN_REL(ofpinfo->outerrel))
+		return false;
+
 	/*
 	 * Examine grouping expressions, as well as other expressions we'd need to
 	 * compute, and check whether they are safe to push down to the foreign
@@ -3467,7 +5222,8 @@ mongo_foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
 			 * as-is to the foreign server?
 			 */
 			if (mongo_is_foreign_expr(root, grouped_rel, expr) &&
-				!mongo_is_foreign_param(root, grouped_rel, expr))
+				!mongo_is_foreign_param(root, grouped_rel, expr) &&
+				(IsA(expr, Aggref) || !mongo_has_finalized_aggref((Node *) expr)))
 			{
 				/* Yes, so add to tlist as-is; OK to suppress duplicates */
 				tlist = add_to_flat_tlist(tlist, list_make1(expr));
@@ -3513,79 +5269,363 @@ mongo_foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
 	}
 
 	/*
-	 * Classify the pushable and non-pushable HAVING clauses and save them in
-	 * remote_conds and local_conds of the grouped rel's fpinfo.
+	 * Classify the pushable and non-pushable HAVING clauses and save them in
+	 * remote_conds and local_conds of the grouped rel's fpinfo.
+	 */
+	if (havingQual)
+	{
+		foreach(lc, (List *) havingQual)
+		{
+			Expr	   *expr = (Expr *) lfirst(lc);
+			RestrictInfo *rinfo;
+
+			/*
+			 * Currently, the core code doesn't wrap havingQuals in
+			 * RestrictInfos, so we must make our own.
+			 */
+			Assert(!IsA(expr, RestrictInfo));
+#if PG_VERSION_NUM >= 140000
+			rinfo = make_restrictinfo(root,
+#else
+			rinfo = make_restrictinfo(
+#endif
+									  expr,
+									  true,
+									  false,
+									  false,
+#if PG_VERSION_NUM >= 160000
+									  false,
+#endif
+									  root->qual_security_level,
+									  grouped_rel->relids,
+									  NULL,
+									  NULL);
+			/*
+			 * With grouping sets, the rows of all the sets are put together
+			 * after their "$group" stages, where a column left out of a set
+			 * is missing rather than null.  Apply HAVING locally then.
+			 */
+			if (!query->groupingSets &&
+				mongo_is_foreign_expr(root, grouped_rel, expr))
+				fpinfo->remote_conds = lappend(fpinfo->remote_conds, rinfo);
+			else
+				fpinfo->local_conds = lappend(fpinfo->local_conds, rinfo);
+		}
+	}
+
+	/*
+	 * If there are any local conditions, pull Vars and aggregates from it and
+	 * check whether they are safe to pushdown or not.
+	 */
+	if (fpinfo->local_conds)
+	{
+		List	   *aggvars = NIL;
+
+		foreach(lc, fpinfo->local_conds)
+		{
+			RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+
+			aggvars = list_concat(aggvars,
+								  pull_var_clause((Node *) rinfo->clause,
+												  PVC_INCLUDE_AGGREGATES));
+		}
+
+		foreach(lc, aggvars)
+		{
+			Expr	   *expr = (Expr *) lfirst(lc);
+
+			/*
+			 * If aggregates within local conditions are not safe to push
+			 * down, then we cannot push down the query.  Vars are already
+			 * part of GROUP BY clause which are checked above, so no need to
+			 * access them again here.  Again, we need not check
+			 * is_foreign_param for a foreign aggregate.
+			 */
+			if (IsA(expr, Aggref))
+			{
+				if (!mongo_is_foreign_expr(root, grouped_rel, expr))
+					return false;
+
+				tlist = add_to_flat_tlist(tlist, list_make1(expr));
+			}
+		}
+	}
+
+	/* Store generated targetlist */
+	fpinfo->grouped_tlist = tlist;
+
+	/* Safe to pushdown */
+	fpinfo->pushdown_safe = true;
+
+	return true;
+}
+
+/*
+ * mongo_add_foreign_grouping_paths
+ *		Add foreign path for grouping and/or aggregation.
+ *
+ * Given input_rel represents the underlying scan.  The paths are added to the
+ * given grouped_rel.  For a partition-wise aggregation, grouped_rel is the
+ * partially grouped relation of a partition, whose aggregates return their
+ * partial states, and the HAVING clause is applied after combining them.
+ */
+static void
+mongo_add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
+						   RelOptInfo *grouped_rel,
+						   GroupPathExtraData *extra)
+{
+	Query	   *parse = root->parse;
+	MongoFdwRelationInfo *fpinfo = grouped_rel->fdw_private;
+	ForeignPath *grouppath;
+	double		rows;
+	Cost		startup_cost;
+	Cost		total_cost;
+
+	/* Nothing to be done, if there is no grouping or aggregation required. */
+	if (!parse->groupClause && !parse->groupingSets && !parse->hasAggs &&
+		!root->hasHavingQual)
+		return;
+
+	Assert(extra->patype == PARTITIONWISE_AGGREGATE_NONE ||
+		   extra->patype == PARTITIONWISE_AGGREGATE_FULL ||
+		   (extra->patype == PARTITIONWISE_AGGREGATE_PARTIAL &&
+			fpinfo->stage == UPPERREL_PARTIAL_GROUP_AGG));
+
+	/* save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
+
+	/*
+	 * Assess if it is safe to push down aggregation and grouping.
+	 *
+	 * Use HAVING qual from extra. In case of child partition, it will have
+	 * translated Vars.
+	 */
+	if (!mongo_foreign_grouping_ok(root, grouped_rel,
+								   fpinfo->stage == UPPERREL_PARTIAL_GROUP_AGG ?
+								   NULL : extra->havingQual))
+		return;
+
+	/*
+	 * If no grouping, numGroups - possible number of groups should be set 1.
+	 * When creating upper path, rows is passed to pathnode->path.rows.
+	 * When creating aggregation plan, somehow path.rows is passed to numGroups.
+	 */
+	if (!parse->groupClause)
+	{
+		/* Not grouping */
+		rows = 1;
+	}
+	else if (parse->hasAggs || root->hasHavingQual)
+	{
+		/* Plain aggregation, one result row */
+		rows = 1;
+	}
+	else
+	{
+		rows = 0;
+	}
+
+	/* Estimate the cost of push down */
+	startup_cost = total_cost = 0;
+
+
+	/* Create and add foreign path to the grouping relation. */
+	grouppath = create_foreign_upper_path(root,
+										  grouped_rel,
+										  grouped_rel->reltarget,
+										  rows,
+										  startup_cost,
+										  total_cost,
+										  NIL,	/* no pathkeys */
+										  NULL,
+										  NIL); /* no fdw_private */
+
+	/* Add generated path into grouped_rel by add_path(). */
+	add_path(grouped_rel, (Path *) grouppath);
+}
+
+/*
+ * mongo_has_finalized_aggref
+ *		Check whether the given expression contains an aggregate that is
+ *		computed after the "$group" stage, like one with DISTINCT.
+ *
+ * Such an aggregate is finished by a stage that follows "$group", so it can
+ * only be pushed down as a target of its own.
+ */
+static bool
+mongo_has_finalized_aggref(Node *node)
+{
+	ListCell   *lc;
+
+	foreach(lc, pull_var_clause(node, PVC_INCLUDE_AGGREGATES))
+	{
+		Node	   *aggref = (Node *) lfirst(lc);
+
+		if (IsA(aggref, Aggref) && mongo_is_finalized_aggref((Aggref *) aggref))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * mongo_add_foreign_distinct_paths
+ *		Add foreign path for SELECT DISTINCT.
+ *
+ * The distinct rows are computed remotely by a "$group" stage on all the
+ * output columns.  Given input_rel represents the underlying scan.  The path
+ * is added to the given distinct_rel.
+ */
+static void
+mongo_add_foreign_distinct_paths(PlannerInfo *root, RelOptInfo *input_rel,
+								 RelOptInfo *distinct_rel)
+{
+	Query	   *parse = root->parse;
+	MongoFdwRelationInfo *ifpinfo = (MongoFdwRelationInfo *) input_rel->fdw_private;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) distinct_rel->fdw_private;
+	PathTarget *distinct_target = root->upper_targets[UPPERREL_DISTINCT];
+	ForeignPath *distinct_path;
+	List	   *tlist = NIL;
+	List	   *group_exprs = NIL;
+	ListCell   *lc;
+	double		rows;
+	Cost		startup_cost;
+	Cost		total_cost;
+	int			i;
+
+	/*
+	 * Only a plain scan or join can be grouped again; DISTINCT ON needs the
+	 * first row of each group in the sort order, and SRFs are evaluated
+	 * locally.
+	 */
+	if (input_rel->reloptkind == RELOPT_UPPER_REL ||
+		parse->hasDistinctOn || parse->hasTargetSRFs)
+		return;
+
+	/* The local conditions have to be applied before removing duplicates */
+	if (ifpinfo->local_conds)
+		return;
+
+	/* Same restriction as for the grouping of a nested join */
+	if (IS_JOIN_REL(input_rel) && IS_JOIN_REL(ifpinfo->outerrel))
+		return;
+
+	/* Save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
+
+	/*
+	 * Every output column is a grouping key.  As for GROUP BY, none of them
+	 * may be a foreign param, see mongo_foreign_grouping_ok.
+	 */
+	i = 0;
+	foreach(lc, distinct_target->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc);
+		Index		sgref = get_pathtarget_sortgroupref(distinct_target, i);
+		TargetEntry *tle;
+
+		if (!sgref || !get_sortgroupref_clause_noerr(sgref, parse->distinctClause))
+			return;
+
+		if (!mongo_is_foreign_expr(root, distinct_rel, expr) ||
+			mongo_is_foreign_param(root, distinct_rel, expr))
+			return;
+
+		tle = makeTargetEntry(expr, list_length(tlist) + 1, NULL, false);
+		tle->ressortgroupref = sgref;
+		tlist = lappend(tlist, tle);
+		group_exprs = lappend(group_exprs, expr);
+
+		i++;
+	}
+
+	/* Store generated targetlist */
+	fpinfo->grouped_tlist = tlist;
+
+	/* Safe to pushdown */
+	fpinfo->pushdown_safe = true;
+
+	rows = estimate_num_groups(root, group_exprs, input_rel->rows, NULL
+#if PG_VERSION_NUM >= 140000
+							   ,NULL
+#endif
+		);
+
+	/* Use small cost to push down the distinct always */
+	startup_cost = total_cost = 0;
+
+	distinct_path = create_foreign_upper_path(root,
+											  distinct_rel,
+											  distinct_target,
+											  rows,
+											  startup_cost,
+											  total_cost,
+											  NIL,	/* no pathkeys */
+											  NULL,
+											  NIL); /* no fdw_private */
+
+	add_path(distinct_rel, (Path *) distinct_path);
+}
+
+/*
+ * mongo_add_foreign_window_paths
+ *		Add foreign path for computing window functions.
+ *
+ * The window functions are computed by "$setWindowFields" stages over the
+ * documents of a base relation.  Given input_rel represents the underlying
+ * scan.  The path is added to the given window_rel.
+ */
+static void
+mongo_add_foreign_window_paths(PlannerInfo *root, RelOptInfo *input_rel,
+							   RelOptInfo *window_rel)
+{
+	Query	   *parse = root->parse;
+	MongoFdwRelationInfo *ifpinfo = (MongoFdwRelationInfo *) input_rel->fdw_private;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) window_rel->fdw_private;
+	PathTarget *window_target = root->upper_targets[UPPERREL_WINDOW];
+	ForeignPath *window_path;
+	List	   *tlist = NIL;
+	ListCell   *lc;
+
+	/*
+	 * The columns of a join are not at hand for "$setWindowFields", and
+	 * window functions over grouped rows are computed locally.
 	 */
-	if (havingQual)
-	{
-		foreach(lc, (List *) havingQual)
-		{
-			Expr	   *expr = (Expr *) lfirst(lc);
-			RestrictInfo *rinfo;
+	if (input_rel->reloptkind != RELOPT_BASEREL || parse->hasTargetSRFs)
+		return;
 
-			/*
-			 * Currently, the core code doesn't wrap havingQuals in
-			 * RestrictInfos, so we must make our own.
-			 */
-			Assert(!IsA(expr, RestrictInfo));
-#if PG_VERSION_NUM >= 140000
-			rinfo = make_restrictinfo(root,
-#else
-			rinfo = make_restrictinfo(
-#endif
-									  expr,
-									  true,
-									  false,
-									  false,
-#if PG_VERSION_NUM >= 160000
-									  false,
-#endif
-									  root->qual_security_level,
-									  grouped_rel->relids,
-									  NULL,
-									  NULL);
-			if (mongo_is_foreign_expr(root, grouped_rel, expr))
-				fpinfo->remote_conds = lappend(fpinfo->remote_conds, rinfo);
-			else
-				fpinfo->local_conds = lappend(fpinfo->local_conds, rinfo);
-		}
-	}
+	/* The local conditions have to be applied before the windows */
+	if (ifpinfo->local_conds)
+		return;
+
+	/* Save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
 
 	/*
-	 * If there are any local conditions, pull Vars and aggregates from it and
-	 * check whether they are safe to pushdown or not.
+	 * All the window functions must be pushed down.  The other expressions
+	 * are computed remotely if they can be, else from their Vars.
 	 */
-	if (fpinfo->local_conds)
+	foreach(lc, window_target->exprs)
 	{
-		List	   *aggvars = NIL;
+		Expr	   *expr = (Expr *) lfirst(lc);
 
-		foreach(lc, fpinfo->local_conds)
+		if (IsA(expr, WindowFunc))
 		{
-			RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
-
-			aggvars = list_concat(aggvars,
-								  pull_var_clause((Node *) rinfo->clause,
-												  PVC_INCLUDE_AGGREGATES));
+			if (!mongo_is_foreign_expr(root, window_rel, expr))
+				return;
+			tlist = add_to_flat_tlist(tlist, list_make1(expr));
 		}
-
-		foreach(lc, aggvars)
+		else if (mongo_is_foreign_expr(root, window_rel, expr) &&
+				 !mongo_is_foreign_param(root, window_rel, expr))
+			tlist = add_to_flat_tlist(tlist, list_make1(expr));
+		else
 		{
-			Expr	   *expr = (Expr *) lfirst(lc);
-
-			/*
-			 * If aggregates within local conditions are not safe to push
-			 * down, then we cannot push down the query.  Vars are already
-			 * part of GROUP BY clause which are checked above, so no need to
-			 * access them again here.  Again, we need not check
-			 * is_foreign_param for a foreign aggregate.
-			 */
-			if (IsA(expr, Aggref))
-			{
-				if (!mongo_is_foreign_expr(root, grouped_rel, expr))
-					return false;
+			List	   *vars = pull_var_clause((Node *) expr,
+											   PVC_INCLUDE_WINDOWFUNCS);
 
-				tlist = add_to_flat_tlist(tlist, list_make1(expr));
-			}
+			if (!mongo_is_foreign_expr(root, window_rel, (Expr *) vars))
+				return;
+			tlist = add_to_flat_tlist(tlist, vars);
 		}
 	}
 
@@ -3595,85 +5635,127 @@ mongo_foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
 	/* Safe to pushdown */
 	fpinfo->pushdown_safe = true;
 
-	return true;
+	/* Use small cost to push down the windows always */
+	window_path = create_foreign_upper_path(root,
+											window_rel,
+											window_target,
+											input_rel->rows,
+											0,
+											0,
+											NIL,	/* no pathkeys */
+											NULL,
+											NIL);	/* no fdw_private */
+
+	add_path(window_rel, (Path *) window_path);
 }
 
 /*
- * mongo_add_foreign_grouping_paths
- *		Add foreign path for grouping and/or aggregation.
+ * mongo_add_foreign_ordered_paths
+ *		Add foreign paths for performing the final sort remotely.
  *
- * Given input_rel represents the underlying scan.  The paths are added to the
- * given grouped_rel.
+ * Given input_rel contains the source-data Paths.  The paths are added to the
+ * given ordered_rel.
  */
 static void
-mongo_add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
-						   RelOptInfo *grouped_rel,
-						   GroupPathExtraData *extra)
+mongo_add_foreign_ordered_paths(PlannerInfo *root, RelOptInfo *input_rel,
+								RelOptInfo *ordered_rel)
 {
 	Query	   *parse = root->parse;
-	MongoFdwRelationInfo *fpinfo = grouped_rel->fdw_private;
-	ForeignPath *grouppath;
+	MongoFdwRelationInfo *ifpinfo = (MongoFdwRelationInfo *) input_rel->fdw_private;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) ordered_rel->fdw_private;
 	double		rows;
 	Cost		startup_cost;
 	Cost		total_cost;
+	List	   *fdw_private;
+	ForeignPath *ordered_path;
+	ListCell   *lc;
 
-	/* Nothing to be done, if there is no grouping or aggregation required. */
-	if (!parse->groupClause && !parse->groupingSets && !parse->hasAggs &&
-		!root->hasHavingQual)
-		return;
+	/* Shouldn't get here unless the query has ORDER BY */
+	Assert(parse->sortClause);
 
-	Assert(extra->patype == PARTITIONWISE_AGGREGATE_NONE ||
-		   extra->patype == PARTITIONWISE_AGGREGATE_FULL);
+	/* We don't support cases where there are any SRFs in the targetlist */
+	if (parse->hasTargetSRFs)
+		return;
 
-	/* save the input_rel as outerrel in fpinfo */
+	/* Save the input_rel as outerrel in fpinfo */
 	fpinfo->outerrel = input_rel;
 
 	/*
-	 * Assess if it is safe to push down aggregation and grouping.
-	 *
-	 * Use HAVING qual from extra. In case of child partition, it will have
-	 * translated Vars.
+	 * If the input_rel is a base or join relation, we would already have
+	 * considered pushing down the final sort to the remote server when
+	 * creating pre-sorted foreign paths for that relation, because the
+	 * query_pathkeys is set to the root->sort_pathkeys in that case (see
+	 * standard_qp_callback()).
 	 */
-	if (!mongo_foreign_grouping_ok(root, grouped_rel, extra->havingQual))
+	if (input_rel->reloptkind == RELOPT_BASEREL ||
+		input_rel->reloptkind == RELOPT_JOINREL)
+	{
+		Assert(root->query_pathkeys == root->sort_pathkeys);
+
+		/* Safe to push down if the query_pathkeys is safe to push down */
+		fpinfo->pushdown_safe = ifpinfo->qp_is_pushdown_safe;
+
 		return;
+	}
 
 	/*
-	 * If no grouping, numGroups - possible number of groups should be set 1.
-	 * When creating upper path, rows is passed to pathnode->path.rows.
-	 * When creating aggregation plan, somehow path.rows is passed to numGroups.
+	 * The results of window functions are sorted locally, and so are those of
+	 * grouping sets, whose nulled grouping columns would need null keys.
 	 */
-	if (!parse->groupClause)
-	{
-		/* Not grouping */
-		rows = 1;
-	}
-	else if (parse->hasAggs || root->hasHavingQual)
-	{
-		/* Plain aggregation, one result row */
-		rows = 1;
-	}
-	else
+	if (ifpinfo->stage == UPPERREL_WINDOW || parse->groupingSets)
+		return;
+
+	/* The input_rel should be a grouping or distinct relation */
+	Assert(input_rel->reloptkind == RELOPT_UPPER_REL &&
+		   (ifpinfo->stage == UPPERREL_GROUP_AGG ||
+			ifpinfo->stage == UPPERREL_DISTINCT));
+
+	/*
+	 * The HAVING quals evaluated locally would be applied after the sort, which
+	 * is fine, but keep things simple and sort locally in that case.
+	 */
+	if (ifpinfo->local_conds)
+		return;
+
+	/* The sort keys must all be computed by the remote grouping */
+	foreach(lc, root->sort_pathkeys)
 	{
-		rows = 0;
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+
+		if (!mongo_is_foreign_pathkey(root, input_rel, pathkey))
+			return;
 	}
 
-	/* Estimate the cost of push down */
-	startup_cost = total_cost = 0;
+	/* Safe to push down */
+	fpinfo->pushdown_safe = true;
 
+	/* Use small cost to push down the sort always */
+	rows = input_rel->rows;
+	startup_cost = total_cost = 0;
 
-	/* Create and add foreign path to the grouping relation. */
-	grouppath = create_foreign_upper_path(root,
-										  grouped_rel,
-										  grouped_rel->reltarget,
-										  rows,
-										  startup_cost,
-										  total_cost,
-										  NIL,	/* no pathkeys */
-										  NULL,
-										  NIL); /* no fdw_private */
+	/*
+	 * Build the fdw_private list that will be used by mongoGetForeignPlan.
+	 * Items in the list must match order in enum FdwPathPrivateIndex.
+	 */
+#if PG_VERSION_NUM >= 150000
+	fdw_private = list_make2(makeBoolean(true), makeBoolean(false));
+#else
+	fdw_private = list_make2(makeInteger(true), makeInteger(false));
+#endif
 
-	/* Add generated path into grouped_rel by add_path(). */
-	add_path(grouped_rel, (Path *) grouppath);
+	/* Create foreign ordering path */
+	ordered_path = create_foreign_upper_path(root,
+											 input_rel,
+											 root->upper_targets[UPPERREL_ORDERED],
+											 rows,
+											 startup_cost,
+											 total_cost,
+											 root->sort_pathkeys,
+											 NULL,	/* no extra plan */
+											 fdw_private);
+
+	/* and add it to the ordered_rel */
+	add_path(ordered_rel, (Path *) ordered_path);
 }
 
 /*
@@ -3697,6 +5779,8 @@ mongo_add_foreign_final_paths(PlannerInfo *root, RelOptInfo *input_rel,
 	Cost		total_cost;
 	List	   *fdw_private;
 	ForeignPath *final_path;
+	bool		has_final_sort = false;
+	List	   *pathkeys = NIL;
 
 	/*
 	 * Currently, we only support this for SELECT commands
@@ -3721,11 +5805,26 @@ mongo_add_foreign_final_paths(PlannerInfo *root, RelOptInfo *input_rel,
 
 	Assert(extra->limit_needed);
 
-	/* The input_rel should be a base, join, or grouping relation */
+	/*
+	 * If the input_rel is an ordered relation, replace the input_rel with its
+	 * input relation
+	 */
+	if (input_rel->reloptkind == RELOPT_UPPER_REL &&
+		ifpinfo->stage == UPPERREL_ORDERED)
+	{
+		input_rel = ifpinfo->outerrel;
+		ifpinfo = (MongoFdwRelationInfo *) input_rel->fdw_private;
+		has_final_sort = true;
+		pathkeys = root->sort_pathkeys;
+	}
+
+	/* The input_rel should be a base, join, grouping, window or distinct relation */
 	Assert(input_rel->reloptkind == RELOPT_BASEREL ||
 		   input_rel->reloptkind == RELOPT_JOINREL ||
 		   (input_rel->reloptkind == RELOPT_UPPER_REL &&
-			ifpinfo->stage == UPPERREL_GROUP_AGG));
+			(ifpinfo->stage == UPPERREL_GROUP_AGG ||
+			 ifpinfo->stage == UPPERREL_WINDOW ||
+			 ifpinfo->stage == UPPERREL_DISTINCT)));
 
 	/*
 	 * If the underlying relation has any local conditions, the LIMIT/OFFSET
@@ -3755,10 +5854,10 @@ mongo_add_foreign_final_paths(PlannerInfo *root, RelOptInfo *input_rel,
 	 * Items in the list must match order in enum FdwPathPrivateIndex.
 	 */
 #if PG_VERSION_NUM >= 150000
-	fdw_private = list_make2(makeBoolean(false),
+	fdw_private = list_make2(makeBoolean(has_final_sort),
 							 makeBoolean(extra->limit_needed));
 #else
-	fdw_private = list_make2(makeInteger(false),
+	fdw_private = list_make2(makeInteger(has_final_sort),
 							 makeInteger(extra->limit_needed));
 #endif
 
@@ -3772,7 +5871,7 @@ mongo_add_foreign_final_paths(PlannerInfo *root, RelOptInfo *input_rel,
 										   rows,
 										   startup_cost,
 										   total_cost,
-										   NULL, /* no pathkeys */
+										   pathkeys,
 										   NULL,	/* no extra plan */
 										   fdw_private);
 
@@ -3802,6 +5901,10 @@ mongoGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
 
 	/* Ignore stages we don't support; and skip any duplicate calls. */
 	if ((stage != UPPERREL_GROUP_AGG &&
+		 stage != UPPERREL_PARTIAL_GROUP_AGG &&
+		 stage != UPPERREL_WINDOW &&
+		 stage != UPPERREL_DISTINCT &&
+		 stage != UPPERREL_ORDERED &&
 		 stage != UPPERREL_FINAL) ||
 		output_rel->fdw_private)
 		return;
@@ -3814,9 +5917,19 @@ mongoGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
 	switch (stage)
 	{
 		case UPPERREL_GROUP_AGG:
+		case UPPERREL_PARTIAL_GROUP_AGG:
 			mongo_add_foreign_grouping_paths(root, input_rel, output_rel,
 									   (GroupPathExtraData *) extra);
 			break;
+		case UPPERREL_WINDOW:
+			mongo_add_foreign_window_paths(root, input_rel, output_rel);
+			break;
+		case UPPERREL_DISTINCT:
+			mongo_add_foreign_distinct_paths(root, input_rel, output_rel);
+			break;
+		case UPPERREL_ORDERED:
+			mongo_add_foreign_ordered_paths(root, input_rel, output_rel);
+			break;
 		case UPPERREL_FINAL:
 			mongo_add_foreign_final_paths(root, input_rel, output_rel,
 									(FinalPathExtraData *) extra);
@@ -3926,6 +6039,12 @@ static void mongo_get_join_planner_info(PlannerInfo *root, RelOptInfo *scanrel,
 
 		if (rte->alias)
 			join_info->innerrel_aliasname = rte->alias->aliasname;
+
+#ifdef META_DRIVER
+		/* MongoDB takes both a field match and a pipeline since 5.0 */
+		join_info->lookup_fields =
+			((MongoFdwRelationInfo *) innerrel->fdw_private)->options->svr_version >= 500;
+#endif
 	}
 	else if (IS_JOIN_REL(innerrel))
 	{
@@ -3935,12 +6054,231 @@ static void mongo_get_join_planner_info(PlannerInfo *root, RelOptInfo *scanrel,
 	if (IS_JOIN_REL(scanrel))
 	{
 		join_info->joinclauses = f_joininfo->joinclauses;
+		join_info->inner_remote_conds = f_joininfo->inner_remote_conds;
 		join_info->join_is_sub_query = f_joininfo->join_is_sub_query;
+		join_info->jointype = f_joininfo->jointype;
 	}
 
 	plannerInfo->joininfo_list = lappend(plannerInfo->joininfo_list, join_info);
 }
 
+/*
+ * mongo_get_sort_info
+ *		Collect the sort expressions and their ordering for the given pathkeys.
+ */
+static void
+mongo_get_sort_info(PlannerInfo *root, RelOptInfo *foreignrel, List *pathkeys,
+					MongoPlanerInfo *plannerInfo)
+{
+	ListCell   *lc;
+
+	foreach(lc, pathkeys)
+	{
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+		Expr	   *em_expr;
+		int			options = 0;
+
+		em_expr = mongo_find_em_expr_for_rel(pathkey->pk_eclass, foreignrel);
+		if (em_expr == NULL)
+			elog(ERROR, "could not find pathkey item to sort");
+
+		if (pathkey->pk_strategy == BTGreaterStrategyNumber)
+			options |= MONGO_SORT_DESC;
+		if (pathkey->pk_nulls_first)
+			options |= MONGO_SORT_NULLS_FIRST;
+
+		/*
+		 * A column of a base relation that cannot be null needs no null key.
+		 * In a join, an outer join may still produce nulls for it.
+		 */
+		if (IS_SIMPLE_REL(foreignrel) && IsA(em_expr, Var) &&
+			mongo_column_is_not_null(root, foreignrel,
+									 ((Var *) em_expr)->varattno))
+			options |= MONGO_SORT_NOT_NULL;
+
+		plannerInfo->sort_exprs = lappend(plannerInfo->sort_exprs, em_expr);
+		plannerInfo->sort_options = lappend_int(plannerInfo->sort_options,
+												options);
+	}
+}
+
+/*
+ * mongo_column_is_not_null
+ *		Check whether a column of a base relation can never be null in the
+ *		rows it returns.
+ *
+ * That is so for a NOT NULL column, and for one that a strict restriction
+ * clause of the relation rejects nulls of, such as "c1 > 0" or
+ * "c1 IS NOT NULL".  Its sort keys then need no null key, whatever the
+ * placement of nulls requested.
+ */
+static bool
+mongo_column_is_not_null(PlannerInfo *root, RelOptInfo *baserel,
+						 AttrNumber attnum)
+{
+	RangeTblEntry *rte = planner_rt_fetch(baserel->relid, root);
+	ListCell   *lc;
+
+	if (attnum <= 0)
+		return false;
+
+	if (get_attnotnull(rte->relid, attnum))
+		return true;
+
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		List	   *nonnullable;
+
+		nonnullable = find_nonnullable_vars((Node *) rinfo->clause);
+#if PG_VERSION_NUM >= 160000
+		if (mbms_is_member(baserel->relid,
+						   attnum - FirstLowInvalidHeapAttributeNumber,
+						   nonnullable))
+			return true;
+#else
+		{
+			ListCell   *lc2;
+
+			foreach(lc2, nonnullable)
+			{
+				Var		   *var = (Var *) lfirst(lc2);
+
+				if (var->varno == baserel->relid && var->varattno == attnum)
+					return true;
+			}
+		}
+#endif
+	}
+
+	return false;
+}
+
+/*
+ * mongo_get_driving_rel_index
+ *		Returns the position of the relation that drives a join among the base
+ *		relations of the join, counted from 0.
+ *
+ * The "$lookup" stages run on the documents of the outer relation of the
+ * lowest join, which need not be the lowest-numbered relation, since either
+ * relation of an inner join may drive it.  The range table indexes are only
+ * final after the plan is complete, but their order stays the same, so the
+ * position is what is kept in the plan.
+ */
+static int
+mongo_get_driving_rel_index(PlannerInfo *root, RelOptInfo *joinrel)
+{
+	RelOptInfo *rel = joinrel;
+	Relids		relids;
+	int			relid;
+	int			index = 0;
+	int			i = -1;
+
+	while (IS_JOIN_REL(rel))
+		rel = ((MongoFdwRelationInfo *) rel->fdw_private)->outerrel;
+	relid = rel->relid;
+
+#if PG_VERSION_NUM >= 160000
+	relids = bms_difference(joinrel->relids, root->outer_join_rels);
+#else
+	relids = joinrel->relids;
+#endif
+	while ((i = bms_next_member(relids, i)) >= 0 && i < relid)
+		index++;
+
+	return index;
+}
+
+/*
+ * mongo_get_scan_rtindex
+ *		Returns the range table index of the relation whose collection a
+ *		foreign scan reads: the base relation scanned, or the relation that
+ *		drives a join, see mongo_get_driving_rel_index.
+ */
+static int
+mongo_get_scan_rtindex(ForeignScan *fsplan, MongoPlanerInfo *plannerInfo)
+{
+	Bitmapset  *relids;
+	int			rtindex = -1;
+	int			i;
+
+	if (fsplan->scan.scanrelid > 0)
+		return fsplan->scan.scanrelid;
+
+#if PG_VERSION_NUM >= 160000
+	relids = fsplan->fs_base_relids;
+#else
+	relids = fsplan->fs_relids;
+#endif
+	for (i = 0; i <= plannerInfo->driving_rel_index; i++)
+		rtindex = bms_next_member(relids, rtindex);
+
+	return rtindex;
+}
+
+/*
+ * mongo_get_window_info
+ *		Collect the windows of the window functions in the target list.
+ */
+static void
+mongo_get_window_info(PlannerInfo *root, MongoPlanerInfo *plannerInfo)
+{
+	List	   *targetList = root->parse->targetList;
+	ListCell   *lc;
+
+	foreach(lc, root->parse->windowClause)
+	{
+		WindowClause *wc = lfirst_node(WindowClause, lc);
+		MongoPlanerWindowInfo *window_info;
+		bool		is_used = false;
+		ListCell   *lc_tle;
+
+		foreach(lc_tle, plannerInfo->tlist)
+		{
+			TargetEntry *tle = lfirst_node(TargetEntry, lc_tle);
+
+			if (IsA(tle->expr, WindowFunc) &&
+				((WindowFunc *) tle->expr)->winref == wc->winref)
+			{
+				is_used = true;
+				break;
+			}
+		}
+
+		if (!is_used)
+			continue;
+
+		window_info = (MongoPlanerWindowInfo *) palloc0(sizeof(MongoPlanerWindowInfo));
+		window_info->winref = wc->winref;
+		window_info->frameOptions = wc->frameOptions;
+		window_info->startOffset = wc->startOffset;
+		window_info->endOffset = wc->endOffset;
+
+		foreach(lc_tle, wc->partitionClause)
+		{
+			SortGroupClause *sgc = lfirst_node(SortGroupClause, lc_tle);
+
+			window_info->partition_exprs =
+				lappend(window_info->partition_exprs,
+						get_sortgroupref_tle(sgc->tleSortGroupRef, targetList)->expr);
+		}
+
+		foreach(lc_tle, wc->orderClause)
+		{
+			SortGroupClause *sgc = lfirst_node(SortGroupClause, lc_tle);
+			Expr	   *expr = get_sortgroupref_tle(sgc->tleSortGroupRef,
+													targetList)->expr;
+
+			window_info->sort_exprs = lappend(window_info->sort_exprs, expr);
+			window_info->sort_options =
+				lappend_int(window_info->sort_options,
+							mongo_window_sort_options(root, sgc, expr));
+		}
+
+		plannerInfo->window_list = lappend(plannerInfo->window_list, window_info);
+	}
+}
+
 /*
  * Get LIMIT/OFFSET information.
  *  If LIMIT NULL | ALL, there is no need LIMIT.
@@ -77,6 +77,7 @@
 #define BSON_TYPE_CODE 						BSON_TYPE_CODE
 #define BSON_TYPE_CODEWSCOPE 				BSON_TYPE_CODEWSCOPE
 #define BSON_TYPE_TIMESTAMP 				BSON_TYPE_TIMESTAMP
+#define MONGO_BULK 							mongoc_bulk_operation_t
 
 #define PREF_READ_PRIMARY_NAME 				"readPrimary"
 #define PREF_READ_SECONDARY_NAME 			"readSecondary"
@@ -158,6 +159,12 @@
 #define OPTION_NAME_CA_DIR 					"ca_dir"
 #define OPTION_NAME_CRL_FILE 				"crl_file"
 #define OPTION_NAME_WEAK_CERT 				"weak_cert_validation"
+#define OPTION_NAME_WRITE_CONCERN 			"write_concern"
+#define OPTION_NAME_BYPASS_DOC_VALIDATION 	"bypass_document_validation"
+#define OPTION_NAME_UPSERT 					"upsert"
+#define OPTION_NAME_BATCH_SIZE 				"batch_size"
+#define OPTION_NAME_TRUNCATE_MODE 			"truncate_mode"
+#define OPTION_NAME_SERVER_VERSION 			"server_version"
 #endif
 #define OPTION_NAME_ENABLE_JOIN_PUSHDOWN	"enable_join_pushdown"
 
@@ -165,12 +172,15 @@
 #define DEFAULT_IP_ADDRESS 					"127.0.0.1"
 #define DEFAULT_PORT_NUMBER 				27017
 #define DEFAULT_DATABASE_NAME 				"test"
+#define DEFAULT_BATCH_SIZE 					1000
 
 /* Defines for sending queries and converting types */
 #define EQUALITY_OPERATOR_NAME 				"="
 #define INITIAL_ARRAY_CAPACITY 				8
 #define MONGO_TUPLE_COST_MULTIPLIER 		5
 #define MONGO_CONNECTION_COST_MULTIPLIER 	5
+#define MONGO_SORT_COST_MULTIPLIER 			1.2
+#define MONGO_INDEX_SORT_COST_MULTIPLIER 	1.05
 #define POSTGRES_TO_UNIX_EPOCH_DAYS 		(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
 #define POSTGRES_TO_UNIX_EPOCH_USECS 		(POSTGRES_TO_UNIX_EPOCH_DAYS * USECS_PER_DAY)
 
@@ -194,7 +204,7 @@ typedef struct MongoValidOption
 
 /* Array of options that are valid for mongo_fdw */
 #ifdef META_DRIVER
-static const uint32 ValidOptionCount = 20;
+static const uint32 ValidOptionCount = 30;
 #else
 static const uint32 ValidOptionCount = 8;
 #endif
@@ -216,6 +226,11 @@ static const MongoValidOption ValidOptionArray[] =
 	{OPTION_NAME_CA_DIR, ForeignServerRelationId},
 	{OPTION_NAME_CRL_FILE, ForeignServerRelationId},
 	{OPTION_NAME_WEAK_CERT, ForeignServerRelationId},
+	{OPTION_NAME_WRITE_CONCERN, ForeignServerRelationId},
+	{OPTION_NAME_BYPASS_DOC_VALIDATION, ForeignServerRelationId},
+	{OPTION_NAME_BATCH_SIZE, ForeignServerRelationId},
+	{OPTION_NAME_TRUNCATE_MODE, ForeignServerRelationId},
+	{OPTION_NAME_SERVER_VERSION, ForeignServerRelationId},
 #endif
 	{OPTION_NAME_ENABLE_JOIN_PUSHDOWN, ForeignServerRelationId},
 
@@ -223,6 +238,13 @@ static const MongoValidOption ValidOptionArray[] =
 	{OPTION_NAME_DATABASE, ForeignTableRelationId},
 	{OPTION_NAME_COLLECTION, ForeignTableRelationId},
 	{OPTION_NAME_ENABLE_JOIN_PUSHDOWN, ForeignTableRelationId},
+#ifdef META_DRIVER
+	{OPTION_NAME_WRITE_CONCERN, ForeignTableRelationId},
+	{OPTION_NAME_BYPASS_DOC_VALIDATION, ForeignTableRelationId},
+	{OPTION_NAME_UPSERT, ForeignTableRelationId},
+	{OPTION_NAME_BATCH_SIZE, ForeignTableRelationId},
+	{OPTION_NAME_TRUNCATE_MODE, ForeignTableRelationId},
+#endif
 
 	/* Column option */
 	{OPTION_NAME_COLUMN_NAME, AttributeRelationId},
@@ -259,26 +281,76 @@ typedef struct MongoFdwOptions
 	char	   *ca_dir;
 	char	   *crl_file;
 	bool		weak_cert_validation;
+	char	   *writeConcern;	/* unparsed write_concern value */
+	bool		bypass_document_validation;
+	bool		upsert;			/* INSERT replaces documents with same _id */
+	int			batch_size;		/* # of writes sent in one bulk operation */
+	bool		truncate_drop;	/* TRUNCATE drops and recreates collection */
+	int			svr_version;	/* major * 100 + minor, 0 if not given */
 #endif
 } MongoFdwOptions;
 
+/*
+ * MongoWriteConcern holds the pieces of a "w=..., j=..., wtimeout=..."
+ * write concern specification.  Members that were not given are left unset
+ * so that the driver defaults apply to them.
+ */
+typedef struct MongoWriteConcern
+{
+	char	   *w;				/* number, "majority" or a tag set name */
+	int			journal;		/* 1 or 0, -1 if not given */
+	int			wtimeout;		/* milliseconds, -1 if not given */
+} MongoWriteConcern;
+
+/*
+ * Kinds of writes kept back by mongo_fdw.deferred_writes until the local
+ * transaction commits.
+ */
+typedef enum MongoDeferredWriteKind
+{
+	DEFERRED_INSERT,			/* insert a new document */
+	DEFERRED_REPLACE,			/* replace the document, or insert it */
+	DEFERRED_UPDATE,			/* set some fields of the document */
+	DEFERRED_DELETE				/* delete the document */
+} MongoDeferredWriteKind;
+
 typedef struct MongoPlanerJoinInfo
 {
 	Index		outerrel_relid;	/* Index of outer relation in range table entry */
 	Index		innerrel_relid; /* Index of inner relation in range table entry */
 	/* joinclauses contains only JOIN/ON conditions for an outer join */
 	List	   *joinclauses;	/* List of RestrictInfo */
+	List	   *inner_remote_conds;	/* Remote conditions of inner relation */
 	char	   *innerel_name;	/* Name of inner relation */
 	char	   *outerrel_name;	/* Name of outer relation */
 	Oid			outerrel_oid;	/* Outer relation oid */
 	Oid			innerrel_oid;	/* Inner relation oid */
 	bool		join_is_sub_query;	/* If join relation is in sub query */
+	JoinType	jointype;		/* Type of this join */
 	RTEKind		outerrel_rtekind;	/* Outer relation of RangeTblEntry node */
 	RTEKind		innerrel_rtekind;	/* Inner relation of RangeTblEntry node */
 	char	   *outerrel_aliasname;	/* Alias name of outer relation */
 	char	   *innerrel_aliasname;	/* Alias name of inner relation */
+	bool		lookup_fields;	/* "$lookup" may name localField and
+								 * foreignField along with a pipeline */
 } MongoPlanerJoinInfo;
 
+/*
+ * A window of the window functions computed by a "$setWindowFields" stage.
+ * The frame is that of the WindowClause, whose sort keys are given with the
+ * MONGO_SORT_* flags of each.
+ */
+typedef struct MongoPlanerWindowInfo
+{
+	Index		winref;			/* ID referenced by the window functions */
+	List	   *partition_exprs;	/* Expressions to partition by */
+	List	   *sort_exprs;		/* Expressions to sort by */
+	List	   *sort_options;	/* Integer list of MONGO_SORT_* flags */
+	int			frameOptions;	/* FRAMEOPTION_* flags of the frame */
+	Node	   *startOffset;	/* Const offset of the start, or NULL */
+	Node	   *endOffset;		/* Const offset of the end, or NULL */
+} MongoPlanerWindowInfo;
+
 /*
  * The planner information is passed to execution stage
  * to build query document.
@@ -297,11 +369,24 @@ typedef struct MongoPlanerInfo
 	List	   *remote_exprs;	/* Remote conditions are applied for WHERE */
 	List	   *local_exprs;	/* Local conditions are applied for WHERE */
 	List	   *having_quals;	/* qualifications applied for HAVING to groups */
+	List	   *lookup_exprs;	/* Conditions on looked up documents alone */
 
 	bool	   has_limit;		/* Has LIMIT query */
 	Node	   *limitOffset;	/* # of result tuples to skip (int8 expr) */
 	Node	   *limitCount;		/* # of result tuples to return (int8 expr) */
 
+	List	   *sort_exprs;		/* Expressions to sort the result by */
+	List	   *sort_options;	/* Integer list of MONGO_SORT_* flags, one
+								 * per sort expression */
+
+	/*
+	 * Params and Vars of other relations in the remote conditions, whose
+	 * values are supplied at execution time.  The values are not serialized.
+	 */
+	List	   *param_exprs;
+	Datum	   *param_values;	/* NULL until the values are known */
+	bool	   *param_isnulls;
+
 	/* Bitmap of attr numbers we need to fetch from the remote server. */
 	Bitmapset *attrs_used;
 
@@ -316,10 +401,45 @@ typedef struct MongoPlanerInfo
 								 * a base relation. */
 	/* JOIN information */
 	JoinType   jointype;
+	int		   driving_rel_index;	/* Position of the relation whose
+									 * collection drives the join among the
+									 * base relations of the scan, from 0 */
 	int		   joininfo_num;	/* Length of joininfo_list */
 	List	   *joininfo_list;	/* This is list of join information that contains MongoPlanerJoinInfo */
+
+	List	   *window_list;	/* List of MongoPlanerWindowInfo */
+
+	/*
+	 * Expanded GROUPING SETS, ROLLUP or CUBE: a list of integer lists of the
+	 * ressortgrouprefs of each set.  NIL for a plain GROUP BY.
+	 */
+	List	   *grouping_sets;
 } MongoPlanerInfo;
 
+/*
+ * MongoIndexInfo describes an index of a remote collection whose key order
+ * can serve a "$sort" stage.
+ */
+typedef struct MongoIndexInfo
+{
+	char	   *name;			/* index name */
+	List	   *fields;			/* key fields, as String nodes */
+	List	   *directions;		/* 1 or -1 for each of fields */
+} MongoIndexInfo;
+
+/* Flags kept in MongoPlanerInfo.sort_options */
+#define MONGO_SORT_DESC				0x01	/* descending order */
+#define MONGO_SORT_NULLS_FIRST		0x02	/* NULLS FIRST was requested */
+#define MONGO_SORT_NOT_NULL			0x04	/* sort key can never be null */
+
+/*
+ * MongoDB sorts nulls below any other value, i.e. first in ascending and last
+ * in descending order.  The opposite placement needs an extra null key.
+ */
+#define MONGO_SORT_NEEDS_NULL_KEY(options) \
+	(((options) & MONGO_SORT_NOT_NULL) == 0 && \
+	 (((options) & MONGO_SORT_DESC) != 0) == (((options) & MONGO_SORT_NULLS_FIRST) != 0))
+
 /*
  * MongoFdwExecState keeps foreign data wrapper specific execution state that
  * we create and hold onto when executing the query.
@@ -340,7 +460,18 @@ typedef struct MongoFdwModifyState
 	BSON	   *queryDocument;	/* Bson Document */
 
 	MongoFdwOptions *options;
+	BSON	   *writeOptions;	/* write concern etc. sent with each write */
 	AttrNumber	rowidAttno; 	/* attnum of resjunk rowid column */
+
+#ifdef META_DRIVER
+	/* Upserts are collected into unordered bulk writes */
+	bool		upsert;			/* replace documents with a matching _id */
+	bool		do_nothing;		/* INSERT ... ON CONFLICT DO NOTHING */
+	MONGO_BULK *bulk;			/* bulk write being filled, or NULL */
+	int			bulk_count;		/* # of writes queued in bulk */
+	MemoryContextCallback bulk_cb;	/* throws bulk away on error */
+	bool		deferred;		/* keep writes until the transaction commits */
+#endif
 } MongoFdwModifyState;
 
 /*
@@ -358,6 +489,10 @@ typedef struct MongoFdwScanState
 
 	/* All necessary planner information to build query document */
 	MongoPlanerInfo *plannerInfo;
+
+	/* For evaluating the parameters of the query document */
+	int			numParams;
+	List	   *param_exprs;	/* ExprStates of the fdw_exprs */
 } MongoFdwScanState;
 
 /*
@@ -399,11 +534,43 @@ typedef struct MongoFdwRelationInfo
 	JoinType	jointype;
 	/* joinclauses contains only JOIN/ON conditions for an outer join */
 	List	   *joinclauses;	/* List of RestrictInfo */
+	/* Remote conditions of the inner relation, applied before joining it */
+	List	   *inner_remote_conds;
 	Oid			baserel_oid;	/* Base relation Oid, only set for base relation */
 	Oid			outerrel_oid;	/* Outer relation Oid */
 	Oid			innerrel_oid;	/* Inner relation Oid */
 	bool		join_is_sub_query;	/* Mark if the join clause is planned in sub query */
 
+	/* True means that the query_pathkeys is safe to push down */
+	bool		qp_is_pushdown_safe;
+
+	/* Orderings provided by the remote indexes, as lists of pathkeys */
+	List	   *index_pathkeys;
+
+	/*
+	 * Costs of the remote query, and for a base relation the size of its
+	 * collection and its remote indexes.  Only set when based on remote
+	 * estimates.
+	 */
+	bool		remote_estimated;
+	Cost		startup_cost;
+	Cost		total_cost;
+	double		document_count;
+	int32		document_width;
+	List	   *indexes;
+
+	/*
+	 * Filters implied by the restrictions of the relations joined to a base
+	 * relation, as a list of Exprs.  Not rechecked or used for estimates.
+	 */
+	List	   *key_filter_conds;
+
+	/*
+	 * jsonb filters among the local_conds, given to MongoDB as well to narrow
+	 * the documents down.  See mongo_is_json_filter_expr.
+	 */
+	List	   *json_filter_conds;
+
 	/* Upper relation information */
 	UpperRelationKind stage;
 
@@ -422,6 +589,10 @@ typedef struct MongoFdwRelationInfo
 extern MongoFdwOptions *mongo_get_options(Oid foreignTableId, Oid userid);
 extern void mongo_free_options(MongoFdwOptions *options);
 extern StringInfo mongo_option_names_string(Oid currentContextId);
+extern const char *mongo_parse_write_concern(const char *value,
+											 MongoWriteConcern *wc);
+extern int	mongo_parse_server_version(const char *value);
+extern int	mongo_get_server_version(Oid serverid);
 
 /* connection.c */
 MONGO_CONN *mongo_get_connection(ForeignServer *server,
@@ -430,12 +601,38 @@ MONGO_CONN *mongo_get_connection(ForeignServer *server,
 
 extern void mongo_cleanup_connection(void);
 extern void mongo_release_connection(MONGO_CONN *conn);
+#ifdef META_DRIVER
+extern bool mongo_defer_write(MONGO_CONN *conn, MongoFdwOptions *opt,
+							  BSON *writeOptions, MongoDeferredWriteKind kind,
+							  BSON *selector, BSON *doc);
+extern void mongo_flush_deferred_writes(MONGO_CONN *conn);
+extern void mongo_discard_deferred_writes(MONGO_CONN *conn, char *database,
+										  char *collection);
+extern BSON *mongo_get_session_opts(MONGO_CONN *conn);
+extern BSON *mongo_get_write_session_opts(MONGO_CONN *conn);
+#endif
 
 /* Function declarations related to creating the mongo query */
 extern List *mongo_get_column_list(PlannerInfo *root, RelOptInfo *foreignrel,
 								   List *scan_var_list);
 extern bool mongo_is_foreign_expr(PlannerInfo *root, RelOptInfo *baserel,
 								  Expr *expression);
+extern bool mongo_is_json_filter_expr(PlannerInfo *root, RelOptInfo *baserel,
+									  Expr *expr);
+extern bool mongo_is_foreign_pathkey(PlannerInfo *root, RelOptInfo *rel,
+									 PathKey *pathkey);
+extern int	mongo_window_sort_options(PlannerInfo *root, SortGroupClause *sgc,
+									  Expr *expr);
+extern Expr *mongo_find_em_expr_for_rel(EquivalenceClass *ec,
+										RelOptInfo *rel);
+
+/* mongo_fdw.c */
+extern int	mongo_fdw_key_filter_limit;
+#ifdef META_DRIVER
+extern char *mongo_fdw_write_concern;
+extern bool mongo_fdw_deferred_writes;
+extern bool mongo_fdw_deferred_write_transaction;
+#endif
 
 /* Function declarations for foreign data wrapper */
 extern Datum mongo_fdw_handler(PG_FUNCTION_ARGS);
@@ -25,7 +25,10 @@
 #if PG_VERSION_NUM >= 120000
 #include "access/table.h"
 #endif
+#include "access/stratnum.h"
+#include "access/transam.h"
 #include "catalog/heap.h"
+#include "catalog/pg_am.h"
 #include "catalog/pg_collation.h"
 #ifdef META_DRIVER
 #include "mongoc.h"
@@ -48,9 +51,18 @@
 #include "optimizer/tlist.h"
 #include "utils/builtins.h"
 #include "nodes/nodeFuncs.h"
+#include "utils/jsonb.h"
+#include "utils/numeric.h"
+#include "utils/pg_locale.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
 #include "utils/rel.h"
 
+#if PG_VERSION_NUM < 110000
+#define DatumGetJsonbP(d)	DatumGetJsonb(d)
+#endif
+
 /*
  * Global context for foreign_expr_walker's search of an expression tree.
  */
@@ -62,6 +74,7 @@ typedef struct foreign_glob_cxt
 	unsigned short opexprcount;
 	Relids		relids;			/* relids of base relations in the underlying
 								 * scan */
+	int			svr_version;	/* server_version option of the server */
 } foreign_glob_cxt;
 
 /*
@@ -88,7 +101,8 @@ typedef enum MongoOperatorsSupport
 	OP_CONDITIONAL = 1,
 	OP_MATH = 2,
 	OP_JSON = 3,
-	OP_UNSUPPORT = 4,
+	OP_REGEX = 4,
+	OP_UNSUPPORT = 5,
 } MongoOperatorsSupport;
 
 typedef struct mongo_target_ref
@@ -113,7 +127,6 @@ typedef struct qdoc_expr_cxt
 
 	Oid			rel_oid;			/* OID of the relation */
 	Index		rtindex;			/* Range table index */
-	Index		inner_rtindex;		/* Range table index of inner relation */
 	int			conds_num;			/* Number of remote conditions */
 	RelOptKind	reloptkind;			/* Relation kind of the foreign relation we are planning for */
 	RelOptKind	scan_reloptkind;	/* Relation kind of the underlying scan relation */
@@ -121,6 +134,7 @@ typedef struct qdoc_expr_cxt
 	bool		has_groupClause;	/* True if having GROUP clause */
 	bool		has_grouping_agg;	/* True if query has having GROUP clause, aggregation */
 	List		*agg_ref_list;		/* Refer to aggregate functions in HAVING clause */
+	List		*final_agg_list;	/* Aggregate functions finished after "$group" */
 
 	char		*bs_key;			/* BSON key for BSON object */
 	bool		need_aggexpr_syntax;	/* Expression need to be built in aggregate expression syntax */
@@ -129,10 +143,15 @@ typedef struct qdoc_expr_cxt
 	char		*innerel_name;		/* Name of inner relation */
 	char		*outerrel_name;		/* Name of outer relation */
 	List		*innerel_name_list; /* List name of inner relation */
+	List		*inner_rtindex_list;	/* Range table index of each inner relation */
 	bool		is_join_expr;		/* Is join condition */
 	int			rte_index_offset;	/* Offset when translate between planner and exectuor range table index */
 	List		*inner_pipeline_ref_list;	/* Reference list from inner(join) pipeline */
 	bool		is_in_grouping_clause;		/* Mark if the deparsing is in grouping clause */
+
+	List		*param_exprs;		/* Params and Vars of other relations */
+	Datum		*param_values;		/* Their values, NULL if not known yet */
+	bool		*param_isnulls;
 } qdoc_expr_cxt;
 
 typedef struct deparse_expr_cxt
@@ -149,6 +168,15 @@ typedef struct pull_aggref_list_context
 	List	   *aggref_list;
 } pull_aggref_list_context;
 
+/*
+ * Struct to pull out the parameters of remote conditions
+ */
+typedef struct pull_param_exprs_context
+{
+	Index		relid;			/* Range table index of the foreign table */
+	List	   *param_exprs;
+} pull_param_exprs_context;
+
 /* Local functions forward declarations */
 static bool foreign_expr_walker(Node *node,
 								foreign_glob_cxt *glob_cxt,
@@ -170,13 +198,123 @@ static void mongo_append_lookup_doc(TupleDesc tupdesc,
 									MongoPlanerJoinInfo *join_info,
 									qdoc_expr_cxt *context);
 static void mongo_append_grouping_doc(TupleDesc tupdesc, BSON *pipeline, MongoPlanerInfo *plannerInfo, qdoc_expr_cxt *context);
+static void mongo_append_group_stages(BSON *pipeline, MongoPlanerInfo *plannerInfo,
+									  qdoc_expr_cxt *context, List *grouping_set);
 static void mongo_append_target_list_doc(TupleDesc tupdesc, BSON *pipeline, MongoPlanerInfo *plannerInfo, qdoc_expr_cxt *context);
 static void mongo_append_filter_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo, qdoc_expr_cxt *context);
+static void mongo_append_sort_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo, qdoc_expr_cxt *context);
+static void mongo_append_limit_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo);
+static char *mongo_get_sort_field(Expr *expr, MongoPlanerInfo *plannerInfo, qdoc_expr_cxt *context);
+static char *mongo_get_column_name(Oid relid, AttrNumber attnum);
 static void mongo_build_expr_doc(BSON *qdoc, Expr *node, qdoc_expr_cxt *context);
+static char *mongo_get_aggregate_operator(char *proname);
+static bool mongo_is_sortable_type(Oid typid, Oid collation);
+static bool mongo_is_collect_aggregate(char *aggname);
+static bool mongo_collect_aggregate_ok(Aggref *agg, char *aggname,
+									   int svr_version);
+static bool mongo_partial_aggregate_ok(Aggref *agg);
+static bool mongo_window_func_ok(PlannerInfo *root, RelOptInfo *foreignrel,
+								 WindowFunc *wfunc);
+static void mongo_append_window_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo,
+									qdoc_expr_cxt *context);
+static void mongo_build_window_func_doc(BSON *qdoc, WindowFunc *wfunc,
+										MongoPlanerWindowInfo *window_info,
+										qdoc_expr_cxt *context);
+static void mongo_append_window_bounds_doc(BSON *qdoc,
+										   MongoPlanerWindowInfo *window_info);
+static bool mongo_is_window_sum(WindowFunc *wfunc);
+static void mongo_append_partial_agg_doc(BSON *qdoc, Aggref *node,
+										 qdoc_expr_cxt *context);
+static void mongo_append_value_count_doc(BSON *qdoc, const char *key,
+										 const char *input);
+static void mongo_append_partial_final_doc(BSON *qdoc, const char *key,
+										   Aggref *node);
+static void mongo_append_collect_doc(BSON *qdoc, Aggref *node,
+									 qdoc_expr_cxt *context);
+static void mongo_append_collect_final_doc(BSON *qdoc, const char *key,
+										   Aggref *node, char *proname);
+static void mongo_append_sorted_input_doc(BSON *qdoc, const char *key,
+										  Aggref *node, const char *input);
+static bool mongo_funcexpr_ok(FuncExpr *fe, int svr_version);
+static bool mongo_date_arith_ok(OpExpr *oe, int svr_version);
+static bool mongo_is_datetime_type(Oid typid);
+static bool mongo_text_op_ok(OpExpr *oe);
+static bool mongo_regex_op_ok(OpExpr *oe);
+static char *mongo_get_regex_pattern(OpExpr *oe, const char **options,
+									 bool *is_negated, bool *is_exact);
+static void mongo_build_regex_doc(BSON *qdoc, OpExpr *node,
+								  qdoc_expr_cxt *context);
+static bool mongo_conditional_expr_ok(foreign_glob_cxt *glob_cxt, Node *node);
+static bool mongo_bool_column_ok(foreign_glob_cxt *glob_cxt, Node *node);
+static void mongo_append_cond_doc(BSON *qdoc, Expr *expr,
+								  qdoc_expr_cxt *context);
+static void mongo_build_bool_test_doc(BSON *qdoc, Var *var, BoolTestType type,
+									  qdoc_expr_cxt *context);
+static bool mongo_case_cond_ok(Node *cond);
+static void mongo_build_case_doc(BSON *qdoc, CaseExpr *node,
+								 qdoc_expr_cxt *context);
+static void mongo_append_case_cond_doc(BSON *qdoc, const char *key, Expr *cond,
+									   qdoc_expr_cxt *context);
+static void mongo_build_coalesce_doc(BSON *qdoc, CoalesceExpr *node,
+									 qdoc_expr_cxt *context);
+static void mongo_append_ifnull_doc(BSON *qdoc, const char *key, List *args,
+									qdoc_expr_cxt *context);
+static void mongo_build_nullif_doc(BSON *qdoc, NullIfExpr *node,
+								   qdoc_expr_cxt *context);
+static void mongo_build_minmax_doc(BSON *qdoc, MinMaxExpr *node,
+								   qdoc_expr_cxt *context);
+static const char *mongo_get_date_trunc_unit(Const *c);
+static const char *mongo_get_date_part_operator(Const *c);
+static bool mongo_is_simple_operand(Expr *expr);
+static void mongo_append_date_op_doc(BSON *qdoc, const char *key,
+									 const char *op_name, Expr *arg,
+									 qdoc_expr_cxt *context);
+static void mongo_build_funcexpr_doc(BSON *qdoc, FuncExpr *node,
+									 qdoc_expr_cxt *context);
+static void mongo_build_date_add_doc(BSON *qdoc, OpExpr *node,
+									 qdoc_expr_cxt *context);
+static void mongo_build_expr_match_doc(BSON *qdoc, Expr *node, List *operands,
+									   qdoc_expr_cxt *context);
+static void mongo_append_not_null_doc(BSON *qdoc, const char *key, Expr *expr,
+									  qdoc_expr_cxt *context);
+static int	mongo_get_param_index(Expr *node, qdoc_expr_cxt *context);
+static void mongo_append_param_value(BSON *qdoc, const char *keyName,
+									 int paramno, qdoc_expr_cxt *context);
+static bool mongo_pull_param_exprs_walker(Node *node,
+										  pull_param_exprs_context *context);
 static void mongo_deparseExpr(Expr *node, deparse_expr_cxt *deparse_context);
 static void mongo_deparseRelation(StringInfo buf, Relation rel);
 static void mongo_get_func_info_scalar_array (Oid const_array_type, Oid *consttype, PGFunction *func_addr);
 static void fetch_executor_relation_offset(MongoPlanerJoinInfo *join_info, qdoc_expr_cxt *context);
+static char *mongo_get_inner_rel_name(Index varno, qdoc_expr_cxt *context);
+static int	mongo_get_tlist_index(List *tlist, Expr *expr);
+static bool mongo_get_lookup_fields(MongoPlanerJoinInfo *join_info, List *tlist,
+									qdoc_expr_cxt *context, char **local_field,
+									char **foreign_field);
+static bool append_jsonb_container(BSON *queryDocument, const char *keyName,
+								   JsonbContainer *container);
+static bool append_jsonb_scalar(BSON *queryDocument, const char *keyName,
+								JsonbValue *value);
+static bool append_jsonb_extended(BSON *queryDocument, const char *keyName,
+								  JsonbContainer *container);
+static bool jsonb_find_key(JsonbContainer *container, const char *key,
+						   JsonbValue *result);
+static bool mongo_numeric_float8_ok(Datum num);
+static bool mongo_append_json_path(StringInfo buf, Expr *expr, Oid relid,
+								   Index varno, bool *is_text);
+static bool mongo_json_path_key_ok(const char *key);
+static char *mongo_get_json_filter(OpExpr *node, Oid relid, Index varno,
+								   Const **value);
+static int	mongo_append_json_filter_conds(BSON *conds, OpExpr *node,
+										   const char *path, Const *value);
+static int	mongo_append_jsonb_contains_conds(BSON *conds, const char *path,
+											  JsonbContainer *container);
+static int	mongo_append_jsonb_scalar_cond(BSON *conds, const char *path,
+										   JsonbValue *value);
+static bool mongo_jsonb_scalar_ok(JsonbValue *value);
+static void mongo_build_json_filter_doc(BSON *qdoc, OpExpr *node,
+										const char *path, Const *value,
+										qdoc_expr_cxt *context);
 
 /*
  * mongo_operator_name
@@ -464,6 +602,13 @@ append_mongo_value(BSON *queryDocument, const char *keyName, Datum value,
 			}
 			break;
 		case JSONBOID:
+			{
+				Jsonb	   *jb = DatumGetJsonbP(value);
+
+				status = append_jsonb_container(queryDocument, keyName,
+												&jb->root);
+			}
+			break;
 		case JSONOID:
 			{
 				char	   *outputString;
@@ -510,6 +655,260 @@ append_mongo_value(BSON *queryDocument, const char *keyName, Datum value,
 	return status;
 }
 
+/*
+ * mongo_numeric_float8_ok
+ *		A numeric value is converted to a double for MongoDB, which fails for
+ *		values outside the range of float8.  Those are kept local.
+ *
+ * The bounds are a little inside the real range of float8, which is all
+ * that is needed to avoid the error.
+ */
+static bool
+mongo_numeric_float8_ok(Datum num)
+{
+	Datum		absval = DirectFunctionCall1(numeric_abs, num);
+	Datum		bound;
+
+	bound = DirectFunctionCall3(numeric_in, CStringGetDatum("1e308"),
+								ObjectIdGetDatum(InvalidOid),
+								Int32GetDatum(-1));
+	if (!DatumGetBool(DirectFunctionCall2(numeric_le, absval, bound)))
+		return false;
+
+	if (DatumGetBool(DirectFunctionCall2(numeric_eq, absval,
+										 DirectFunctionCall1(int4_numeric,
+															 Int32GetDatum(0)))))
+		return true;
+
+	bound = DirectFunctionCall3(numeric_in, CStringGetDatum("1e-307"),
+								ObjectIdGetDatum(InvalidOid),
+								Int32GetDatum(-1));
+	return DatumGetBool(DirectFunctionCall2(numeric_ge, absval, bound));
+}
+
+/*
+ * append_jsonb_container
+ *		Append a jsonb object, array or scalar to the document under
+ *		'keyName'.
+ *
+ * The container is walked with a JsonbIterator and written to BSON directly,
+ * without going through the text form of the value.
+ */
+static bool
+append_jsonb_container(BSON *queryDocument, const char *keyName,
+					   JsonbContainer *container)
+{
+	JsonbIterator *it;
+	JsonbIteratorToken r;
+	JsonbValue	v;
+	BSON		childDocument;
+	BSON	   *target;
+	bool		is_array;
+	int			index = 0;
+
+	it = JsonbIteratorInit(container);
+	r = JsonbIteratorNext(&it, &v, true);
+
+	if (r == WJB_BEGIN_ARRAY && v.val.array.rawScalar)
+	{
+		/* A scalar at top level is stored as a one-element pseudo array */
+		r = JsonbIteratorNext(&it, &v, true);
+		Assert(r == WJB_ELEM);
+
+		/*
+		 * A top-level JSON null is written as the string "null", so that it
+		 * reads back as a JSON null instead of an SQL NULL.
+		 */
+		if (v.type == jbvNull)
+			return bsonAppendUTF8(queryDocument, keyName, (char *) "null");
+
+		return append_jsonb_scalar(queryDocument, keyName, &v);
+	}
+
+	is_array = (r == WJB_BEGIN_ARRAY);
+	if (is_array)
+		bsonAppendStartArray(queryDocument, keyName, &childDocument);
+	else
+	{
+		if (append_jsonb_extended(queryDocument, keyName, container))
+			return true;
+		bsonAppendStartObject(queryDocument, (char *) keyName, &childDocument);
+	}
+
+#ifdef META_DRIVER
+	target = &childDocument;
+#else
+	target = queryDocument;
+#endif
+
+	while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		char		indexString[16];
+		char	   *key;
+
+		if (r == WJB_KEY)
+		{
+			key = pnstrdup(v.val.string.val, v.val.string.len);
+			r = JsonbIteratorNext(&it, &v, true);
+			Assert(r == WJB_VALUE);
+		}
+		else if (r == WJB_ELEM)
+		{
+			snprintf(indexString, sizeof(indexString), "%d", index++);
+			key = indexString;
+		}
+		else
+			continue;
+
+		/* Nested containers are returned unexpanded */
+		if (v.type == jbvBinary)
+			append_jsonb_container(target, key, v.val.binary.data);
+		else
+			append_jsonb_scalar(target, key, &v);
+	}
+
+	if (is_array)
+		return bsonAppendFinishArray(queryDocument, &childDocument);
+
+	return bsonAppendFinishObject(queryDocument, &childDocument);
+}
+
+/*
+ * append_jsonb_scalar
+ *		Append a scalar jsonb value to the document under 'keyName'.
+ *
+ * Integral numbers become int32 or int64 values, whichever fits, so that they
+ * are stored exactly.  Other numbers become doubles, and one outside the
+ * range of a double is an error.
+ */
+static bool
+append_jsonb_scalar(BSON *queryDocument, const char *keyName,
+					JsonbValue *value)
+{
+	switch (value->type)
+	{
+		case jbvNull:
+			return bsonAppendNull(queryDocument, keyName);
+		case jbvBool:
+			return bsonAppendBool(queryDocument, keyName,
+								  value->val.boolean);
+		case jbvString:
+			return bsonAppendUTF8(queryDocument, keyName,
+								  pnstrdup(value->val.string.val,
+										   value->val.string.len));
+		case jbvNumeric:
+			{
+				Datum		num = NumericGetDatum(value->val.numeric);
+				Datum		truncated;
+				Datum		minLong;
+				Datum		maxLong;
+				float8		valueFloat;
+
+				truncated = DirectFunctionCall2(numeric_trunc, num,
+												Int32GetDatum(0));
+				minLong = DirectFunctionCall1(int8_numeric,
+											  Int64GetDatum(PG_INT64_MIN));
+				maxLong = DirectFunctionCall1(int8_numeric,
+											  Int64GetDatum(PG_INT64_MAX));
+
+				/* Compared as numeric, which has no range to overflow */
+				if (DatumGetBool(DirectFunctionCall2(numeric_eq, num,
+													 truncated)) &&
+					DatumGetBool(DirectFunctionCall2(numeric_ge, num,
+													 minLong)) &&
+					DatumGetBool(DirectFunctionCall2(numeric_le, num,
+													 maxLong)))
+				{
+					int64		valueLong;
+
+					valueLong = DatumGetInt64(DirectFunctionCall1(numeric_int8,
+																  num));
+					if (valueLong >= PG_INT32_MIN && valueLong <= PG_INT32_MAX)
+						return bsonAppendInt32(queryDocument, keyName,
+											   (int) valueLong);
+
+					return bsonAppendInt64(queryDocument, keyName, valueLong);
+				}
+
+				if (!mongo_numeric_float8_ok(num))
+					ereport(ERROR,
+							(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+							 errmsg("jsonb number in \"%s\" is out of range for a BSON double",
+									keyName)));
+
+				valueFloat = DatumGetFloat8(DirectFunctionCall1(numeric_float8,
+																num));
+				return bsonAppendDouble(queryDocument, keyName, valueFloat);
+			}
+		default:
+			elog(ERROR, "unexpected jsonb value type: %d", value->type);
+	}
+
+	return false;
+}
+
+/*
+ * append_jsonb_extended
+ *		Append an object of the form {"$oid": "..."} or {"$date": n} as the
+ *		BSON ObjectId or date it stands for.
+ *
+ * Returns false, having appended nothing, for any other object.
+ */
+static bool
+append_jsonb_extended(BSON *queryDocument, const char *keyName,
+					  JsonbContainer *container)
+{
+	JsonbValue	v;
+
+	if (jsonb_find_key(container, "$oid", &v) && v.type == jbvString)
+	{
+		bson_oid_t	bsonObjectId;
+
+		memset(bsonObjectId.bytes, 0, sizeof(bsonObjectId.bytes));
+		bsonOidFromString(&bsonObjectId,
+						  pnstrdup(v.val.string.val, v.val.string.len));
+		return bsonAppendOid(queryDocument, keyName, &bsonObjectId);
+	}
+
+	if (jsonb_find_key(container, "$date", &v) && v.type == jbvNumeric)
+	{
+		Datum		millis;
+
+		millis = DirectFunctionCall1(numeric_int8,
+									 NumericGetDatum(v.val.numeric));
+		return bsonAppendDate(queryDocument, keyName, DatumGetInt64(millis));
+	}
+
+	return false;
+}
+
+/*
+ * jsonb_find_key
+ *		Look up a key of a jsonb object, returning false if it is absent.
+ */
+static bool
+jsonb_find_key(JsonbContainer *container, const char *key, JsonbValue *result)
+{
+#if PG_VERSION_NUM >= 130000
+	return getKeyJsonValueFromContainer(container, key, strlen(key),
+										result) != NULL;
+#else
+	JsonbValue	k;
+	JsonbValue *v;
+
+	k.type = jbvString;
+	k.val.string.val = (char *) key;
+	k.val.string.len = strlen(key);
+
+	v = findJsonbValueFromContainer(container, JB_FOBJECT, &k);
+	if (v == NULL)
+		return false;
+	*result = *v;
+
+	return true;
+#endif
+}
+
 /*
  * mongo_get_column_list
  *		Process scan_var_list to find all columns needed for query execution
@@ -664,6 +1063,27 @@ foreign_expr_walker(Node *node, foreign_glob_cxt *glob_cxt,
 					OidIsValid(get_element_type(c->consttype)))
 					return false;
 
+				/* A numeric that does not fit in a double stays local */
+				if (!c->constisnull && c->consttype == NUMERICOID &&
+					!mongo_numeric_float8_ok(c->constvalue))
+					return false;
+
+				if (!c->constisnull && c->consttype == NUMERICARRAYOID)
+				{
+					Datum	   *elems;
+					bool	   *nulls;
+					int			nelems;
+					int			i;
+
+					deconstruct_array(DatumGetArrayTypeP(c->constvalue),
+									  NUMERICOID, -1, false, TYPALIGN_INT,
+									  &elems, &nulls, &nelems);
+
+					for (i = 0; i < nelems; i++)
+						if (!nulls[i] && !mongo_numeric_float8_ok(elems[i]))
+							return false;
+				}
+
 				/*
 				 * If the constant has nondefault collation, either it's of a
 				 * non-builtin type, or it reflects folding of a CollateExpr.
@@ -725,8 +1145,30 @@ foreign_expr_walker(Node *node, foreign_glob_cxt *glob_cxt,
 				}
 				else if (opKind == OP_MATH)
 				{
-					/* Does not support arithmetic operation within comparing operation */
-					if (outer_cxt->has_compare_op)
+					/*
+					 * A comparison of a computed value is checked by "$expr",
+					 * so a timestamp plus or minus an interval, or a
+					 * concatenation, may be within a comparing operation,
+					 * but for the join clauses.  Numeric arithmetic is not,
+					 * since "$divide" does not truncate integers.  Date/time
+					 * values only take an interval constant.
+					 */
+					if (outer_cxt->has_compare_op &&
+						(IS_JOIN_REL(glob_cxt->foreignrel) ||
+						 (!mongo_is_datetime_type(oe->opresulttype) &&
+						  oe->opresulttype != TEXTOID)))
+						return false;
+					if (!mongo_date_arith_ok(oe, glob_cxt->svr_version) ||
+						!mongo_text_op_ok(oe))
+						return false;
+					inner_cxt.has_compare_op = true;
+				}
+				else if (opKind == OP_REGEX)
+				{
+					/* A pattern match is a comparing operation of its own */
+					if (outer_cxt->has_compare_op ||
+						IS_JOIN_REL(glob_cxt->foreignrel) ||
+						!mongo_regex_op_ok(oe))
 						return false;
 					inner_cxt.has_compare_op = true;
 				}
@@ -751,9 +1193,33 @@ foreign_expr_walker(Node *node, foreign_glob_cxt *glob_cxt,
 				foreach(lc, oe->args)
 				{
 					Node *n = (Node *) lfirst(lc);
+					Node *arg = n;
+
+					/*
+					 * A Param or a column of another relation is a value
+					 * supplied at execution time, which a base relation can
+					 * compare a column against.
+					 */
+					while (IsA(arg, RelabelType))
+						arg = (Node *) ((RelabelType *) arg)->arg;
+					if (IS_SIMPLE_REL(glob_cxt->foreignrel) &&
+						(IsA(arg, Param) ||
+						 (IsA(arg, Var) &&
+						  !bms_is_member(((Var *) arg)->varno, glob_cxt->relids))))
+					{
+						if (opKind != OP_CONDITIONAL)
+							return false;
+						continue;
+					}
+
 					if (IsA(n, RelabelType) ||
 						IsA(n, List) ||
 						IsA(n, OpExpr) ||
+						IsA(n, FuncExpr) ||
+						IsA(n, CaseExpr) ||
+						IsA(n, CoalesceExpr) ||
+						IsA(n, NullIfExpr) ||
+						IsA(n, MinMaxExpr) ||
 						(IsA(n, Aggref) && opKind == OP_CONDITIONAL))
 						continue;
 
@@ -895,14 +1361,17 @@ foreign_expr_walker(Node *node, foreign_glob_cxt *glob_cxt,
 				if (!IS_UPPER_REL(glob_cxt->foreignrel))
 					return false;
 
-				/* Only non-split aggregates are pushable. */
-				if (agg->aggsplit != AGGSPLIT_SIMPLE)
+				/*
+				 * Only non-split aggregates are pushable, and the partial
+				 * aggregates whose state MongoDB can compute.
+				 */
+				if (agg->aggsplit != AGGSPLIT_SIMPLE &&
+					(agg->aggsplit != AGGSPLIT_INITIAL_SERIAL ||
+					 !mongo_partial_aggregate_ok(agg)))
 					return false;
 
-				/* Does not support DISTINCT, ORDER BY, FILTER, VARIADIC
-				 * inside aggregate function.
-				 */
-				if (agg->aggdistinct || agg->aggorder || agg->aggfilter || agg->aggvariadic)
+				/* Does not support FILTER, VARIADIC inside aggregate function */
+				if (agg->aggfilter || agg->aggvariadic)
 					return false;
 
 				if (AGGKIND_IS_ORDERED_SET(agg->aggkind))
@@ -913,17 +1382,48 @@ foreign_expr_walker(Node *node, foreign_glob_cxt *glob_cxt,
 				if (aggname == NULL)
 					elog(ERROR, "No such function name for function OID %u", agg->aggfnoid);
 
-				/* These functions can be passed to MongoDB */
-				if (!(strcmp(aggname, "avg") == 0
-					  || (strcmp(aggname, "count") == 0 && agg->aggstar)
-					  || strcmp(aggname, "min") == 0
-					  || strcmp(aggname, "max") == 0
-					  || strcmp(aggname, "sum") == 0
-					  || strcmp(aggname, "stddev") == 0
-					  || strcmp(aggname, "stddev_pop") == 0
-					  || strcmp(aggname, "stddev_samp") == 0))
+				if (mongo_is_collect_aggregate(aggname))
 				{
-					return false;
+					/* The values are collected by "$push", without DISTINCT */
+					if (agg->aggdistinct ||
+						!mongo_collect_aggregate_ok(agg, aggname,
+						    glob_cxt->svr_version))
+						return false;
+				}
+				else
+				{
+					/* Nor ORDER BY, nor DISTINCT but for a single argument */
+					if (agg->aggorder)
+						return false;
+					if (agg->aggdistinct && list_length(agg->args) != 1)
+						return false;
+
+					/* These functions can be passed to MongoDB */
+					if (!(strcmp(aggname, "avg") == 0
+						  || strcmp(aggname, "count") == 0
+						  || strcmp(aggname, "min") == 0
+						  || strcmp(aggname, "max") == 0
+						  || strcmp(aggname, "sum") == 0
+						  || strcmp(aggname, "stddev") == 0
+						  || strcmp(aggname, "stddev_pop") == 0
+						  || strcmp(aggname, "stddev_samp") == 0
+						  || strcmp(aggname, "bool_and") == 0
+						  || strcmp(aggname, "bool_or") == 0
+						  || strcmp(aggname, "every") == 0))
+					{
+						return false;
+					}
+
+					/*
+					 * "$min" and "$max" skip a null or missing column, but a
+					 * comparison of it is false rather than null, which
+					 * bool_and and bool_or would not skip.
+					 */
+					if ((strcmp(aggname, "bool_and") == 0 ||
+						 strcmp(aggname, "bool_or") == 0 ||
+						 strcmp(aggname, "every") == 0) &&
+						!IsA(((TargetEntry *) linitial(agg->args))->expr, Var))
+						return false;
 				}
 
 				foreach(lc, agg->args)
@@ -970,89 +1470,325 @@ foreign_expr_walker(Node *node, foreign_glob_cxt *glob_cxt,
 					state = FDW_COLLATE_UNSAFE;
 			}
 			break;
-		case T_BoolExpr:
+		case T_WindowFunc:
 			{
-				BoolExpr   *b = (BoolExpr *) node;
-				ListCell   *lc;
+				WindowFunc *wfunc = (WindowFunc *) node;
+				MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) glob_cxt->foreignrel->fdw_private;
 
-				foreach(lc, b->args)
-				{
-					Node *n = (Node *) lfirst(lc);
+				/* Only computed by the window stage */
+				if (!IS_UPPER_REL(glob_cxt->foreignrel) ||
+					fpinfo->stage != UPPERREL_WINDOW)
+					return false;
 
-					/*
-					 * Does not support Var has boolean type
-					 * e.g. WHERE c1::bool [ AND | OR ] { expression }.
-					 */
-					if (IsA(n, Var))
-						return false;
-				}
+				/* "$setWindowFields" is only known from MongoDB 5.0 on */
+				if (glob_cxt->svr_version < 500)
+					return false;
 
-				/*
-				 * Recurse to input subexpressions.
-				 */
-				if (!foreign_expr_walker((Node *) b->args,
-										 glob_cxt, &inner_cxt))
+				if (!mongo_window_func_ok(glob_cxt->root, glob_cxt->foreignrel,
+										  wfunc))
 					return false;
 
-				/* Output is always boolean and so noncollatable. */
-				collation = InvalidOid;
-				state = FDW_COLLATE_NONE;
+				if (!foreign_expr_walker((Node *) wfunc->args, glob_cxt,
+										 &inner_cxt))
+					return false;
+
+				/* Same collation rules as for an aggregate */
+				if (wfunc->inputcollid == InvalidOid)
+					 /* OK, inputs are all noncollatable */ ;
+				else if (inner_cxt.state != FDW_COLLATE_SAFE ||
+						 wfunc->inputcollid != inner_cxt.collation)
+					return false;
+
+				collation = wfunc->wincollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else if (collation == DEFAULT_COLLATION_OID)
+					state = FDW_COLLATE_NONE;
+				else
+					state = FDW_COLLATE_UNSAFE;
 			}
 			break;
-		case T_NullTest:
+		case T_FuncExpr:
 			{
-				NullTest   *nt = (NullTest *) node;
+				FuncExpr   *fe = (FuncExpr *) node;
 
-				/* Input expression only support column */
-				if (!IsA(nt->arg, Var))
+				/* Only the functions MongoDB has an expression for */
+				if (!mongo_funcexpr_ok(fe, glob_cxt->svr_version))
 					return false;
 
 				/*
 				 * Recurse to input subexpressions.
 				 */
-				if (!foreign_expr_walker((Node *) nt->arg,
+				if (!foreign_expr_walker((Node *) fe->args,
 										 glob_cxt, &inner_cxt))
 					return false;
 
-				/* Output is always boolean and so noncollatable. */
-				collation = InvalidOid;
-				state = FDW_COLLATE_NONE;
+				/* Result-collation handling */
+				collation = fe->funccollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else if (collation == DEFAULT_COLLATION_OID)
+					state = FDW_COLLATE_NONE;
+				else
+					state = FDW_COLLATE_UNSAFE;
 			}
 			break;
-		case T_ScalarArrayOpExpr:
+		case T_CaseExpr:
 			{
-				ScalarArrayOpExpr *oe = (ScalarArrayOpExpr *) node;
-				char	   *opname = NULL;
+				CaseExpr   *ce = (CaseExpr *) node;
+				ListCell   *lc;
 
-				/* Sanity check. */
-				Assert(list_length(oe->args) == 2);
+				/*
+				 * Only a searched CASE of plain values is computed by
+				 * "$switch", see mongo_conditional_expr_ok.
+				 */
+				if (ce->arg != NULL ||
+					!mongo_conditional_expr_ok(glob_cxt, node))
+					return false;
 
-				/* Get operator name */
-				opname = get_opname(oe->opno);
-				if (opname == NULL)
-					elog(ERROR, "No such operator name for operator OID %u", oe->opno);
+				foreach(lc, ce->args)
+				{
+					CaseWhen   *cw = lfirst_node(CaseWhen, lc);
 
-				/* Operator must be equal or not-equal operator. */
-				if (!(strcmp(opname, "=") == 0 ||
-					  strcmp(opname, "<>") == 0 ||
-					  strcmp(opname, "!=") == 0))
+					if (!mongo_case_cond_ok((Node *) cw->expr))
+						return false;
+
+					if (!foreign_expr_walker((Node *) cw->expr,
+											 glob_cxt, &inner_cxt) ||
+						!foreign_expr_walker((Node *) cw->result,
+											 glob_cxt, &inner_cxt))
+						return false;
+				}
+
+				if (!foreign_expr_walker((Node *) ce->defresult,
+										 glob_cxt, &inner_cxt))
 					return false;
 
-				inner_cxt.has_scalar_array_op_expr = true;
+				/* Result-collation handling */
+				collation = ce->casecollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else if (collation == DEFAULT_COLLATION_OID)
+					state = FDW_COLLATE_NONE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_CoalesceExpr:
+			{
+				CoalesceExpr *ce = (CoalesceExpr *) node;
+
+				if (!mongo_conditional_expr_ok(glob_cxt, node))
+					return false;
 
 				/*
 				 * Recurse to input subexpressions.
 				 */
-				if (!foreign_expr_walker((Node *) oe->args,
-												glob_cxt, &inner_cxt))
+				if (!foreign_expr_walker((Node *) ce->args,
+										 glob_cxt, &inner_cxt))
 					return false;
 
-				/*
-				 * If operator's input collation is not derived from a foreign
-				 * Var, it can't be sent to remote.
-				 */
-				if (oe->inputcollid == InvalidOid)
-					 /* OK, inputs are all noncollatable */ ;
+				/* Result-collation handling */
+				collation = ce->coalescecollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else if (collation == DEFAULT_COLLATION_OID)
+					state = FDW_COLLATE_NONE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_NullIfExpr:
+			{
+				NullIfExpr *ni = (NullIfExpr *) node;
+				const char *opname = NULL;
+
+				/* The arguments are compared by "$eq" */
+				if (!mongo_conditional_expr_ok(glob_cxt, node) ||
+					mongo_validateOperatorName(ni->opno, &opname, NULL) != OP_CONDITIONAL ||
+					strcmp(opname, "$eq") != 0)
+					return false;
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) ni->args,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Same collation rules as for an operator */
+				if (ni->inputcollid == InvalidOid)
+					 /* OK, inputs are all noncollatable */ ;
+				else if (inner_cxt.state != FDW_COLLATE_SAFE ||
+						 ni->inputcollid != inner_cxt.collation)
+					return false;
+
+				collation = ni->opcollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else if (collation == DEFAULT_COLLATION_OID)
+					state = FDW_COLLATE_NONE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_MinMaxExpr:
+			{
+				MinMaxExpr *mm = (MinMaxExpr *) node;
+
+				/* "$max" and "$min" must order the values as PostgreSQL */
+				if (!mongo_conditional_expr_ok(glob_cxt, node) ||
+					!mongo_is_sortable_type(mm->minmaxtype, mm->inputcollid))
+					return false;
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) mm->args,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Same collation rules as for an operator */
+				if (mm->inputcollid == InvalidOid)
+					 /* OK, inputs are all noncollatable */ ;
+				else if (inner_cxt.state != FDW_COLLATE_SAFE ||
+						 mm->inputcollid != inner_cxt.collation)
+					return false;
+
+				collation = mm->minmaxcollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else if (collation == DEFAULT_COLLATION_OID)
+					state = FDW_COLLATE_NONE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_BoolExpr:
+			{
+				BoolExpr   *b = (BoolExpr *) node;
+				ListCell   *lc;
+
+				foreach(lc, b->args)
+				{
+					Node *n = (Node *) lfirst(lc);
+
+					/*
+					 * A boolean column is a condition of its own, like
+					 * WHERE c1 [ AND | OR ] { expression }, and NOT is
+					 * only taken for a boolean column, see
+					 * mongo_bool_column_ok.
+					 */
+					if ((IsA(n, Var) || b->boolop == NOT_EXPR) &&
+						!mongo_bool_column_ok(glob_cxt, n))
+						return false;
+				}
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) b->args,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Output is always boolean and so noncollatable. */
+				collation = InvalidOid;
+				state = FDW_COLLATE_NONE;
+			}
+			break;
+		case T_BooleanTest:
+			{
+				BooleanTest *bt = (BooleanTest *) node;
+
+				/* Input expression only support column */
+				if (!IsA(bt->arg, Var) ||
+					!mongo_bool_column_ok(glob_cxt, (Node *) bt->arg))
+					return false;
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) bt->arg,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Output is always boolean and so noncollatable. */
+				collation = InvalidOid;
+				state = FDW_COLLATE_NONE;
+			}
+			break;
+		case T_NullTest:
+			{
+				NullTest   *nt = (NullTest *) node;
+
+				/* Input expression only support column */
+				if (!IsA(nt->arg, Var))
+					return false;
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) nt->arg,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Output is always boolean and so noncollatable. */
+				collation = InvalidOid;
+				state = FDW_COLLATE_NONE;
+			}
+			break;
+		case T_ScalarArrayOpExpr:
+			{
+				ScalarArrayOpExpr *oe = (ScalarArrayOpExpr *) node;
+				char	   *opname = NULL;
+
+				/* Sanity check. */
+				Assert(list_length(oe->args) == 2);
+
+				/* Get operator name */
+				opname = get_opname(oe->opno);
+				if (opname == NULL)
+					elog(ERROR, "No such operator name for operator OID %u", oe->opno);
+
+				/* Operator must be equal or not-equal operator. */
+				if (!(strcmp(opname, "=") == 0 ||
+					  strcmp(opname, "<>") == 0 ||
+					  strcmp(opname, "!=") == 0))
+					return false;
+
+				inner_cxt.has_scalar_array_op_expr = true;
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) oe->args,
+												glob_cxt, &inner_cxt))
+					return false;
+
+				/*
+				 * If operator's input collation is not derived from a foreign
+				 * Var, it can't be sent to remote.
+				 */
+				if (oe->inputcollid == InvalidOid)
+					 /* OK, inputs are all noncollatable */ ;
 				else if (inner_cxt.state != FDW_COLLATE_SAFE ||
 						 oe->inputcollid != inner_cxt.collation)
 					return false;
@@ -1148,6 +1884,7 @@ mongo_is_foreign_expr(PlannerInfo *root, RelOptInfo *baserel, Expr *expression)
 		glob_cxt.relids = fpinfo->outerrel->relids;
 	else
 		glob_cxt.relids = baserel->relids;
+	glob_cxt.svr_version = mongo_get_server_version(baserel->serverid);
 
 	loc_cxt.collation = InvalidOid;
 	loc_cxt.state = FDW_COLLATE_NONE;
@@ -1168,1559 +1905,5713 @@ mongo_is_foreign_expr(PlannerInfo *root, RelOptInfo *baserel, Expr *expression)
 }
 
 /*
- * prepare_var_list_for_baserel
- *		Build list of nodes corresponding to the attributes requested for given
- *		base relation.
+ * mongo_find_em_expr_for_rel
+ *		Find an equivalence class member expression that can be used as a
+ *		sort key of the given relation.
  *
- * The list contains Var nodes corresponding to the attributes specified in
- * attrs_used. If whole-row reference is required, add Var nodes corresponding
- * to all the attributes in the relation.
+ * For a base or join relation, this is a plain column of the relation; a join
+ * relation must also emit the column.  For an upper relation, it is one of
+ * the expressions computed by the remote grouping, which is returned as it
+ * appears in the grouped target list.
  */
-static List *
-prepare_var_list_for_baserel(Oid relid, Index varno, Bitmapset *attrs_used)
+Expr *
+mongo_find_em_expr_for_rel(EquivalenceClass *ec, RelOptInfo *rel)
 {
-	int			attno;
-	List	   *tlist = NIL;
-	Node	   *node;
-	bool		wholerow_requested = false;
-	Relation	relation;
-	TupleDesc	tupdesc;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) rel->fdw_private;
+	ListCell   *lc_em;
 
-	Assert(OidIsValid(relid));
+	foreach(lc_em, ec->ec_members)
+	{
+		EquivalenceMember *em = (EquivalenceMember *) lfirst(lc_em);
+		Expr	   *em_expr = em->em_expr;
 
-	/* Planner must have taken a lock, so request no lock here */
-#if PG_VERSION_NUM < 130000
-	relation = heap_open(relid, NoLock);
-#else
-	relation = table_open(relid, NoLock);
-#endif
+		if (em->em_is_const)
+			continue;
 
-	tupdesc = RelationGetDescr(relation);
+		/* Ignore binary-compatible relabeling */
+		while (IsA(em_expr, RelabelType))
+			em_expr = ((RelabelType *) em_expr)->arg;
 
-	/* Is whole-row reference requested? */
-	wholerow_requested = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber,
-									   attrs_used);
+		if (IS_UPPER_REL(rel))
+		{
+			ListCell   *lc;
 
-	/* Handle user defined attributes first. */
-	for (attno = 1; attno <= tupdesc->natts; attno++)
-	{
-		Form_pg_attribute attr = TupleDescAttr(tupdesc, attno - 1);
+			foreach(lc, fpinfo->grouped_tlist)
+			{
+				TargetEntry *tle = lfirst_node(TargetEntry, lc);
+				Expr	   *expr = tle->expr;
 
-		/* Ignore dropped attributes. */
-		if (attr->attisdropped)
+				while (IsA(expr, RelabelType))
+					expr = ((RelabelType *) expr)->arg;
+
+				if (equal(em_expr, expr))
+					return tle->expr;
+			}
 			continue;
+		}
 
-		/* For a required attribute create a Var node */
-		if (wholerow_requested ||
-			bms_is_member(attno - FirstLowInvalidHeapAttributeNumber,
-						  attrs_used))
-		{
-			node = (Node *) makeVar(varno, attno, attr->atttypid,
-									attr->atttypmod, attr->attcollation, 0);
-			tlist = lappend(tlist, node);
+		if (!IsA(em_expr, Var) || ((Var *) em_expr)->varattno <= 0)
+			continue;
 
-		}
+		if (bms_is_empty(em->em_relids) ||
+			!bms_is_subset(em->em_relids, rel->relids))
+			continue;
+
+		if (IS_JOIN_REL(rel) && !list_member(rel->reltarget->exprs, em_expr))
+			continue;
+
+		return em_expr;
 	}
 
-#if PG_VERSION_NUM < 130000
-	heap_close(relation, NoLock);
-#else
-	table_close(relation, NoLock);
-#endif
+	return NULL;
+}
 
-	return tlist;
+/*
+ * mongo_is_sortable_type
+ *		Returns true if MongoDB sorts the values of the given type the way
+ *		PostgreSQL does under the given collation.
+ *
+ * MongoDB compares strings bytewise, so collatable types qualify only under
+ * the C collation.  Floating-point and numeric types don't qualify either:
+ * MongoDB sorts NaN below all other numbers, where PostgreSQL sorts it above.
+ */
+static bool
+mongo_is_sortable_type(Oid typid, Oid collation)
+{
+	switch (typid)
+	{
+		case BOOLOID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case DATEOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return true;
+		case TEXTOID:
+		case VARCHAROID:
+		case NAMEOID:
+			return lc_collate_is_c(collation);
+		default:
+			return false;
+	}
 }
 
 /*
- * Build a pipeline query document based on aggregate API.
+ * mongo_is_foreign_pathkey
+ *		Returns true if the given pathkey can be evaluated by a "$sort" stage
+ *		on the given relation.
+ *
+ * Placement of nulls is dealt with when the stage is built.
  */
-static void mongo_aggregate_pipeline_query(EState *estate, TupleDesc tupdesc,
-											MongoPlanerInfo *plannerInfo,
-											qdoc_expr_cxt *context,
-											BSON *queryDocument)
+bool
+mongo_is_foreign_pathkey(PlannerInfo *root, RelOptInfo *rel, PathKey *pathkey)
 {
-	BSON	pipeline;
+	EquivalenceClass *ec = pathkey->pk_eclass;
+	Expr	   *em_expr;
+	Oid			typid;
+	Oid			opclass;
 
-	if (queryDocument == NULL)
-		return;
+	/* Volatile sort expressions can't be evaluated remotely */
+	if (ec->ec_has_volatile)
+		return false;
 
-	/* Build pipeline */
-	bsonAppendStartArray (queryDocument, "pipeline", &pipeline);
+	if (pathkey->pk_strategy != BTLessStrategyNumber &&
+		pathkey->pk_strategy != BTGreaterStrategyNumber)
+		return false;
 
-	/* Scan rel must be join relation */
-	if (context->scan_reloptkind == RELOPT_JOINREL ||
-		context->scan_reloptkind == RELOPT_OTHER_JOINREL)
-	{
-		ListCell *lc;
-		/*
-		 * Build "$lookup" object.
-		 */
-		foreach(lc, plannerInfo->joininfo_list)
-		{
-			MongoPlanerJoinInfo *join_info = (MongoPlanerJoinInfo *)lfirst(lc);
-			context->is_join_expr = true;
+	em_expr = mongo_find_em_expr_for_rel(ec, rel);
+	if (em_expr == NULL)
+		return false;
 
-			mongo_append_lookup_doc(tupdesc, &pipeline, plannerInfo->tlist,
-									plannerInfo->scan_reloptkind, join_info, context);
-			context->is_join_expr = false;
+	typid = exprType((Node *) em_expr);
+	if (!mongo_is_sortable_type(typid, ec->ec_collation))
+		return false;
 
-			/* Build $unwind stage */
-			if (context->innerel_name)
-			{
-				BSON unwind, unwind_doc;
-				char *buf;
+	/* The ordering must be the type's default btree ordering */
+	opclass = GetDefaultOpClass(typid, BTREE_AM_OID);
+	if (!OidIsValid(opclass) ||
+		get_opclass_family(opclass) != pathkey->pk_opfamily)
+		return false;
 
-				bsonAppendStartObject (&pipeline, "0", &unwind);
-				bsonAppendStartObject (&unwind, "$unwind", &unwind_doc);
-				buf = psprintf("$%s", context->innerel_name);
+	return true;
+}
 
-				bsonAppendUTF8 (&unwind_doc, "path", buf);
-				if (plannerInfo->jointype == JOIN_INNER)
-				{
-					bsonAppendBool (&unwind_doc, "preserveNullAndEmptyArrays", false);
-				}
-				else
-				{
-					bsonAppendBool (&unwind_doc, "preserveNullAndEmptyArrays", true);
-				}
+/*
+ * mongo_window_sort_options
+ *		Returns the MONGO_SORT_* flags of a sort key of a window.
+ */
+int
+mongo_window_sort_options(PlannerInfo *root, SortGroupClause *sgc, Expr *expr)
+{
+	TypeCacheEntry *typentry;
+	int			options = 0;
 
-				bsonAppendFinishObject (&unwind, &unwind_doc);
-				bsonAppendFinishObject (&pipeline, &unwind);
+	typentry = lookup_type_cache(exprType((Node *) expr), TYPECACHE_GT_OPR);
+	if (sgc->sortop == typentry->gt_opr)
+		options |= MONGO_SORT_DESC;
+	if (sgc->nulls_first)
+		options |= MONGO_SORT_NULLS_FIRST;
 
-				context->innerel_name_list = lappend(context->innerel_name_list, makeString(context->innerel_name));
-			}
-		}
+	/* A NOT NULL column needs no null key */
+	if (IsA(expr, Var))
+	{
+		Var		   *var = (Var *) expr;
+		RangeTblEntry *rte = planner_rt_fetch(var->varno, root);
+
+		if (var->varattno > 0 && get_attnotnull(rte->relid, var->varattno))
+			options |= MONGO_SORT_NOT_NULL;
 	}
 
-	/* Build filter document for WHERE clause */
-	if (plannerInfo->remote_exprs)
-		mongo_append_filter_doc(&pipeline, plannerInfo, context);
+	return options;
+}
 
-	if (context->reloptkind == RELOPT_UPPER_REL ||
-		context->reloptkind == RELOPT_OTHER_UPPER_REL)
-	{
-		/*
-		 * Build "$group" object.
-		 *
-		 * For a join or upper relation the input tlist gives the list of
-		 * columns required to be fetched from the foreign server.
-		 */
-		if (context->has_grouping_agg)
-			mongo_append_grouping_doc(tupdesc, &pipeline, plannerInfo, context);
-	}
+/*
+ * mongo_window_func_ok
+ *		Check whether the given window function can be computed by a
+ *		"$setWindowFields" stage.
+ *
+ * row_number, rank and dense_rank are converted to $documentNumber, $rank and
+ * $denseRank, and count(*), sum, avg, min and max to the accumulators of the
+ * same name over a window of documents (ROWS) or of the sort key value
+ * (RANGE).  The window is sorted on keys that MongoDB sorts like PostgreSQL,
+ * see mongo_is_sortable_type; the placement of nulls is obtained by sorting
+ * on a null flag first.  $rank, $denseRank and a range window take a single
+ * sort key, so the nulls must be placed where MongoDB places them.
+ */
+static bool
+mongo_window_func_ok(PlannerInfo *root, RelOptInfo *foreignrel,
+					 WindowFunc *wfunc)
+{
+	char	   *funcname = get_func_name(wfunc->winfnoid);
+	WindowClause *wc = NULL;
+	bool		single_key = false;
+	int			frameOptions;
+	ListCell   *lc;
 
-	/* Build filter document for HAVING clause */
-	if (plannerInfo->having_quals)
+	if (funcname == NULL || wfunc->aggfilter)
+		return false;
+
+	foreach(lc, root->parse->windowClause)
 	{
-		context->need_aggexpr_syntax = true;
-		mongo_append_filter_doc(&pipeline, plannerInfo, context);
+		WindowClause *clause = lfirst_node(WindowClause, lc);
+
+		if (clause->winref == wfunc->winref)
+		{
+			wc = clause;
+			break;
+		}
 	}
 
-	/* Build target list document */
-	mongo_append_target_list_doc(tupdesc, &pipeline, plannerInfo, context);
+	if (wc == NULL)
+		return false;
 
-	/*
-	 * Build LIMIT/OFFSET:
-	 *		{$skip:1}, {$limit: 1}
-	 */
-	if (plannerInfo->has_limit)
+	frameOptions = wc->frameOptions;
+
+	if (strcmp(funcname, "row_number") == 0 ||
+		strcmp(funcname, "rank") == 0 ||
+		strcmp(funcname, "dense_rank") == 0)
+	{
+		/* MongoDB ranks the documents of a sorted window only */
+		if (wc->orderClause == NIL)
+			return false;
+
+		single_key = (strcmp(funcname, "row_number") != 0);
+	}
+	else if (wfunc->winagg &&
+			 ((strcmp(funcname, "count") == 0 && wfunc->winstar) ||
+			  (list_length(wfunc->args) == 1 &&
+			   (strcmp(funcname, "sum") == 0 ||
+				strcmp(funcname, "avg") == 0 ||
+				strcmp(funcname, "min") == 0 ||
+				strcmp(funcname, "max") == 0))))
 	{
-		if (plannerInfo->limitOffset)
+		if (frameOptions & (FRAMEOPTION_GROUPS | FRAMEOPTION_EXCLUSION))
+			return false;
+
+		if (frameOptions & FRAMEOPTION_ROWS)
 		{
-			BSON offset_doc;
+			/* A window of documents needs a sorted window */
+			if (wc->orderClause == NIL)
+				return false;
 
-			bsonAppendStartObject (&pipeline, "0", &offset_doc);
-			append_constant_value (&offset_doc, "$skip", (Const *)plannerInfo->limitOffset);
-			bsonAppendFinishObject (&pipeline, &offset_doc);
+			if ((frameOptions & FRAMEOPTION_START_OFFSET) &&
+				(!IsA(wc->startOffset, Const) ||
+				 ((Const *) wc->startOffset)->constisnull))
+				return false;
+			if ((frameOptions & FRAMEOPTION_END_OFFSET) &&
+				(!IsA(wc->endOffset, Const) ||
+				 ((Const *) wc->endOffset)->constisnull))
+				return false;
 		}
-		if (plannerInfo->limitCount)
+		else
 		{
-			BSON limit_doc;
+			if (frameOptions & (FRAMEOPTION_START_OFFSET | FRAMEOPTION_END_OFFSET))
+				return false;
+
+			/*
+			 * Without ORDER BY, all rows are peers and the frame is the
+			 * partition.  Otherwise, a range window is on a single numeric
+			 * key.
+			 */
+			if (wc->orderClause != NIL &&
+				!((frameOptions & FRAMEOPTION_START_UNBOUNDED_PRECEDING) &&
+				  (frameOptions & FRAMEOPTION_END_UNBOUNDED_FOLLOWING)))
+			{
+				SortGroupClause *sgc = linitial_node(SortGroupClause, wc->orderClause);
+				Oid			typid;
+
+				typid = exprType((Node *) get_sortgroupref_tle(sgc->tleSortGroupRef,
+															   root->parse->targetList)->expr);
+				if (typid != INT2OID && typid != INT4OID && typid != INT8OID &&
+					typid != FLOAT4OID && typid != FLOAT8OID &&
+					typid != NUMERICOID)
+					return false;
 
-			bsonAppendStartObject (&pipeline, "0", &limit_doc);
-			append_constant_value (&limit_doc, "$limit", (Const *)plannerInfo->limitCount);
-			bsonAppendFinishObject (&pipeline, &limit_doc);
+				single_key = true;
+			}
 		}
 	}
+	else
+		return false;
 
-	bsonAppendFinishArray (queryDocument, &pipeline);
+	foreach(lc, wc->partitionClause)
+	{
+		SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+		Expr	   *expr = get_sortgroupref_tle(sgc->tleSortGroupRef,
+												root->parse->targetList)->expr;
 
-	if (!bsonFinish(queryDocument))
+		if (!mongo_is_foreign_expr(root, foreignrel, expr))
+			return false;
+	}
+
+	if (single_key && list_length(wc->orderClause) != 1)
+		return false;
+
+	foreach(lc, wc->orderClause)
 	{
-#ifdef META_DRIVER
-		ereport(ERROR,
-				(errmsg("could not create document for query"),
-				 errhint("BSON flags: %d", queryDocument->flags)));
-#else
-		ereport(ERROR,
-				(errmsg("could not create document for query"),
-				 errhint("BSON error: %d", queryDocument->err)));
-#endif
+		SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+		Expr	   *expr = get_sortgroupref_tle(sgc->tleSortGroupRef,
+												root->parse->targetList)->expr;
+		Oid			typid = exprType((Node *) expr);
+		TypeCacheEntry *typentry;
+
+		if (!mongo_is_foreign_expr(root, foreignrel, expr) ||
+			!mongo_is_sortable_type(typid, exprCollation((Node *) expr)))
+			return false;
+
+		/* The ordering must be the type's default btree ordering */
+		typentry = lookup_type_cache(typid,
+									 TYPECACHE_LT_OPR | TYPECACHE_GT_OPR);
+		if (sgc->sortop != typentry->lt_opr &&
+			sgc->sortop != typentry->gt_opr)
+			return false;
+
+		if (single_key &&
+			MONGO_SORT_NEEDS_NULL_KEY(mongo_window_sort_options(root, sgc, expr)))
+			return false;
 	}
+
+	return true;
 }
 
 /*
- * Building "$lookup" stage".
+ * mongo_funcexpr_ok
+ *		Check whether the given function can be computed by a MongoDB
+ *		aggregate expression.
+ *
+ * The date/time functions take a timestamp without time zone, which is stored
+ * as a UTC date, so that MongoDB computes them in UTC as PostgreSQL does:
+ *		date_trunc(unit, ts)		-> $dateTrunc
+ *		date_part(field, ts), extract(field FROM ts)
+ *									-> $year, $month, $hour, ...
+ *		to_timestamp(double)		-> $toDate
+ * and a date is cast to a timestamp as it is.  The unit and field names must
+ * be constants.  $dateTrunc is only known from MongoDB 5.0 on, so date_trunc
+ * needs the server_version option to say so.
+ *
+ * The string functions are computed on code points:
+ *		lower(s), upper(s)			-> $toLower, $toUpper
+ *		length(s), char_length(s)	-> $strLenCP
+ *		substring(s, start, count)	-> $substrCP
+ *		btrim(s, chars), ltrim, rtrim
+ *									-> $trim, $ltrim, $rtrim
+ * MongoDB changes the case of ASCII letters only, so lower and upper are
+ * pushed down only for the C ctype.  The positions and characters to trim
+ * must be constants.
  */
-static void mongo_append_lookup_doc(TupleDesc tupdesc,
-									  BSON *pipeline,
-									  List *tlist,
-									  RelOptKind scan_reloptkind,
-									  MongoPlanerJoinInfo *join_info,
-									  qdoc_expr_cxt *context)
+static bool
+mongo_funcexpr_ok(FuncExpr *fe, int svr_version)
 {
-	BSON lookup_stage, join_doc, let_doc;
-	RangeTblEntry *rte_o = NULL;
-	RangeTblEntry *rte_i = NULL;
-	Relation	rel;
-	StringInfoData buf;
-	ListCell *lc;
-	qdoc_expr_cxt local_context;
-	MongoPlanerInfo *plannerInfo_inner;
-	int i = 0;
+	char	   *funcname;
+	int			nargs = list_length(fe->args);
 
-	Assert (scan_reloptkind == RELOPT_JOINREL ||
-			scan_reloptkind == RELOPT_OTHER_JOINREL);
+	/* Only built-in functions */
+	if (fe->funcid >= FirstNormalObjectId || fe->funcvariadic)
+		return false;
 
-	if (join_info->join_is_sub_query)
-		fetch_executor_relation_offset(join_info, context);
+	funcname = get_func_name(fe->funcid);
+	if (funcname == NULL)
+		elog(ERROR, "No such function name for function OID %u", fe->funcid);
+
+	if (strcmp(funcname, "date_trunc") == 0)
+		return (svr_version >= 500 && nargs == 2 &&
+				exprType((Node *) lsecond(fe->args)) == TIMESTAMPOID &&
+				IsA(linitial(fe->args), Const) &&
+				mongo_get_date_trunc_unit((Const *) linitial(fe->args)) != NULL);
+
+	if (strcmp(funcname, "date_part") == 0 ||
+		strcmp(funcname, "extract") == 0)
+		return (nargs == 2 &&
+				exprType((Node *) lsecond(fe->args)) == TIMESTAMPOID &&
+				IsA(linitial(fe->args), Const) &&
+				mongo_get_date_part_operator((Const *) linitial(fe->args)) != NULL);
+
+	if (strcmp(funcname, "to_timestamp") == 0)
+		return (nargs == 1 &&
+				exprType((Node *) linitial(fe->args)) == FLOAT8OID);
+
+	if (strcmp(funcname, "timestamp") == 0)
+		return (nargs == 1 && fe->funcresulttype == TIMESTAMPOID &&
+				exprType((Node *) linitial(fe->args)) == DATEOID);
+
+	/* All the string functions take a text first */
+	if (nargs < 1 || exprType((Node *) linitial(fe->args)) != TEXTOID)
+		return false;
 
-	if (join_info->outerrel_relid > 0)
+	if (strcmp(funcname, "lower") == 0 ||
+		strcmp(funcname, "upper") == 0)
+		return (nargs == 1 && OidIsValid(fe->inputcollid) &&
+				lc_ctype_is_c(fe->inputcollid));
+
+	if (strcmp(funcname, "length") == 0 ||
+		strcmp(funcname, "char_length") == 0 ||
+		strcmp(funcname, "character_length") == 0)
+		return (nargs == 1 && fe->funcresulttype == INT4OID);
+
+	if (strcmp(funcname, "substring") == 0 ||
+		strcmp(funcname, "substr") == 0)
 	{
-		rte_o = exec_rt_fetch(join_info->outerrel_relid + context->rte_index_offset, context->estate);
-		context->rel_oid = rte_o->relid;
-		context->rtindex = join_info->outerrel_relid;
+		Const	   *start;
+		Const	   *count;
 
-		initStringInfo(&buf);
-		rel = table_open(rte_o->relid, NoLock);
-		mongo_deparseRelation(&buf, rel);
-		table_close(rel, NoLock);
+		if (nargs != 2 && nargs != 3)
+			return false;
 
-		context->outerrel_name = pstrdup(buf.data);
-		join_info->outerrel_name = context->outerrel_name;
+		/* A start before the first character shortens the count */
+		start = (Const *) lsecond(fe->args);
+		if (!IsA(start, Const) || start->consttype != INT4OID ||
+			start->constisnull || DatumGetInt32(start->constvalue) < 1)
+			return false;
+
+		if (nargs == 3)
+		{
+			count = (Const *) lthird(fe->args);
+			if (!IsA(count, Const) || count->consttype != INT4OID ||
+				count->constisnull || DatumGetInt32(count->constvalue) < 0)
+				return false;
+		}
+
+		return true;
 	}
 
-	if (join_info->innerrel_relid > 0)
+	if (strcmp(funcname, "btrim") == 0 ||
+		strcmp(funcname, "ltrim") == 0 ||
+		strcmp(funcname, "rtrim") == 0)
 	{
-		rte_i = exec_rt_fetch(join_info->innerrel_relid + context->rte_index_offset, context->estate);
-		local_context.rel_oid = rte_i->relid;
-		local_context.rtindex = join_info->innerrel_relid;
-		context->inner_rtindex = join_info->innerrel_relid;
+		Const	   *chars;
 
-		if (rte_o)
-			resetStringInfo(&buf);
-		else
-			initStringInfo(&buf);
-		rel = table_open(rte_i->relid, NoLock);
-		mongo_deparseRelation(&buf, rel);
-		table_close(rel, NoLock);
+		if (nargs == 1)
+			return true;
+		if (nargs != 2)
+			return false;
 
-		context->innerel_name = pstrdup(buf.data);
-		join_info->innerel_name = context->innerel_name;
+		chars = (Const *) lsecond(fe->args);
+		return (IsA(chars, Const) && chars->consttype == TEXTOID &&
+				!chars->constisnull);
 	}
 
-	local_context.estate = context->estate;
-	local_context.conds_num = 0;
-	local_context.reloptkind = RELOPT_BASEREL;
-	local_context.scan_reloptkind = RELOPT_BASEREL;
-	local_context.target_ref_list = NIL;
-	local_context.has_groupClause = false;
-	local_context.has_grouping_agg = false;
-	local_context.bs_key = NULL;
-	local_context.need_aggexpr_syntax = true;
-	local_context.agg_ref_list = NIL;
-	local_context.count_boolexpr = 0;
-	local_context.innerel_name = NULL;
-	local_context.outerrel_name = NULL;
-	local_context.innerel_name_list = NIL;
-	local_context.is_join_expr = true;
-	local_context.inner_rtindex = 0;
-	local_context.inner_pipeline_ref_list = NIL;
-	local_context.is_in_grouping_clause = false;
-	local_context.rte_index_offset = 0;
+	return false;
+}
 
-	bsonAppendStartObject (pipeline, "0", &lookup_stage);
-	bsonAppendStartObject (&lookup_stage, "$lookup", &join_doc);
+/*
+ * mongo_is_datetime_type
+ *		Check whether the given type is a date/time or interval type.
+ */
+static bool
+mongo_is_datetime_type(Oid typid)
+{
+	switch (typid)
+	{
+		case DATEOID:
+		case TIMEOID:
+		case TIMETZOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+		case INTERVALOID:
+			return true;
+		default:
+			return false;
+	}
+}
 
-	/* From inner relation name: { from: "inner collection name" } */
-	bsonAppendUTF8(&join_doc, "from", buf.data);
+/*
+ * mongo_date_arith_ok
+ *		Check the operands of an arithmetic operator for date/time values.
+ *
+ * The only date/time arithmetic pushed down is a timestamp plus or minus an
+ * interval constant, which $dateAdd computes as PostgreSQL does: months
+ * first, then days, then the time in milliseconds.  Other arithmetic is
+ * left alone.  $dateAdd is only known from MongoDB 5.0 on, as given by
+ * svr_version.
+ */
+static bool
+mongo_date_arith_ok(OpExpr *oe, int svr_version)
+{
+	char	   *opname;
+	Node	   *larg = (Node *) linitial(oe->args);
+	Node	   *rarg = (Node *) lsecond(oe->args);
+	Node	   *interval;
+	Interval   *span;
+
+	if (!mongo_is_datetime_type(oe->opresulttype) &&
+		!mongo_is_datetime_type(exprType(larg)) &&
+		!mongo_is_datetime_type(exprType(rarg)))
+		return true;
 
-	/* Build "let" object document */
-	bsonAppendStartObject (&join_doc, "let", &let_doc);
-	/*
-	 * Pull out Columns in joinclauses which are column that belongs to
-	 * outer relation. These columns are passed to pipeline stage.
-	 */
-	foreach(lc, join_info->joinclauses)
-	{
-		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
-		List *var_list;
-		ListCell *var_cell;
-		mongo_aggref_ref *agg_ref = NULL;
+	if (oe->opresulttype != TIMESTAMPOID || svr_version < 500)
+		return false;
 
-		var_list = pull_var_clause((Node *) rinfo->clause, PVC_RECURSE_PLACEHOLDERS);
-		foreach(var_cell, var_list)
-		{
-			RangeTblEntry *rte = NULL;
-			Var *var = (Var *) lfirst(var_cell);
-			char *ref_var_outer;
-			char *col_name;
+	opname = get_opname(oe->opno);
+	if (strcmp(opname, "+") == 0 && exprType(larg) == INTERVALOID)
+		interval = larg;
+	else if ((strcmp(opname, "+") == 0 || strcmp(opname, "-") == 0) &&
+			 exprType(larg) == TIMESTAMPOID)
+		interval = rarg;
+	else
+		return false;
 
-			/* Using Var node that belong to outer to create "let" object */
-			if (join_info->innerrel_relid != 0 &&
-				var->varno == join_info->innerrel_relid)
-				continue;
+	if (!IsA(interval, Const) || ((Const *) interval)->constisnull)
+		return false;
 
-			/*
-			 * Build reference column name for "let".
-			 * Using varattno as reference index.
-			 */
-			rte = exec_rt_fetch(var->varno + context->rte_index_offset, context->estate);
-			col_name = get_attname(rte->relid, var->varattno, false);
-			col_name = psprintf("$%s", col_name);
-			ref_var_outer = psprintf("ref%d", var->varattno);
-			bsonAppendUTF8(&let_doc, ref_var_outer, col_name);
+	/* MongoDB dates have a precision of milliseconds */
+	span = DatumGetIntervalP(((Const *) interval)->constvalue);
 
-			agg_ref = palloc0(sizeof(mongo_aggref_ref));
-			agg_ref->expr = (Expr *)var;
-			agg_ref->ref_target = psprintf("$ref%d", var->varattno);
+	return (span->time % 1000 == 0);
+}
 
-			local_context.agg_ref_list = lappend(local_context.agg_ref_list, agg_ref);
-		}
-	}
-	bsonAppendFinishObject (&join_doc, &let_doc);
+/*
+ * mongo_text_op_ok
+ *		Check the operands of an arithmetic operator for text values.
+ *
+ * The only arithmetic on text is the concatenation of two text values, which
+ * $concat computes as PostgreSQL does, a null input giving null.
+ */
+static bool
+mongo_text_op_ok(OpExpr *oe)
+{
+	ListCell   *lc;
+	bool		is_text = false;
+	bool		is_concat = (strcmp(get_opname(oe->opno), "||") == 0);
 
-	/* Rebuild plannerInfo for inner relation */
-	plannerInfo_inner = (MongoPlanerInfo *) palloc0(sizeof(MongoPlanerInfo));
-	foreach(lc, tlist)
+	foreach(lc, oe->args)
 	{
-		Node *node = (Node *)lfirst(lc);
-		Expr *expr = (Expr *) node;
-
-		if (IsA(node, TargetEntry))
-			expr = ((TargetEntry *)node)->expr;
-
-		if (IsA(expr, Var))
-		{
-			Var *var = (Var *)expr;
+		Oid			typid = exprType((Node *) lfirst(lc));
 
-			if (var->varno == join_info->innerrel_relid)
-			{
-				mongo_target_ref *target_ref = palloc0(sizeof(mongo_target_ref));
-				plannerInfo_inner->tlist = add_to_flat_tlist(plannerInfo_inner->tlist, list_make1(expr));
-
-				target_ref->expr = expr;
-				target_ref->is_group_target = false;
-				target_ref->target_idx = i;
-				local_context.target_ref_list = lappend(local_context.target_ref_list, target_ref);
-			}
-		}
-		i++;
+		if (typid == TEXTOID)
+			is_text = true;
+		else if (is_concat || typid == VARCHAROID || typid == BPCHAROID ||
+				 typid == NAMEOID)
+			return false;
 	}
 
-	/* Save inner reference list for main query to build inner grouping target */
-	context->inner_pipeline_ref_list = local_context.target_ref_list;
+	if (is_concat)
+		return (is_text && oe->opresulttype == TEXTOID);
 
-	plannerInfo_inner->reloptkind = RELOPT_BASEREL;
-	plannerInfo_inner->scan_reloptkind = RELOPT_BASEREL;
-	plannerInfo_inner->rtindex = join_info->innerrel_relid;
-	plannerInfo_inner->remote_exprs = join_info->joinclauses;
+	return !is_text;
+}
 
-	/* Build sub-pipeline */
-	mongo_aggregate_pipeline_query(context->estate, tupdesc, plannerInfo_inner, &local_context, &join_doc);
+/*
+ * mongo_regex_op_ok
+ *		Check whether a pattern matching operator can be pushed down.
+ *
+ * The left operand is a text expression, the pattern a constant that
+ * mongo_get_regex_pattern can translate.
+ */
+static bool
+mongo_regex_op_ok(OpExpr *oe)
+{
+	const char *options;
+	bool		is_negated;
+	bool		is_exact;
+	Node	   *pattern;
 
-	/* Build "as" */
-	bsonAppendUTF8(&join_doc, "as", buf.data);
+	if (list_length(oe->args) != 2 ||
+		exprType((Node *) linitial(oe->args)) != TEXTOID)
+		return false;
 
-	bsonAppendFinishObject (&lookup_stage, &join_doc);
-	bsonAppendFinishObject (pipeline, &lookup_stage);
+	pattern = (Node *) lsecond(oe->args);
+	if (!IsA(pattern, Const) || ((Const *) pattern)->constisnull ||
+		((Const *) pattern)->consttype != TEXTOID)
+		return false;
+
+	return (mongo_get_regex_pattern(oe, &options, &is_negated, &is_exact) != NULL);
 }
 
 /*
- * Building "$group" stage".
+ * mongo_get_regex_pattern
+ *		Translate the pattern of a LIKE, ILIKE or regular expression operator
+ *		into a MongoDB regular expression, or return NULL if it cannot be.
+ *
+ * A LIKE pattern is anchored at the start, and at the end unless it ends with
+ * "%", so that "abc%" becomes the prefix expression "^abc", for which MongoDB
+ * scans a range of an index.  A LIKE pattern without wildcards is returned as
+ * it is, with *is_exact set, to be compared by equality.
+ *
+ * A POSIX regular expression is passed as it is, but for the escapes and
+ * constructs that differ in PCRE.  "$" becomes "\z", which matches at the end
+ * only, like in PostgreSQL.  Dots match newlines in PostgreSQL, hence the "s"
+ * option; the "i" option is for the case-insensitive operators.
  */
-static void mongo_append_grouping_doc(TupleDesc tupdesc,
-									  BSON *pipeline,
-									  MongoPlanerInfo *plannerInfo,
-									  qdoc_expr_cxt *context)
+static char *
+mongo_get_regex_pattern(OpExpr *oe, const char **options, bool *is_negated,
+						bool *is_exact)
 {
-	BSON	group_stage, group_tlist, col_group;
-	List	*aggref_tlist = NIL;
-	ListCell   *lc;
-	int		i = 0;
+	char	   *opname = get_opname(oe->opno);
+	char	   *pattern = TextDatumGetCString(((Const *) lsecond(oe->args))->constvalue);
+	bool		is_like = (strstr(opname, "~~") != NULL);
+	bool		is_icase = (opname[strlen(opname) - 1] == '*');
+	bool		in_bracket = false;
+	StringInfoData buf;
+	char	   *p;
 
-	Assert (plannerInfo->reloptkind == RELOPT_UPPER_REL ||
-			plannerInfo->reloptkind == RELOPT_OTHER_UPPER_REL);
+	*is_negated = (opname[0] == '!');
+	*is_exact = false;
+	*options = is_icase ? "si" : "s";
 
-	bsonAppendStartObject (pipeline, "0", &group_stage);
-	bsonAppendStartObject (&group_stage, "$group", &group_tlist);
+	initStringInfo(&buf);
 
-	bsonAppendStartObject (&group_tlist, "_id", &col_group);
-	foreach(lc, plannerInfo->tlist)
+	if (is_like)
 	{
-		TargetEntry *tle = lfirst_node(TargetEntry, lc);
-		Expr		*expr = (Expr *) tle->expr;
-		char		*ref_target;
+		bool		has_wildcard = false;
+		bool		has_dot = false;
+		bool		anchor_end = true;
+		StringInfoData literal;
 
-		/* Build sort group target in "_id" object */
-		if (context->has_groupClause && tle->ressortgroupref != 0)
-		{
-			mongo_target_ref *target_ref = palloc0(sizeof(mongo_target_ref));
-			mongo_aggref_ref *agg_ref = palloc0(sizeof(mongo_aggref_ref));
+		initStringInfo(&literal);
+		appendStringInfoChar(&buf, '^');
 
-			/* Build reference target in aggregation group likes: {"ref0: "$(expr)" } */
-			ref_target = psprintf("ref%d", i);
+		for (p = pattern; *p; p++)
+		{
+			char		c = *p;
 
-			context->bs_key = ref_target;
-			context->is_in_grouping_clause = true;
-			mongo_build_expr_doc(&col_group, expr, context);
-			context->bs_key = NULL;
-			context->is_in_grouping_clause = false;
+			if (c == '%')
+			{
+				has_wildcard = true;
+				/* A trailing "%" matches anything left */
+				if (p[1] == '\0')
+					anchor_end = false;
+				else
+				{
+					appendStringInfoString(&buf, ".*");
+					has_dot = true;
+				}
+				continue;
+			}
+			if (c == '_')
+			{
+				appendStringInfoChar(&buf, '.');
+				has_wildcard = has_dot = true;
+				continue;
+			}
+			if (c == '\\')
+			{
+				/* The pattern must not end with the escape character */
+				if (*++p == '\0')
+					return NULL;
+				c = *p;
+			}
 
-			target_ref->is_group_target = true;
-			target_ref->target_idx = i;
-			context->target_ref_list = lappend(context->target_ref_list, target_ref);
+			if (strchr("\\^$.|?*+()[]{}", c) != NULL)
+				appendStringInfoChar(&buf, '\\');
+			appendStringInfoChar(&buf, c);
+			appendStringInfoChar(&literal, c);
+		}
 
-			agg_ref->expr = expr;
-			agg_ref->ref_target = ref_target;
-			context->agg_ref_list = lappend(context->agg_ref_list, agg_ref);
+		if (!has_wildcard && !is_icase)
+		{
+			*is_exact = true;
+			return literal.data;
 		}
 
-		i++;
+		if (anchor_end)
+			appendStringInfoString(&buf, "\\z");
+
+		if (!has_dot)
+			*options = is_icase ? "i" : "";
+
+		return buf.data;
 	}
-	bsonAppendFinishObject (&group_tlist, &col_group);
 
-	i = 0;
-	foreach(lc, plannerInfo->tlist)
+	/* Directors and embedded options are particular to PostgreSQL */
+	if (strncmp(pattern, "***", 3) == 0)
+		return NULL;
+
+	for (p = pattern; *p; p++)
 	{
-		TargetEntry *tle = lfirst_node(TargetEntry, lc);
-		Expr		*expr = (Expr *) tle->expr;
-		char		*ref_target;
+		char		c = *p;
 
-		/* Build non - sort group target */
-		if (!context->has_groupClause || tle->ressortgroupref == 0)
+		/* A bracket expression is left alone, but for its escapes */
+		if (in_bracket)
 		{
-			mongo_target_ref *target_ref = palloc0(sizeof(mongo_target_ref));
+			if (c == '[' && (p[1] == '.' || p[1] == '='))
+				return NULL;
+			if (c == '[' && p[1] == ':')
+			{
+				char	   *end = strstr(p, ":]");
 
-			/* Build reference target in aggregation group likes: {"ref0: "$(expr)" } */
-			ref_target = psprintf("ref%d", i);
+				if (end == NULL)
+					return NULL;
+				appendBinaryStringInfo(&buf, p, end + 2 - p);
+				p = end + 1;
+				continue;
+			}
+			if (c == ']')
+				in_bracket = false;
+		}
+		else if (c == '[')
+		{
+			in_bracket = true;
+			appendStringInfoChar(&buf, c);
+			/* A leading "]" is a member */
+			if (p[1] == '^')
+				appendStringInfoChar(&buf, *++p);
+			if (p[1] == ']')
+				appendStringInfoChar(&buf, *++p);
+			continue;
+		}
 
-			context->bs_key = ref_target;
-			mongo_build_expr_doc(&group_tlist, expr, context);
-			context->bs_key = NULL;
+		if (c == '\\')
+		{
+			c = *++p;
+			if (c == '\0')
+				return NULL;
 
-			target_ref->is_group_target = false;
-			target_ref->target_idx = i;
-			context->target_ref_list = lappend(context->target_ref_list, target_ref);
+			/* Class shorthands, newline and tab are alike, \b is not */
+			if (((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+				 (c >= 'a' && c <= 'z')) && strchr("dDsSwWnt", c) == NULL)
+				return NULL;
+
+			appendStringInfoChar(&buf, '\\');
+			appendStringInfoChar(&buf, c);
+			continue;
 		}
-		i++;
+
+		if (in_bracket)
+		{
+			appendStringInfoChar(&buf, c);
+			continue;
+		}
+
+		if (c == '(' && p[1] == '?' && p[2] != ':')
+			return NULL;
+
+		if (c == '$')
+			appendStringInfoString(&buf, "\\z");
+		else
+			appendStringInfoChar(&buf, c);
 	}
 
-	/*
-	 * Extract and append aggregate function in remote
-	 * conditions of HAVING to target list
-	 */
-	foreach(lc, plannerInfo->having_quals)
-	{
-		List		*agglist;
-		ListCell	*aggcell;
-		Expr	   *expr = (Expr *) lfirst(lc);
+	return buf.data;
+}
 
-		/* Pull out aggregate functions */
-		agglist = mongo_pull_func_clause((Node *) expr);
+/*
+ * mongo_bool_column_ok
+ *		Check whether a condition is a boolean column of the scanned base
+ *		relation.
+ *
+ * Such a condition is a test of the column for true or false, which is built
+ * in query syntax.  The columns of a join or of a grouping are not tested.
+ */
+static bool
+mongo_bool_column_ok(foreign_glob_cxt *glob_cxt, Node *node)
+{
+	Var		   *var = (Var *) node;
 
-		foreach(aggcell, agglist)
-		{
-			expr = (Expr *) lfirst(aggcell);
+	if (!IsA(node, Var) || !IS_SIMPLE_REL(glob_cxt->foreignrel))
+		return false;
 
-			if (!list_member(aggref_tlist, expr))
-				aggref_tlist = lappend(aggref_tlist, expr);
-		}
-	}
+	return (var->vartype == BOOLOID && var->varattno > 0 &&
+			var->varlevelsup == 0 &&
+			bms_is_member(var->varno, glob_cxt->relids));
+}
 
-	i = list_length(context->target_ref_list);
-	/* Build reference group expression for HAVING clause */
-	foreach(lc, aggref_tlist)
-	{
-		Expr		*expr = (Expr *) lfirst(lc);
-		mongo_aggref_ref *agg_ref = palloc0(sizeof(mongo_aggref_ref));
+/*
+ * mongo_conditional_expr_ok
+ *		Check whether a CASE, COALESCE, NULLIF, GREATEST or LEAST expression
+ *		can be computed by a MongoDB aggregate expression.
+ *
+ * The expression is computed on the documents, so it must not contain an
+ * aggregate; the aggregates of such an expression are pushed down by
+ * themselves and the expression is computed locally.  A boolean expression
+ * is not pushed down, as it would be a condition of its own, nor are the
+ * join clauses.
+ */
+static bool
+mongo_conditional_expr_ok(foreign_glob_cxt *glob_cxt, Node *node)
+{
+	if (IS_JOIN_REL(glob_cxt->foreignrel))
+		return false;
 
-		/* Build reference target in aggregation group likes: {"ref0: {"$avg": "$c1" } */
-		agg_ref->expr = expr;
-		agg_ref->ref_target = psprintf("ref%d", i);
+	if (exprType(node) == BOOLOID)
+		return false;
 
-		context->bs_key = agg_ref->ref_target;
-		mongo_build_expr_doc(&group_tlist, expr, context);
-		context->bs_key = NULL;
+	return (mongo_pull_func_clause(node) == NIL);
+}
 
-		context->agg_ref_list = lappend(context->agg_ref_list, agg_ref);
+/*
+ * mongo_case_cond_ok
+ *		Check whether a condition of CASE can be evaluated by "$switch".
+ *
+ * MongoDB orders null before any other value, so a comparison with null may
+ * be true there.  The comparisons are built along with a check that their
+ * operands are not null, which makes a null condition false, as CASE takes
+ * it.  That holds for AND and OR of them, but not under NOT.
+ */
+static bool
+mongo_case_cond_ok(Node *cond)
+{
+	ListCell   *lc;
 
-		i++;
+	switch (nodeTag(cond))
+	{
+		case T_BoolExpr:
+			if (((BoolExpr *) cond)->boolop == NOT_EXPR)
+				return false;
+			foreach(lc, ((BoolExpr *) cond)->args)
+			{
+				if (!mongo_case_cond_ok((Node *) lfirst(lc)))
+					return false;
+			}
+			return true;
+		case T_OpExpr:
+			switch (mongo_validateOperatorName(((OpExpr *) cond)->opno,
+											   NULL, NULL))
+			{
+				case OP_CONDITIONAL:
+				case OP_REGEX:
+					return true;
+				default:
+					return false;
+			}
+		case T_NullTest:
+			return true;
+		default:
+			return false;
 	}
-
-	bsonAppendFinishObject (&group_stage, &group_tlist);
-	bsonAppendFinishObject (pipeline, &group_stage);
 }
 
 /*
- * Building "$project" stage for targets list.
+ * mongo_get_date_trunc_unit
+ *		Get the unit of $dateTrunc for the unit name of date_trunc, or NULL.
  */
-static void mongo_append_target_list_doc(TupleDesc tupdesc,
-										 BSON *pipeline,
-										 MongoPlanerInfo *plannerInfo,
-										 qdoc_expr_cxt *context)
+static const char *
+mongo_get_date_trunc_unit(Const *c)
 {
-	BSON	project_stage, tlist_doc;
-	ListCell	*lc;
-	bool	is_first = true;
-	List		*options;
+	static const char *units[] =
+	{
+		"second", "minute", "hour", "day", "week", "month", "quarter", "year",
+		NULL
+	};
+	char	   *unit;
+	int			i;
 
-	plannerInfo->retrieved_attrs = NIL;
+	if (c->constisnull || c->consttype != TEXTOID)
+		return NULL;
 
-	if (plannerInfo->reloptkind != RELOPT_UPPER_REL &&
-		plannerInfo->reloptkind != RELOPT_OTHER_UPPER_REL)
+	unit = TextDatumGetCString(c->constvalue);
+	for (i = 0; units[i] != NULL; i++)
 	{
-		if (plannerInfo->tlist != NIL)
-		{
-			char	   *ref_target = NULL;
-			int			i = 0, ref_index = 0;
+		if (pg_strcasecmp(unit, units[i]) == 0)
+			return units[i];
+	}
 
-			/* Build target list contains jsonb arrow operator */
-			foreach(lc, plannerInfo->tlist)
-			{
-				Expr *expr = ((TargetEntry *)lfirst(lc))->expr;
-				ListCell *tc;
+	return NULL;
+}
 
-				ref_index = i;
+/*
+ * mongo_get_date_part_operator
+ *		Get the MongoDB operator for the field name of date_part, or NULL.
+ *
+ * The fields without an operator of their own are computed from others, see
+ * mongo_build_funcexpr_doc.
+ */
+static const char *
+mongo_get_date_part_operator(Const *c)
+{
+	typedef struct
+	{
+		const char *field;		/* Field name of date_part */
+		const char *op_name;	/* MongoDB operator */
+	} date_part_field;
+	static date_part_field fieldMappings[] =
+	{
+		{"year",			"$year"			},
+		{"quarter",			"$month"		},
+		{"month",			"$month"		},
+		{"week",			"$isoWeek"		},
+		{"day",				"$dayOfMonth"	},
+		{"dow",				"$dayOfWeek"	},
+		{"isodow",			"$isoDayOfWeek"	},
+		{"doy",				"$dayOfYear"	},
+		{"isoyear",			"$isoWeekYear"	},
+		{"hour",			"$hour"			},
+		{"minute",			"$minute"		},
+		{"second",			"$second"		},
+		{"milliseconds",	"$second"		},
+		{"epoch",			"$toLong"		},
+		{NULL,				NULL			},
+	};
+	char	   *field;
+	int			i;
 
-				foreach(tc, context->target_ref_list)
-				{
-					mongo_target_ref *target_ref = (mongo_target_ref *)lfirst(tc);
+	if (c->constisnull || c->consttype != TEXTOID)
+		return NULL;
 
-					if (equal(expr, target_ref->expr))
-					{
-						ref_index = target_ref->target_idx;
-						break;
-					}
-				}
-
-				if (is_first)
-				{
-					bsonAppendStartObject (pipeline, "0", &project_stage);
-					bsonAppendStartObject (&project_stage, "$project", &tlist_doc);
-					is_first = false;
-				}
-
-				/* Build reference target in aggregation group */
-				ref_target = psprintf("ref%d", ref_index);
-
-				context->bs_key = ref_target;
-				mongo_build_expr_doc(&tlist_doc, expr, context);
-				context->bs_key = NULL;
-				pfree(ref_target);
-
-				plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, ref_index + 1);
-				i++;
-			}
-		}
-		else
-		{
-			Relation	rel = table_open(context->rel_oid, NoLock);
-			bool		have_wholerow;
-			int			i = 0;
-
-			/*
-			* Identify which attributes will need to be retrieved from the remote
-			* server.  These include all attrs needed for joins or final output, plus
-			* all attrs used in the local_conds.  (Note: if we end up using a
-			* parameterized scan, it's possible that some of the join clauses will be
-			* sent to the remote and thus we wouldn't really need to retrieve the
-			* columns used in them.  Doesn't seem worth detecting that case though.)
-			*/
-			plannerInfo->attrs_used = NULL;
-			pull_varattnos((Node *)plannerInfo->ptarget_exprs, plannerInfo->rtindex,
-							&plannerInfo->attrs_used);
-			foreach(lc, plannerInfo->local_exprs)
-			{
-				Expr	   *expr = (Expr *) lfirst(lc);
-
-				/* Extract clause from RestrictInfo, if required */
-				if (IsA(expr, RestrictInfo))
-					expr = ((RestrictInfo *) expr)->clause;
-
-				pull_varattnos((Node *) expr, plannerInfo->rtindex,
-							&plannerInfo->attrs_used);
-			}
-
-			/* If there's a whole-row reference, we'll need all the columns. */
-			have_wholerow = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber,
-										plannerInfo->attrs_used);
-
-			for (i = 1; i <= tupdesc->natts; i++)
-			{
-				Form_pg_attribute attr = TupleDescAttr(tupdesc, i - 1);
+	field = TextDatumGetCString(c->constvalue);
+	for (i = 0; fieldMappings[i].field != NULL; i++)
+	{
+		if (pg_strcasecmp(field, fieldMappings[i].field) == 0)
+			return fieldMappings[i].op_name;
+	}
 
-				/* Ignore dropped attributes. */
-				if (attr->attisdropped)
-					continue;
+	return NULL;
+}
 
-				if (have_wholerow ||
-					bms_is_member(i - FirstLowInvalidHeapAttributeNumber,
-								plannerInfo->attrs_used))
-				{
-					/* Use attribute name or column_name option. */
-					char *colname = get_attname(context->rel_oid, i, false);
+/*
+ * mongo_is_simple_operand
+ *		Check whether an operand of a comparison can be written in a query on
+ *		a field: a column or a json field of the left, a value on the right.
+ */
+static bool
+mongo_is_simple_operand(Expr *expr)
+{
+	while (IsA(expr, RelabelType))
+		expr = ((RelabelType *) expr)->arg;
 
-					options = GetForeignColumnOptions(context->rel_oid, i);
+	if (IsA(expr, Var) || IsA(expr, Const) || IsA(expr, Param))
+		return true;
 
-					foreach(lc, options)
-					{
-						DefElem    *def = (DefElem *) lfirst(lc);
+	return (IsA(expr, OpExpr) &&
+			mongo_validateOperatorName(((OpExpr *) expr)->opno, NULL, NULL) == OP_JSON);
+}
 
-						if (strcmp(def->defname, "column_name") == 0)
-						{
-							colname = defGetString(def);
-							break;
-						}
-					}
+/*
+ * prepare_var_list_for_baserel
+ *		Build list of nodes corresponding to the attributes requested for given
+ *		base relation.
+ *
+ * The list contains Var nodes corresponding to the attributes specified in
+ * attrs_used. If whole-row reference is required, add Var nodes corresponding
+ * to all the attributes in the relation.
+ */
+static List *
+prepare_var_list_for_baserel(Oid relid, Index varno, Bitmapset *attrs_used)
+{
+	int			attno;
+	List	   *tlist = NIL;
+	Node	   *node;
+	bool		wholerow_requested = false;
+	Relation	relation;
+	TupleDesc	tupdesc;
 
-					if (strcmp(colname, "__doc") == 0)
-					{
-						/* Does not include __doc to target */
-						plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, i);
-						continue;
-					}
+	Assert(OidIsValid(relid));
 
-					if (is_first)
-					{
-						bsonAppendStartObject (pipeline, "0", &project_stage);
-						bsonAppendStartObject (&project_stage, "$project", &tlist_doc);
-						is_first = false;
-					}
+	/* Planner must have taken a lock, so request no lock here */
+#if PG_VERSION_NUM < 130000
+	relation = heap_open(relid, NoLock);
+#else
+	relation = table_open(relid, NoLock);
+#endif
 
-					/* Append column name */
-					bsonAppendInt32 (&tlist_doc, colname, 1);
+	tupdesc = RelationGetDescr(relation);
 
-					plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, i);
-				}
-			}
+	/* Is whole-row reference requested? */
+	wholerow_requested = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber,
+									   attrs_used);
 
-			table_close(rel, NoLock);
-		}
-	}
-	else
+	/* Handle user defined attributes first. */
+	for (attno = 1; attno <= tupdesc->natts; attno++)
 	{
-		char	   *ref_target = NULL;
-		int			i = 0;
-
-		foreach(lc, context->target_ref_list)
-		{
-			mongo_target_ref *target_ref = (mongo_target_ref *)lfirst(lc);
-
-			if (is_first)
-			{
-				bsonAppendStartObject (pipeline, "0", &project_stage);
-				bsonAppendStartObject (&project_stage, "$project", &tlist_doc);
-				is_first = false;
-			}
-
-			/* Append target reference */
-			/* Build reference target in aggregation group */
-			ref_target = psprintf("ref%d", target_ref->target_idx);
-			if (target_ref->is_group_target)
-			{
-				char *ref_target_path = psprintf("$_id.%s", ref_target);
+		Form_pg_attribute attr = TupleDescAttr(tupdesc, attno - 1);
 
-				bsonAppendUTF8 (&tlist_doc, ref_target, ref_target_path);
-				pfree(ref_target_path);
-			}
-			else
-			{
-				bsonAppendInt32 (&tlist_doc, ref_target, 1);
-			}
+		/* Ignore dropped attributes. */
+		if (attr->attisdropped)
+			continue;
 
-			pfree(ref_target);
+		/* For a required attribute create a Var node */
+		if (wholerow_requested ||
+			bms_is_member(attno - FirstLowInvalidHeapAttributeNumber,
+						  attrs_used))
+		{
+			node = (Node *) makeVar(varno, attno, attr->atttypid,
+									attr->atttypmod, attr->attcollation, 0);
+			tlist = lappend(tlist, node);
 
-			plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, i + 1);
-			i++;
 		}
 	}
 
-	if (is_first == false)
-	{
-		foreach(lc, context->innerel_name_list)
-		{
-			char *innerel_name = strVal(lfirst(lc));
-
-			bsonAppendInt32 (&tlist_doc, innerel_name, 1);
-		}
+#if PG_VERSION_NUM < 130000
+	heap_close(relation, NoLock);
+#else
+	table_close(relation, NoLock);
+#endif
 
-		bsonAppendFinishObject (&project_stage, &tlist_doc);
-		bsonAppendFinishObject (pipeline, &project_stage);
-	}
+	return tlist;
 }
 
 /*
- * Building "$match" stage for filter BSON query document.
+ * Build a pipeline query document based on aggregate API.
  */
-static void mongo_append_filter_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo, qdoc_expr_cxt *context)
+static void mongo_aggregate_pipeline_query(EState *estate, TupleDesc tupdesc,
+											MongoPlanerInfo *plannerInfo,
+											qdoc_expr_cxt *context,
+											BSON *queryDocument)
 {
-	BSON	match_stage, filter_conds, multi_cond_exprs, expr_stage;
-	List	*remote_exprs = NIL;
-	ListCell   *lc;
-	int			nestlevel;
-	bool		is_first = true;
-	int 		conds_num;
+	BSON	pipeline;
+	bool	sort_by_field;
+	bool	outer_filtered = false;
 
-	remote_exprs = plannerInfo->remote_exprs;
+	if (queryDocument == NULL)
+		return;
 
-	if (context->need_aggexpr_syntax)
+	/* Build pipeline */
+	bsonAppendStartArray (queryDocument, "pipeline", &pipeline);
+
+	/*
+	 * The conditions on the looked up documents alone are applied first, in
+	 * query syntax, so that MongoDB can use an index for them.
+	 */
+	if (plannerInfo->lookup_exprs)
 	{
-		context->bs_key = "$expr";
+		List	   *join_exprs = plannerInfo->remote_exprs;
 
-		if (context->reloptkind == RELOPT_UPPER_REL ||
-			context->reloptkind == RELOPT_OTHER_UPPER_REL)
-			remote_exprs = plannerInfo->having_quals;
+		plannerInfo->remote_exprs = plannerInfo->lookup_exprs;
+		context->need_aggexpr_syntax = false;
+		context->is_join_expr = false;
+		mongo_append_filter_doc(&pipeline, plannerInfo, context);
+		context->need_aggexpr_syntax = true;
+		context->is_join_expr = true;
+		plannerInfo->remote_exprs = join_exprs;
 	}
 
-	conds_num = list_length(remote_exprs);
-	context->conds_num = conds_num;
+	/* Scan rel must be join relation */
+	if (context->scan_reloptkind == RELOPT_JOINREL ||
+		context->scan_reloptkind == RELOPT_OTHER_JOINREL)
+	{
+		ListCell *lc;
 
-	bsonAppendStartObject (pipeline, "0", &match_stage);
-	bsonAppendStartObject (&match_stage, "$match", &filter_conds);
+		/*
+		 * The remote conditions of a join, but for a RIGHT OUTER join, are
+		 * those of its outermost relation.  Apply them before the "$lookup"
+		 * stages, so that fewer documents are joined.
+		 */
+		if (plannerInfo->remote_exprs && plannerInfo->jointype != JOIN_RIGHT)
+		{
+			MongoPlanerJoinInfo *join_info = (MongoPlanerJoinInfo *) linitial(plannerInfo->joininfo_list);
+			RangeTblEntry *rte;
 
-	/* Make sure any constants in the exprs are printed portably */
-	nestlevel = mongo_set_transmission_modes();
+			if (join_info->join_is_sub_query)
+				fetch_executor_relation_offset(join_info, context);
 
-	foreach(lc, remote_exprs)
-	{
-		Expr	   *expr = (Expr *) lfirst(lc);
+			rte = exec_rt_fetch(join_info->outerrel_relid + context->rte_index_offset,
+								estate);
+			context->rel_oid = rte->relid;
+			context->rtindex = join_info->outerrel_relid;
 
-		/* Extract clause from RestrictInfo, if required */
-		if (IsA(expr, RestrictInfo))
-			expr = ((RestrictInfo *) expr)->clause;
+			mongo_append_filter_doc(&pipeline, plannerInfo, context);
+			outer_filtered = true;
+		}
 
 		/*
-		 * If more than 1 condition use and for combine as:
-		 *		{ $and: [ { <expr1> }, { <expr2> } , ... , { <exprN> } ] }
+		 * Build "$lookup" object.  A nested join is left-deep, its innermost
+		 * join comes first, and each further inner relation is looked up
+		 * into the documents of the preceding ones.
 		 */
-		if (conds_num > 1 && is_first)
+		foreach(lc, plannerInfo->joininfo_list)
 		{
-			if (context->need_aggexpr_syntax)
+			MongoPlanerJoinInfo *join_info = (MongoPlanerJoinInfo *)lfirst(lc);
+			context->is_join_expr = true;
+
+			mongo_append_lookup_doc(tupdesc, &pipeline, plannerInfo->tlist,
+									plannerInfo->scan_reloptkind, join_info, context);
+			context->is_join_expr = false;
+
+			/*
+			 * A semi or anti join keeps the outer documents which have some
+			 * or no inner documents, by a "$match" stage on the looked up
+			 * array: { innerrel_name: { $ne: [] } }
+			 */
+			if (join_info->jointype == JOIN_SEMI ||
+				join_info->jointype == JOIN_ANTI)
 			{
-				bsonAppendStartObject (&filter_conds, "$expr", &expr_stage);
-				bsonAppendStartArray (&expr_stage, "$and", &multi_cond_exprs);
+				BSON match, match_doc, cond_doc, empty_array;
+
+				bsonAppendStartObject (&pipeline, "0", &match);
+				bsonAppendStartObject (&match, "$match", &match_doc);
+				bsonAppendStartObject (&match_doc, context->innerel_name, &cond_doc);
+				bsonAppendStartArray (&cond_doc,
+									  (join_info->jointype == JOIN_SEMI) ? "$ne" : "$eq",
+									  &empty_array);
+				bsonAppendFinishArray (&cond_doc, &empty_array);
+				bsonAppendFinishObject (&match_doc, &cond_doc);
+				bsonAppendFinishObject (&match, &match_doc);
+				bsonAppendFinishObject (&pipeline, &match);
 			}
-			else
-				bsonAppendStartArray (&filter_conds, "$and", &multi_cond_exprs);
-			mongo_build_expr_doc(&multi_cond_exprs, expr, context);
-		}
-		else if (conds_num > 1)
-			mongo_build_expr_doc(&multi_cond_exprs, expr, context);
-		else
-			mongo_build_expr_doc(&filter_conds, expr, context);
-
-		is_first = false;
-	}
+			/* Build $unwind stage */
+			else if (context->innerel_name)
+			{
+				BSON unwind, unwind_doc;
+				char *buf;
 
-	if (conds_num > 1)
-	{
-		if (context->need_aggexpr_syntax)
-		{
-			bsonAppendFinishArray (&expr_stage, &multi_cond_exprs);
-			bsonAppendFinishObject (&filter_conds, &expr_stage);
-		}
-		else
-			bsonAppendFinishArray (&filter_conds, &multi_cond_exprs);
-	}
+				bsonAppendStartObject (&pipeline, "0", &unwind);
+				bsonAppendStartObject (&unwind, "$unwind", &unwind_doc);
+				buf = psprintf("$%s", context->innerel_name);
 
-	mongo_reset_transmission_modes(nestlevel);
+				bsonAppendUTF8 (&unwind_doc, "path", buf);
+				if (join_info->jointype == JOIN_INNER)
+				{
+					bsonAppendBool (&unwind_doc, "preserveNullAndEmptyArrays", false);
+				}
+				else
+				{
+					bsonAppendBool (&unwind_doc, "preserveNullAndEmptyArrays", true);
+				}
 
-	if (context->need_aggexpr_syntax)
-		context->bs_key = NULL;
+				bsonAppendFinishObject (&unwind, &unwind_doc);
+				bsonAppendFinishObject (&pipeline, &unwind);
 
-	bsonAppendFinishObject (&match_stage, &filter_conds);
-	bsonAppendFinishObject (pipeline, &match_stage);
-}
+				context->innerel_name_list = lappend(context->innerel_name_list, makeString(context->innerel_name));
+				context->inner_rtindex_list = lappend_int(context->inner_rtindex_list, join_info->innerrel_relid);
+			}
+		}
+	}
 
-/*
- *	Build Boolean expression in BSON query document.
- */
-static void mongo_build_boolexpr_doc(BSON *qdoc, BoolExpr *node, qdoc_expr_cxt *context)
-{
-	BSON boolexpr_doc, op_doc, expr_stage, *ptr_qdoc;
-	char *op = NULL;		/* keep compiler quiet */
-	ListCell   *lc;
-	int		conds_num = context->conds_num;
+	/* Build filter document for WHERE clause */
+	if (plannerInfo->remote_exprs && !outer_filtered)
+		mongo_append_filter_doc(&pipeline, plannerInfo, context);
 
-	switch (node->boolop)
+	if (context->reloptkind == RELOPT_UPPER_REL ||
+		context->reloptkind == RELOPT_OTHER_UPPER_REL)
 	{
-		case AND_EXPR:
-			op = "$and";
-			break;
-		case OR_EXPR:
-			op = "$or";
-			break;
-		default :
-			return;
+		/*
+		 * Build "$group" object.
+		 *
+		 * For a join or upper relation the input tlist gives the list of
+		 * columns required to be fetched from the foreign server.
+		 */
+		if (plannerInfo->window_list)
+			mongo_append_window_doc(&pipeline, plannerInfo, context);
+		else if (context->has_grouping_agg)
+			mongo_append_grouping_doc(tupdesc, &pipeline, plannerInfo, context);
 	}
 
-	ptr_qdoc = qdoc;
-
-	if (context->need_aggexpr_syntax && context->count_boolexpr == 0)
+	/* Build filter document for HAVING clause */
+	if (plannerInfo->having_quals)
 	{
-		if (context->bs_key == NULL)
-			elog(ERROR, "Could not add a boolean expression");
-		bsonAppendStartObject(qdoc, context->bs_key, &expr_stage);
-		ptr_qdoc = &expr_stage;
+		context->need_aggexpr_syntax = true;
+		mongo_append_filter_doc(&pipeline, plannerInfo, context);
 	}
 
-	context->count_boolexpr++;
+	/*
+	 * A base relation scan is sorted on the stored fields, ahead of "$project",
+	 * so that MongoDB can use an index for the sort and coalesce it with the
+	 * LIMIT into a top-N.  Otherwise the sort keys are the projected targets.
+	 */
+	sort_by_field = (plannerInfo->sort_exprs != NIL && plannerInfo->tlist == NIL);
 
-	if (context->conds_num > 1)
+	if (sort_by_field)
 	{
-		bsonAppendStartObject(ptr_qdoc, op, &op_doc);
-		bsonAppendStartArray (&op_doc, op, &boolexpr_doc);
+		mongo_append_sort_doc(&pipeline, plannerInfo, context);
+		mongo_append_limit_doc(&pipeline, plannerInfo);
 	}
-	else
-		bsonAppendStartArray (ptr_qdoc, op, &boolexpr_doc);
 
-	foreach(lc, node->args)
-	{
-		context->conds_num++;
-		mongo_build_expr_doc(&boolexpr_doc, (Expr *) lfirst(lc), context);
-	}
-	context->conds_num = conds_num;
+	/* Build target list document */
+	mongo_append_target_list_doc(tupdesc, &pipeline, plannerInfo, context);
 
-	if (context->conds_num > 1)
+	if (!sort_by_field)
 	{
-		bsonAppendFinishArray (&op_doc, &boolexpr_doc);
-		bsonAppendFinishObject(ptr_qdoc, &op_doc);
+		if (plannerInfo->sort_exprs != NIL)
+			mongo_append_sort_doc(&pipeline, plannerInfo, context);
+		mongo_append_limit_doc(&pipeline, plannerInfo);
 	}
-	else
-		bsonAppendFinishArray (ptr_qdoc, &boolexpr_doc);
-
-	context->count_boolexpr--;
 
-	if (context->need_aggexpr_syntax && context->count_boolexpr == 0)
-		bsonAppendFinishObject(qdoc, &expr_stage);
+	bsonAppendFinishArray (queryDocument, &pipeline);
 
-	context->conds_num++;
+	if (!bsonFinish(queryDocument))
+	{
+#ifdef META_DRIVER
+		ereport(ERROR,
+				(errmsg("could not create document for query"),
+				 errhint("BSON flags: %d", queryDocument->flags)));
+#else
+		ereport(ERROR,
+				(errmsg("could not create document for query"),
+				 errhint("BSON error: %d", queryDocument->err)));
+#endif
+	}
 }
 
 /*
- *	Build operator expression in BSON query document.
+ * Building "$sort" stage for ORDER BY.
+ *
+ * MongoDB places null and missing fields before any other value.  Where the
+ * requested placement of nulls disagrees with that, a boolean key telling
+ * whether the value is null is added by "$addFields" and sorted on first.
  */
-static void mongo_build_opexpr_doc(BSON *qdoc, OpExpr *node, qdoc_expr_cxt *context)
+static void mongo_append_sort_doc(BSON *pipeline,
+								  MongoPlanerInfo *plannerInfo,
+								  qdoc_expr_cxt *context)
 {
-	MongoOperatorsSupport opkind;
-	Expr		*right_opr = NULL;
-	Expr		*left_opr = NULL;
-	Node		*n;
-	bool		is_switch_operator = false;
-	bool		need_switch_operator = false;
-	const char	*opName = NULL;
+	BSON		sort_stage, sort_doc;
+	List	   *fields = NIL;
+	ListCell   *lc_expr;
+	ListCell   *lc_opt;
+	ListCell   *lc_field;
+	bool		has_null_key = false;
+	int			i = 0;
+
+	forboth(lc_expr, plannerInfo->sort_exprs, lc_opt, plannerInfo->sort_options)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc_expr);
+		int			options = lfirst_int(lc_opt);
 
-	/* Retrieve information about the operator. */
-	opkind = mongo_validateOperatorName(node->opno, &opName, &is_switch_operator);
+		fields = lappend(fields, mongo_get_sort_field(expr, plannerInfo, context));
 
-	/* Sanity check. */
-	Assert(list_length(node->args) == 2);
+		if (MONGO_SORT_NEEDS_NULL_KEY(options))
+			has_null_key = true;
+	}
 
-	if (opkind == OP_JSON)
+	/* Build { $addFields: { "__null_sort0": { $eq: [{ $ifNull: ["$a", null] }, null] } } } */
+	if (has_null_key)
 	{
-		/* Deparse expression for nested json object */
-		deparse_expr_cxt deparse_context;
-		StringInfoData buf;
+		BSON		add_stage, add_doc;
 
-		initStringInfo(&buf);
+		bsonAppendStartObject (pipeline, "0", &add_stage);
+		bsonAppendStartObject (&add_stage, "$addFields", &add_doc);
 
-		deparse_context.buf = &buf;
-		deparse_context.qdoc_ctx = context;
+		forboth(lc_field, fields, lc_opt, plannerInfo->sort_options)
+		{
+			char	   *field = (char *) lfirst(lc_field);
+			BSON		eq_doc, eq_args, ifnull_doc, ifnull_args;
+			char	   *null_key;
+			char	   *field_path;
 
-		appendStringInfoChar(&buf, '$');
+			if (MONGO_SORT_NEEDS_NULL_KEY(lfirst_int(lc_opt)))
+			{
+				null_key = psprintf("__null_sort%d", i);
+				field_path = psprintf("$%s", field);
+
+				bsonAppendStartObject (&add_doc, null_key, &eq_doc);
+				bsonAppendStartArray (&eq_doc, "$eq", &eq_args);
+				bsonAppendStartObject (&eq_args, "0", &ifnull_doc);
+				bsonAppendStartArray (&ifnull_doc, "$ifNull", &ifnull_args);
+				bsonAppendUTF8 (&ifnull_args, "0", field_path);
+				bsonAppendNull (&ifnull_args, "1");
+				bsonAppendFinishArray (&ifnull_doc, &ifnull_args);
+				bsonAppendFinishObject (&eq_args, &ifnull_doc);
+				bsonAppendNull (&eq_args, "1");
+				bsonAppendFinishArray (&eq_doc, &eq_args);
+				bsonAppendFinishObject (&add_doc, &eq_doc);
+
+				pfree(field_path);
+				pfree(null_key);
+			}
+			i++;
+		}
 
-		mongo_deparseExpr((Expr *) node, &deparse_context);
+		bsonAppendFinishObject (&add_stage, &add_doc);
+		bsonAppendFinishObject (pipeline, &add_stage);
+	}
 
-		if (context->bs_key)
-			bsonAppendUTF8(qdoc, context->bs_key, buf.data);
-		else
-			elog(ERROR, "Could not add json nested object");
+	/* Build { $sort: { "__null_sort0": 1, "a": -1 } } */
+	bsonAppendStartObject (pipeline, "0", &sort_stage);
+	bsonAppendStartObject (&sort_stage, "$sort", &sort_doc);
 
-		return;
+	i = 0;
+	forboth(lc_field, fields, lc_opt, plannerInfo->sort_options)
+	{
+		char	   *field = (char *) lfirst(lc_field);
+		int			options = lfirst_int(lc_opt);
+
+		/* "true" sorts after "false", so ascending puts nulls last */
+		if (MONGO_SORT_NEEDS_NULL_KEY(options))
+		{
+			char	   *null_key = psprintf("__null_sort%d", i);
+
+			bsonAppendInt32 (&sort_doc, null_key,
+							 (options & MONGO_SORT_NULLS_FIRST) ? -1 : 1);
+			pfree(null_key);
+		}
+
+		bsonAppendInt32 (&sort_doc, field,
+						 (options & MONGO_SORT_DESC) ? -1 : 1);
+		i++;
 	}
 
-	/*
-	 * If right operand of a logic operator expression
-	 * is a column name, we need to switch left and right
-	 * operands with converted logic operator.
-	 */
-	n = (Node *) lfirst(list_tail(node->args));
-	if (is_switch_operator && IsA(n, Var))
+	bsonAppendFinishObject (&sort_stage, &sort_doc);
+	bsonAppendFinishObject (pipeline, &sort_stage);
+}
+
+/*
+ * Building "$skip" and "$limit" stages for LIMIT/OFFSET:
+ *		{$skip:1}, {$limit: 1}
+ */
+static void mongo_append_limit_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo)
+{
+	if (!plannerInfo->has_limit)
+		return;
+
+	if (plannerInfo->limitOffset)
 	{
-		need_switch_operator = true;
-		/* Get node for left operand */
-		left_opr = (Expr *)lfirst(list_tail(node->args));
+		BSON offset_doc;
 
-		/* Get node for right operand */
-		right_opr = (Expr *)lfirst(list_head(node->args));
+		bsonAppendStartObject (pipeline, "0", &offset_doc);
+		append_constant_value (&offset_doc, "$skip", (Const *)plannerInfo->limitOffset);
+		bsonAppendFinishObject (pipeline, &offset_doc);
 	}
-	else
+	if (plannerInfo->limitCount)
 	{
-		/* Get node for left operand */
-		left_opr = (Expr *)lfirst(list_head(node->args));
+		BSON limit_doc;
 
-		/* Get node for right operand */
-		right_opr = (Expr *)lfirst(list_tail(node->args));
+		bsonAppendStartObject (pipeline, "0", &limit_doc);
+		append_constant_value (&limit_doc, "$limit", (Const *)plannerInfo->limitCount);
+		bsonAppendFinishObject (pipeline, &limit_doc);
 	}
+}
 
-	if (opkind == OP_CONDITIONAL && !context->need_aggexpr_syntax)
+/*
+ * mongo_get_sort_field
+ *		Returns the name of the field holding the given sort expression.
+ *
+ * Without a target list, the expression is a column of the scanned
+ * collection.  Otherwise it is one of the "refN" fields built by "$project",
+ * or for a column of an inner relation of a join, the "refN" field of its
+ * nested documents, like "innerrel_name.refN".
+ */
+static char *
+mongo_get_sort_field(Expr *expr, MongoPlanerInfo *plannerInfo,
+					 qdoc_expr_cxt *context)
+{
+	ListCell   *lc;
+	int			i = 0;
+
+	if (plannerInfo->tlist == NIL)
 	{
-		BSON opexpr_doc, left_opr_doc;
-		char *leftopr_str = NULL;
+		Assert(IsA(expr, Var));
+		return mongo_get_column_name(context->rel_oid,
+									 ((Var *) expr)->varattno);
+	}
 
-		/* Left operand only can be field name or a nested json object */
-		if (IsA(left_opr, Var))
-			leftopr_str = get_attname(context->rel_oid, ((Var *) left_opr)->varattno, false);
-		else
+	foreach(lc, plannerInfo->tlist)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+
+		if (equal(tle->expr, expr))
 		{
-			/* Deparse expression for nested json object */
-			deparse_expr_cxt deparse_context;
-			StringInfoData buf;
+			char	   *inner_name = NULL;
 
-			initStringInfo(&buf);
+			if ((context->reloptkind == RELOPT_JOINREL ||
+				 context->reloptkind == RELOPT_OTHER_JOINREL) &&
+				IsA(expr, Var))
+				inner_name = mongo_get_inner_rel_name(((Var *) expr)->varno,
+													  context);
 
-			deparse_context.buf = &buf;
-			deparse_context.qdoc_ctx = context;
+			if (inner_name != NULL)
+				return psprintf("%s.ref%d", inner_name, i);
 
-			mongo_deparseExpr(left_opr, &deparse_context);
-			leftopr_str = pstrdup(deparse_context.buf->data);
+			return psprintf("ref%d", i);
 		}
+		i++;
+	}
 
-		/* Build BSON for comparing operator: {field: { opname: value}} */
-		if (context->conds_num > 1)
-		{
-			bsonAppendStartObject (qdoc, leftopr_str, &opexpr_doc);
-			bsonAppendStartObject(&opexpr_doc, leftopr_str, &left_opr_doc);
-		}
-		else
-			bsonAppendStartObject(qdoc, leftopr_str, &left_opr_doc);
+	elog(ERROR, "sort expression not found in the target list");
+	return NULL;				/* keep compiler quiet */
+}
 
-		opName = mongo_getSwitchedCmpOperatorName(opName, need_switch_operator);
-		append_constant_value(&left_opr_doc, opName, (Const *) right_opr);
+/*
+ * mongo_get_column_name
+ *		Returns the remote field name of a column, which is the column_name
+ *		option if specified, else the attribute name.
+ */
+static char *
+mongo_get_column_name(Oid relid, AttrNumber attnum)
+{
+	char	   *colname = get_attname(relid, attnum, false);
+	List	   *options = GetForeignColumnOptions(relid, attnum);
+	ListCell   *lc;
 
-		if (context->conds_num > 1)
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "column_name") == 0)
 		{
-			bsonAppendFinishObject(&opexpr_doc, &left_opr_doc);
-			bsonAppendFinishObject (qdoc, &opexpr_doc);
+			colname = defGetString(def);
+			break;
 		}
-		else
-			bsonAppendFinishObject(qdoc, &left_opr_doc);
 	}
-	else
-	{
-		BSON opexpr_doc, ref_doc, and_obj, and_op;
-		ListCell *lc;
 
-		/* Build reference target in aggregation group likes: {"bson_key": { "$add":["$c1", 1] } } */
-		if (context->bs_key == NULL)
-			elog(ERROR, "Could not add a operator expression");
+	return colname;
+}
 
-		if (context->is_join_expr)
-		{
-			/* Add $and object to prepare to add null check clause */
-			bsonAppendStartObject(qdoc, context->bs_key, &and_obj);
-			bsonAppendStartArray (&and_obj, "$and", &and_op);
-
-			bsonAppendStartObject (&and_op, context->bs_key, &ref_doc);
-			bsonAppendStartArray (&ref_doc, opName, &opexpr_doc);
-
-		}
-		else
-		{
-			bsonAppendStartObject (qdoc, context->bs_key, &ref_doc);
-			bsonAppendStartArray (&ref_doc, opName, &opexpr_doc);
-		}
+/*
+ * Building "$lookup" stage".
+ */
+static void mongo_append_lookup_doc(TupleDesc tupdesc,
+									  BSON *pipeline,
+									  List *tlist,
+									  RelOptKind scan_reloptkind,
+									  MongoPlanerJoinInfo *join_info,
+									  qdoc_expr_cxt *context)
+{
+	BSON lookup_stage, join_doc, let_doc;
+	RangeTblEntry *rte_o = NULL;
+	RangeTblEntry *rte_i = NULL;
+	Relation	rel;
+	StringInfoData buf;
+	ListCell *lc;
+	qdoc_expr_cxt local_context;
+	MongoPlanerInfo *plannerInfo_inner;
+	char *local_field;
+	char *foreign_field;
+	int i = 0;
 
-		foreach(lc, node->args)
-		{
-			Expr *expr = (Expr *) lfirst(lc);
-			ListCell *aggcell;
-			char *ref_key = NULL;
+	Assert (scan_reloptkind == RELOPT_JOINREL ||
+			scan_reloptkind == RELOPT_OTHER_JOINREL);
 
-			if (context->need_aggexpr_syntax && (IsA(expr, Aggref) || IsA(expr, Var) || IsA(expr, RelabelType)))
-			{
-				foreach(aggcell, context->agg_ref_list)
-				{
-					mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
+	if (join_info->join_is_sub_query)
+		fetch_executor_relation_offset(join_info, context);
 
-					if (IsA(expr, RelabelType))
-						expr = ((RelabelType *)expr)->arg;
+	if (join_info->outerrel_relid > 0)
+	{
+		rte_o = exec_rt_fetch(join_info->outerrel_relid + context->rte_index_offset, context->estate);
+		context->rel_oid = rte_o->relid;
+		context->rtindex = join_info->outerrel_relid;
 
-					/*
-					 * Check whether expression in HAVING is referenced by
-					 * aggref in grouping.
-					 */
-					if (equal(expr, agg_ref->expr))
-					{
-						/* Build reference key like "$refx" */
-						if (IsA(expr, Aggref))
-							ref_key = psprintf("$%s", agg_ref->ref_target);
-						else if (IsA(expr, Var))
-						{
-							if (context->has_groupClause)
-								ref_key = psprintf("$_id.%s", agg_ref->ref_target); /* reference from $group stage */
-							else
-								ref_key = psprintf("$%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
-						}
+		initStringInfo(&buf);
+		rel = table_open(rte_o->relid, NoLock);
+		mongo_deparseRelation(&buf, rel);
+		table_close(rel, NoLock);
 
-						break;
-					}
-				}
+		context->outerrel_name = pstrdup(buf.data);
+		join_info->outerrel_name = context->outerrel_name;
+	}
 
-				if (ref_key != NULL)
-					bsonAppendUTF8(&opexpr_doc, context->bs_key, ref_key);
-				else
-					mongo_build_expr_doc(&opexpr_doc, expr, context);
-			}
-			else
-				mongo_build_expr_doc(&opexpr_doc, expr, context);
-		}
+	if (join_info->innerrel_relid > 0)
+	{
+		rte_i = exec_rt_fetch(join_info->innerrel_relid + context->rte_index_offset, context->estate);
+		local_context.rel_oid = rte_i->relid;
+		local_context.rtindex = join_info->innerrel_relid;
 
-		/* Finish append the op experesion */
-		if (context->is_join_expr)
-		{
-			bsonAppendFinishArray (&ref_doc, &opexpr_doc);
-			bsonAppendFinishObject (&and_op, &ref_doc);
-		}
+		if (rte_o)
+			resetStringInfo(&buf);
 		else
-		{
-			bsonAppendFinishArray (&ref_doc, &opexpr_doc);
-			bsonAppendFinishObject (qdoc, &ref_doc);
-		}
+			initStringInfo(&buf);
+		rel = table_open(rte_i->relid, NoLock);
+		mongo_deparseRelation(&buf, rel);
+		table_close(rel, NoLock);
 
-		/* Add null check for JOIN condition */
-		if (context->is_join_expr)
+		/*
+		 * The inner documents are nested under the name of their collection.
+		 * In a nested join the same collection may be looked up again, then
+		 * its documents need another name.
+		 */
+		context->innerel_name = pstrdup(buf.data);
+		foreach(lc, context->innerel_name_list)
 		{
-			foreach(lc, node->args)
+			if (strcmp(strVal(lfirst(lc)), buf.data) == 0)
 			{
-				Expr *expr = (Expr *) lfirst(lc);
-				ListCell *aggcell;
-				char *ref_key = NULL;
-
-				foreach(aggcell, context->agg_ref_list)
-				{
-					mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
-
-					/* We ignore binary-compatible relabeling on both ends */
-					while (expr && IsA(expr, RelabelType))
-						expr = ((RelabelType *) expr)->arg;
-
-					if (equal(expr, agg_ref->expr))
-					{
-						/* Build reference key like "$refx" */
-						if (IsA(expr, Var))
-						{
-							ref_key = psprintf("$%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
-						}
-
-						break;
-					}
-				}
-
-				/* Add null check for reference from outer relation */
-				if (ref_key != NULL)
-					mongo_add_null_check_ref(ref_key, &and_op);
-				else
-					mongo_add_null_check_var((Var *)expr , &and_op, context->rel_oid);
+				context->innerel_name = psprintf("%s_%d", buf.data,
+												 list_length(context->innerel_name_list) + 1);
+				break;
 			}
-
-			bsonAppendFinishArray (&and_obj, &and_op);
-			bsonAppendFinishObject (qdoc, &and_obj);
 		}
+		join_info->innerel_name = context->innerel_name;
 	}
-}
 
-/*
- *	Build column name in BSON query document.
- */
-static void
-mongo_build_column_doc(BSON *qdoc, Var *node, qdoc_expr_cxt *context)
-{
-	char	   *colname = NULL;
+	local_context.estate = context->estate;
+	local_context.conds_num = 0;
+	local_context.reloptkind = RELOPT_BASEREL;
+	local_context.scan_reloptkind = RELOPT_BASEREL;
+	local_context.target_ref_list = NIL;
+	local_context.has_groupClause = false;
+	local_context.has_grouping_agg = false;
+	local_context.bs_key = NULL;
+	local_context.need_aggexpr_syntax = true;
+	local_context.agg_ref_list = NIL;
+	local_context.final_agg_list = NIL;
+	local_context.count_boolexpr = 0;
+	local_context.innerel_name = NULL;
+	local_context.outerrel_name = NULL;
+	local_context.innerel_name_list = NIL;
+	local_context.is_join_expr = true;
+	local_context.inner_rtindex_list = NIL;
+	local_context.inner_pipeline_ref_list = NIL;
+	local_context.is_in_grouping_clause = false;
+	local_context.rte_index_offset = 0;
 
-	if (node->varattno < 0)
-		elog(ERROR, "Could not build BSON query document for system attribute");
-	else if (node->varattno == 0)
-		elog(ERROR, "Could not build BSON query document for whole-row reference");
+	bsonAppendStartObject (pipeline, "0", &lookup_stage);
+	bsonAppendStartObject (&lookup_stage, "$lookup", &join_doc);
 
-	/* In grouping clause, it can contain column belong to inner relation */
-	if (!context->is_in_grouping_clause || !context->inner_pipeline_ref_list)
+	/* From inner relation name: { from: "inner collection name" } */
+	bsonAppendUTF8(&join_doc, "from", buf.data);
+
+	/*
+	 * An equality join also names the joined fields, so that the inner
+	 * documents are looked up by an index on the foreign field.  The join
+	 * clauses are still checked by the pipeline, because the field match
+	 * also matches null and missing values, and array elements.
+	 */
+	if (mongo_get_lookup_fields(join_info, tlist, context, &local_field,
+								&foreign_field))
 	{
-		if (context->rtindex != 0 && node->varno != context->rtindex)
-			return;
+		bsonAppendUTF8(&join_doc, "localField", local_field);
+		bsonAppendUTF8(&join_doc, "foreignField", foreign_field);
 	}
 
-	if (node->varno == context->inner_rtindex)
+	/* Build "let" object document */
+	bsonAppendStartObject (&join_doc, "let", &let_doc);
+	/*
+	 * Pull out Columns in joinclauses which are column that belongs to
+	 * outer relation. These columns are passed to pipeline stage.
+	 */
+	foreach(lc, join_info->joinclauses)
 	{
-		/* Grouping target belongs to inner relation */
-		ListCell	*lc;
-		int			inner_ref_index = -1;
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+		List *var_list;
+		ListCell *var_cell;
+		mongo_aggref_ref *agg_ref = NULL;
 
-		/* Find the inner reference for this column */
-		foreach(lc, context->inner_pipeline_ref_list)
+		var_list = pull_var_clause((Node *) rinfo->clause, PVC_RECURSE_PLACEHOLDERS);
+		foreach(var_cell, var_list)
 		{
-			mongo_target_ref *target_ref = (mongo_target_ref *)lfirst(lc);
+			RangeTblEntry *rte = NULL;
+			Var *var = (Var *) lfirst(var_cell);
+			char *ref_var_outer;
+			char *col_name;
+			char *inner_name;
 
-			if (equal(node, target_ref->expr))
+			/* Using Var node that belong to outer to create "let" object */
+			if (join_info->innerrel_relid != 0 &&
+				var->varno == join_info->innerrel_relid)
+				continue;
+
+			/*
+			 * Build reference column name for "let".
+			 * Using varattno as reference index.
+			 */
+			inner_name = mongo_get_inner_rel_name(var->varno, context);
+			if (inner_name == NULL)
 			{
-				inner_ref_index = target_ref->target_idx;
-				break;
+				rte = exec_rt_fetch(var->varno + context->rte_index_offset, context->estate);
+				col_name = get_attname(rte->relid, var->varattno, false);
+				col_name = psprintf("$%s", col_name);
+				ref_var_outer = psprintf("ref%d", var->varattno);
 			}
-		}
+			else
+			{
+				/*
+				 * Column of an inner relation of a lower join, which is
+				 * found in its nested documents like "$innerrel_name.refx".
+				 */
+				col_name = psprintf("$%s.ref%d", inner_name,
+									mongo_get_tlist_index(tlist, (Expr *) var));
+				ref_var_outer = psprintf("ref%d_%d", var->varno, var->varattno);
+			}
+			bsonAppendUTF8(&let_doc, ref_var_outer, col_name);
 
-		if (inner_ref_index == -1)
-			elog(ERROR, "Could not find the inner reference for grouping target\n");
+			agg_ref = palloc0(sizeof(mongo_aggref_ref));
+			agg_ref->expr = (Expr *)var;
+			agg_ref->ref_target = psprintf("$%s", ref_var_outer);
 
-		/* Build colname object like "$innerrel_name.column_ref_inner" */
-		colname = psprintf("$%s.ref%d", context->innerel_name, inner_ref_index);
+			local_context.agg_ref_list = lappend(local_context.agg_ref_list, agg_ref);
+		}
 	}
-	else
+	bsonAppendFinishObject (&join_doc, &let_doc);
+
+	/* Rebuild plannerInfo for inner relation */
+	plannerInfo_inner = (MongoPlanerInfo *) palloc0(sizeof(MongoPlanerInfo));
+	foreach(lc, tlist)
 	{
-		colname = get_attname(context->rel_oid, node->varattno, false);
+		Node *node = (Node *)lfirst(lc);
+		Expr *expr = (Expr *) node;
 
-		/* Build colname object like "$column" */
-		colname = psprintf("$%s", colname);
-	}
+		if (IsA(node, TargetEntry))
+			expr = ((TargetEntry *)node)->expr;
 
-	if (context->bs_key)
-		bsonAppendUTF8(qdoc, context->bs_key, colname);
-	else
-		elog(ERROR, "Could not add column object");
-}
-
-/*
- *	Build constant value in BSON query document.
- */
-static void
-mongo_build_const_doc(BSON *qdoc, Const *node, qdoc_expr_cxt *context)
-{
-	if (context->bs_key)
-		append_constant_value(qdoc, context->bs_key, node);
-	else
-		elog(ERROR, "Could not add constant value object");
-}
-
-/*
- *	Build aggregate function in BSON query document.
- */
-static void
-mongo_build_aggref_doc(BSON *qdoc, Aggref *node, qdoc_expr_cxt *context)
-{
-	BSON aggref_doc;
-	char *proname;
-
-	/* Only basic, non-split aggregation accepted. */
-	Assert(node->aggsplit == AGGSPLIT_SIMPLE);
+		if (IsA(expr, Var))
+		{
+			Var *var = (Var *)expr;
 
-	/* Get function name */
-	proname = get_func_name(node->aggfnoid);
-	if (proname == NULL)
-		elog(ERROR, "No such function name for function OID %u", node->aggfnoid);
+			if (var->varno == join_info->innerrel_relid)
+			{
+				mongo_target_ref *target_ref = palloc0(sizeof(mongo_target_ref));
+				plannerInfo_inner->tlist = add_to_flat_tlist(plannerInfo_inner->tlist, list_make1(expr));
 
-	/* Convert to MongoDB aggregate function */
-	if (strcmp(proname, "stddev_pop") == 0)
-		proname = "stdDevPop";
-	else if (strcmp(proname, "stddev") == 0 ||
-			 strcmp(proname, "stddev_samp") == 0)
-		proname = "stdDevSamp";
+				target_ref->expr = expr;
+				target_ref->is_group_target = false;
+				target_ref->target_idx = i;
+				local_context.target_ref_list = lappend(local_context.target_ref_list, target_ref);
+			}
+		}
+		i++;
+	}
 
-	/* Build reference target in aggregation group likes: {"ref0: "$avg" } */
-	if (context->bs_key == NULL)
-		elog(ERROR, "Could not add a aggregate function");
+	/* Save inner reference list for main query to build inner grouping target */
+	context->inner_pipeline_ref_list = list_concat(context->inner_pipeline_ref_list,
+												   local_context.target_ref_list);
 
-	bsonAppendStartObject (qdoc, context->bs_key, &aggref_doc);
+	plannerInfo_inner->reloptkind = RELOPT_BASEREL;
+	plannerInfo_inner->scan_reloptkind = RELOPT_BASEREL;
+	plannerInfo_inner->rtindex = join_info->innerrel_relid;
+	plannerInfo_inner->remote_exprs = join_info->joinclauses;
+	plannerInfo_inner->lookup_exprs = join_info->inner_remote_conds;
 
-	/* aggstar can be set only in zero-argument aggregates */
-	if (node->aggstar)
+	/* One matching inner document is enough for a semi or anti join */
+	if (join_info->jointype == JOIN_SEMI ||
+		join_info->jointype == JOIN_ANTI)
 	{
-		/*
-		 * Currently, we only support count(*).
-		 * This function is built by using "sum" function like:
-		 * 	{ "$sum" : 1 }
-		 */
-		if (strcmp(proname, "count") == 0)
-		{
-			bsonAppendInt32(&aggref_doc, "$sum", 1);
-		}
+		plannerInfo_inner->has_limit = true;
+		plannerInfo_inner->limitCount = (Node *) makeConst(INT4OID, -1, InvalidOid,
+														   sizeof(int32),
+														   Int32GetDatum(1),
+														   false, true);
 	}
-	else
-	{
-		TargetEntry *tle = NULL;
-		Node	   *n = NULL;
-		ListCell   *arg = NULL;
-		int			args_num = list_length(node->args);
 
-		/* Build function name in bson format like "$avg", "$sum" */
-		proname = psprintf("$%s", proname);
+	/* Build sub-pipeline */
+	mongo_aggregate_pipeline_query(context->estate, tupdesc, plannerInfo_inner, &local_context, &join_doc);
 
-		context->bs_key = proname;
-		if (args_num == 1)
-		{
-			tle = (TargetEntry *) lfirst(list_head(node->args));
-			n = (Node *) tle->expr;
+	/* Build "as", under the name the nested documents are referred to by */
+	bsonAppendUTF8(&join_doc, "as", (join_info->innerrel_relid > 0) ?
+				   context->innerel_name : buf.data);
 
-			/* Syntax: e.g. { $max: <expression> } */
-			mongo_build_expr_doc(&aggref_doc, (Expr *)n, context);
-		}
-		else
-		{
-			BSON args_doc;
+	bsonAppendFinishObject (&lookup_stage, &join_doc);
+	bsonAppendFinishObject (pipeline, &lookup_stage);
+}
 
-			/* Syntax: e.g. { $max: [ <expression1>, <expression2> ... ]  } */
-			bsonAppendStartArray (&aggref_doc, context->bs_key, &args_doc);
-			foreach(arg, node->args)
-			{
-				tle = (TargetEntry *) lfirst(arg);
-				n = (Node *) tle->expr;
+/*
+ * Building "$group" stage".
+ *
+ * Grouping sets are grouped each by a pipeline of its own in "$facet", and
+ * their rows are put together again, like:
+ *		{ $facet: { set0: [ { $group: { _id: { ref0: "$c1", ref1: "$c2" }, ... } } ],
+ *					set1: [ { $group: { _id: { ref0: "$c1" }, ... } } ] } },
+ *		{ $project: { __sets: { $concatArrays: ["$set0", "$set1"] } } },
+ *		{ $unwind: "$__sets" },
+ *		{ $replaceRoot: { newRoot: "$__sets" } }
+ * A grouping column left out of a set is missing from "_id", so it is
+ * returned as null.
+ */
+static void mongo_append_grouping_doc(TupleDesc tupdesc,
+									  BSON *pipeline,
+									  MongoPlanerInfo *plannerInfo,
+									  qdoc_expr_cxt *context)
+{
+	BSON		facet_stage, facet_doc;
+	BSON		project_stage, project_doc, sets_doc, sets_array;
+	BSON		unwind_stage, replace_stage, replace_doc;
+	List	   *target_ref_list = context->target_ref_list;
+	List	   *agg_ref_list = context->agg_ref_list;
+	List	   *final_agg_list = context->final_agg_list;
+	ListCell   *lc;
+	int			i = 0;
 
-				if (tle->resjunk)
-					continue;
+	Assert (plannerInfo->reloptkind == RELOPT_UPPER_REL ||
+			plannerInfo->reloptkind == RELOPT_OTHER_UPPER_REL);
 
-				mongo_build_expr_doc(&args_doc, (Expr *)n, context);
-			}
-			bsonAppendFinishArray (&aggref_doc, &args_doc);
-		}
-		context->bs_key = NULL;
+	if (plannerInfo->grouping_sets == NIL)
+	{
+		mongo_append_group_stages(pipeline, plannerInfo, context, NIL);
+		return;
 	}
 
-	bsonAppendFinishObject (qdoc, &aggref_doc);
-}
+	bsonAppendStartObject (pipeline, "0", &facet_stage);
+	bsonAppendStartObject (&facet_stage, "$facet", &facet_doc);
+	foreach(lc, plannerInfo->grouping_sets)
+	{
+		BSON		set_pipeline;
 
-/*
- *	Build RelabelType expression in BSON query document.
- *		Discard explicit cast type.
- */
-static void
-mongo_build_relabeltype_doc(BSON *qdoc, RelabelType *node, qdoc_expr_cxt *context)
-{
-	mongo_build_expr_doc(qdoc, node->arg, context);
+		/* Every set refers to the targets alike */
+		context->target_ref_list = target_ref_list;
+		context->agg_ref_list = agg_ref_list;
+		context->final_agg_list = final_agg_list;
+
+		bsonAppendStartArray (&facet_doc, psprintf("set%d", i++), &set_pipeline);
+		mongo_append_group_stages(&set_pipeline, plannerInfo, context,
+								  (List *) lfirst(lc));
+		bsonAppendFinishArray (&facet_doc, &set_pipeline);
+	}
+	bsonAppendFinishObject (&facet_stage, &facet_doc);
+	bsonAppendFinishObject (pipeline, &facet_stage);
+
+	bsonAppendStartObject (pipeline, "0", &project_stage);
+	bsonAppendStartObject (&project_stage, "$project", &project_doc);
+	bsonAppendStartObject (&project_doc, "__sets", &sets_doc);
+	bsonAppendStartArray (&sets_doc, "$concatArrays", &sets_array);
+	for (i = 0; i < list_length(plannerInfo->grouping_sets); i++)
+		bsonAppendUTF8 (&sets_array, psprintf("%d", i), psprintf("$set%d", i));
+	bsonAppendFinishArray (&sets_doc, &sets_array);
+	bsonAppendFinishObject (&project_doc, &sets_doc);
+	bsonAppendFinishObject (&project_stage, &project_doc);
+	bsonAppendFinishObject (pipeline, &project_stage);
+
+	bsonAppendStartObject (pipeline, "0", &unwind_stage);
+	bsonAppendUTF8 (&unwind_stage, "$unwind", "$__sets");
+	bsonAppendFinishObject (pipeline, &unwind_stage);
+
+	bsonAppendStartObject (pipeline, "0", &replace_stage);
+	bsonAppendStartObject (&replace_stage, "$replaceRoot", &replace_doc);
+	bsonAppendUTF8 (&replace_doc, "newRoot", "$__sets");
+	bsonAppendFinishObject (&replace_stage, &replace_doc);
+	bsonAppendFinishObject (pipeline, &replace_stage);
 }
 
 /*
- * Build IS [NOT] NULL expression query document, e.g:
- * 	c1 IS NULL is transformed by { eq: ["$c1", null] }
- * 	c1 IS NOT NULL is transformed by { ne: ["$c1", null] }
+ * Building "$group" stage and the stage finishing its aggregates, for the
+ * given grouping set or, when there are no grouping sets, the GROUP BY clause.
  */
 static void
-mongo_build_NullTest_doc(BSON *qdoc, NullTest *node, qdoc_expr_cxt *context)
+mongo_append_group_stages(BSON *pipeline, MongoPlanerInfo *plannerInfo,
+						  qdoc_expr_cxt *context, List *grouping_set)
 {
-	BSON nulltest_doc;
-	BSON op_doc;
-	const char* opname = NULL;
-	char *input_expr_str = NULL;
-
-	if (node->nulltesttype == IS_NULL)
-		opname = "$eq";
-	else
-		opname = "$ne";
+	BSON	group_stage, group_tlist, col_group;
+	List	*aggref_tlist = NIL;
+	ListCell   *lc;
+	int		i = 0;
 
-	/* Input expression only is field name. */
-	if (IsA(node->arg, Var))
-		input_expr_str = get_attname(context->rel_oid, ((Var *) node->arg)->varattno, false);
-	else
-		elog (ERROR, "Could not build BSON document for input expression of NullTest");
+	bsonAppendStartObject (pipeline, "0", &group_stage);
+	bsonAppendStartObject (&group_stage, "$group", &group_tlist);
 
-	if (context->need_aggexpr_syntax)
+	bsonAppendStartObject (&group_tlist, "_id", &col_group);
+	foreach(lc, plannerInfo->tlist)
 	{
-		ListCell *aggcell;
-		char *ref_key = NULL;
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		Expr		*expr = (Expr *) tle->expr;
+		char		*ref_target;
 
-		foreach(aggcell, context->agg_ref_list)
+		/* Build sort group target in "_id" object */
+		if (context->has_groupClause && tle->ressortgroupref != 0)
 		{
-			mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
+			mongo_target_ref *target_ref = palloc0(sizeof(mongo_target_ref));
+			mongo_aggref_ref *agg_ref = palloc0(sizeof(mongo_aggref_ref));
 
-			/*
-			 * Check whether expression in HAVING is referenced by
-			 * aggref in grouping.
-			 */
-			if (equal(node->arg, agg_ref->expr))
+			/* Build reference target in aggregation group likes: {"ref0: "$(expr)" } */
+			ref_target = psprintf("ref%d", i);
+
+			if (plannerInfo->grouping_sets == NIL ||
+				list_member_int(grouping_set, tle->ressortgroupref))
 			{
-				/* Build reference key like "$refx" */
-				ref_key = psprintf("%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
+				List	   *agg_ref_list = context->agg_ref_list;
 
-				break;
+				/* A key is computed on the documents, not on other keys */
+				context->agg_ref_list = NIL;
+				context->bs_key = ref_target;
+				context->is_in_grouping_clause = true;
+				mongo_build_expr_doc(&col_group, expr, context);
+				context->bs_key = NULL;
+				context->is_in_grouping_clause = false;
+				context->agg_ref_list = agg_ref_list;
 			}
+
+			target_ref->is_group_target = true;
+			target_ref->target_idx = i;
+			context->target_ref_list = lappend(context->target_ref_list, target_ref);
+
+			agg_ref->expr = expr;
+			agg_ref->ref_target = ref_target;
+			context->agg_ref_list = lappend(context->agg_ref_list, agg_ref);
 		}
 
-		if (ref_key != NULL)
-			input_expr_str = ref_key;
-		else
-			input_expr_str = psprintf("$%s", input_expr_str);
+		i++;
+	}
+	bsonAppendFinishObject (&group_tlist, &col_group);
 
-		bsonAppendStartObject(qdoc, "0", &nulltest_doc);
+	i = 0;
+	foreach(lc, plannerInfo->tlist)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		Expr		*expr = (Expr *) tle->expr;
+		char		*ref_target;
 
-		bsonAppendStartArray(&nulltest_doc, opname, &op_doc);
-		bsonAppendUTF8(&op_doc, "0", input_expr_str);
-		bsonAppendNull(&op_doc, "1");
+		/* Build non - sort group target */
+		if (!context->has_groupClause || tle->ressortgroupref == 0)
+		{
+			mongo_target_ref *target_ref = palloc0(sizeof(mongo_target_ref));
 
-		bsonAppendFinishArray(&nulltest_doc, &op_doc);
+			/* Build reference target in aggregation group likes: {"ref0: "$(expr)" } */
+			ref_target = psprintf("ref%d", i);
 
-		bsonAppendFinishObject(qdoc, &nulltest_doc);
+			context->bs_key = ref_target;
+			mongo_build_expr_doc(&group_tlist, expr, context);
+			context->bs_key = NULL;
+
+			target_ref->is_group_target = false;
+			target_ref->target_idx = i;
+			context->target_ref_list = lappend(context->target_ref_list, target_ref);
+		}
+		i++;
 	}
-	else
+
+	/*
+	 * Extract and append aggregate function in remote
+	 * conditions of HAVING to target list
+	 */
+	foreach(lc, plannerInfo->having_quals)
 	{
-		if (context->conds_num > 1)
-		{
-			bsonAppendStartObject(qdoc, "0", &nulltest_doc);
+		List		*agglist;
+		ListCell	*aggcell;
+		Expr	   *expr = (Expr *) lfirst(lc);
 
-			bsonAppendStartObject(&nulltest_doc, input_expr_str, &op_doc);
-			bsonAppendNull(&op_doc, opname);
-			bsonAppendFinishObject(&nulltest_doc, &op_doc);
+		/* Pull out aggregate functions */
+		agglist = mongo_pull_func_clause((Node *) expr);
 
-			bsonAppendFinishObject(qdoc, &nulltest_doc);
-		}
-		else
+		foreach(aggcell, agglist)
 		{
-			bsonAppendStartObject(qdoc, input_expr_str, &nulltest_doc);
-			bsonAppendNull(&nulltest_doc, opname);
-			bsonAppendFinishObject(qdoc, &nulltest_doc);
+			expr = (Expr *) lfirst(aggcell);
+
+			if (!list_member(aggref_tlist, expr))
+				aggref_tlist = lappend(aggref_tlist, expr);
 		}
 	}
-}
 
-/*
- * Deparse given ScalarArrayOpExpr expression.  To avoid problems
- * around priority of operations, we always parenthesize the arguments.
- */
-static void
-mongo_build_scalar_array_op_expr(BSON *qdoc, ScalarArrayOpExpr *node, qdoc_expr_cxt *context)
-{
-	Expr	   *arg1;
-	Expr	   *arg2;
-	List	   *const_list = NIL;
-	ListCell   *lc;
-	char	   *opname = NULL;
-	char	   *extval;
-	const char *mongo_opname = NULL;
-	char	   *input_expr_str = NULL;
-	char	   *ref_key = NULL;
-	BSON	   scalarArrayOpExpr_doc;
-	BSON	   op_doc;
-	int		   i = -1;
+	i = list_length(context->target_ref_list);
+	/* Build reference group expression for HAVING clause */
+	foreach(lc, aggref_tlist)
+	{
+		Expr		*expr = (Expr *) lfirst(lc);
+		mongo_aggref_ref *agg_ref = palloc0(sizeof(mongo_aggref_ref));
 
-	/* Sanity check. */
-	Assert(list_length(node->args) == 2);
+		/* Build reference target in aggregation group likes: {"ref0: {"$avg": "$c1" } */
+		agg_ref->expr = expr;
+		agg_ref->ref_target = psprintf("ref%d", i);
 
-	/* Get operator name */
-	opname = get_opname(node->opno);
-	if (opname == NULL)
-		elog(ERROR, "No such operator name for operator OID %u", node->opno);
+		context->bs_key = agg_ref->ref_target;
+		mongo_build_expr_doc(&group_tlist, expr, context);
+		context->bs_key = NULL;
+
+		context->agg_ref_list = lappend(context->agg_ref_list, agg_ref);
+
+		i++;
+	}
+
+	bsonAppendFinishObject (&group_stage, &group_tlist);
+	bsonAppendFinishObject (pipeline, &group_stage);
 
 	/*
-	 * Using $in for '= ANY'$ (similar with IN )
-	 * Using $nin for '<> ALL' (similar with NOT IN )
-	 * Using $all for '= ALL'
+	 * An aggregate function with DISTINCT collects the distinct values in the
+	 * "$group" stage.  Compute it from them in place, like:
+	 *		{ $addFields: { ref1: { $avg: "$ref1" } } }
+	 * and for count:
+	 *		{ $size: { $filter: { input: "$ref1", cond: { $ne: ["$$this", null] } } } }
+	 * A sum is null when there is no value:
+	 *		{ $cond: [{ $gt: [{ $size: ... }, 0] }, { $sum: "$ref1" }, null] }
+	 * The arrays collected for string_agg and ordered aggregates are finished
+	 * the same way.
 	 */
-	if (node->useOr == true)
-		mongo_opname = "$in";
-	else if (strcmp(opname, "<>") == 0)
-		mongo_opname = "$nin";
-	else if (strcmp(opname, "=") == 0)
-		mongo_opname = "$all";
+	if (context->final_agg_list)
+	{
+		BSON		fields_stage, fields_doc;
 
-	/* Get left and right argument for deparsing */
-	arg1 = linitial(node->args);
-	arg2 = lsecond(node->args);
+		bsonAppendStartObject (pipeline, "0", &fields_stage);
+		bsonAppendStartObject (&fields_stage, "$addFields", &fields_doc);
 
-	/* Parse scalar constant into array */
-	switch (nodeTag((Node *) arg2))
-	{
-		case T_Const:
+		foreach(lc, context->final_agg_list)
+		{
+			mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(lc);
+			Aggref	   *agg = (Aggref *) agg_ref->expr;
+			char	   *proname = get_func_name(agg->aggfnoid);
+			char	   *input = psprintf("$%s", agg_ref->ref_target);
+			BSON		agg_doc;
+
+			if (agg->aggsplit != AGGSPLIT_SIMPLE ||
+				(strcmp(proname, "sum") == 0 && !agg->aggdistinct))
 			{
-				StringInfoData	buf;
-				Const	   *c = (Const *) arg2;
-				const char *valptr;
-				Const	   *new_expr;
-				Oid			consttype = InvalidOid;
-				Datum		value;
-				bool		constisnull = c->constisnull;
-				bool		constbyval = c->constbyval;
-				PGFunction  func_addr = NULL;
-				Oid		    typoutput;
-				bool	    typIsVarlena;
+				mongo_append_partial_final_doc(&fields_doc, agg_ref->ref_target,
+											   agg);
+				continue;
+			}
 
-				initStringInfo(&buf);
-				i = -1;
+			if (!agg->aggdistinct)
+			{
+				mongo_append_collect_final_doc(&fields_doc, agg_ref->ref_target,
+											   agg, proname);
+				continue;
+			}
 
-				if (!c->constisnull)
-				{
-					getTypeOutputInfo(c->consttype,
-									  &typoutput, &typIsVarlena);
-					extval = OidOutputFunctionCall(typoutput, c->constvalue);
+			bsonAppendStartObject (&fields_doc, agg_ref->ref_target, &agg_doc);
+			if (strcmp(proname, "count") == 0)
+				mongo_append_value_count_doc(&agg_doc, "$size", input);
+			else if (strcmp(proname, "sum") == 0)
+			{
+				BSON		cond_args, gt_doc, gt_args, sum_doc;
+
+				bsonAppendStartArray (&agg_doc, "$cond", &cond_args);
+				bsonAppendStartObject (&cond_args, "0", &gt_doc);
+				bsonAppendStartArray (&gt_doc, "$gt", &gt_args);
+				bsonAppendStartObject (&gt_args, "0", &sum_doc);
+				mongo_append_value_count_doc(&sum_doc, "$size", input);
+				bsonAppendFinishObject (&gt_args, &sum_doc);
+				bsonAppendInt32 (&gt_args, "1", 0);
+				bsonAppendFinishArray (&gt_doc, &gt_args);
+				bsonAppendFinishObject (&cond_args, &gt_doc);
+				bsonAppendStartObject (&cond_args, "1", &sum_doc);
+				bsonAppendUTF8 (&sum_doc, "$sum", input);
+				bsonAppendFinishObject (&cond_args, &sum_doc);
+				bsonAppendNull (&cond_args, "2");
+				bsonAppendFinishArray (&agg_doc, &cond_args);
+			}
+			else
+				bsonAppendUTF8 (&agg_doc, mongo_get_aggregate_operator(proname),
+								input);
+			bsonAppendFinishObject (&fields_doc, &agg_doc);
+		}
 
-					/* Get contant type and function address */
-					mongo_get_func_info_scalar_array(c->consttype, &consttype, &func_addr);
+		bsonAppendFinishObject (&fields_stage, &fields_doc);
+		bsonAppendFinishObject (pipeline, &fields_stage);
+	}
+}
 
-					for (valptr = extval; *valptr; valptr++)
-					{
-						char		ch = *valptr;
+/*
+ * Building "$setWindowFields" stages for window functions.
+ *
+ * The plain targets and the sort keys of the windows are computed first, like:
+ *		{ $addFields: { ref0: "$c1", __win_sort0_0: "$c2",
+ *						__win_null0_0: { $lte: ["$c2", null] } } }
+ * then each window computes its functions, like:
+ *		{ $setWindowFields: { partitionBy: "$c1",
+ *							  sortBy: { __win_null0_0: 1, __win_sort0_0: 1 },
+ *							  output: { ref1: { $rank: {} } } } }
+ */
+static void
+mongo_append_window_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo,
+						qdoc_expr_cxt *context)
+{
+	BSON		fields_stage, fields_doc;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	bool		is_first = true;
+	ListCell   *lc;
+	int			i = 0;
 
-						i++;
+	context->need_aggexpr_syntax = true;
 
-						/*
-						 * Remove '{', '}' and \" character from the string.
-						 * Because this syntax is not recognize by the remote
-						 * MongoDB server.
-						 */
-						if ((ch == '{' && i == 0) || ch == '\"')
-							continue;
-						if ((ch == ',') || (ch == '}' && (i == (strlen(extval) - 1))))
-						{
-							value = DirectFunctionCall1(func_addr, CStringGetDatum(buf.data));
+	foreach(lc, plannerInfo->tlist)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		mongo_target_ref *target_ref = palloc0(sizeof(mongo_target_ref));
 
-							/* Append constant */
-							new_expr = makeConst(consttype,
-											 -1,
-											 InvalidOid,
-											 buf.len,
-											 value,
-											 constisnull,	/* isnull */
-											 constbyval /* byval */ );
-							const_list = lappend(const_list, (Expr *) new_expr);
-							resetStringInfo(&buf);
-							continue;
-						}
-						appendStringInfoChar(&buf, ch);
-					}
-				}
-				else
-				{
-					/* Append NULL */
-					new_expr = makeConst(INT4OID,
-										 -1,
-										 InvalidOid,
-										 sizeof(int32),
-										 (Datum) 0,
-										 true, /* isnull */
-										 true /* byval */ );
-					const_list = lappend(const_list, (Expr *) new_expr);
-					return;
-				}
+		target_ref->expr = tle->expr;
+		target_ref->is_group_target = false;
+		target_ref->target_idx = i;
+		context->target_ref_list = lappend(context->target_ref_list, target_ref);
+
+		if (!IsA(tle->expr, WindowFunc))
+		{
+			if (is_first)
+			{
+				bsonAppendStartObject (pipeline, "0", &fields_stage);
+				bsonAppendStartObject (&fields_stage, "$addFields", &fields_doc);
+				is_first = false;
 			}
-			break;
-		default:
-			elog(ERROR, "unsupported expression type for deparse: %d", (int) nodeTag(node));
-			break;
+
+			context->bs_key = psprintf("ref%d", i);
+			mongo_build_expr_doc(&fields_doc, tle->expr, context);
+		}
+		i++;
 	}
 
-	/* Building BSON document for ScalarArrayOpExpr. */
-	if (IsA(arg1, Var))
-		input_expr_str = get_attname(context->rel_oid, ((Var *) arg1)->varattno, false);
-	if (IsA(arg1, RelabelType))
+	i = 0;
+	foreach(lc, plannerInfo->window_list)
 	{
-		Var *var = (Var *) ((RelabelType *) arg1)->arg;
-		input_expr_str = get_attname(context->rel_oid, var->varattno, false);
+		MongoPlanerWindowInfo *window_info = (MongoPlanerWindowInfo *) lfirst(lc);
+		ListCell   *lc_expr;
+		ListCell   *lc_opt;
+		int			j = 0;
+
+		forboth(lc_expr, window_info->sort_exprs, lc_opt, window_info->sort_options)
+		{
+			Expr	   *expr = (Expr *) lfirst(lc_expr);
+
+			if (is_first)
+			{
+				bsonAppendStartObject (pipeline, "0", &fields_stage);
+				bsonAppendStartObject (&fields_stage, "$addFields", &fields_doc);
+				is_first = false;
+			}
+
+			if (MONGO_SORT_NEEDS_NULL_KEY(lfirst_int(lc_opt)))
+			{
+				BSON		null_doc, null_args;
+
+				bsonAppendStartObject (&fields_doc, psprintf("__win_null%d_%d", i, j),
+									   &null_doc);
+				bsonAppendStartArray (&null_doc, "$lte", &null_args);
+				context->bs_key = "0";
+				mongo_build_expr_doc(&null_args, expr, context);
+				bsonAppendNull (&null_args, "1");
+				bsonAppendFinishArray (&null_doc, &null_args);
+				bsonAppendFinishObject (&fields_doc, &null_doc);
+			}
+
+			context->bs_key = psprintf("__win_sort%d_%d", i, j);
+			mongo_build_expr_doc(&fields_doc, expr, context);
+			j++;
+		}
+		i++;
+	}
+	context->bs_key = NULL;
+
+	if (!is_first)
+	{
+		bsonAppendFinishObject (&fields_stage, &fields_doc);
+		bsonAppendFinishObject (pipeline, &fields_stage);
 	}
 
 	i = 0;
-	if (context->need_aggexpr_syntax)
+	foreach(lc, plannerInfo->window_list)
 	{
-		ListCell *aggcell;
-		char *ref_key = NULL;
-		BSON array_doc, element_doc;
+		MongoPlanerWindowInfo *window_info = (MongoPlanerWindowInfo *) lfirst(lc);
+		BSON		window_stage, window_doc, output_doc;
+		ListCell   *lc_tle;
+		ListCell   *lc_opt;
+		int			j;
 
-		foreach(aggcell, context->agg_ref_list)
+		bsonAppendStartObject (pipeline, "0", &window_stage);
+		bsonAppendStartObject (&window_stage, "$setWindowFields", &window_doc);
+
+		/* Build partitionBy: "$c1" or partitionBy: { p0: "$c1", p1: "$c2" } */
+		if (list_length(window_info->partition_exprs) == 1)
 		{
-			mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
+			context->bs_key = "partitionBy";
+			mongo_build_expr_doc(&window_doc,
+								 (Expr *) linitial(window_info->partition_exprs),
+								 context);
+		}
+		else if (window_info->partition_exprs != NIL)
+		{
+			BSON		partition_doc;
+			ListCell   *lc_expr;
 
-			/*
-			 * Check whether expression in HAVING is referenced by
-			 * aggref in grouping.
-			 */
-			if (equal(arg1, agg_ref->expr))
+			j = 0;
+			bsonAppendStartObject (&window_doc, "partitionBy", &partition_doc);
+			foreach(lc_expr, window_info->partition_exprs)
 			{
-				/* Build reference key like "$refx" */
-				ref_key = psprintf("%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
+				context->bs_key = psprintf("p%d", j++);
+				mongo_build_expr_doc(&partition_doc, (Expr *) lfirst(lc_expr),
+									 context);
+			}
+			bsonAppendFinishObject (&window_doc, &partition_doc);
+		}
+		context->bs_key = NULL;
 
-				break;
+		/* "true" sorts after "false", so ascending puts nulls last */
+		if (window_info->sort_options != NIL)
+		{
+			BSON		sort_doc;
+
+			j = 0;
+			bsonAppendStartObject (&window_doc, "sortBy", &sort_doc);
+			foreach(lc_opt, window_info->sort_options)
+			{
+				int			options = lfirst_int(lc_opt);
+
+				if (MONGO_SORT_NEEDS_NULL_KEY(options))
+					bsonAppendInt32 (&sort_doc, psprintf("__win_null%d_%d", i, j),
+									 (options & MONGO_SORT_NULLS_FIRST) ? -1 : 1);
+				bsonAppendInt32 (&sort_doc, psprintf("__win_sort%d_%d", i, j),
+								 (options & MONGO_SORT_DESC) ? -1 : 1);
+				j++;
 			}
+			bsonAppendFinishObject (&window_doc, &sort_doc);
 		}
 
-		if (ref_key != NULL)
-			input_expr_str = ref_key;
-		else
-			input_expr_str = psprintf("$%s", input_expr_str);
+		j = 0;
+		bsonAppendStartObject (&window_doc, "output", &output_doc);
+		foreach(lc_tle, plannerInfo->tlist)
+		{
+			TargetEntry *tle = lfirst_node(TargetEntry, lc_tle);
 
-		bsonAppendStartObject(qdoc, "0", &element_doc);
+			if (IsA(tle->expr, WindowFunc) &&
+				((WindowFunc *) tle->expr)->winref == window_info->winref)
+			{
+				context->bs_key = psprintf("ref%d", j);
+				mongo_build_window_func_doc(&output_doc, (WindowFunc *) tle->expr,
+											window_info, context);
+			}
+			j++;
+		}
+		bsonAppendFinishObject (&window_doc, &output_doc);
+		context->bs_key = NULL;
 
-		bsonAppendStartArray(&element_doc, mongo_opname, &op_doc);
+		bsonAppendFinishObject (&window_stage, &window_doc);
+		bsonAppendFinishObject (pipeline, &window_stage);
+		i++;
+	}
 
-		bsonAppendUTF8(&op_doc, "0", input_expr_str);
+	/*
+	 * "$sum" gives 0 for no value, where sum is null, so a sum is taken when
+	 * the count of its values is not zero:
+	 *		{ $addFields: { ref1: { $cond: [{ $gt: ["$ref1_n", 0] }, "$ref1", null] } } }
+	 */
+	is_first = true;
+	i = 0;
+	foreach(lc, plannerInfo->tlist)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
 
-		bsonAppendStartArray(&op_doc, "1", &array_doc);
-		foreach(lc, const_list)
+		if (IsA(tle->expr, WindowFunc) &&
+			mongo_is_window_sum((WindowFunc *) tle->expr))
 		{
-			Const *c = (Const *) lfirst(lc);
+			BSON		sum_doc, cond_args, gt_doc, gt_args;
+			char	   *key = psprintf("ref%d", i);
 
-			ref_key = psprintf("%d", i);
-			append_constant_value(&array_doc, ref_key, c);
-			i++;
+			if (is_first)
+			{
+				bsonAppendStartObject (pipeline, "0", &fields_stage);
+				bsonAppendStartObject (&fields_stage, "$addFields", &fields_doc);
+				is_first = false;
+			}
+
+			bsonAppendStartObject (&fields_doc, key, &sum_doc);
+			bsonAppendStartArray (&sum_doc, "$cond", &cond_args);
+			bsonAppendStartObject (&cond_args, "0", &gt_doc);
+			bsonAppendStartArray (&gt_doc, "$gt", &gt_args);
+			bsonAppendUTF8 (&gt_args, "0", psprintf("$%s_n", key));
+			bsonAppendInt32 (&gt_args, "1", 0);
+			bsonAppendFinishArray (&gt_doc, &gt_args);
+			bsonAppendFinishObject (&cond_args, &gt_doc);
+			bsonAppendUTF8 (&cond_args, "1", psprintf("$%s", key));
+			bsonAppendNull (&cond_args, "2");
+			bsonAppendFinishArray (&sum_doc, &cond_args);
+			bsonAppendFinishObject (&fields_doc, &sum_doc);
 		}
-		bsonAppendFinishArray(&op_doc, &array_doc);
+		i++;
+	}
 
-		bsonAppendFinishArray(&element_doc, &op_doc);
+	if (!is_first)
+	{
+		bsonAppendFinishObject (&fields_stage, &fields_doc);
+		bsonAppendFinishObject (pipeline, &fields_stage);
+	}
 
-		bsonAppendFinishObject(qdoc, &element_doc);
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ * Build a window function of "$setWindowFields", like:
+ *		{ $sum: "$c1", window: { documents: ["unbounded", "current"] } }
+ *
+ * See mongo_window_func_ok for the functions and frames supported.
+ */
+static void
+mongo_build_window_func_doc(BSON *qdoc, WindowFunc *wfunc,
+							MongoPlanerWindowInfo *window_info,
+							qdoc_expr_cxt *context)
+{
+	char	   *funcname = get_func_name(wfunc->winfnoid);
+	BSON		func_doc;
+
+	if (funcname == NULL)
+		elog(ERROR, "No such function name for function OID %u", wfunc->winfnoid);
+
+	if (!wfunc->winagg)
+	{
+		BSON		empty_doc;
+		const char *opname;
+
+		bsonAppendStartObject (qdoc, context->bs_key, &func_doc);
+
+		if (strcmp(funcname, "row_number") == 0)
+			opname = "$documentNumber";
+		else if (strcmp(funcname, "rank") == 0)
+			opname = "$rank";
+		else
+			opname = "$denseRank";
+
+		bsonAppendStartObject (&func_doc, opname, &empty_doc);
+		bsonAppendFinishObject (&func_doc, &empty_doc);
+		bsonAppendFinishObject (qdoc, &func_doc);
+		return;
+	}
+
+	/*
+	 * A sum comes with the count of its values in the same window, like:
+	 *		ref1_n: { $sum: { $cond: [{ $lte: ["$c1", null] }, 0, 1] }, window: ... }
+	 * see mongo_append_window_doc.
+	 */
+	if (mongo_is_window_sum(wfunc))
+	{
+		BSON		count_doc, cond_doc, cond_args, null_doc, null_args;
+		char	   *key = context->bs_key;
+
+		bsonAppendStartObject (qdoc, psprintf("%s_n", key), &count_doc);
+		bsonAppendStartObject (&count_doc, "$sum", &cond_doc);
+		bsonAppendStartArray (&cond_doc, "$cond", &cond_args);
+		bsonAppendStartObject (&cond_args, "0", &null_doc);
+		bsonAppendStartArray (&null_doc, "$lte", &null_args);
+		context->bs_key = "0";
+		mongo_build_expr_doc(&null_args, (Expr *) linitial(wfunc->args), context);
+		bsonAppendNull (&null_args, "1");
+		bsonAppendFinishArray (&null_doc, &null_args);
+		bsonAppendFinishObject (&cond_args, &null_doc);
+		bsonAppendInt32 (&cond_args, "1", 0);
+		bsonAppendInt32 (&cond_args, "2", 1);
+		bsonAppendFinishArray (&cond_doc, &cond_args);
+		bsonAppendFinishObject (&count_doc, &cond_doc);
+		mongo_append_window_bounds_doc(&count_doc, window_info);
+		bsonAppendFinishObject (qdoc, &count_doc);
+		context->bs_key = key;
 	}
+
+	bsonAppendStartObject (qdoc, context->bs_key, &func_doc);
+
+	if (wfunc->winstar)
+		bsonAppendInt32 (&func_doc, "$sum", 1);
 	else
 	{
-		if (context->conds_num > 1)
-		{
-			BSON element_doc;
+		context->bs_key = psprintf("$%s", funcname);
+		mongo_build_expr_doc(&func_doc, (Expr *) linitial(wfunc->args), context);
+	}
+
+	mongo_append_window_bounds_doc(&func_doc, window_info);
+	bsonAppendFinishObject (qdoc, &func_doc);
+}
+
+/*
+ * mongo_append_window_bounds_doc
+ *		Append the "window" field of a window function, like:
+ *			window: { documents: ["unbounded", "current"] }
+ *		A frame over the whole partition needs none.
+ */
+static void
+mongo_append_window_bounds_doc(BSON *qdoc, MongoPlanerWindowInfo *window_info)
+{
+	int			frameOptions = window_info->frameOptions;
+
+	if (window_info->sort_exprs != NIL &&
+		!((frameOptions & FRAMEOPTION_START_UNBOUNDED_PRECEDING) &&
+		  (frameOptions & FRAMEOPTION_END_UNBOUNDED_FOLLOWING)))
+	{
+		BSON		window_doc, bounds_doc;
+
+		bsonAppendStartObject (qdoc, "window", &window_doc);
+		bsonAppendStartArray (&window_doc,
+							  (frameOptions & FRAMEOPTION_ROWS) ? "documents" : "range",
+							  &bounds_doc);
+
+		if (frameOptions & FRAMEOPTION_START_UNBOUNDED_PRECEDING)
+			bsonAppendUTF8 (&bounds_doc, "0", "unbounded");
+		else if (frameOptions & FRAMEOPTION_START_CURRENT_ROW)
+			bsonAppendUTF8 (&bounds_doc, "0", "current");
+		else
+		{
+			int64		offset = DatumGetInt64(((Const *) window_info->startOffset)->constvalue);
+
+			bsonAppendInt64 (&bounds_doc, "0",
+							 (frameOptions & FRAMEOPTION_START_OFFSET_PRECEDING) ?
+							 -offset : offset);
+		}
+
+		if (frameOptions & FRAMEOPTION_END_UNBOUNDED_FOLLOWING)
+			bsonAppendUTF8 (&bounds_doc, "1", "unbounded");
+		else if (frameOptions & FRAMEOPTION_END_CURRENT_ROW)
+			bsonAppendUTF8 (&bounds_doc, "1", "current");
+		else
+		{
+			int64		offset = DatumGetInt64(((Const *) window_info->endOffset)->constvalue);
+
+			bsonAppendInt64 (&bounds_doc, "1",
+							 (frameOptions & FRAMEOPTION_END_OFFSET_PRECEDING) ?
+							 -offset : offset);
+		}
+
+		bsonAppendFinishArray (&window_doc, &bounds_doc);
+		bsonAppendFinishObject (qdoc, &window_doc);
+	}
+}
+
+/*
+ * mongo_is_window_sum
+ *		Returns true if the given window function is a sum of an expression,
+ *		whose count of values is computed too.
+ */
+static bool
+mongo_is_window_sum(WindowFunc *wfunc)
+{
+	char	   *funcname;
+
+	if (!wfunc->winagg || wfunc->winstar)
+		return false;
+
+	funcname = get_func_name(wfunc->winfnoid);
+
+	return (funcname != NULL && strcmp(funcname, "sum") == 0);
+}
+
+/*
+ * Building "$project" stage for targets list.
+ */
+static void mongo_append_target_list_doc(TupleDesc tupdesc,
+										 BSON *pipeline,
+										 MongoPlanerInfo *plannerInfo,
+										 qdoc_expr_cxt *context)
+{
+	BSON	project_stage, tlist_doc;
+	ListCell	*lc;
+	bool	is_first = true;
+
+	plannerInfo->retrieved_attrs = NIL;
+
+	if (plannerInfo->reloptkind != RELOPT_UPPER_REL &&
+		plannerInfo->reloptkind != RELOPT_OTHER_UPPER_REL)
+	{
+		if (plannerInfo->tlist != NIL)
+		{
+			char	   *ref_target = NULL;
+			int			i = 0, ref_index = 0;
+
+			/* Build target list contains jsonb arrow operator */
+			foreach(lc, plannerInfo->tlist)
+			{
+				Expr *expr = ((TargetEntry *)lfirst(lc))->expr;
+				ListCell *tc;
+
+				ref_index = i;
+
+				foreach(tc, context->target_ref_list)
+				{
+					mongo_target_ref *target_ref = (mongo_target_ref *)lfirst(tc);
+
+					if (equal(expr, target_ref->expr))
+					{
+						ref_index = target_ref->target_idx;
+						break;
+					}
+				}
+
+				if (is_first)
+				{
+					bsonAppendStartObject (pipeline, "0", &project_stage);
+					bsonAppendStartObject (&project_stage, "$project", &tlist_doc);
+					is_first = false;
+				}
+
+				/* Build reference target in aggregation group */
+				ref_target = psprintf("ref%d", ref_index);
+
+				context->bs_key = ref_target;
+				mongo_build_expr_doc(&tlist_doc, expr, context);
+				context->bs_key = NULL;
+				pfree(ref_target);
+
+				plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, ref_index + 1);
+				i++;
+			}
+		}
+		else
+		{
+			Relation	rel = table_open(context->rel_oid, NoLock);
+			bool		have_wholerow;
+			int			i = 0;
+
+			/*
+			* Identify which attributes will need to be retrieved from the remote
+			* server.  These include all attrs needed for joins or final output, plus
+			* all attrs used in the local_conds.  (Note: if we end up using a
+			* parameterized scan, it's possible that some of the join clauses will be
+			* sent to the remote and thus we wouldn't really need to retrieve the
+			* columns used in them.  Doesn't seem worth detecting that case though.)
+			*/
+			plannerInfo->attrs_used = NULL;
+			pull_varattnos((Node *)plannerInfo->ptarget_exprs, plannerInfo->rtindex,
+							&plannerInfo->attrs_used);
+			foreach(lc, plannerInfo->local_exprs)
+			{
+				Expr	   *expr = (Expr *) lfirst(lc);
+
+				/* Extract clause from RestrictInfo, if required */
+				if (IsA(expr, RestrictInfo))
+					expr = ((RestrictInfo *) expr)->clause;
+
+				pull_varattnos((Node *) expr, plannerInfo->rtindex,
+							&plannerInfo->attrs_used);
+			}
+
+			/* If there's a whole-row reference, we'll need all the columns. */
+			have_wholerow = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber,
+										plannerInfo->attrs_used);
+
+			for (i = 1; i <= tupdesc->natts; i++)
+			{
+				Form_pg_attribute attr = TupleDescAttr(tupdesc, i - 1);
+
+				/* Ignore dropped attributes. */
+				if (attr->attisdropped)
+					continue;
+
+				if (have_wholerow ||
+					bms_is_member(i - FirstLowInvalidHeapAttributeNumber,
+								plannerInfo->attrs_used))
+				{
+					/* Use attribute name or column_name option. */
+					char *colname = mongo_get_column_name(context->rel_oid, i);
+
+					if (strcmp(colname, "__doc") == 0)
+					{
+						/* Does not include __doc to target */
+						plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, i);
+						continue;
+					}
+
+					if (is_first)
+					{
+						bsonAppendStartObject (pipeline, "0", &project_stage);
+						bsonAppendStartObject (&project_stage, "$project", &tlist_doc);
+						is_first = false;
+					}
+
+					/* Append column name */
+					bsonAppendInt32 (&tlist_doc, colname, 1);
+
+					plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, i);
+				}
+			}
+
+			table_close(rel, NoLock);
+		}
+	}
+	else
+	{
+		char	   *ref_target = NULL;
+		int			i = 0;
+
+		foreach(lc, context->target_ref_list)
+		{
+			mongo_target_ref *target_ref = (mongo_target_ref *)lfirst(lc);
+
+			if (is_first)
+			{
+				bsonAppendStartObject (pipeline, "0", &project_stage);
+				bsonAppendStartObject (&project_stage, "$project", &tlist_doc);
+				is_first = false;
+			}
+
+			/* Append target reference */
+			/* Build reference target in aggregation group */
+			ref_target = psprintf("ref%d", target_ref->target_idx);
+			if (target_ref->is_group_target)
+			{
+				char *ref_target_path = psprintf("$_id.%s", ref_target);
+
+				bsonAppendUTF8 (&tlist_doc, ref_target, ref_target_path);
+				pfree(ref_target_path);
+			}
+			else
+			{
+				bsonAppendInt32 (&tlist_doc, ref_target, 1);
+			}
+
+			pfree(ref_target);
+
+			plannerInfo->retrieved_attrs = lappend_int(plannerInfo->retrieved_attrs, i + 1);
+			i++;
+		}
+	}
+
+	if (is_first == false)
+	{
+		foreach(lc, context->innerel_name_list)
+		{
+			char *innerel_name = strVal(lfirst(lc));
+
+			bsonAppendInt32 (&tlist_doc, innerel_name, 1);
+		}
+
+		bsonAppendFinishObject (&project_stage, &tlist_doc);
+		bsonAppendFinishObject (pipeline, &project_stage);
+	}
+}
+
+/*
+ * Building "$match" stage for filter BSON query document.
+ */
+static void mongo_append_filter_doc(BSON *pipeline, MongoPlanerInfo *plannerInfo, qdoc_expr_cxt *context)
+{
+	BSON	match_stage, filter_conds, multi_cond_exprs, expr_stage;
+	List	*remote_exprs = NIL;
+	ListCell   *lc;
+	int			nestlevel;
+	bool		is_first = true;
+	int 		conds_num;
+
+	remote_exprs = plannerInfo->remote_exprs;
+
+	if (context->need_aggexpr_syntax)
+	{
+		context->bs_key = "$expr";
+
+		if (context->reloptkind == RELOPT_UPPER_REL ||
+			context->reloptkind == RELOPT_OTHER_UPPER_REL)
+			remote_exprs = plannerInfo->having_quals;
+	}
+
+	conds_num = list_length(remote_exprs);
+	context->conds_num = conds_num;
+
+	bsonAppendStartObject (pipeline, "0", &match_stage);
+	bsonAppendStartObject (&match_stage, "$match", &filter_conds);
+
+	/* Make sure any constants in the exprs are printed portably */
+	nestlevel = mongo_set_transmission_modes();
+
+	foreach(lc, remote_exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc);
+
+		/* Extract clause from RestrictInfo, if required */
+		if (IsA(expr, RestrictInfo))
+			expr = ((RestrictInfo *) expr)->clause;
+
+		/*
+		 * If more than 1 condition use and for combine as:
+		 *		{ $and: [ { <expr1> }, { <expr2> } , ... , { <exprN> } ] }
+		 */
+		if (conds_num > 1 && is_first)
+		{
+			if (context->need_aggexpr_syntax)
+			{
+				bsonAppendStartObject (&filter_conds, "$expr", &expr_stage);
+				bsonAppendStartArray (&expr_stage, "$and", &multi_cond_exprs);
+			}
+			else
+				bsonAppendStartArray (&filter_conds, "$and", &multi_cond_exprs);
+			mongo_append_cond_doc(&multi_cond_exprs, expr, context);
+		}
+		else if (conds_num > 1)
+			mongo_append_cond_doc(&multi_cond_exprs, expr, context);
+		else
+			mongo_append_cond_doc(&filter_conds, expr, context);
+
+		is_first = false;
+	}
+
+	if (conds_num > 1)
+	{
+		if (context->need_aggexpr_syntax)
+		{
+			bsonAppendFinishArray (&expr_stage, &multi_cond_exprs);
+			bsonAppendFinishObject (&filter_conds, &expr_stage);
+		}
+		else
+			bsonAppendFinishArray (&filter_conds, &multi_cond_exprs);
+	}
+
+	mongo_reset_transmission_modes(nestlevel);
+
+	if (context->need_aggexpr_syntax)
+		context->bs_key = NULL;
+
+	bsonAppendFinishObject (&match_stage, &filter_conds);
+	bsonAppendFinishObject (pipeline, &match_stage);
+}
+
+/*
+ *	Build a condition in BSON query document.  A boolean column is a
+ *	condition of its own, which is true for the value true only.
+ */
+static void
+mongo_append_cond_doc(BSON *qdoc, Expr *expr, qdoc_expr_cxt *context)
+{
+	if (IsA(expr, Var) && ((Var *) expr)->vartype == BOOLOID)
+		mongo_build_bool_test_doc(qdoc, (Var *) expr, IS_TRUE, context);
+	else
+		mongo_build_expr_doc(qdoc, expr, context);
+}
+
+/*
+ *	Build a test of a boolean column in BSON query document, like:
+ *		{ c1: { $eq: true } }		for c1, c1 IS TRUE
+ *		{ c1: { $eq: false } }		for NOT c1, c1 IS FALSE
+ *		{ c1: { $ne: true } }		for c1 IS NOT TRUE
+ *		{ c1: { $eq: null } }		for c1 IS UNKNOWN
+ * A missing field matches null, as it is null in PostgreSQL.  In aggregate
+ * expression syntax, the test is like { $ne: ["$c1", true] }, and a null test
+ * is made by comparing with null, as missing is less than null.
+ */
+static void
+mongo_build_bool_test_doc(BSON *qdoc, Var *var, BoolTestType type,
+						  qdoc_expr_cxt *context)
+{
+	const char *opname;
+	int			value;			/* 1 for true, 0 for false, -1 for null */
+
+	switch (type)
+	{
+		case IS_TRUE:
+			opname = "$eq";
+			value = 1;
+			break;
+		case IS_NOT_TRUE:
+			opname = "$ne";
+			value = 1;
+			break;
+		case IS_FALSE:
+			opname = "$eq";
+			value = 0;
+			break;
+		case IS_NOT_FALSE:
+			opname = "$ne";
+			value = 0;
+			break;
+		case IS_UNKNOWN:
+			opname = context->need_aggexpr_syntax ? "$lte" : "$eq";
+			value = -1;
+			break;
+		case IS_NOT_UNKNOWN:
+			opname = context->need_aggexpr_syntax ? "$gt" : "$ne";
+			value = -1;
+			break;
+		default:
+			elog(ERROR, "unrecognized booltesttype: %d", (int) type);
+			return;
+	}
+
+	if (!context->need_aggexpr_syntax)
+	{
+		BSON		field_doc, cond_doc;
+		BSON	   *ptr_qdoc = qdoc;
+		char	   *colname = get_attname(context->rel_oid, var->varattno,
+										  false);
+
+		if (context->conds_num > 1)
+		{
+			bsonAppendStartObject (qdoc, colname, &field_doc);
+			ptr_qdoc = &field_doc;
+		}
+
+		bsonAppendStartObject (ptr_qdoc, colname, &cond_doc);
+		if (value < 0)
+			bsonAppendNull (&cond_doc, opname);
+		else
+			bsonAppendBool (&cond_doc, opname, value == 1);
+		bsonAppendFinishObject (ptr_qdoc, &cond_doc);
+
+		if (context->conds_num > 1)
+			bsonAppendFinishObject (qdoc, &field_doc);
+	}
+	else
+	{
+		char	   *key = context->bs_key;
+		BSON		cond_doc, cond_args;
+
+		if (key == NULL)
+			elog(ERROR, "Could not add a boolean test");
+
+		bsonAppendStartObject (qdoc, key, &cond_doc);
+		bsonAppendStartArray (&cond_doc, opname, &cond_args);
+		context->bs_key = "0";
+		mongo_build_expr_doc(&cond_args, (Expr *) var, context);
+		if (value < 0)
+			bsonAppendNull (&cond_args, "1");
+		else
+			bsonAppendBool (&cond_args, "1", value == 1);
+		bsonAppendFinishArray (&cond_doc, &cond_args);
+		bsonAppendFinishObject (qdoc, &cond_doc);
+
+		context->bs_key = key;
+	}
+}
+
+/*
+ *	Build Boolean expression in BSON query document.
+ */
+static void mongo_build_boolexpr_doc(BSON *qdoc, BoolExpr *node, qdoc_expr_cxt *context)
+{
+	BSON boolexpr_doc, op_doc, expr_stage, *ptr_qdoc;
+	char *op = NULL;		/* keep compiler quiet */
+	ListCell   *lc;
+	int		conds_num = context->conds_num;
+
+	switch (node->boolop)
+	{
+		case AND_EXPR:
+			op = "$and";
+			break;
+		case OR_EXPR:
+			op = "$or";
+			break;
+		case NOT_EXPR:
+			/* NOT of a boolean column, see mongo_bool_column_ok */
+			mongo_build_bool_test_doc(qdoc, (Var *) linitial(node->args),
+									  IS_FALSE, context);
+			return;
+		default :
+			return;
+	}
+
+	ptr_qdoc = qdoc;
+
+	if (context->need_aggexpr_syntax && context->count_boolexpr == 0)
+	{
+		if (context->bs_key == NULL)
+			elog(ERROR, "Could not add a boolean expression");
+		bsonAppendStartObject(qdoc, context->bs_key, &expr_stage);
+		ptr_qdoc = &expr_stage;
+	}
+
+	context->count_boolexpr++;
+
+	if (context->conds_num > 1)
+	{
+		bsonAppendStartObject(ptr_qdoc, op, &op_doc);
+		bsonAppendStartArray (&op_doc, op, &boolexpr_doc);
+	}
+	else
+		bsonAppendStartArray (ptr_qdoc, op, &boolexpr_doc);
+
+	foreach(lc, node->args)
+	{
+		context->conds_num++;
+		mongo_append_cond_doc(&boolexpr_doc, (Expr *) lfirst(lc), context);
+	}
+	context->conds_num = conds_num;
+
+	if (context->conds_num > 1)
+	{
+		bsonAppendFinishArray (&op_doc, &boolexpr_doc);
+		bsonAppendFinishObject(ptr_qdoc, &op_doc);
+	}
+	else
+		bsonAppendFinishArray (ptr_qdoc, &boolexpr_doc);
+
+	context->count_boolexpr--;
+
+	if (context->need_aggexpr_syntax && context->count_boolexpr == 0)
+		bsonAppendFinishObject(qdoc, &expr_stage);
+
+	context->conds_num++;
+}
+
+/*
+ *	Build operator expression in BSON query document.
+ */
+static void mongo_build_opexpr_doc(BSON *qdoc, OpExpr *node, qdoc_expr_cxt *context)
+{
+	MongoOperatorsSupport opkind;
+	Expr		*right_opr = NULL;
+	Expr		*left_opr = NULL;
+	Node		*n;
+	bool		is_switch_operator = false;
+	bool		need_switch_operator = false;
+	const char	*opName = NULL;
+
+	/* Retrieve information about the operator. */
+	opkind = mongo_validateOperatorName(node->opno, &opName, &is_switch_operator);
+
+	/* Sanity check. */
+	Assert(list_length(node->args) == 2);
+
+	/* A timestamp plus or minus an interval */
+	if (opkind == OP_MATH && mongo_is_datetime_type(exprType((Node *) node)))
+	{
+		mongo_build_date_add_doc(qdoc, node, context);
+		return;
+	}
+
+	if (opkind == OP_REGEX)
+	{
+		mongo_build_regex_doc(qdoc, node, context);
+		return;
+	}
+
+	/* A jsonb filter, see mongo_is_json_filter_expr */
+	if ((opkind == OP_UNSUPPORT || node->opno == TextEqualOperator) &&
+		!context->need_aggexpr_syntax)
+	{
+		Const	   *value;
+		char	   *path = mongo_get_json_filter(node, context->rel_oid,
+												 context->rtindex, &value);
+
+		if (path != NULL)
+		{
+			mongo_build_json_filter_doc(qdoc, node, path, value, context);
+			return;
+		}
+	}
+
+	/*
+	 * A comparison of a computed value, like a function of a column, cannot
+	 * be written as a query on a field.  Check it by an aggregate expression.
+	 */
+	if (opkind == OP_CONDITIONAL && !context->need_aggexpr_syntax &&
+		!(mongo_is_simple_operand((Expr *) linitial(node->args)) &&
+		  mongo_is_simple_operand((Expr *) lsecond(node->args))))
+	{
+		mongo_build_expr_match_doc(qdoc, (Expr *) node, node->args, context);
+		return;
+	}
+
+	if (opkind == OP_JSON)
+	{
+		/* Deparse expression for nested json object */
+		deparse_expr_cxt deparse_context;
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+
+		deparse_context.buf = &buf;
+		deparse_context.qdoc_ctx = context;
+
+		appendStringInfoChar(&buf, '$');
+
+		mongo_deparseExpr((Expr *) node, &deparse_context);
+
+		if (context->bs_key)
+			bsonAppendUTF8(qdoc, context->bs_key, buf.data);
+		else
+			elog(ERROR, "Could not add json nested object");
+
+		return;
+	}
+
+	/*
+	 * If right operand of a logic operator expression
+	 * is a column name, we need to switch left and right
+	 * operands with converted logic operator.
+	 */
+	n = (Node *) lfirst(list_tail(node->args));
+	if (is_switch_operator &&
+		((IsA(n, Var) && mongo_get_param_index((Expr *) n, context) < 0) ||
+		 mongo_get_param_index((Expr *) lfirst(list_head(node->args)), context) >= 0))
+	{
+		need_switch_operator = true;
+		/* Get node for left operand */
+		left_opr = (Expr *)lfirst(list_tail(node->args));
+
+		/* Get node for right operand */
+		right_opr = (Expr *)lfirst(list_head(node->args));
+	}
+	else
+	{
+		/* Get node for left operand */
+		left_opr = (Expr *)lfirst(list_head(node->args));
+
+		/* Get node for right operand */
+		right_opr = (Expr *)lfirst(list_tail(node->args));
+	}
+
+	if (opkind == OP_CONDITIONAL && !context->need_aggexpr_syntax)
+	{
+		BSON opexpr_doc, left_opr_doc;
+		char *leftopr_str = NULL;
+		int paramno;
+
+		/* Left operand only can be field name or a nested json object */
+		if (IsA(left_opr, Var))
+			leftopr_str = get_attname(context->rel_oid, ((Var *) left_opr)->varattno, false);
+		else
+		{
+			/* Deparse expression for nested json object */
+			deparse_expr_cxt deparse_context;
+			StringInfoData buf;
+
+			initStringInfo(&buf);
+
+			deparse_context.buf = &buf;
+			deparse_context.qdoc_ctx = context;
+
+			mongo_deparseExpr(left_opr, &deparse_context);
+			leftopr_str = pstrdup(deparse_context.buf->data);
+		}
+
+		/* Build BSON for comparing operator: {field: { opname: value}} */
+		if (context->conds_num > 1)
+		{
+			bsonAppendStartObject (qdoc, leftopr_str, &opexpr_doc);
+			bsonAppendStartObject(&opexpr_doc, leftopr_str, &left_opr_doc);
+		}
+		else
+			bsonAppendStartObject(qdoc, leftopr_str, &left_opr_doc);
+
+		opName = mongo_getSwitchedCmpOperatorName(opName, need_switch_operator);
+		paramno = mongo_get_param_index(right_opr, context);
+		if (paramno >= 0)
+			mongo_append_param_value(&left_opr_doc, opName, paramno, context);
+		else
+			append_constant_value(&left_opr_doc, opName, (Const *) right_opr);
+
+		if (context->conds_num > 1)
+		{
+			bsonAppendFinishObject(&opexpr_doc, &left_opr_doc);
+			bsonAppendFinishObject (qdoc, &opexpr_doc);
+		}
+		else
+			bsonAppendFinishObject(qdoc, &left_opr_doc);
+	}
+	else
+	{
+		BSON opexpr_doc, ref_doc, and_obj, and_op;
+		ListCell *lc;
+
+		/* Build reference target in aggregation group likes: {"bson_key": { "$add":["$c1", 1] } } */
+		if (context->bs_key == NULL)
+			elog(ERROR, "Could not add a operator expression");
+
+		/*
+		 * A comparison with a null parameter is null, but MongoDB takes null
+		 * as a value to compare with.  NOT is only pushed down for a boolean
+		 * column, so the comparison can be false instead.
+		 */
+		if (opkind == OP_CONDITIONAL)
+		{
+			foreach(lc, node->args)
+			{
+				int			paramno = mongo_get_param_index((Expr *) lfirst(lc),
+															context);
+
+				if (paramno >= 0 && context->param_values != NULL &&
+					context->param_isnulls[paramno])
+				{
+					bsonAppendBool(qdoc, context->bs_key, false);
+					return;
+				}
+			}
+		}
+
+		if (context->is_join_expr)
+		{
+			/* Add $and object to prepare to add null check clause */
+			bsonAppendStartObject(qdoc, context->bs_key, &and_obj);
+			bsonAppendStartArray (&and_obj, "$and", &and_op);
+
+			bsonAppendStartObject (&and_op, context->bs_key, &ref_doc);
+			bsonAppendStartArray (&ref_doc, opName, &opexpr_doc);
+
+		}
+		else
+		{
+			bsonAppendStartObject (qdoc, context->bs_key, &ref_doc);
+			bsonAppendStartArray (&ref_doc, opName, &opexpr_doc);
+		}
+
+		foreach(lc, node->args)
+		{
+			Expr *expr = (Expr *) lfirst(lc);
+			ListCell *aggcell;
+			char *ref_key = NULL;
+
+			if (context->need_aggexpr_syntax && (IsA(expr, Aggref) || IsA(expr, Var) || IsA(expr, RelabelType)))
+			{
+				foreach(aggcell, context->agg_ref_list)
+				{
+					mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
+
+					if (IsA(expr, RelabelType))
+						expr = ((RelabelType *)expr)->arg;
+
+					/*
+					 * Check whether expression in HAVING is referenced by
+					 * aggref in grouping.
+					 */
+					if (equal(expr, agg_ref->expr))
+					{
+						/* Build reference key like "$refx" */
+						if (IsA(expr, Aggref))
+							ref_key = psprintf("$%s", agg_ref->ref_target);
+						else if (IsA(expr, Var))
+						{
+							if (context->has_groupClause)
+								ref_key = psprintf("$_id.%s", agg_ref->ref_target); /* reference from $group stage */
+							else
+								ref_key = psprintf("$%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
+						}
+
+						break;
+					}
+				}
+
+				if (ref_key != NULL)
+					bsonAppendUTF8(&opexpr_doc, context->bs_key, ref_key);
+				else
+					mongo_build_expr_doc(&opexpr_doc, expr, context);
+			}
+			else
+				mongo_build_expr_doc(&opexpr_doc, expr, context);
+		}
+
+		/* Finish append the op experesion */
+		if (context->is_join_expr)
+		{
+			bsonAppendFinishArray (&ref_doc, &opexpr_doc);
+			bsonAppendFinishObject (&and_op, &ref_doc);
+		}
+		else
+		{
+			bsonAppendFinishArray (&ref_doc, &opexpr_doc);
+			bsonAppendFinishObject (qdoc, &ref_doc);
+		}
+
+		/* Add null check for JOIN condition */
+		if (context->is_join_expr)
+		{
+			foreach(lc, node->args)
+			{
+				Expr *expr = (Expr *) lfirst(lc);
+				ListCell *aggcell;
+				char *ref_key = NULL;
+
+				foreach(aggcell, context->agg_ref_list)
+				{
+					mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
+
+					/* We ignore binary-compatible relabeling on both ends */
+					while (expr && IsA(expr, RelabelType))
+						expr = ((RelabelType *) expr)->arg;
+
+					if (equal(expr, agg_ref->expr))
+					{
+						/* Build reference key like "$refx" */
+						if (IsA(expr, Var))
+						{
+							ref_key = psprintf("$%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
+						}
+
+						break;
+					}
+				}
+
+				/* Add null check for reference from outer relation */
+				if (ref_key != NULL)
+					mongo_add_null_check_ref(ref_key, &and_op);
+				else if (IsA(expr, Var))
+					mongo_add_null_check_var((Var *)expr , &and_op, context->rel_oid);
+				else if (!IsA(expr, Const))
+					mongo_append_not_null_doc(&and_op, context->bs_key, expr,
+											  context);
+			}
+
+			bsonAppendFinishArray (&and_obj, &and_op);
+			bsonAppendFinishObject (qdoc, &and_obj);
+		}
+	}
+}
+
+/*
+ *	Build column name in BSON query document.
+ */
+static void
+mongo_build_column_doc(BSON *qdoc, Var *node, qdoc_expr_cxt *context)
+{
+	char	   *colname = NULL;
+	char	   *inner_name;
+
+	if (node->varattno < 0)
+		elog(ERROR, "Could not build BSON query document for system attribute");
+	else if (node->varattno == 0)
+		elog(ERROR, "Could not build BSON query document for whole-row reference");
+
+	/* In grouping clause, it can contain column belong to inner relation */
+	if (!context->is_in_grouping_clause || !context->inner_pipeline_ref_list)
+	{
+		if (context->rtindex != 0 && node->varno != context->rtindex)
+			return;
+	}
+
+	inner_name = mongo_get_inner_rel_name(node->varno, context);
+	if (inner_name != NULL)
+	{
+		/* Grouping target belongs to inner relation */
+		ListCell	*lc;
+		int			inner_ref_index = -1;
+
+		/* Find the inner reference for this column */
+		foreach(lc, context->inner_pipeline_ref_list)
+		{
+			mongo_target_ref *target_ref = (mongo_target_ref *)lfirst(lc);
+
+			if (equal(node, target_ref->expr))
+			{
+				inner_ref_index = target_ref->target_idx;
+				break;
+			}
+		}
+
+		if (inner_ref_index == -1)
+			elog(ERROR, "Could not find the inner reference for grouping target\n");
+
+		/* Build colname object like "$innerrel_name.column_ref_inner" */
+		colname = psprintf("$%s.ref%d", inner_name, inner_ref_index);
+	}
+	else
+	{
+		colname = get_attname(context->rel_oid, node->varattno, false);
+
+		/* Build colname object like "$column" */
+		colname = psprintf("$%s", colname);
+	}
+
+	if (context->bs_key)
+		bsonAppendUTF8(qdoc, context->bs_key, colname);
+	else
+		elog(ERROR, "Could not add column object");
+}
+
+/*
+ *	Build constant value in BSON query document.
+ *
+ * In aggregate expression syntax, a string beginning with "$" is a field path,
+ * so a text constant is given as { $literal: "..." }.
+ */
+static void
+mongo_build_const_doc(BSON *qdoc, Const *node, qdoc_expr_cxt *context)
+{
+	if (context->bs_key == NULL)
+		elog(ERROR, "Could not add constant value object");
+
+	if (context->need_aggexpr_syntax && !node->constisnull &&
+		(node->consttype == TEXTOID || node->consttype == VARCHAROID ||
+		 node->consttype == BPCHAROID || node->consttype == NAMEOID))
+	{
+		BSON		literal_doc;
+
+		bsonAppendStartObject (qdoc, context->bs_key, &literal_doc);
+		append_constant_value(&literal_doc, "$literal", node);
+		bsonAppendFinishObject (qdoc, &literal_doc);
+	}
+	else
+		append_constant_value(qdoc, context->bs_key, node);
+}
+
+/*
+ *	Build a date/time part operator of an expression, like { $hour: "$c1" }.
+ */
+static void
+mongo_append_date_op_doc(BSON *qdoc, const char *key, const char *op_name,
+						 Expr *arg, qdoc_expr_cxt *context)
+{
+	BSON		op_doc;
+
+	bsonAppendStartObject (qdoc, key, &op_doc);
+	context->bs_key = (char *) op_name;
+	mongo_build_expr_doc(&op_doc, arg, context);
+	bsonAppendFinishObject (qdoc, &op_doc);
+}
+
+/*
+ *	Build function expression in BSON query document.
+ *
+ * See mongo_funcexpr_ok for the functions supported.  The function is built
+ * in aggregate expression syntax, like:
+ *		{ bs_key: { $dateTrunc: { date: "$c1", unit: "day" } } }
+ */
+static void
+mongo_build_funcexpr_doc(BSON *qdoc, FuncExpr *node, qdoc_expr_cxt *context)
+{
+	char	   *funcname = get_func_name(node->funcid);
+	char	   *key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	BSON		func_doc;
+
+	if (key == NULL)
+		elog(ERROR, "Could not add a function expression");
+
+	/* A date is stored as the timestamp of its midnight */
+	if (strcmp(funcname, "timestamp") == 0)
+	{
+		mongo_build_expr_doc(qdoc, (Expr *) linitial(node->args), context);
+		return;
+	}
+
+	context->need_aggexpr_syntax = true;
+
+	bsonAppendStartObject (qdoc, key, &func_doc);
+
+	if (strcmp(funcname, "date_trunc") == 0)
+	{
+		const char *unit = mongo_get_date_trunc_unit((Const *) linitial(node->args));
+		BSON		trunc_doc;
+
+		bsonAppendStartObject (&func_doc, "$dateTrunc", &trunc_doc);
+		context->bs_key = "date";
+		mongo_build_expr_doc(&trunc_doc, (Expr *) lsecond(node->args), context);
+		bsonAppendUTF8 (&trunc_doc, "unit", (char *) unit);
+		/* PostgreSQL weeks are ISO weeks */
+		if (strcmp(unit, "week") == 0)
+			bsonAppendUTF8 (&trunc_doc, "startOfWeek", "monday");
+		bsonAppendFinishObject (&func_doc, &trunc_doc);
+	}
+	else if (strcmp(funcname, "date_part") == 0 ||
+			 strcmp(funcname, "extract") == 0)
+	{
+		Const	   *c = (Const *) linitial(node->args);
+		Expr	   *arg = (Expr *) lsecond(node->args);
+		const char *op_name = mongo_get_date_part_operator(c);
+		char	   *field = TextDatumGetCString(c->constvalue);
+		BSON		args_doc, inner_doc;
+
+		if (pg_strcasecmp(field, "dow") == 0)
+		{
+			/* $dayOfWeek counts from 1 for Sunday */
+			bsonAppendStartArray (&func_doc, "$subtract", &args_doc);
+			mongo_append_date_op_doc(&args_doc, "0", op_name, arg, context);
+			bsonAppendInt32 (&args_doc, "1", 1);
+			bsonAppendFinishArray (&func_doc, &args_doc);
+		}
+		else if (pg_strcasecmp(field, "quarter") == 0)
+		{
+			bsonAppendStartObject (&func_doc, "$ceil", &inner_doc);
+			bsonAppendStartArray (&inner_doc, "$divide", &args_doc);
+			mongo_append_date_op_doc(&args_doc, "0", op_name, arg, context);
+			bsonAppendInt32 (&args_doc, "1", 3);
+			bsonAppendFinishArray (&inner_doc, &args_doc);
+			bsonAppendFinishObject (&func_doc, &inner_doc);
+		}
+		else if (pg_strcasecmp(field, "second") == 0)
+		{
+			BSON		divide_doc;
+
+			/* The seconds include the fraction */
+			bsonAppendStartArray (&func_doc, "$add", &args_doc);
+			mongo_append_date_op_doc(&args_doc, "0", op_name, arg, context);
+			bsonAppendStartObject (&args_doc, "1", &inner_doc);
+			bsonAppendStartArray (&inner_doc, "$divide", &divide_doc);
+			mongo_append_date_op_doc(&divide_doc, "0", "$millisecond", arg,
+									 context);
+			bsonAppendInt32 (&divide_doc, "1", 1000);
+			bsonAppendFinishArray (&inner_doc, &divide_doc);
+			bsonAppendFinishObject (&args_doc, &inner_doc);
+			bsonAppendFinishArray (&func_doc, &args_doc);
+		}
+		else if (pg_strcasecmp(field, "milliseconds") == 0)
+		{
+			BSON		multiply_doc;
+
+			bsonAppendStartArray (&func_doc, "$add", &args_doc);
+			bsonAppendStartObject (&args_doc, "0", &inner_doc);
+			bsonAppendStartArray (&inner_doc, "$multiply", &multiply_doc);
+			mongo_append_date_op_doc(&multiply_doc, "0", op_name, arg, context);
+			bsonAppendInt32 (&multiply_doc, "1", 1000);
+			bsonAppendFinishArray (&inner_doc, &multiply_doc);
+			bsonAppendFinishObject (&args_doc, &inner_doc);
+			mongo_append_date_op_doc(&args_doc, "1", "$millisecond", arg, context);
+			bsonAppendFinishArray (&func_doc, &args_doc);
+		}
+		else if (pg_strcasecmp(field, "epoch") == 0)
+		{
+			/* A date converts to milliseconds since the epoch */
+			bsonAppendStartArray (&func_doc, "$divide", &args_doc);
+			mongo_append_date_op_doc(&args_doc, "0", op_name, arg, context);
+			bsonAppendInt32 (&args_doc, "1", 1000);
+			bsonAppendFinishArray (&func_doc, &args_doc);
+		}
+		else
+		{
+			context->bs_key = (char *) op_name;
+			mongo_build_expr_doc(&func_doc, arg, context);
+		}
+	}
+	else if (strcmp(funcname, "to_timestamp") == 0)
+	{
+		BSON		todate_doc, args_doc;
+
+		bsonAppendStartObject (&func_doc, "$toDate", &todate_doc);
+		bsonAppendStartArray (&todate_doc, "$multiply", &args_doc);
+		context->bs_key = "0";
+		mongo_build_expr_doc(&args_doc, (Expr *) linitial(node->args), context);
+		bsonAppendInt32 (&args_doc, "1", 1000);
+		bsonAppendFinishArray (&todate_doc, &args_doc);
+		bsonAppendFinishObject (&func_doc, &todate_doc);
+	}
+	else if (strcmp(funcname, "btrim") == 0 ||
+			 strcmp(funcname, "ltrim") == 0 ||
+			 strcmp(funcname, "rtrim") == 0)
+	{
+		const char *op_name = (funcname[0] == 'b') ? "$trim" :
+							  (funcname[0] == 'l') ? "$ltrim" : "$rtrim";
+		BSON		trim_doc;
+
+		/* MongoDB trims all white space by default, PostgreSQL spaces only */
+		bsonAppendStartObject (&func_doc, op_name, &trim_doc);
+		context->bs_key = "input";
+		mongo_build_expr_doc(&trim_doc, (Expr *) linitial(node->args), context);
+		if (list_length(node->args) == 2)
+		{
+			context->bs_key = "chars";
+			mongo_build_const_doc(&trim_doc, (Const *) lsecond(node->args),
+								  context);
+		}
+		else
+			bsonAppendUTF8 (&trim_doc, "chars", " ");
+		bsonAppendFinishObject (&func_doc, &trim_doc);
+	}
+	else
+	{
+		/*
+		 * The other string functions give an empty string or an error for a
+		 * null input, so they are computed only when it is not null:
+		 *		{ $cond: { if: { $gt: ["$c1", null] },
+		 *				   then: { $toLower: "$c1" }, else: null } }
+		 */
+		Expr	   *arg = (Expr *) linitial(node->args);
+		BSON		cond_doc, then_doc;
+
+		bsonAppendStartObject (&func_doc, "$cond", &cond_doc);
+		mongo_append_not_null_doc(&cond_doc, "if", arg, context);
+		bsonAppendStartObject (&cond_doc, "then", &then_doc);
+
+		if (strcmp(funcname, "lower") == 0 ||
+			strcmp(funcname, "upper") == 0)
+		{
+			context->bs_key = (funcname[0] == 'l') ? "$toLower" : "$toUpper";
+			mongo_build_expr_doc(&then_doc, arg, context);
+		}
+		else if (strcmp(funcname, "substring") == 0 ||
+				 strcmp(funcname, "substr") == 0)
+		{
+			int32		start = DatumGetInt32(((Const *) lsecond(node->args))->constvalue);
+			BSON		args_doc, len_doc;
+
+			bsonAppendStartArray (&then_doc, "$substrCP", &args_doc);
+			context->bs_key = "0";
+			mongo_build_expr_doc(&args_doc, arg, context);
+			bsonAppendInt32 (&args_doc, "1", start - 1);
+			if (list_length(node->args) == 3)
+				bsonAppendInt32 (&args_doc, "2",
+								 DatumGetInt32(((Const *) lthird(node->args))->constvalue));
+			else
+			{
+				/* Up to the end of the string */
+				bsonAppendStartObject (&args_doc, "2", &len_doc);
+				context->bs_key = "$strLenCP";
+				mongo_build_expr_doc(&len_doc, arg, context);
+				bsonAppendFinishObject (&args_doc, &len_doc);
+			}
+			bsonAppendFinishArray (&then_doc, &args_doc);
+		}
+		else if (strcmp(funcname, "length") == 0 ||
+				 strcmp(funcname, "char_length") == 0 ||
+				 strcmp(funcname, "character_length") == 0)
+		{
+			context->bs_key = "$strLenCP";
+			mongo_build_expr_doc(&then_doc, arg, context);
+		}
+		else
+			elog(ERROR, "unsupported function for deparse: %s", funcname);
+
+		bsonAppendFinishObject (&cond_doc, &then_doc);
+		bsonAppendNull (&cond_doc, "else");
+		bsonAppendFinishObject (&func_doc, &cond_doc);
+	}
+
+	bsonAppendFinishObject (qdoc, &func_doc);
+
+	context->bs_key = key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Build a timestamp plus or minus an interval constant in BSON query
+ *	document, like:
+ *		{ $dateAdd: { startDate: { $dateAdd: { startDate: "$c1", unit: "month",
+ *											  amount: 1 } },
+ *					  unit: "day", amount: 2 } }
+ * for c1 + interval '1 month 2 days'.  See mongo_date_arith_ok.
+ */
+static void
+mongo_build_date_add_doc(BSON *qdoc, OpExpr *node, qdoc_expr_cxt *context)
+{
+	static const char *units[] = {"month", "day", "millisecond"};
+	char	   *key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	Expr	   *date;
+	Const	   *interval;
+	Interval   *span;
+	int64		amounts[3];
+	int			sign = 1;
+	int			nsteps = 0;
+	int			steps[3];
+	BSON		add_docs[3], add_stages[3];
+	int			i;
+
+	if (key == NULL)
+		elog(ERROR, "Could not add a date arithmetic expression");
+
+	if (exprType((Node *) linitial(node->args)) == INTERVALOID)
+	{
+		interval = (Const *) linitial(node->args);
+		date = (Expr *) lsecond(node->args);
+	}
+	else
+	{
+		date = (Expr *) linitial(node->args);
+		interval = (Const *) lsecond(node->args);
+		if (strcmp(get_opname(node->opno), "-") == 0)
+			sign = -1;
+	}
+
+	span = DatumGetIntervalP(interval->constvalue);
+	amounts[0] = sign * (int64) span->month;
+	amounts[1] = sign * (int64) span->day;
+	amounts[2] = sign * (span->time / 1000);
+
+	for (i = 0; i < 3; i++)
+	{
+		if (amounts[i] != 0)
+			steps[nsteps++] = i;
+	}
+
+	context->need_aggexpr_syntax = true;
+
+	/* The last step is the outermost */
+	for (i = nsteps - 1; i >= 0; i--)
+	{
+		BSON	   *parent = (i == nsteps - 1) ? qdoc : &add_docs[i + 1];
+
+		bsonAppendStartObject (parent, (i == nsteps - 1) ? key : "startDate",
+							   &add_stages[i]);
+		bsonAppendStartObject (&add_stages[i], "$dateAdd", &add_docs[i]);
+	}
+
+	context->bs_key = (nsteps == 0) ? key : "startDate";
+	mongo_build_expr_doc((nsteps == 0) ? qdoc : &add_docs[0], date, context);
+
+	for (i = 0; i < nsteps; i++)
+	{
+		BSON	   *parent = (i == nsteps - 1) ? qdoc : &add_docs[i + 1];
+
+		bsonAppendUTF8 (&add_docs[i], "unit", (char *) units[steps[i]]);
+		bsonAppendInt64 (&add_docs[i], "amount", amounts[steps[i]]);
+		bsonAppendFinishObject (&add_stages[i], &add_docs[i]);
+		bsonAppendFinishObject (parent, &add_stages[i]);
+	}
+
+	context->bs_key = key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Build a pattern matching operator in BSON query document.
+ *
+ * In a query, a column is matched like:
+ *		{ c1: { $regex: "^abc", $options: "" } }
+ *		{ c1: { $not: { $regex: "^abc", $options: "" }, $ne: null } }
+ * and a pattern without wildcards is compared by equality.  Otherwise it is
+ * built in aggregate expression syntax:
+ *		{ $regexMatch: { input: { $toLower: "$c1" }, regex: "^abc", options: "" } }
+ * A negated match is not true for null in PostgreSQL, so the input must not
+ * be null.  See mongo_get_regex_pattern.
+ */
+static void
+mongo_build_regex_doc(BSON *qdoc, OpExpr *node, qdoc_expr_cxt *context)
+{
+	Expr	   *input = (Expr *) linitial(node->args);
+	Expr	   *column = input;
+	char	   *key = context->bs_key;
+	const char *options;
+	bool		is_negated;
+	bool		is_exact;
+	char	   *pattern;
+
+	pattern = mongo_get_regex_pattern(node, &options, &is_negated, &is_exact);
+
+	while (IsA(column, RelabelType))
+		column = ((RelabelType *) column)->arg;
+
+	if (!context->need_aggexpr_syntax)
+	{
+		BSON		field_doc, cond_doc, not_doc, nin_array;
+		BSON	   *ptr_qdoc = qdoc;
+		char	   *colname;
+
+		/* A computed value is matched by "$expr" */
+		if (!IsA(column, Var))
+		{
+			mongo_build_expr_match_doc(qdoc, (Expr *) node, list_make1(input),
+									   context);
+			return;
+		}
+
+		colname = get_attname(context->rel_oid, ((Var *) column)->varattno,
+							  false);
+
+		if (context->conds_num > 1)
+		{
+			bsonAppendStartObject (qdoc, colname, &field_doc);
+			ptr_qdoc = &field_doc;
+		}
+		bsonAppendStartObject (ptr_qdoc, colname, &cond_doc);
+
+		if (is_exact && is_negated)
+		{
+			bsonAppendStartArray (&cond_doc, "$nin", &nin_array);
+			bsonAppendUTF8 (&nin_array, "0", pattern);
+			bsonAppendNull (&nin_array, "1");
+			bsonAppendFinishArray (&cond_doc, &nin_array);
+		}
+		else if (is_exact)
+			bsonAppendUTF8 (&cond_doc, "$eq", pattern);
+		else if (is_negated)
+		{
+			bsonAppendStartObject (&cond_doc, "$not", &not_doc);
+			bsonAppendUTF8 (&not_doc, "$regex", pattern);
+			bsonAppendUTF8 (&not_doc, "$options", (char *) options);
+			bsonAppendFinishObject (&cond_doc, &not_doc);
+			bsonAppendNull (&cond_doc, "$ne");
+		}
+		else
+		{
+			bsonAppendUTF8 (&cond_doc, "$regex", pattern);
+			bsonAppendUTF8 (&cond_doc, "$options", (char *) options);
+		}
+
+		bsonAppendFinishObject (ptr_qdoc, &cond_doc);
+		if (context->conds_num > 1)
+			bsonAppendFinishObject (qdoc, &field_doc);
+	}
+	else
+	{
+		BSON		expr_doc, and_doc, not_doc, not_args, match_doc, match_args;
+		BSON	   *ptr_qdoc = qdoc;
+		const char *match_key = key;
+
+		if (key == NULL)
+			elog(ERROR, "Could not add a pattern matching expression");
+
+		if (is_negated)
+		{
+			bsonAppendStartObject (qdoc, key, &expr_doc);
+			bsonAppendStartArray (&expr_doc, "$and", &and_doc);
+			bsonAppendStartObject (&and_doc, "0", &not_doc);
+			bsonAppendStartArray (&not_doc, "$not", &not_args);
+			ptr_qdoc = &not_args;
+			match_key = "0";
+		}
+
+		bsonAppendStartObject (ptr_qdoc, match_key, &match_doc);
+		if (is_exact)
+		{
+			BSON		literal_doc;
+
+			bsonAppendStartArray (&match_doc, "$eq", &match_args);
+			context->bs_key = "0";
+			mongo_build_expr_doc(&match_args, input, context);
+			/* See mongo_build_const_doc */
+			bsonAppendStartObject (&match_args, "1", &literal_doc);
+			bsonAppendUTF8 (&literal_doc, "$literal", pattern);
+			bsonAppendFinishObject (&match_args, &literal_doc);
+			bsonAppendFinishArray (&match_doc, &match_args);
+		}
+		else
+		{
+			bsonAppendStartObject (&match_doc, "$regexMatch", &match_args);
+			context->bs_key = "input";
+			mongo_build_expr_doc(&match_args, input, context);
+			bsonAppendUTF8 (&match_args, "regex", pattern);
+			bsonAppendUTF8 (&match_args, "options", (char *) options);
+			bsonAppendFinishObject (&match_doc, &match_args);
+		}
+		bsonAppendFinishObject (ptr_qdoc, &match_doc);
+
+		if (is_negated)
+		{
+			bsonAppendFinishArray (&not_doc, &not_args);
+			bsonAppendFinishObject (&and_doc, &not_doc);
+			mongo_append_not_null_doc(&and_doc, "1", input, context);
+			bsonAppendFinishArray (&expr_doc, &and_doc);
+			bsonAppendFinishObject (qdoc, &expr_doc);
+		}
+
+		context->bs_key = key;
+	}
+}
+
+/*
+ *	Build a searched CASE expression in BSON query document, like:
+ *		{ $switch: { branches: [{ case: { $and: [{ $gt: ["$c1", 0] },
+ *												 { $gt: ["$c1", null] }] },
+ *								  then: "$c2" }],
+ *					 default: null } }
+ * See mongo_case_cond_ok for the conditions.
+ */
+static void
+mongo_build_case_doc(BSON *qdoc, CaseExpr *node, qdoc_expr_cxt *context)
+{
+	char	   *key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	BSON		case_doc, switch_doc, branches_doc, branch_doc;
+	ListCell   *lc;
+
+	if (key == NULL)
+		elog(ERROR, "Could not add a CASE expression");
+
+	context->need_aggexpr_syntax = true;
+
+	bsonAppendStartObject (qdoc, key, &case_doc);
+	bsonAppendStartObject (&case_doc, "$switch", &switch_doc);
+	bsonAppendStartArray (&switch_doc, "branches", &branches_doc);
+	foreach(lc, node->args)
+	{
+		CaseWhen   *cw = lfirst_node(CaseWhen, lc);
+
+		bsonAppendStartObject (&branches_doc, "0", &branch_doc);
+		mongo_append_case_cond_doc(&branch_doc, "case", cw->expr, context);
+		context->bs_key = "then";
+		mongo_build_expr_doc(&branch_doc, cw->result, context);
+		bsonAppendFinishObject (&branches_doc, &branch_doc);
+	}
+	bsonAppendFinishArray (&switch_doc, &branches_doc);
+
+	/* The default result is a null constant when there is no ELSE */
+	context->bs_key = "default";
+	mongo_build_expr_doc(&switch_doc, node->defresult, context);
+	bsonAppendFinishObject (&case_doc, &switch_doc);
+	bsonAppendFinishObject (qdoc, &case_doc);
+
+	context->bs_key = key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Build a condition of CASE, which is false where PostgreSQL finds it null.
+ */
+static void
+mongo_append_case_cond_doc(BSON *qdoc, const char *key, Expr *cond,
+						   qdoc_expr_cxt *context)
+{
+	char	   *bs_key = context->bs_key;
+	BSON		cond_doc, args_doc;
+	ListCell   *lc;
+
+	if (IsA(cond, BoolExpr))
+	{
+		BoolExpr   *b = (BoolExpr *) cond;
+
+		bsonAppendStartObject (qdoc, key, &cond_doc);
+		bsonAppendStartArray (&cond_doc,
+							  (b->boolop == AND_EXPR) ? "$and" : "$or",
+							  &args_doc);
+		foreach(lc, b->args)
+			mongo_append_case_cond_doc(&args_doc, "0", (Expr *) lfirst(lc),
+									   context);
+		bsonAppendFinishArray (&cond_doc, &args_doc);
+		bsonAppendFinishObject (qdoc, &cond_doc);
+	}
+	else if (IsA(cond, NullTest))
+	{
+		NullTest   *nt = (NullTest *) cond;
+
+		/* A missing field is null as well */
+		if (nt->nulltesttype == IS_NULL)
+		{
+			bsonAppendStartObject (qdoc, key, &cond_doc);
+			bsonAppendStartArray (&cond_doc, "$lte", &args_doc);
+			context->bs_key = "0";
+			mongo_build_expr_doc(&args_doc, nt->arg, context);
+			bsonAppendNull (&args_doc, "1");
+			bsonAppendFinishArray (&cond_doc, &args_doc);
+			bsonAppendFinishObject (qdoc, &cond_doc);
+		}
+		else
+			mongo_append_not_null_doc(qdoc, key, nt->arg, context);
+	}
+	else if (mongo_validateOperatorName(((OpExpr *) cond)->opno, NULL,
+										NULL) == OP_CONDITIONAL)
+	{
+		bsonAppendStartObject (qdoc, key, &cond_doc);
+		bsonAppendStartArray (&cond_doc, "$and", &args_doc);
+		context->bs_key = "0";
+		mongo_build_expr_doc(&args_doc, cond, context);
+		foreach(lc, ((OpExpr *) cond)->args)
+		{
+			Expr	   *operand = (Expr *) lfirst(lc);
+
+			if (!IsA(operand, Const))
+				mongo_append_not_null_doc(&args_doc, "1", operand, context);
+		}
+		bsonAppendFinishArray (&cond_doc, &args_doc);
+		bsonAppendFinishObject (qdoc, &cond_doc);
+	}
+	else
+	{
+		/* A pattern match is not true for null */
+		context->bs_key = (char *) key;
+		mongo_build_expr_doc(qdoc, cond, context);
+	}
+
+	context->bs_key = bs_key;
+}
+
+/*
+ *	Build COALESCE in BSON query document, like:
+ *		{ $ifNull: ["$c1", { $ifNull: ["$c2", 0] }] }
+ * which treats a missing field as null.
+ */
+static void
+mongo_build_coalesce_doc(BSON *qdoc, CoalesceExpr *node, qdoc_expr_cxt *context)
+{
+	char	   *key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+
+	if (key == NULL)
+		elog(ERROR, "Could not add a COALESCE expression");
+
+	context->need_aggexpr_syntax = true;
+	mongo_append_ifnull_doc(qdoc, key, node->args, context);
+
+	context->bs_key = key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Build "$ifNull" of the first argument and the rest of them.
+ */
+static void
+mongo_append_ifnull_doc(BSON *qdoc, const char *key, List *args,
+						qdoc_expr_cxt *context)
+{
+	BSON		ifnull_doc, ifnull_args;
+
+	if (list_length(args) == 1)
+	{
+		context->bs_key = (char *) key;
+		mongo_build_expr_doc(qdoc, (Expr *) linitial(args), context);
+		return;
+	}
+
+	bsonAppendStartObject (qdoc, key, &ifnull_doc);
+	bsonAppendStartArray (&ifnull_doc, "$ifNull", &ifnull_args);
+	context->bs_key = "0";
+	mongo_build_expr_doc(&ifnull_args, (Expr *) linitial(args), context);
+	mongo_append_ifnull_doc(&ifnull_args, "1", list_copy_tail(args, 1),
+							context);
+	bsonAppendFinishArray (&ifnull_doc, &ifnull_args);
+	bsonAppendFinishObject (qdoc, &ifnull_doc);
+}
+
+/*
+ *	Build NULLIF in BSON query document, like:
+ *		{ $cond: [{ $eq: ["$c1", 0] }, null, "$c1"] }
+ */
+static void
+mongo_build_nullif_doc(BSON *qdoc, NullIfExpr *node, qdoc_expr_cxt *context)
+{
+	char	   *key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	BSON		nullif_doc, cond_args, eq_doc, eq_args;
+
+	if (key == NULL)
+		elog(ERROR, "Could not add a NULLIF expression");
+
+	context->need_aggexpr_syntax = true;
+
+	bsonAppendStartObject (qdoc, key, &nullif_doc);
+	bsonAppendStartArray (&nullif_doc, "$cond", &cond_args);
+	bsonAppendStartObject (&cond_args, "0", &eq_doc);
+	bsonAppendStartArray (&eq_doc, "$eq", &eq_args);
+	context->bs_key = "0";
+	mongo_build_expr_doc(&eq_args, (Expr *) linitial(node->args), context);
+	context->bs_key = "1";
+	mongo_build_expr_doc(&eq_args, (Expr *) lsecond(node->args), context);
+	bsonAppendFinishArray (&eq_doc, &eq_args);
+	bsonAppendFinishObject (&cond_args, &eq_doc);
+	bsonAppendNull (&cond_args, "1");
+	context->bs_key = "2";
+	mongo_build_expr_doc(&cond_args, (Expr *) linitial(node->args), context);
+	bsonAppendFinishArray (&nullif_doc, &cond_args);
+	bsonAppendFinishObject (qdoc, &nullif_doc);
+
+	context->bs_key = key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Build GREATEST or LEAST in BSON query document, like:
+ *		{ $max: ["$c1", "$c2", 0] }
+ * Like PostgreSQL, "$max" and "$min" ignore null values.
+ */
+static void
+mongo_build_minmax_doc(BSON *qdoc, MinMaxExpr *node, qdoc_expr_cxt *context)
+{
+	char	   *key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	BSON		minmax_doc, args_doc;
+	ListCell   *lc;
+
+	if (key == NULL)
+		elog(ERROR, "Could not add a GREATEST or LEAST expression");
+
+	context->need_aggexpr_syntax = true;
+
+	bsonAppendStartObject (qdoc, key, &minmax_doc);
+	bsonAppendStartArray (&minmax_doc,
+						  (node->op == IS_GREATEST) ? "$max" : "$min",
+						  &args_doc);
+	context->bs_key = "0";
+	foreach(lc, node->args)
+		mongo_build_expr_doc(&args_doc, (Expr *) lfirst(lc), context);
+	bsonAppendFinishArray (&minmax_doc, &args_doc);
+	bsonAppendFinishObject (qdoc, &minmax_doc);
+
+	context->bs_key = key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Build a condition of a query in aggregate expression syntax, like:
+ *		{ $expr: { $and: [ { $eq: [{ $hour: "$c1" }, 10] },
+ *						   { $gt: [{ $hour: "$c1" }, null] } ] } }
+ *
+ * MongoDB orders null before any other value, while a comparison with null
+ * is not true in PostgreSQL, so each given operand that is not a constant
+ * must be greater than null as well.
+ */
+static void
+mongo_build_expr_match_doc(BSON *qdoc, Expr *node, List *operands,
+						   qdoc_expr_cxt *context)
+{
+	char	   *key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	BSON		cond_doc, expr_doc, and_doc;
+	BSON	   *ptr_qdoc = qdoc;
+	ListCell   *lc;
+
+	/* A condition combined with others is an element of their array */
+	if (context->conds_num > 1)
+	{
+		bsonAppendStartObject (qdoc, "$expr", &cond_doc);
+		ptr_qdoc = &cond_doc;
+	}
+
+	bsonAppendStartObject (ptr_qdoc, "$expr", &expr_doc);
+	bsonAppendStartArray (&expr_doc, "$and", &and_doc);
+
+	context->need_aggexpr_syntax = true;
+	context->bs_key = "0";
+	mongo_build_expr_doc(&and_doc, node, context);
+
+	foreach(lc, operands)
+	{
+		Expr	   *operand = (Expr *) lfirst(lc);
+
+		if (!IsA(operand, Const))
+			mongo_append_not_null_doc(&and_doc, "1", operand, context);
+	}
+
+	bsonAppendFinishArray (&expr_doc, &and_doc);
+	bsonAppendFinishObject (ptr_qdoc, &expr_doc);
+	if (context->conds_num > 1)
+		bsonAppendFinishObject (qdoc, &cond_doc);
+
+	context->bs_key = key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Build a check that an expression is neither null nor missing, like:
+ *		{ $gt: ["$c1", null] }
+ */
+static void
+mongo_append_not_null_doc(BSON *qdoc, const char *key, Expr *expr,
+						  qdoc_expr_cxt *context)
+{
+	char	   *bs_key = context->bs_key;
+	bool		need_aggexpr_syntax = context->need_aggexpr_syntax;
+	BSON		gt_doc, gt_args;
+
+	bsonAppendStartObject (qdoc, key, &gt_doc);
+	bsonAppendStartArray (&gt_doc, "$gt", &gt_args);
+	context->need_aggexpr_syntax = true;
+	context->bs_key = "0";
+	mongo_build_expr_doc(&gt_args, expr, context);
+	bsonAppendNull (&gt_args, "1");
+	bsonAppendFinishArray (&gt_doc, &gt_args);
+	bsonAppendFinishObject (qdoc, &gt_doc);
+
+	context->bs_key = bs_key;
+	context->need_aggexpr_syntax = need_aggexpr_syntax;
+}
+
+/*
+ *	Get the index of a parameter of the query document, or -1 if the
+ *	expression is not one.
+ */
+static int
+mongo_get_param_index(Expr *node, qdoc_expr_cxt *context)
+{
+	ListCell   *lc;
+	int			i = 0;
+
+	/* We ignore binary-compatible relabeling */
+	while (node && IsA(node, RelabelType))
+		node = ((RelabelType *) node)->arg;
+
+	if (node == NULL || !(IsA(node, Param) || IsA(node, Var)))
+		return -1;
+
+	foreach(lc, context->param_exprs)
+	{
+		if (equal(node, lfirst(lc)))
+			return i;
+		i++;
+	}
+
+	return -1;
+}
+
+/*
+ *	Build parameter value in BSON query document.  Until the values are
+ *	known, as for EXPLAIN without ANALYZE, a "$n" placeholder is shown.
+ *
+ *	In a query on a field, { c1: { $eq: null } } would match null and missing
+ *	fields, while a comparison with a null parameter matches nothing.  The
+ *	operator is replaced by one that is never true:
+ *		{ c1: { $in: [] } }
+ */
+static void
+mongo_append_param_value(BSON *qdoc, const char *keyName, int paramno,
+						 qdoc_expr_cxt *context)
+{
+	if (context->param_values == NULL)
+	{
+		char	   *placeholder = psprintf("$%d", paramno + 1);
+
+		bsonAppendUTF8(qdoc, keyName, placeholder);
+	}
+	else if (context->param_isnulls[paramno] &&
+			 !context->need_aggexpr_syntax)
+	{
+		BSON		in_array;
+
+		bsonAppendStartArray(qdoc, "$in", &in_array);
+		bsonAppendFinishArray(qdoc, &in_array);
+	}
+	else
+	{
+		Node	   *param = (Node *) list_nth(context->param_exprs, paramno);
+		Oid			typid = exprType(param);
+
+		/* See mongo_build_const_doc */
+		if (context->need_aggexpr_syntax && !context->param_isnulls[paramno] &&
+			(typid == TEXTOID || typid == VARCHAROID ||
+			 typid == BPCHAROID || typid == NAMEOID))
+		{
+			BSON		literal_doc;
+
+			bsonAppendStartObject(qdoc, (char *) keyName, &literal_doc);
+			append_mongo_value(&literal_doc, "$literal",
+							   context->param_values[paramno], false, typid);
+			bsonAppendFinishObject(qdoc, &literal_doc);
+		}
+		else
+			append_mongo_value(qdoc, keyName, context->param_values[paramno],
+							   context->param_isnulls[paramno], typid);
+	}
+}
+
+/*
+ *	Get the MongoDB operator of an aggregate function, like "$avg".
+ */
+static char *
+mongo_get_aggregate_operator(char *proname)
+{
+	if (strcmp(proname, "stddev_pop") == 0)
+		return "$stdDevPop";
+	if (strcmp(proname, "stddev") == 0 ||
+		strcmp(proname, "stddev_samp") == 0)
+		return "$stdDevSamp";
+	/* false sorts before true */
+	if (strcmp(proname, "bool_and") == 0 ||
+		strcmp(proname, "every") == 0)
+		return "$min";
+	if (strcmp(proname, "bool_or") == 0)
+		return "$max";
+
+	return psprintf("$%s", proname);
+}
+
+/*
+ *	Build aggregate function in BSON query document.
+ */
+static void
+mongo_build_aggref_doc(BSON *qdoc, Aggref *node, qdoc_expr_cxt *context)
+{
+	BSON aggref_doc;
+	char *proname;
+
+	/* Only basic aggregation, or its partial step, accepted. */
+	Assert(node->aggsplit == AGGSPLIT_SIMPLE ||
+		   node->aggsplit == AGGSPLIT_INITIAL_SERIAL);
+
+	/* Get function name */
+	proname = get_func_name(node->aggfnoid);
+	if (proname == NULL)
+		elog(ERROR, "No such function name for function OID %u", node->aggfnoid);
+
+	/* Build reference target in aggregation group likes: {"ref0: "$avg" } */
+	if (context->bs_key == NULL)
+		elog(ERROR, "Could not add a aggregate function");
+
+	/*
+	 * The state of a partial avg or stddev is put together after "$group",
+	 * and so is a sum, which is null for no value.
+	 */
+	if ((node->aggsplit != AGGSPLIT_SIMPLE ||
+		 (strcmp(proname, "sum") == 0 && !node->aggdistinct)) &&
+		mongo_is_finalized_aggref(node))
+	{
+		mongo_aggref_ref *agg_ref = palloc0(sizeof(mongo_aggref_ref));
+
+		agg_ref->expr = (Expr *) node;
+		agg_ref->ref_target = context->bs_key;
+		context->final_agg_list = lappend(context->final_agg_list, agg_ref);
+
+		mongo_append_partial_agg_doc(qdoc, node, context);
+		return;
+	}
+
+	bsonAppendStartObject (qdoc, context->bs_key, &aggref_doc);
+
+	/*
+	 * With DISTINCT, collect the distinct values of the argument, which the
+	 * aggregate is computed from after the "$group" stage:
+	 *		{ $addToSet: <expression> }
+	 */
+	if (node->aggdistinct)
+	{
+		mongo_aggref_ref *agg_ref = palloc0(sizeof(mongo_aggref_ref));
+		TargetEntry *tle = (TargetEntry *) linitial(node->args);
+
+		agg_ref->expr = (Expr *) node;
+		agg_ref->ref_target = context->bs_key;
+		context->final_agg_list = lappend(context->final_agg_list, agg_ref);
+
+		context->bs_key = "$addToSet";
+		mongo_build_expr_doc(&aggref_doc, tle->expr, context);
+		context->bs_key = NULL;
+
+		bsonAppendFinishObject (qdoc, &aggref_doc);
+		return;
+	}
+
+	/* array_agg, string_agg and jsonb_agg build an array of the values */
+	if (mongo_is_collect_aggregate(proname))
+	{
+		if (mongo_is_finalized_aggref(node))
+		{
+			mongo_aggref_ref *agg_ref = palloc0(sizeof(mongo_aggref_ref));
+
+			agg_ref->expr = (Expr *) node;
+			agg_ref->ref_target = context->bs_key;
+			context->final_agg_list = lappend(context->final_agg_list, agg_ref);
+		}
+
+		mongo_append_collect_doc(&aggref_doc, node, context);
+
+		bsonAppendFinishObject (qdoc, &aggref_doc);
+		return;
+	}
+
+	/* Convert to MongoDB aggregate function */
+	proname = mongo_get_aggregate_operator(proname);
+
+	/* aggstar can be set only in zero-argument aggregates */
+	if (node->aggstar)
+	{
+		/*
+		 * Currently, we only support count(*).
+		 * This function is built by using "sum" function like:
+		 * 	{ "$sum" : 1 }
+		 */
+		if (strcmp(proname, "$count") == 0)
+		{
+			bsonAppendInt32(&aggref_doc, "$sum", 1);
+		}
+	}
+	else if (strcmp(proname, "$count") == 0)
+	{
+		/*
+		 * count(expression) counts the values that are not null:
+		 *		{ $sum: { $cond: [{ $gt: [<expression>, null] }, 1, 0] } }
+		 */
+		TargetEntry *tle = (TargetEntry *) linitial(node->args);
+		BSON		cond_doc, cond_args;
+
+		bsonAppendStartObject (&aggref_doc, "$sum", &cond_doc);
+		bsonAppendStartArray (&cond_doc, "$cond", &cond_args);
+		mongo_append_not_null_doc(&cond_args, "0", tle->expr, context);
+		bsonAppendInt32 (&cond_args, "1", 1);
+		bsonAppendInt32 (&cond_args, "2", 0);
+		bsonAppendFinishArray (&cond_doc, &cond_args);
+		bsonAppendFinishObject (&aggref_doc, &cond_doc);
+		context->bs_key = NULL;
+	}
+	else
+	{
+		TargetEntry *tle = NULL;
+		Node	   *n = NULL;
+		ListCell   *arg = NULL;
+		int			args_num = list_length(node->args);
+
+		context->bs_key = proname;
+		if (args_num == 1)
+		{
+			tle = (TargetEntry *) lfirst(list_head(node->args));
+			n = (Node *) tle->expr;
+
+			/* Syntax: e.g. { $max: <expression> } */
+			mongo_build_expr_doc(&aggref_doc, (Expr *)n, context);
+		}
+		else
+		{
+			BSON args_doc;
+
+			/* Syntax: e.g. { $max: [ <expression1>, <expression2> ... ]  } */
+			bsonAppendStartArray (&aggref_doc, context->bs_key, &args_doc);
+			foreach(arg, node->args)
+			{
+				tle = (TargetEntry *) lfirst(arg);
+				n = (Node *) tle->expr;
+
+				if (tle->resjunk)
+					continue;
+
+				mongo_build_expr_doc(&args_doc, (Expr *)n, context);
+			}
+			bsonAppendFinishArray (&aggref_doc, &args_doc);
+		}
+		context->bs_key = NULL;
+	}
+
+	bsonAppendFinishObject (qdoc, &aggref_doc);
+}
+
+/*
+ * mongo_is_collect_aggregate
+ *		Returns true for the aggregate functions built on an array of the
+ *		values of the group.
+ */
+static bool
+mongo_is_collect_aggregate(char *aggname)
+{
+	return (strcmp(aggname, "array_agg") == 0 ||
+			strcmp(aggname, "string_agg") == 0 ||
+			strcmp(aggname, "jsonb_agg") == 0);
+}
+
+/*
+ * mongo_collect_aggregate_ok
+ *		Check whether array_agg, string_agg or jsonb_agg can be computed from
+ *		the values collected by "$push".
+ *
+ * The result is read back as an array of the argument type, or as a JSON
+ * array, so the argument must have a BSON equivalent.  The delimiter of
+ * string_agg must be a constant.  The ordering inside the aggregate is done
+ * by "$sortArray", on keys sorted by MongoDB like PostgreSQL does, which
+ * needs a server of version 5.2 or later.
+ */
+static bool
+mongo_collect_aggregate_ok(Aggref *agg, char *aggname, int svr_version)
+{
+	List	   *args = NIL;
+	Oid			argtype;
+	ListCell   *lc;
+
+	foreach(lc, agg->args)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+
+		if (!tle->resjunk)
+			args = lappend(args, tle->expr);
+	}
+
+	if (args == NIL)
+		return false;
+
+	argtype = exprType((Node *) linitial(args));
+
+	if (strcmp(aggname, "string_agg") == 0)
+	{
+		Const	   *delim;
+
+		if (list_length(args) != 2 || argtype != TEXTOID)
+			return false;
+
+		delim = (Const *) lsecond(args);
+		if (!IsA(delim, Const) || delim->constisnull ||
+			delim->consttype != TEXTOID)
+			return false;
+	}
+	else
+	{
+		if (list_length(args) != 1)
+			return false;
+
+		switch (argtype)
+		{
+			case BOOLOID:
+			case INT2OID:
+			case INT4OID:
+			case INT8OID:
+			case FLOAT4OID:
+			case FLOAT8OID:
+			case NUMERICOID:
+			case TEXTOID:
+			case VARCHAROID:
+				break;
+			case DATEOID:
+			case TIMESTAMPOID:
+			case TIMESTAMPTZOID:
+				/* BSON dates have no plain JSON form */
+				if (strcmp(aggname, "jsonb_agg") == 0)
+					return false;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	/* "$sortArray" is only known from MongoDB 5.2 on */
+	if (agg->aggorder != NIL && svr_version < 502)
+		return false;
+
+	foreach(lc, agg->aggorder)
+	{
+		SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+		TargetEntry *tle = get_sortgroupref_tle(sgc->tleSortGroupRef,
+												agg->args);
+		Oid			typid = exprType((Node *) tle->expr);
+		TypeCacheEntry *typentry;
+
+		if (!mongo_is_sortable_type(typid, exprCollation((Node *) tle->expr)))
+			return false;
+
+		/* The ordering must be the type's default btree ordering */
+		typentry = lookup_type_cache(typid,
+									 TYPECACHE_LT_OPR | TYPECACHE_GT_OPR);
+		if (sgc->sortop != typentry->lt_opr &&
+			sgc->sortop != typentry->gt_opr)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * mongo_is_finalized_aggref
+ *		Returns true if the given aggregate is computed after the "$group"
+ *		stage, from the values it collected.
+ */
+bool
+mongo_is_finalized_aggref(Aggref *agg)
+{
+	char	   *aggname;
+
+	if (agg->aggdistinct || agg->aggorder)
+		return true;
+
+	aggname = get_func_name(agg->aggfnoid);
+	if (aggname == NULL)
+		return false;
+
+	/*
+	 * "$sum" gives 0 for no value, where sum is null, so a sum is computed
+	 * along with the count of its values.  So is the partial state of a sum.
+	 */
+	if (strcmp(aggname, "sum") == 0)
+		return true;
+
+	/* The partial state of these is an array, see mongo_partial_aggregate_ok */
+	if (agg->aggsplit != AGGSPLIT_SIMPLE)
+		return (strcmp(aggname, "avg") == 0 ||
+				strncmp(aggname, "stddev", 6) == 0);
+
+	return (strcmp(aggname, "string_agg") == 0);
+}
+
+/*
+ * mongo_partial_aggregate_ok
+ *		Check whether the partial state of the given aggregate can be computed
+ *		by MongoDB.
+ *
+ * The state must be of a plain type, as PostgreSQL combines the states of the
+ * partitions with the aggregate's combine function:
+ *	- count(*), min, max, bool_and, bool_or, and sum of int2, int4, float4
+ *	  and float8, whose state is the result of the aggregate itself (an int8
+ *	  for the sum of integers).
+ *	- avg of int2 and int4, whose state is the int8[] {count, sum}.
+ *	- avg, stddev, stddev_pop and stddev_samp of float4 and float8, whose
+ *	  state is the float8[] {N, sum(X), sum((X - mean)^2)}.
+ * Aggregates with an internal state, such as the sum of int8 or numeric, are
+ * not pushed down.
+ */
+static bool
+mongo_partial_aggregate_ok(Aggref *agg)
+{
+	char	   *aggname = get_func_name(agg->aggfnoid);
+	Oid			argtype = InvalidOid;
+
+	if (aggname == NULL || agg->aggdistinct || agg->aggorder)
+		return false;
+
+	if (agg->aggstar)
+		return (strcmp(aggname, "count") == 0);
+
+	if (list_length(agg->args) != 1)
+		return false;
+
+	argtype = exprType((Node *) ((TargetEntry *) linitial(agg->args))->expr);
+
+	if (strcmp(aggname, "min") == 0 ||
+		strcmp(aggname, "max") == 0 ||
+		strcmp(aggname, "bool_and") == 0 ||
+		strcmp(aggname, "bool_or") == 0 ||
+		strcmp(aggname, "every") == 0)
+		return true;
+
+	if (strcmp(aggname, "sum") == 0)
+		return (argtype == INT2OID || argtype == INT4OID ||
+				argtype == FLOAT4OID || argtype == FLOAT8OID);
+
+	if (strcmp(aggname, "avg") == 0)
+		return (argtype == INT2OID || argtype == INT4OID ||
+				argtype == FLOAT4OID || argtype == FLOAT8OID);
+
+	if (strcmp(aggname, "stddev") == 0 ||
+		strcmp(aggname, "stddev_pop") == 0 ||
+		strcmp(aggname, "stddev_samp") == 0)
+		return (argtype == FLOAT4OID || argtype == FLOAT8OID);
+
+	return false;
+}
+
+/*
+ * mongo_append_partial_agg_doc
+ *		Build the accumulators of the partial state of avg or stddev, or of
+ *		a sum, which is null for no value, in the "$group" stage, like:
+ *			ref1: { $sum: { $cond: [{ $lte: ["$c1", null] }, 0, 1] } },
+ *			ref1_sum: { $sum: "$c1" },
+ *			ref1_sd: { $stdDevPop: "$c1" }
+ *		The last one is for a float8 state only.
+ *
+ * mongo_append_partial_final_doc makes the state array of them.
+ */
+static void
+mongo_append_partial_agg_doc(BSON *qdoc, Aggref *node, qdoc_expr_cxt *context)
+{
+	Expr	   *arg = ((TargetEntry *) linitial(node->args))->expr;
+	char	   *key = context->bs_key;
+	BSON		count_doc, cond_doc, cond_args, null_doc, null_args;
+	BSON		sum_doc;
+
+	/* The count of non-null values */
+	bsonAppendStartObject (qdoc, key, &count_doc);
+	bsonAppendStartObject (&count_doc, "$sum", &cond_doc);
+	bsonAppendStartArray (&cond_doc, "$cond", &cond_args);
+	bsonAppendStartObject (&cond_args, "0", &null_doc);
+	bsonAppendStartArray (&null_doc, "$lte", &null_args);
+	context->bs_key = "0";
+	mongo_build_expr_doc(&null_args, arg, context);
+	bsonAppendNull (&null_args, "1");
+	bsonAppendFinishArray (&null_doc, &null_args);
+	bsonAppendFinishObject (&cond_args, &null_doc);
+	bsonAppendInt32 (&cond_args, "1", 0);
+	bsonAppendInt32 (&cond_args, "2", 1);
+	bsonAppendFinishArray (&cond_doc, &cond_args);
+	bsonAppendFinishObject (&count_doc, &cond_doc);
+	bsonAppendFinishObject (qdoc, &count_doc);
+
+	bsonAppendStartObject (qdoc, psprintf("%s_sum", key), &sum_doc);
+	context->bs_key = "$sum";
+	mongo_build_expr_doc(&sum_doc, arg, context);
+	bsonAppendFinishObject (qdoc, &sum_doc);
+
+	if (node->aggtype == FLOAT8ARRAYOID)
+	{
+		BSON		sd_doc;
+
+		bsonAppendStartObject (qdoc, psprintf("%s_sd", key), &sd_doc);
+		context->bs_key = "$stdDevPop";
+		mongo_build_expr_doc(&sd_doc, arg, context);
+		bsonAppendFinishObject (qdoc, &sd_doc);
+	}
+
+	context->bs_key = NULL;
+}
+
+/*
+ * mongo_append_value_count_doc
+ *		Append the count of the non-null values of an array, like:
+ *			$size: { $filter: { input: "$ref1", cond: { $ne: ["$$this", null] } } }
+ */
+static void
+mongo_append_value_count_doc(BSON *qdoc, const char *key, const char *input)
+{
+	BSON		filter_doc, filter_args, cond_doc, ne_args;
+
+	bsonAppendStartObject (qdoc, (char *) key, &filter_doc);
+	bsonAppendStartObject (&filter_doc, "$filter", &filter_args);
+	bsonAppendUTF8 (&filter_args, "input", (char *) input);
+	bsonAppendStartObject (&filter_args, "cond", &cond_doc);
+	bsonAppendStartArray (&cond_doc, "$ne", &ne_args);
+	bsonAppendUTF8 (&ne_args, "0", "$$this");
+	bsonAppendNull (&ne_args, "1");
+	bsonAppendFinishArray (&cond_doc, &ne_args);
+	bsonAppendFinishObject (&filter_args, &cond_doc);
+	bsonAppendFinishObject (&filter_doc, &filter_args);
+	bsonAppendFinishObject (qdoc, &filter_doc);
+}
+
+/*
+ * mongo_append_partial_final_doc
+ *		Put together the partial state of avg or stddev, like:
+ *			ref1: ["$ref1", "$ref1_sum",
+ *				   { $ifNull: [{ $multiply: ["$ref1", "$ref1_sd", "$ref1_sd"] }, 0] }]
+ *
+ * The sum of the squared deviations from the mean is N times the population
+ * variance, which is null for no value.  A sum, which is null for no value
+ * as well, is taken when the count of values is not zero.
+ */
+static void
+mongo_append_partial_final_doc(BSON *qdoc, const char *key, Aggref *node)
+{
+	BSON		state_doc;
+
+	if (strcmp(get_func_name(node->aggfnoid), "sum") == 0)
+	{
+		BSON		sum_doc, cond_args, gt_doc, gt_args;
+
+		/* ref1: { $cond: [{ $gt: ["$ref1", 0] }, "$ref1_sum", null] } */
+		bsonAppendStartObject (qdoc, key, &sum_doc);
+		bsonAppendStartArray (&sum_doc, "$cond", &cond_args);
+		bsonAppendStartObject (&cond_args, "0", &gt_doc);
+		bsonAppendStartArray (&gt_doc, "$gt", &gt_args);
+		bsonAppendUTF8 (&gt_args, "0", psprintf("$%s", key));
+		bsonAppendInt32 (&gt_args, "1", 0);
+		bsonAppendFinishArray (&gt_doc, &gt_args);
+		bsonAppendFinishObject (&cond_args, &gt_doc);
+		bsonAppendUTF8 (&cond_args, "1", psprintf("$%s_sum", key));
+		bsonAppendNull (&cond_args, "2");
+		bsonAppendFinishArray (&sum_doc, &cond_args);
+		bsonAppendFinishObject (qdoc, &sum_doc);
+		return;
+	}
+
+	bsonAppendStartArray (qdoc, key, &state_doc);
+	bsonAppendUTF8 (&state_doc, "0", psprintf("$%s", key));
+	bsonAppendUTF8 (&state_doc, "1", psprintf("$%s_sum", key));
+
+	if (node->aggtype == FLOAT8ARRAYOID)
+	{
+		BSON		ifnull_doc, ifnull_args, mul_doc, mul_args;
+		char	   *sd = psprintf("$%s_sd", key);
+
+		bsonAppendStartObject (&state_doc, "2", &ifnull_doc);
+		bsonAppendStartArray (&ifnull_doc, "$ifNull", &ifnull_args);
+		bsonAppendStartObject (&ifnull_args, "0", &mul_doc);
+		bsonAppendStartArray (&mul_doc, "$multiply", &mul_args);
+		bsonAppendUTF8 (&mul_args, "0", psprintf("$%s", key));
+		bsonAppendUTF8 (&mul_args, "1", sd);
+		bsonAppendUTF8 (&mul_args, "2", sd);
+		bsonAppendFinishArray (&mul_doc, &mul_args);
+		bsonAppendFinishObject (&ifnull_args, &mul_doc);
+		bsonAppendInt32 (&ifnull_args, "1", 0);
+		bsonAppendFinishArray (&ifnull_doc, &ifnull_args);
+		bsonAppendFinishObject (&state_doc, &ifnull_doc);
+	}
+
+	bsonAppendFinishArray (qdoc, &state_doc);
+}
+
+/*
+ * mongo_append_collect_doc
+ *		Build the "$push" of the values of array_agg, string_agg or jsonb_agg.
+ *
+ * A missing field is pushed as null, like:
+ *		{ $push: { $ifNull: ["$c1", null] } }
+ * With ORDER BY, the value is pushed along with its sort keys, each preceded
+ * by a flag of it being null:
+ *		{ $push: { v: { $ifNull: ["$c1", null] },
+ *				   n0: { $lte: ["$c2", null] }, k0: "$c2" } }
+ */
+static void
+mongo_append_collect_doc(BSON *qdoc, Aggref *node, qdoc_expr_cxt *context)
+{
+	TargetEntry *tle = (TargetEntry *) linitial(node->args);
+	BSON		push_doc, value_doc, ifnull_args;
+	BSON	   *parent = qdoc;
+	ListCell   *lc;
+	int			i = 0;
+
+	if (node->aggorder)
+	{
+		bsonAppendStartObject (qdoc, "$push", &push_doc);
+		parent = &push_doc;
+	}
+
+	bsonAppendStartObject (parent, node->aggorder ? "v" : "$push", &value_doc);
+	bsonAppendStartArray (&value_doc, "$ifNull", &ifnull_args);
+	context->bs_key = "0";
+	mongo_build_expr_doc(&ifnull_args, tle->expr, context);
+	bsonAppendNull (&ifnull_args, "1");
+	bsonAppendFinishArray (&value_doc, &ifnull_args);
+	bsonAppendFinishObject (parent, &value_doc);
+
+	foreach(lc, node->aggorder)
+	{
+		SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+		Expr	   *key = get_sortgroupref_tle(sgc->tleSortGroupRef,
+											   node->args)->expr;
+		BSON		null_doc, null_args;
+
+		bsonAppendStartObject (&push_doc, psprintf("n%d", i), &null_doc);
+		bsonAppendStartArray (&null_doc, "$lte", &null_args);
+		context->bs_key = "0";
+		mongo_build_expr_doc(&null_args, key, context);
+		bsonAppendNull (&null_args, "1");
+		bsonAppendFinishArray (&null_doc, &null_args);
+		bsonAppendFinishObject (&push_doc, &null_doc);
+
+		context->bs_key = psprintf("k%d", i);
+		mongo_build_expr_doc(&push_doc, key, context);
+
+		i++;
+	}
+
+	if (node->aggorder)
+		bsonAppendFinishObject (qdoc, &push_doc);
+
+	context->bs_key = NULL;
+}
+
+/*
+ * mongo_append_sorted_input_doc
+ *		Append the array collected for the given aggregate under the key,
+ *		in the order of its ORDER BY, like:
+ *			{ $map: { input: { $sortArray: { input: "$ref1",
+ *												 sortBy: { n0: 1, k0: 1 } } },
+ *					  in: "$$this.v" } }
+ *
+ * See mongo_append_collect_doc for the layout of the collected documents.
+ */
+static void
+mongo_append_sorted_input_doc(BSON *qdoc, const char *key, Aggref *node,
+							  const char *input)
+{
+	BSON		map_doc, map_args, sort_doc, sort_args, sort_by;
+	ListCell   *lc;
+	int			i = 0;
+
+	if (node->aggorder == NIL)
+	{
+		bsonAppendUTF8 (qdoc, key, (char *) input);
+		return;
+	}
+
+	bsonAppendStartObject (qdoc, key, &map_doc);
+	bsonAppendStartObject (&map_doc, "$map", &map_args);
+	bsonAppendStartObject (&map_args, "input", &sort_doc);
+	bsonAppendStartObject (&sort_doc, "$sortArray", &sort_args);
+	bsonAppendUTF8 (&sort_args, "input", (char *) input);
+	bsonAppendStartObject (&sort_args, "sortBy", &sort_by);
+
+	foreach(lc, node->aggorder)
+	{
+		SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+		TypeCacheEntry *typentry;
+		Oid			typid;
+
+		typid = exprType((Node *) get_sortgroupref_tle(sgc->tleSortGroupRef,
+													   node->args)->expr);
+		typentry = lookup_type_cache(typid, TYPECACHE_LT_OPR);
+
+		/* The null flag is true for nulls, which sort after false */
+		bsonAppendInt32 (&sort_by, psprintf("n%d", i), sgc->nulls_first ? -1 : 1);
+		bsonAppendInt32 (&sort_by, psprintf("k%d", i),
+						 sgc->sortop == typentry->lt_opr ? 1 : -1);
+		i++;
+	}
+
+	bsonAppendFinishObject (&sort_args, &sort_by);
+	bsonAppendFinishObject (&sort_doc, &sort_args);
+	bsonAppendFinishObject (&map_args, &sort_doc);
+	bsonAppendUTF8 (&map_args, "in", "$$this.v");
+	bsonAppendFinishObject (&map_doc, &map_args);
+	bsonAppendFinishObject (qdoc, &map_doc);
+}
+
+/*
+ * mongo_append_collect_final_doc
+ *		Compute array_agg, string_agg or jsonb_agg from the collected array.
+ *
+ * Only the ordering is left to do for array_agg and jsonb_agg.  string_agg
+ * concatenates the non-null values, like:
+ *		{ $reduce: { input: { $filter: { input: "$ref1",
+ *										 cond: { $ne: ["$$this", null] } } },
+ *					 initialValue: null,
+ *					 in: { $cond: [{ $eq: ["$$value", null] }, "$$this",
+ *								   { $concat: ["$$value", { $literal: "," },
+ *											   "$$this"] }] } } }
+ * which is null for no value, as in PostgreSQL.
+ */
+static void
+mongo_append_collect_final_doc(BSON *qdoc, const char *key, Aggref *node,
+							   char *proname)
+{
+	char	   *input = psprintf("$%s", key);
+	Const	   *delim;
+	BSON		reduce_doc, reduce_args, filter_doc, filter_args, cond_doc,
+				ne_args, in_doc, cond_args, eq_doc, eq_args, concat_doc,
+				concat_args, literal_doc;
+
+	if (strcmp(proname, "string_agg") != 0)
+	{
+		mongo_append_sorted_input_doc(qdoc, key, node, input);
+		return;
+	}
+
+	delim = (Const *) ((TargetEntry *) lsecond(node->args))->expr;
+
+	bsonAppendStartObject (qdoc, key, &reduce_doc);
+	bsonAppendStartObject (&reduce_doc, "$reduce", &reduce_args);
+
+	bsonAppendStartObject (&reduce_args, "input", &filter_doc);
+	bsonAppendStartObject (&filter_doc, "$filter", &filter_args);
+	mongo_append_sorted_input_doc(&filter_args, "input", node, input);
+	bsonAppendStartObject (&filter_args, "cond", &cond_doc);
+	bsonAppendStartArray (&cond_doc, "$ne", &ne_args);
+	bsonAppendUTF8 (&ne_args, "0", "$$this");
+	bsonAppendNull (&ne_args, "1");
+	bsonAppendFinishArray (&cond_doc, &ne_args);
+	bsonAppendFinishObject (&filter_args, &cond_doc);
+	bsonAppendFinishObject (&filter_doc, &filter_args);
+	bsonAppendFinishObject (&reduce_args, &filter_doc);
+
+	bsonAppendNull (&reduce_args, "initialValue");
+
+	bsonAppendStartObject (&reduce_args, "in", &in_doc);
+	bsonAppendStartArray (&in_doc, "$cond", &cond_args);
+	bsonAppendStartObject (&cond_args, "0", &eq_doc);
+	bsonAppendStartArray (&eq_doc, "$eq", &eq_args);
+	bsonAppendUTF8 (&eq_args, "0", "$$value");
+	bsonAppendNull (&eq_args, "1");
+	bsonAppendFinishArray (&eq_doc, &eq_args);
+	bsonAppendFinishObject (&cond_args, &eq_doc);
+	bsonAppendUTF8 (&cond_args, "1", "$$this");
+	bsonAppendStartObject (&cond_args, "2", &concat_doc);
+	bsonAppendStartArray (&concat_doc, "$concat", &concat_args);
+	bsonAppendUTF8 (&concat_args, "0", "$$value");
+	/* The delimiter is taken as it is, even if it starts with "$" */
+	bsonAppendStartObject (&concat_args, "1", &literal_doc);
+	bsonAppendUTF8 (&literal_doc, "$literal",
+					TextDatumGetCString(delim->constvalue));
+	bsonAppendFinishObject (&concat_args, &literal_doc);
+	bsonAppendUTF8 (&concat_args, "2", "$$this");
+	bsonAppendFinishArray (&concat_doc, &concat_args);
+	bsonAppendFinishObject (&cond_args, &concat_doc);
+	bsonAppendFinishArray (&in_doc, &cond_args);
+	bsonAppendFinishObject (&reduce_args, &in_doc);
+
+	bsonAppendFinishObject (&reduce_doc, &reduce_args);
+	bsonAppendFinishObject (qdoc, &reduce_doc);
+}
+
+/*
+ *	Build RelabelType expression in BSON query document.
+ *		Discard explicit cast type.
+ */
+static void
+mongo_build_relabeltype_doc(BSON *qdoc, RelabelType *node, qdoc_expr_cxt *context)
+{
+	mongo_build_expr_doc(qdoc, node->arg, context);
+}
+
+/*
+ * Build IS [NOT] NULL expression query document, e.g:
+ * 	c1 IS NULL is transformed by { eq: ["$c1", null] }
+ * 	c1 IS NOT NULL is transformed by { ne: ["$c1", null] }
+ */
+static void
+mongo_build_NullTest_doc(BSON *qdoc, NullTest *node, qdoc_expr_cxt *context)
+{
+	BSON nulltest_doc;
+	BSON op_doc;
+	const char* opname = NULL;
+	char *input_expr_str = NULL;
+
+	if (node->nulltesttype == IS_NULL)
+		opname = "$eq";
+	else
+		opname = "$ne";
+
+	/* Input expression only is field name. */
+	if (IsA(node->arg, Var))
+		input_expr_str = get_attname(context->rel_oid, ((Var *) node->arg)->varattno, false);
+	else
+		elog (ERROR, "Could not build BSON document for input expression of NullTest");
+
+	if (context->need_aggexpr_syntax)
+	{
+		ListCell *aggcell;
+		char *ref_key = NULL;
+
+		foreach(aggcell, context->agg_ref_list)
+		{
+			mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
+
+			/*
+			 * Check whether expression in HAVING is referenced by
+			 * aggref in grouping.
+			 */
+			if (equal(node->arg, agg_ref->expr))
+			{
+				/* Build reference key like "$refx" */
+				ref_key = psprintf("%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
+
+				break;
+			}
+		}
+
+		if (ref_key != NULL)
+			input_expr_str = ref_key;
+		else
+			input_expr_str = psprintf("$%s", input_expr_str);
+
+		bsonAppendStartObject(qdoc, "0", &nulltest_doc);
+
+		bsonAppendStartArray(&nulltest_doc, opname, &op_doc);
+		bsonAppendUTF8(&op_doc, "0", input_expr_str);
+		bsonAppendNull(&op_doc, "1");
+
+		bsonAppendFinishArray(&nulltest_doc, &op_doc);
+
+		bsonAppendFinishObject(qdoc, &nulltest_doc);
+	}
+	else
+	{
+		if (context->conds_num > 1)
+		{
+			bsonAppendStartObject(qdoc, "0", &nulltest_doc);
+
+			bsonAppendStartObject(&nulltest_doc, input_expr_str, &op_doc);
+			bsonAppendNull(&op_doc, opname);
+			bsonAppendFinishObject(&nulltest_doc, &op_doc);
+
+			bsonAppendFinishObject(qdoc, &nulltest_doc);
+		}
+		else
+		{
+			bsonAppendStartObject(qdoc, input_expr_str, &nulltest_doc);
+			bsonAppendNull(&nulltest_doc, opname);
+			bsonAppendFinishObject(qdoc, &nulltest_doc);
+		}
+	}
+}
+
+/*
+ * Deparse given ScalarArrayOpExpr expression.  To avoid problems
+ * around priority of operations, we always parenthesize the arguments.
+ */
+static void
+mongo_build_scalar_array_op_expr(BSON *qdoc, ScalarArrayOpExpr *node, qdoc_expr_cxt *context)
+{
+	Expr	   *arg1;
+	Expr	   *arg2;
+	List	   *const_list = NIL;
+	ListCell   *lc;
+	char	   *opname = NULL;
+	char	   *extval;
+	const char *mongo_opname = NULL;
+	char	   *input_expr_str = NULL;
+	char	   *ref_key = NULL;
+	BSON	   scalarArrayOpExpr_doc;
+	BSON	   op_doc;
+	int		   i = -1;
+
+	/* Sanity check. */
+	Assert(list_length(node->args) == 2);
+
+	/* Get operator name */
+	opname = get_opname(node->opno);
+	if (opname == NULL)
+		elog(ERROR, "No such operator name for operator OID %u", node->opno);
+
+	/*
+	 * Using $in for '= ANY'$ (similar with IN )
+	 * Using $nin for '<> ALL' (similar with NOT IN )
+	 * Using $all for '= ALL'
+	 */
+	if (node->useOr == true)
+		mongo_opname = "$in";
+	else if (strcmp(opname, "<>") == 0)
+		mongo_opname = "$nin";
+	else if (strcmp(opname, "=") == 0)
+		mongo_opname = "$all";
+
+	/* Get left and right argument for deparsing */
+	arg1 = linitial(node->args);
+	arg2 = lsecond(node->args);
+
+	/* Parse scalar constant into array */
+	switch (nodeTag((Node *) arg2))
+	{
+		case T_Const:
+			{
+				StringInfoData	buf;
+				Const	   *c = (Const *) arg2;
+				const char *valptr;
+				Const	   *new_expr;
+				Oid			consttype = InvalidOid;
+				Datum		value;
+				bool		constisnull = c->constisnull;
+				bool		constbyval = c->constbyval;
+				PGFunction  func_addr = NULL;
+				Oid		    typoutput;
+				bool	    typIsVarlena;
+
+				initStringInfo(&buf);
+				i = -1;
+
+				if (!c->constisnull)
+				{
+					getTypeOutputInfo(c->consttype,
+									  &typoutput, &typIsVarlena);
+					extval = OidOutputFunctionCall(typoutput, c->constvalue);
+
+					/* Get contant type and function address */
+					mongo_get_func_info_scalar_array(c->consttype, &consttype, &func_addr);
+
+					for (valptr = extval; *valptr; valptr++)
+					{
+						char		ch = *valptr;
+
+						i++;
+
+						/*
+						 * Remove '{', '}' and \" character from the string.
+						 * Because this syntax is not recognize by the remote
+						 * MongoDB server.
+						 */
+						if ((ch == '{' && i == 0) || ch == '\"')
+							continue;
+						if ((ch == ',') || (ch == '}' && (i == (strlen(extval) - 1))))
+						{
+							value = DirectFunctionCall1(func_addr, CStringGetDatum(buf.data));
+
+							/* Append constant */
+							new_expr = makeConst(consttype,
+											 -1,
+											 InvalidOid,
+											 buf.len,
+											 value,
+											 constisnull,	/* isnull */
+											 constbyval /* byval */ );
+							const_list = lappend(const_list, (Expr *) new_expr);
+							resetStringInfo(&buf);
+							continue;
+						}
+						appendStringInfoChar(&buf, ch);
+					}
+				}
+				else
+				{
+					/* Append NULL */
+					new_expr = makeConst(INT4OID,
+										 -1,
+										 InvalidOid,
+										 sizeof(int32),
+										 (Datum) 0,
+										 true, /* isnull */
+										 true /* byval */ );
+					const_list = lappend(const_list, (Expr *) new_expr);
+					return;
+				}
+			}
+			break;
+		default:
+			elog(ERROR, "unsupported expression type for deparse: %d", (int) nodeTag(node));
+			break;
+	}
+
+	/* Building BSON document for ScalarArrayOpExpr. */
+	if (IsA(arg1, Var))
+		input_expr_str = get_attname(context->rel_oid, ((Var *) arg1)->varattno, false);
+	if (IsA(arg1, RelabelType))
+	{
+		Var *var = (Var *) ((RelabelType *) arg1)->arg;
+		input_expr_str = get_attname(context->rel_oid, var->varattno, false);
+	}
+
+	i = 0;
+	if (context->need_aggexpr_syntax)
+	{
+		ListCell *aggcell;
+		char *ref_key = NULL;
+		char *bs_key;
+		BSON array_doc, element_doc;
+
+		foreach(aggcell, context->agg_ref_list)
+		{
+			mongo_aggref_ref *agg_ref = (mongo_aggref_ref *) lfirst(aggcell);
+
+			/*
+			 * Check whether expression in HAVING is referenced by
+			 * aggref in grouping.
+			 */
+			if (equal(arg1, agg_ref->expr))
+			{
+				/* Build reference key like "$refx" */
+				ref_key = psprintf("%s", agg_ref->ref_target); /* reference from "let" in $lookup stage */
+
+				break;
+			}
+		}
+
+		if (ref_key != NULL)
+			input_expr_str = ref_key;
+		else
+			input_expr_str = psprintf("$%s", input_expr_str);
+
+		bsonAppendStartObject(qdoc, "0", &element_doc);
+
+		bsonAppendStartArray(&element_doc, mongo_opname, &op_doc);
+
+		bsonAppendUTF8(&op_doc, "0", input_expr_str);
+
+		bs_key = context->bs_key;
+		bsonAppendStartArray(&op_doc, "1", &array_doc);
+		foreach(lc, const_list)
+		{
+			Const *c = (Const *) lfirst(lc);
+
+			context->bs_key = psprintf("%d", i);
+			mongo_build_const_doc(&array_doc, c, context);
+			i++;
+		}
+		context->bs_key = bs_key;
+		bsonAppendFinishArray(&op_doc, &array_doc);
+
+		bsonAppendFinishArray(&element_doc, &op_doc);
+
+		bsonAppendFinishObject(qdoc, &element_doc);
+	}
+	else
+	{
+		if (context->conds_num > 1)
+		{
+			BSON element_doc;
 			bsonAppendStartObject(qdoc, "0", &element_doc);
 
-			bsonAppendStartObject(&element_doc, input_expr_str, &scalarArrayOpExpr_doc);
+			bsonAppendStartObject(&element_doc, input_expr_str, &scalarArrayOpExpr_doc);
+
+			bsonAppendStartArray(&scalarArrayOpExpr_doc, mongo_opname, &op_doc);
+			foreach(lc, const_list)
+			{
+				Const *c = (Const *) lfirst(lc);
+
+				ref_key = psprintf("%d", i);
+				append_constant_value(&op_doc, ref_key, c);
+				i++;
+			}
+			bsonAppendFinishArray(&scalarArrayOpExpr_doc, &op_doc);
+
+			bsonAppendFinishObject(&element_doc, &scalarArrayOpExpr_doc);
+
+			bsonAppendFinishObject(qdoc, &element_doc);
+		}
+		else
+		{
+			bsonAppendStartObject(qdoc, input_expr_str, &scalarArrayOpExpr_doc);
+
+			bsonAppendStartArray(&scalarArrayOpExpr_doc, mongo_opname, &op_doc);
+			foreach(lc, const_list)
+			{
+				Const *c = (Const *) lfirst(lc);
+
+				ref_key = psprintf("%d", i);
+				append_constant_value(&op_doc, ref_key, c);
+				i++;
+			}
+			bsonAppendFinishArray(&scalarArrayOpExpr_doc, &op_doc);
+
+			bsonAppendFinishObject(qdoc, &scalarArrayOpExpr_doc);
+		}
+	}
+}
+
+/*
+ * Build query document for expression.
+ */
+static void mongo_build_expr_doc(BSON *qdoc, Expr *node, qdoc_expr_cxt *context)
+{
+	if (node == NULL)
+		return;
+
+	switch (nodeTag(node))
+	{
+		case T_Var:
+		case T_Param:
+			{
+				int			paramno = mongo_get_param_index(node, context);
+
+				if (paramno >= 0)
+				{
+					if (context->bs_key == NULL)
+						elog(ERROR, "Could not add parameter value object");
+					mongo_append_param_value(qdoc, context->bs_key, paramno,
+											 context);
+				}
+				else if (IsA(node, Var))
+					mongo_build_column_doc(qdoc, (Var *) node, context);
+				else
+					elog(ERROR, "Could not find the value of parameter");
+			}
+			break;
+		case T_Const:
+			mongo_build_const_doc(qdoc, (Const *) node, context);
+			break;
+		case T_OpExpr:
+			mongo_build_opexpr_doc(qdoc, (OpExpr *) node, context);
+			break;
+		case T_FuncExpr:
+			mongo_build_funcexpr_doc(qdoc, (FuncExpr *) node, context);
+			break;
+		case T_CaseExpr:
+			mongo_build_case_doc(qdoc, (CaseExpr *) node, context);
+			break;
+		case T_CoalesceExpr:
+			mongo_build_coalesce_doc(qdoc, (CoalesceExpr *) node, context);
+			break;
+		case T_NullIfExpr:
+			mongo_build_nullif_doc(qdoc, (NullIfExpr *) node, context);
+			break;
+		case T_MinMaxExpr:
+			mongo_build_minmax_doc(qdoc, (MinMaxExpr *) node, context);
+			break;
+		case T_RelabelType:
+			mongo_build_relabeltype_doc(qdoc, (RelabelType *)node, context);
+			break;
+		case T_Aggref:
+			{
+				List	   *agg_ref_list = context->agg_ref_list;
+
+				/* The arguments are computed on the documents of the group */
+				context->agg_ref_list = NIL;
+				mongo_build_aggref_doc(qdoc, (Aggref *) node, context);
+				context->agg_ref_list = agg_ref_list;
+			}
+			break;
+		case T_BoolExpr:
+			mongo_build_boolexpr_doc(qdoc, (BoolExpr *) node, context);
+			break;
+		case T_NullTest:
+			mongo_build_NullTest_doc(qdoc, (NullTest *) node, context);
+			break;
+		case T_BooleanTest:
+			mongo_build_bool_test_doc(qdoc, (Var *) ((BooleanTest *) node)->arg,
+									  ((BooleanTest *) node)->booltesttype,
+									  context);
+			break;
+		case T_ScalarArrayOpExpr:
+			mongo_build_scalar_array_op_expr(qdoc, (ScalarArrayOpExpr *) node, context);
+			break;
+		default:
+			elog(ERROR, "unsupported expression type for deparse: %d",
+				 (int) nodeTag(node));
+			break;
+	}
+}
+
+/*
+ * mongo_serialize_plannerInfoList
+ */
+List *mongo_serialize_plannerInfoList (MongoPlanerInfo *plannerInfo)
+{
+	List *plannerInfoList = NIL;
+	ListCell *lc;
+
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->tlist);
+	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->tlist_has_jsonb_arrow_op) ? 1 : 0));
+
+	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->reloptkind));
+	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->scan_reloptkind));
+	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->rtindex));
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->remote_exprs);
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->local_exprs);
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->having_quals);
+
+	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->has_limit) ? 1 : 0));
+	if (plannerInfo->has_limit)
+	{
+		plannerInfoList = lappend(plannerInfoList, plannerInfo->limitOffset);
+		plannerInfoList = lappend(plannerInfoList, plannerInfo->limitCount);
+	}
+
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->sort_exprs);
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->sort_options);
+
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->param_exprs);
+
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->ptarget_exprs);
+
+	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->has_groupClause) ? 1 : 0));
+	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->has_grouping_agg) ? 1 : 0));
+
+	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->jointype));
+	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->driving_rel_index));
+
+	plannerInfo->joininfo_num = list_length(plannerInfo->joininfo_list);
+	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->joininfo_num));
+
+	foreach(lc, plannerInfo->joininfo_list)
+	{
+		MongoPlanerJoinInfo *join_info = (MongoPlanerJoinInfo *)lfirst(lc);
+
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->outerrel_relid));
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->innerrel_relid));
+		plannerInfoList = lappend(plannerInfoList, join_info->joinclauses);
+		plannerInfoList = lappend(plannerInfoList, join_info->inner_remote_conds);
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->outerrel_oid));
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->innerrel_oid));
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->join_is_sub_query));
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->jointype));
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->outerrel_rtekind));
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->innerrel_rtekind));
+
+		plannerInfoList = lappend(plannerInfoList, makeString(join_info->outerrel_aliasname ? join_info->outerrel_aliasname : ""));
+		plannerInfoList = lappend(plannerInfoList, makeString(join_info->innerrel_aliasname ? join_info->innerrel_aliasname : ""));
+		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->lookup_fields));
+	}
+
+	plannerInfoList = lappend(plannerInfoList, makeInteger(list_length(plannerInfo->window_list)));
+
+	foreach(lc, plannerInfo->window_list)
+	{
+		MongoPlanerWindowInfo *window_info = (MongoPlanerWindowInfo *) lfirst(lc);
+
+		plannerInfoList = lappend(plannerInfoList, makeInteger(window_info->winref));
+		plannerInfoList = lappend(plannerInfoList, window_info->partition_exprs);
+		plannerInfoList = lappend(plannerInfoList, window_info->sort_exprs);
+		plannerInfoList = lappend(plannerInfoList, window_info->sort_options);
+		plannerInfoList = lappend(plannerInfoList, makeInteger(window_info->frameOptions));
+		plannerInfoList = lappend(plannerInfoList, window_info->startOffset);
+		plannerInfoList = lappend(plannerInfoList, window_info->endOffset);
+	}
+
+	plannerInfoList = lappend(plannerInfoList, plannerInfo->grouping_sets);
+
+	return plannerInfoList;
+}
+
+/*
+ * mongo_deserialize_plannerInfoList
+ */
+MongoPlanerInfo *mongo_deserialize_plannerInfoList(List *plannerInfoList)
+{
+	MongoPlanerInfo *plannerInfo = NULL;
+	ListCell		*lc = list_head(plannerInfoList);
+	int i;
+	int			window_num;
+
+	plannerInfo = (MongoPlanerInfo *) palloc0(sizeof(MongoPlanerInfo));
+
+	plannerInfo->tlist = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->tlist_has_jsonb_arrow_op = (intVal(lfirst(lc)) == 1) ? true : false;
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->reloptkind = intVal(lfirst(lc));
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->scan_reloptkind = intVal(lfirst(lc));
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->rtindex = intVal(lfirst(lc));
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->remote_exprs = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->local_exprs = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->having_quals = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->has_limit = (intVal(lfirst(lc)) == 1) ? true : false;
+	lc = lnext(plannerInfoList, lc);
+
+	if (plannerInfo->has_limit)
+	{
+		plannerInfo->limitOffset = (Node *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		plannerInfo->limitCount = (Node *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+	}
+
+	plannerInfo->sort_exprs = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->sort_options = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->param_exprs = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->ptarget_exprs = (List *) lfirst(lc);
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->has_groupClause = (intVal(lfirst(lc)) == 1) ? true : false;
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->has_grouping_agg = (intVal(lfirst(lc)) == 1) ? true : false;
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->jointype = intVal(lfirst(lc));
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->driving_rel_index = intVal(lfirst(lc));
+	lc = lnext(plannerInfoList, lc);
+
+	plannerInfo->joininfo_num = intVal(lfirst(lc));
+	lc = lnext(plannerInfoList, lc);
+
+	for(i = 0; i < plannerInfo->joininfo_num; i++)
+	{
+		MongoPlanerJoinInfo *join_info = (MongoPlanerJoinInfo *)palloc0(sizeof(MongoPlanerJoinInfo));
+
+		join_info->outerrel_relid = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->innerrel_relid = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->joinclauses = (List *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->inner_remote_conds = (List *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->outerrel_oid = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->innerrel_oid = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->join_is_sub_query = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->jointype = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->outerrel_rtekind = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->innerrel_rtekind = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->outerrel_aliasname = strVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->innerrel_aliasname = strVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		join_info->lookup_fields = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		plannerInfo->joininfo_list = lappend(plannerInfo->joininfo_list, join_info);
+	}
+
+	window_num = intVal(lfirst(lc));
+	lc = lnext(plannerInfoList, lc);
+
+	for (i = 0; i < window_num; i++)
+	{
+		MongoPlanerWindowInfo *window_info = (MongoPlanerWindowInfo *) palloc0(sizeof(MongoPlanerWindowInfo));
+
+		window_info->winref = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		window_info->partition_exprs = (List *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		window_info->sort_exprs = (List *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		window_info->sort_options = (List *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		window_info->frameOptions = intVal(lfirst(lc));
+		lc = lnext(plannerInfoList, lc);
+
+		window_info->startOffset = (Node *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		window_info->endOffset = (Node *) lfirst(lc);
+		lc = lnext(plannerInfoList, lc);
+
+		plannerInfo->window_list = lappend(plannerInfo->window_list, window_info);
+	}
+
+	plannerInfo->grouping_sets = (List *) lfirst(lc);
+
+	return plannerInfo;
+}
+
+/*
+ * Print the name of an operator.
+ */
+static const char *
+mongo_getSwitchedCmpOperatorName(const char *opname, bool need_switch_operator)
+{
+	if (need_switch_operator)
+	{
+		if (strcmp(opname, "$gt") == 0)
+			opname = "$lte";
+		else if (strcmp(opname, "$gte") == 0)
+			opname = "$lt";
+		else if (strcmp(opname, "$lt") == 0)
+			opname = "$gte";
+		else if (strcmp(opname, "$lte") == 0)
+			opname = "$gt";
+	}
+
+	return opname;
+}
+
+static MongoOperatorsSupport mongo_validateOperatorName(Oid opno,
+												  const char **deparseName,
+												  bool *is_switch_operator)
+{
+	char	   *opname;
+	int			i=0;
+	typedef struct
+	{
+		const char *op_name; 		/* Operator's name supported by PostgreSQL */
+		const char *op_name_abbr; 		/* Abbreviation of operator formed in URL request */
+	} deparse_op_abbr;
+	static deparse_op_abbr compOpNameMappings[] =
+	{
+		/* Operator name		Abbreviation */
+		{"<",					"$lt"	}, 	/* Less than */
+		{">",					"$gt"	},	/* Greater than */
+		{"<=",					"$lte"	},	/* Less than or equal */
+		{">=",					"$gte"	},	/* Greater than or equal */
+		{"=",					"$eq"	},	/* Equal */
+		{"!=",					"$ne"	},	/* Not equal */
+		{"<>",					"$ne"	},	/* Not equal */
+		{NULL,					NULL	},	/* NULL */
+	};
+	static deparse_op_abbr mathOpNameMappings[] =
+	{
+		/* Operator name		Abbreviation */
+		{"+",					"$add"		},	/* Addition */
+		{"-",					"$subtract"	},	/* Subtraction */
+		{"*",					"$multiply"	},	/* Multiplication */
+		{"/",					"$divide"	},	/* Division */
+		{"%",					"$mod"		},	/* Modulo */
+		{"^",					"$pow"		},	/* Power */
+		{"|/",					"$sqrt"		},	/* Square root */
+		{"@",					"$abs"		},	/* Absolute value */
+		{"||",					"$concat"	},	/* Concatenation */
+		{NULL,					NULL		},	/* NULL */
+	};
+	static deparse_op_abbr jsonOpNameMappings[] =
+	{
+		/* Operator name		Abbreviation */
+		{"->",					"."		},	/* json arrow operator */
+		{NULL,					NULL	},	/* NULL */
+	};
+	static deparse_op_abbr regexOpNameMappings[] =
+	{
+		/* Operator name		Abbreviation */
+		{"~~",					"$regex"	},	/* LIKE */
+		{"!~~",					"$regex"	},	/* NOT LIKE */
+		{"~~*",					"$regex"	},	/* ILIKE */
+		{"!~~*",				"$regex"	},	/* NOT ILIKE */
+		{"~",					"$regex"	},	/* Matches regular expression */
+		{"!~",					"$regex"	},	/* Does not match */
+		{"~*",					"$regex"	},	/* Matches, case-insensitive */
+		{"!~*",					"$regex"	},	/* Does not match, case-insensitive */
+		{NULL,					NULL		},	/* NULL */
+	};
+
+
+
+	if (is_switch_operator)
+		*is_switch_operator = false;
+
+	/* Get operator name */
+	opname = get_opname(opno);
+	if (opname == NULL)
+		elog(ERROR, "No such operator name for operator OID %u", opno);
+
+	/* Looking for check if operator is filter operator */
+	for (i = 0; compOpNameMappings[i].op_name != NULL; i++)
+	{
+		if (strcmp(opname, compOpNameMappings[i].op_name) == 0)
+		{
+			/* Current operator is safe to pushdown */
+			if (deparseName)
+				*deparseName = compOpNameMappings[i].op_name_abbr;
+
+			/* Operator can be switched */
+			if (is_switch_operator)
+				*is_switch_operator = true;
+
+			return OP_CONDITIONAL;
+		}
+	}
+
+	for (i = 0; mathOpNameMappings[i].op_name != NULL; i++)
+	{
+		if (strcmp(opname, mathOpNameMappings[i].op_name) == 0)
+		{
+				/* Current operator is safe to pushdown */
+			if (deparseName)
+				*deparseName = mathOpNameMappings[i].op_name_abbr;
+			return OP_MATH;
+		}
+	}
+
+	for (i = 0; jsonOpNameMappings[i].op_name != NULL; i++)
+	{
+		if (strcmp(opname, jsonOpNameMappings[i].op_name) == 0)
+		{
+				/* Current operator is safe to pushdown */
+			if (deparseName)
+				*deparseName = jsonOpNameMappings[i].op_name_abbr;
+			return OP_JSON;
+		}
+	}
+
+	for (i = 0; regexOpNameMappings[i].op_name != NULL; i++)
+	{
+		if (strcmp(opname, regexOpNameMappings[i].op_name) == 0)
+		{
+			if (deparseName)
+				*deparseName = regexOpNameMappings[i].op_name_abbr;
+			return OP_REGEX;
+		}
+	}
+
+	/* Funtion does not in conditional list and math list */
+	return OP_UNSUPPORT;
+}
+
+/*
+ * Returns true if given expr is something we'd have to send the value of
+ * to the foreign server.
+ *
+ * This should return true when the expression is a shippable node that
+ * deparseExpr would add to context->params_list.  Note that we don't care
+ * if the expression *contains* such a node, only whether one appears at top
+ * level.  We need this to detect cases where setrefs.c would recognize a
+ * false match between an fdw_exprs item (which came from the params_list)
+ * and an entry in fdw_scan_tlist (which we're considering putting the given
+ * expression into).
+ */
+bool
+mongo_is_foreign_param(PlannerInfo *root,
+				 RelOptInfo *baserel,
+				 Expr *expr)
+{
+	if (expr == NULL)
+		return false;
+
+	switch (nodeTag(expr))
+	{
+		case T_Var:
+			{
+				/* It would have to be sent unless it's a foreign Var */
+				Var		   *var = (Var *) expr;
+				MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) (baserel->fdw_private);
+				Relids		relids;
+
+				if (IS_UPPER_REL(baserel))
+					relids = fpinfo->outerrel->relids;
+				else
+					relids = baserel->relids;
+
+				if (bms_is_member(var->varno, relids) && var->varlevelsup == 0)
+					return false;	/* foreign Var, so not a param */
+				else
+					return true;	/* it'd have to be a param */
+				break;
+			}
+		case T_Param:
+			/* Params always have to be sent to the foreign server */
+			return true;
+		default:
+			break;
+	}
+	return false;
+}
+
+/*
+ * Build the targetlist for given relation to be deparsed as SELECT clause.
+ *
+ * The output targetlist contains the columns that need to be fetched from the
+ * foreign server for the given relation.  If foreignrel is an upper relation,
+ * then the output targetlist can also contain expressions to be evaluated on
+ * foreign server.
+ */
+List *
+mongo_build_tlist_to_deparse(RelOptInfo *foreignrel)
+{
+	List	   *tlist = NIL;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) foreignrel->fdw_private;
+	ListCell   *lc;
+
+	/*
+	 * For an upper relation, we have already built the target list while
+	 * checking shippability, so just return that.
+	 */
+	if (IS_UPPER_REL(foreignrel))
+		return fpinfo->grouped_tlist;
+
+	/*
+	 * We require columns specified in foreignrel->reltarget->exprs and those
+	 * required for evaluating the local conditions.
+	 */
+	tlist = add_to_flat_tlist(tlist,
+							  pull_var_clause((Node *) foreignrel->reltarget->exprs,
+											  PVC_RECURSE_PLACEHOLDERS));
+	foreach(lc, fpinfo->local_conds)
+	{
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+
+		tlist = add_to_flat_tlist(tlist,
+								  pull_var_clause((Node *) rinfo->clause,
+												  PVC_RECURSE_PLACEHOLDERS));
+	}
+
+	/*
+	 * The join clauses of a nested join may refer to the columns of the
+	 * inner relations of lower joins, which are passed to its "$lookup"
+	 * stage from their nested documents.  Those only contain the columns of
+	 * the target list.
+	 */
+	if (IS_JOIN_REL(foreignrel))
+	{
+		while (IS_JOIN_REL(fpinfo->outerrel))
+		{
+			foreach(lc, fpinfo->joinclauses)
+			{
+				RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+
+				tlist = add_to_flat_tlist(tlist,
+										  pull_var_clause((Node *) rinfo->clause,
+														  PVC_RECURSE_PLACEHOLDERS));
+			}
+
+			fpinfo = (MongoFdwRelationInfo *) fpinfo->outerrel->fdw_private;
+		}
+	}
+
+	return tlist;
+}
+
+
+/*
+ * mongo_pull_func_clause_walker
+ *
+ * Recursively search for functions within a clause.
+ */
+static bool
+mongo_pull_func_clause_walker(Node *node, pull_aggref_list_context *context)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, Aggref))
+	{
+		context->aggref_list = lappend(context->aggref_list, node);
+		return false;
+	}
+
+	return expression_tree_walker(node, mongo_pull_func_clause_walker,
+								  (void *) context);
+}
+
+/*
+ * pull_func_clause
+ *
+ * Pull out function from a clause and then add to target list
+ */
+List *
+mongo_pull_func_clause(Node *node)
+{
+	pull_aggref_list_context context;
+	context.aggref_list = NIL;
+
+	mongo_pull_func_clause_walker(node, &context);
+
+	return context.aggref_list;
+}
+
+/*
+ * mongo_pull_param_exprs_walker
+ *
+ * Recursively search for Params and Vars of other relations within a clause.
+ */
+static bool
+mongo_pull_param_exprs_walker(Node *node, pull_param_exprs_context *context)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, Param) ||
+		(IsA(node, Var) && ((Var *) node)->varno != context->relid))
+	{
+		context->param_exprs = list_append_unique(context->param_exprs, node);
+		return false;
+	}
+
+	return expression_tree_walker(node, mongo_pull_param_exprs_walker,
+								  (void *) context);
+}
+
+/*
+ * mongo_pull_param_exprs
+ *
+ * Pull out the values that the remote conditions of a base relation take at
+ * execution time: Params, and the columns of outer relations in a
+ * parameterized scan.
+ */
+List *
+mongo_pull_param_exprs(List *remote_exprs, Index relid)
+{
+	pull_param_exprs_context context;
+
+	context.relid = relid;
+	context.param_exprs = NIL;
+
+	mongo_pull_param_exprs_walker((Node *) remote_exprs, &context);
+
+	return context.param_exprs;
+}
+
+/*
+ * Deparse given operator expression.   To avoid problems around
+ * priority of operations, we always parenthesize the arguments.
+ */
+static void
+mongo_deparseOpExpr(OpExpr *node, deparse_expr_cxt *deparse_context)
+{
+	StringInfo	buf = deparse_context->buf;
+	char	   *opname;
+	ListCell   *arg;
+
+	/* Sanity check. */
+	Assert(list_length(node->args) == 2);
+
+	/* Deparse left operand. */
+	arg = list_head(node->args);
+	mongo_deparseExpr(lfirst(arg), deparse_context);
+
+	/* Deparse operator name. */
+	opname = get_opname(node->opno);
+	if (opname == NULL)
+		elog(ERROR, "No such operator name for operator OID %u", node->opno);
+
+	if (strcmp(opname, "->") == 0)
+		appendStringInfoChar(buf, '.');
+	else
+		ereport(ERROR, \
+				(errcode(ERRCODE_FDW_ERROR), \
+				errmsg("Can not deparse %s operator", opname), \
+				errhint("Only support deparse JSON arrow operators: \"->\""))); \
+
+	/* Deparse right operand. */
+	arg = list_tail(node->args);
+	mongo_deparseExpr(lfirst(arg), deparse_context);
+}
+
+/*
+ * Deparse given Var node into deparse_context->buf.
+ *
+ * If the Var belongs to the foreign relation, just print its remote name.
+ * Otherwise, it's effectively a Param (and will in fact be a Param at
+ * run time).  Handle it the same way we handle plain Params --- see
+ * deparseParam for comments.
+ */
+static void
+mongo_deparseVar(Var *node, deparse_expr_cxt *deparse_context)
+{
+	char	   *colname = NULL;
+
+	if (node->varattno <= 0)
+		elog(ERROR, "Could not support system attribute and whole row reference");
+
+	colname = get_attname(deparse_context->qdoc_ctx->rel_oid, node->varattno, false);
 
-			bsonAppendStartArray(&scalarArrayOpExpr_doc, mongo_opname, &op_doc);
-			foreach(lc, const_list)
-			{
-				Const *c = (Const *) lfirst(lc);
+	appendStringInfoString(deparse_context->buf, colname);
+}
 
-				ref_key = psprintf("%d", i);
-				append_constant_value(&op_doc, ref_key, c);
-				i++;
-			}
-			bsonAppendFinishArray(&scalarArrayOpExpr_doc, &op_doc);
+/*
+ * Deparse given constant value into deparse_context->buf.
+ *
+ * This function has to be kept in sync with ruleutils.c's get_const_expr.
+ * As for that function, showtype can be -1 to never show "::typename" decoration,
+ * or +1 to always show it, or 0 to show it only if the constant wouldn't be assumed
+ * to be the right type by default.
+ */
+static void
+mongo_deparseConst(Const *node, deparse_expr_cxt *deparse_context)
+{
+	Oid			typoutput;
+	bool		typIsVarlena;
+	char	   *extval;
 
-			bsonAppendFinishObject(&element_doc, &scalarArrayOpExpr_doc);
+	if (node->constisnull)
+	{
+		appendStringInfoString(deparse_context->buf, "null");
+		return;
+	}
 
-			bsonAppendFinishObject(qdoc, &element_doc);
-		}
-		else
-		{
-			bsonAppendStartObject(qdoc, input_expr_str, &scalarArrayOpExpr_doc);
+	getTypeOutputInfo(node->consttype,
+					  &typoutput, &typIsVarlena);
+	extval = OidOutputFunctionCall(typoutput, node->constvalue);
 
-			bsonAppendStartArray(&scalarArrayOpExpr_doc, mongo_opname, &op_doc);
-			foreach(lc, const_list)
-			{
-				Const *c = (Const *) lfirst(lc);
+	appendStringInfoString(deparse_context->buf, extval);
 
-				ref_key = psprintf("%d", i);
-				append_constant_value(&op_doc, ref_key, c);
-				i++;
-			}
-			bsonAppendFinishArray(&scalarArrayOpExpr_doc, &op_doc);
+	pfree(extval);
 
-			bsonAppendFinishObject(qdoc, &scalarArrayOpExpr_doc);
-		}
-	}
+	return;
 }
 
 /*
- * Build query document for expression.
+ * Deparse a RelabelType (binary-compatible cast) node.
+ * 	Discard explicit cast type.
  */
-static void mongo_build_expr_doc(BSON *qdoc, Expr *node, qdoc_expr_cxt *context)
+static void
+mongo_deparseRelabelType(RelabelType *node, deparse_expr_cxt *deparse_context)
+{
+	mongo_deparseExpr(node->arg, deparse_context);
+}
+
+/*
+ * Deparse given expression into deparse_context->buf.
+ *
+ * This function must support all the same node types that foreign_expr_walker
+ * accepts.
+ *
+ * Note: unlike ruleutils.c, we just use a simple hard-wired parenthesization
+ * scheme: anything more complex than a Var, Const, function call or cast
+ * should be self-parenthesized.
+ */
+static void
+mongo_deparseExpr(Expr *node, deparse_expr_cxt *deparse_context)
 {
 	if (node == NULL)
 		return;
@@ -2728,28 +7619,16 @@ static void mongo_build_expr_doc(BSON *qdoc, Expr *node, qdoc_expr_cxt *context)
 	switch (nodeTag(node))
 	{
 		case T_Var:
-			mongo_build_column_doc(qdoc, (Var *) node, context);
+			mongo_deparseVar((Var *) node, deparse_context);
 			break;
 		case T_Const:
-			mongo_build_const_doc(qdoc, (Const *) node, context);
+			mongo_deparseConst((Const *) node, deparse_context);
 			break;
 		case T_OpExpr:
-			mongo_build_opexpr_doc(qdoc, (OpExpr *) node, context);
+			mongo_deparseOpExpr((OpExpr *) node, deparse_context);
 			break;
 		case T_RelabelType:
-			mongo_build_relabeltype_doc(qdoc, (RelabelType *)node, context);
-			break;
-		case T_Aggref:
-			mongo_build_aggref_doc(qdoc, (Aggref *) node, context);
-			break;
-		case T_BoolExpr:
-			mongo_build_boolexpr_doc(qdoc, (BoolExpr *) node, context);
-			break;
-		case T_NullTest:
-			mongo_build_NullTest_doc(qdoc, (NullTest *) node, context);
-			break;
-		case T_ScalarArrayOpExpr:
-			mongo_build_scalar_array_op_expr(qdoc, (ScalarArrayOpExpr *) node, context);
+			mongo_deparseRelabelType((RelabelType *)node, deparse_context);
 			break;
 		default:
 			elog(ERROR, "unsupported expression type for deparse: %d",
@@ -2759,590 +7638,569 @@ static void mongo_build_expr_doc(BSON *qdoc, Expr *node, qdoc_expr_cxt *context)
 }
 
 /*
- * mongo_serialize_plannerInfoList
+ * mongo_tlist_has_jsonb_arrow_op.
+ *
+ * Determine whether target list has Jsonb arrow operator
+ * that is safe to pushdown.
  */
-List *mongo_serialize_plannerInfoList (MongoPlanerInfo *plannerInfo)
+bool
+mongo_tlist_has_jsonb_arrow_op(PlannerInfo *root, RelOptInfo *baserel, List *tlist)
 {
-	List *plannerInfoList = NIL;
+	MongoOperatorsSupport opkind;
+	List	 *input_tlist;
 	ListCell *lc;
+	bool	 json_op_safe = false;
 
-	plannerInfoList = lappend(plannerInfoList, plannerInfo->tlist);
-	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->tlist_has_jsonb_arrow_op) ? 1 : 0));
-
-	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->reloptkind));
-	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->scan_reloptkind));
-	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->rtindex));
-	plannerInfoList = lappend(plannerInfoList, plannerInfo->remote_exprs);
-	plannerInfoList = lappend(plannerInfoList, plannerInfo->local_exprs);
-	plannerInfoList = lappend(plannerInfoList, plannerInfo->having_quals);
-
-	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->has_limit) ? 1 : 0));
-	if (plannerInfo->has_limit)
-	{
-		plannerInfoList = lappend(plannerInfoList, plannerInfo->limitOffset);
-		plannerInfoList = lappend(plannerInfoList, plannerInfo->limitCount);
-	}
-
-	plannerInfoList = lappend(plannerInfoList, plannerInfo->ptarget_exprs);
-
-	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->has_groupClause) ? 1 : 0));
-	plannerInfoList = lappend(plannerInfoList, makeInteger((plannerInfo->has_grouping_agg) ? 1 : 0));
-
-	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->jointype));
-
-	plannerInfo->joininfo_num = list_length(plannerInfo->joininfo_list);
-	plannerInfoList = lappend(plannerInfoList, makeInteger(plannerInfo->joininfo_num));
-
-	foreach(lc, plannerInfo->joininfo_list)
-	{
-		MongoPlanerJoinInfo *join_info = (MongoPlanerJoinInfo *)lfirst(lc);
-
-		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->outerrel_relid));
-		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->innerrel_relid));
-		plannerInfoList = lappend(plannerInfoList, join_info->joinclauses);
-		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->outerrel_oid));
-		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->innerrel_oid));
-		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->join_is_sub_query));
-		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->outerrel_rtekind));
-		plannerInfoList = lappend(plannerInfoList, makeInteger(join_info->innerrel_rtekind));
-
-		plannerInfoList = lappend(plannerInfoList, makeString(join_info->outerrel_aliasname ? join_info->outerrel_aliasname : ""));
-		plannerInfoList = lappend(plannerInfoList, makeString(join_info->innerrel_aliasname ? join_info->innerrel_aliasname : ""));
-	}
-
-	return plannerInfoList;
-}
-
-/*
- * mongo_deserialize_plannerInfoList
- */
-MongoPlanerInfo *mongo_deserialize_plannerInfoList(List *plannerInfoList)
-{
-	MongoPlanerInfo *plannerInfo = NULL;
-	ListCell		*lc = list_head(plannerInfoList);
-	int i;
-
-	plannerInfo = (MongoPlanerInfo *) palloc0(sizeof(MongoPlanerInfo));
-
-	plannerInfo->tlist = (List *) lfirst(lc);
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->tlist_has_jsonb_arrow_op = (intVal(lfirst(lc)) == 1) ? true : false;
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->reloptkind = intVal(lfirst(lc));
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->scan_reloptkind = intVal(lfirst(lc));
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->rtindex = intVal(lfirst(lc));
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->remote_exprs = (List *) lfirst(lc);
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->local_exprs = (List *) lfirst(lc);
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->having_quals = (List *) lfirst(lc);
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->has_limit = (intVal(lfirst(lc)) == 1) ? true : false;
-	lc = lnext(plannerInfoList, lc);
-
-	if (plannerInfo->has_limit)
-	{
-		plannerInfo->limitOffset = (Node *) lfirst(lc);
-		lc = lnext(plannerInfoList, lc);
-
-		plannerInfo->limitCount = (Node *) lfirst(lc);
-		lc = lnext(plannerInfoList, lc);
-	}
-
-	plannerInfo->ptarget_exprs = (List *) lfirst(lc);
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->has_groupClause = (intVal(lfirst(lc)) == 1) ? true : false;
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->has_grouping_agg = (intVal(lfirst(lc)) == 1) ? true : false;
-	lc = lnext(plannerInfoList, lc);
-
-	plannerInfo->jointype = intVal(lfirst(lc));
-	lc = lnext(plannerInfoList, lc);
+	if (!IS_SIMPLE_REL(baserel))
+		return false;
 
-	plannerInfo->joininfo_num = intVal(lfirst(lc));
-	lc = lnext(plannerInfoList, lc);
+	input_tlist = (tlist) ? tlist : baserel->reltarget->exprs;
 
-	for(i = 0; i < plannerInfo->joininfo_num; i++)
+	/* Check Jsonb arrow operator "->" */
+	foreach(lc, input_tlist)
 	{
-		MongoPlanerJoinInfo *join_info = (MongoPlanerJoinInfo *)palloc0(sizeof(MongoPlanerJoinInfo));
-
-		join_info->outerrel_relid = intVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
-
-		join_info->innerrel_relid = intVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
-
-		join_info->joinclauses = (List *) lfirst(lc);
-		lc = lnext(plannerInfoList, lc);
-
-		join_info->outerrel_oid = intVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
-
-		join_info->innerrel_oid = intVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
-
-		join_info->join_is_sub_query = intVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
+		Node *node = lfirst(lc);
 
-		join_info->outerrel_rtekind = intVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
+		if (IsA(node, TargetEntry))
+			node = (Node *) ((TargetEntry *) node)->expr;
 
-		join_info->innerrel_rtekind = intVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
+		/*
+		 * If any target expression is not pushdown, then we cannot
+		 * push down Json arrow operator to the foreign server.
+		 */
+		if (!mongo_is_foreign_expr(root, baserel, (Expr *)node))
+			return false;
 
-		join_info->outerrel_aliasname = strVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
+		if (IsA(node, OpExpr))
+		{
+			OpExpr *oe = (OpExpr *) node;
 
-		join_info->innerrel_aliasname = strVal(lfirst(lc));
-		lc = lnext(plannerInfoList, lc);
+			opkind = mongo_validateOperatorName(oe->opno, NULL, NULL);
 
-		plannerInfo->joininfo_list = lappend(plannerInfo->joininfo_list, join_info);
+			if (opkind == OP_JSON)
+				json_op_safe = true;
+			else
+				return false;
+		}
 	}
 
-	return plannerInfo;
+	return json_op_safe;
 }
 
 /*
- * Print the name of an operator.
+ * mongo_is_json_filter_expr
+ *		Determine whether a restriction clause of a base relation is a jsonb
+ *		filter that MongoDB can apply on the paths of the stored documents.
+ *
+ * These are a jsonb or json column, or a path in it, with:
+ *		c1 ->> 'a' = 'x', c1 #>> '{a,b}' = 'x'
+ *		c1 ? 'a'
+ *		c1 @> '{"a": 1, "b": ["x"]}'
+ * MongoDB matches a field path in the array elements along it as well, and
+ * does not tell a string from the JSON text of other values, so the filter
+ * built for such a clause only narrows the documents down.  The clause itself
+ * stays local and is checked on the documents returned.
  */
-static const char *
-mongo_getSwitchedCmpOperatorName(const char *opname, bool need_switch_operator)
+bool
+mongo_is_json_filter_expr(PlannerInfo *root, RelOptInfo *baserel, Expr *expr)
 {
-	if (need_switch_operator)
-	{
-		if (strcmp(opname, "$gt") == 0)
-			opname = "$lte";
-		else if (strcmp(opname, "$gte") == 0)
-			opname = "$lt";
-		else if (strcmp(opname, "$lt") == 0)
-			opname = "$gte";
-		else if (strcmp(opname, "$lte") == 0)
-			opname = "$gt";
-	}
+	Const	   *value;
+	char	   *path;
 
-	return opname;
-}
+	if (!IS_SIMPLE_REL(baserel) || !IsA(expr, OpExpr))
+		return false;
 
-static MongoOperatorsSupport mongo_validateOperatorName(Oid opno,
-												  const char **deparseName,
-												  bool *is_switch_operator)
-{
-	char	   *opname;
-	int			i=0;
-	typedef struct
-	{
-		const char *op_name; 		/* Operator's name supported by PostgreSQL */
-		const char *op_name_abbr; 		/* Abbreviation of operator formed in URL request */
-	} deparse_op_abbr;
-	static deparse_op_abbr compOpNameMappings[] =
-	{
-		/* Operator name		Abbreviation */
-		{"<",					"$lt"	}, 	/* Less than */
-		{">",					"$gt"	},	/* Greater than */
-		{"<=",					"$lte"	},	/* Less than or equal */
-		{">=",					"$gte"	},	/* Greater than or equal */
-		{"=",					"$eq"	},	/* Equal */
-		{"!=",					"$ne"	},	/* Not equal */
-		{"<>",					"$ne"	},	/* Not equal */
-		{NULL,					NULL	},	/* NULL */
-	};
-	static deparse_op_abbr mathOpNameMappings[] =
-	{
-		/* Operator name		Abbreviation */
-		{"+",					"$add"		},	/* Addition */
-		{"-",					"$subtract"	},	/* Subtraction */
-		{"*",					"$multiply"	},	/* Multiplication */
-		{"/",					"$divide"	},	/* Division */
-		{"%",					"$mod"		},	/* Modulo */
-		{"^",					"$pow"		},	/* Power */
-		{"|/",					"$sqrt"		},	/* Square root */
-		{"@",					"$abs"		},	/* Absolute value */
-		{NULL,					NULL		},	/* NULL */
-	};
-	static deparse_op_abbr jsonOpNameMappings[] =
-	{
-		/* Operator name		Abbreviation */
-		{"->",					"."		},	/* json arrow operator */
-		{NULL,					NULL	},	/* NULL */
-	};
+	path = mongo_get_json_filter((OpExpr *) expr,
+								 planner_rt_fetch(baserel->relid, root)->relid,
+								 baserel->relid, &value);
 
+	return path != NULL &&
+		mongo_append_json_filter_conds(NULL, (OpExpr *) expr, path, value) > 0;
+}
 
+/*
+ * mongo_get_json_filter
+ *		Return the field path of the jsonb operand of a filter, and its
+ *		constant in 'value', or NULL if the expression is not a filter that
+ *		mongo_is_json_filter_expr knows.
+ */
+static char *
+mongo_get_json_filter(OpExpr *node, Oid relid, Index varno, Const **value)
+{
+	Expr	   *left;
+	Expr	   *right;
+	bool		is_text;
+	StringInfoData path;
 
-	if (is_switch_operator)
-		*is_switch_operator = false;
+	if (list_length(node->args) != 2)
+		return NULL;
 
-	/* Get operator name */
-	opname = get_opname(opno);
-	if (opname == NULL)
-		elog(ERROR, "No such operator name for operator OID %u", opno);
+	left = (Expr *) linitial(node->args);
+	right = (Expr *) lsecond(node->args);
 
-	/* Looking for check if operator is filter operator */
-	for (i = 0; compOpNameMappings[i].op_name != NULL; i++)
+	if (node->opno == TextEqualOperator)
 	{
-		if (strcmp(opname, compOpNameMappings[i].op_name) == 0)
+		/* The text extracted is compared by equality with a constant */
+		if (IsA(left, Const))
 		{
-			/* Current operator is safe to pushdown */
-			if (deparseName)
-				*deparseName = compOpNameMappings[i].op_name_abbr;
-
-			/* Operator can be switched */
-			if (is_switch_operator)
-				*is_switch_operator = true;
+			Expr	   *tmp = left;
 
-			return OP_CONDITIONAL;
+			left = right;
+			right = tmp;
 		}
-	}
 
-	for (i = 0; mathOpNameMappings[i].op_name != NULL; i++)
-	{
-		if (strcmp(opname, mathOpNameMappings[i].op_name) == 0)
-		{
-				/* Current operator is safe to pushdown */
-			if (deparseName)
-				*deparseName = mathOpNameMappings[i].op_name_abbr;
-			return OP_MATH;
-		}
+		/* A nondeterministic collation also matches other strings */
+		if (!OidIsValid(node->inputcollid) ||
+			!get_collation_isdeterministic(node->inputcollid))
+			return NULL;
 	}
-
-	for (i = 0; jsonOpNameMappings[i].op_name != NULL; i++)
+	else
 	{
-		if (strcmp(opname, jsonOpNameMappings[i].op_name) == 0)
-		{
-				/* Current operator is safe to pushdown */
-			if (deparseName)
-				*deparseName = jsonOpNameMappings[i].op_name_abbr;
-			return OP_JSON;
-		}
+		char	   *opname = get_opname(node->opno);
+
+		if (opname == NULL || exprType((Node *) left) != JSONBOID)
+			return NULL;
+
+		if (!((strcmp(opname, "?") == 0 &&
+			   exprType((Node *) right) == TEXTOID) ||
+			  (strcmp(opname, "@>") == 0 &&
+			   exprType((Node *) right) == JSONBOID)))
+			return NULL;
 	}
 
-	/* Funtion does not in conditional list and math list */
-	return OP_UNSUPPORT;
+	while (IsA(right, RelabelType))
+		right = ((RelabelType *) right)->arg;
+
+	if (!IsA(right, Const) || ((Const *) right)->constisnull)
+		return NULL;
+
+	initStringInfo(&path);
+	if (!mongo_append_json_path(&path, left, relid, varno, &is_text) ||
+		is_text != (node->opno == TextEqualOperator))
+		return NULL;
+
+	*value = (Const *) right;
+	return path.data;
 }
 
 /*
- * Returns true if given expr is something we'd have to send the value of
- * to the foreign server.
+ * mongo_append_json_path
+ *		Append the dotted field path of a jsonb or json column of the relation,
+ *		or of an element of it taken by the "->", "#>", "->>" or "#>>"
+ *		operators with constant keys, to 'buf'.
  *
- * This should return true when the expression is a shippable node that
- * deparseExpr would add to context->params_list.  Note that we don't care
- * if the expression *contains* such a node, only whether one appears at top
- * level.  We need this to detect cases where setrefs.c would recognize a
- * false match between an fdw_exprs item (which came from the params_list)
- * and an entry in fdw_scan_tlist (which we're considering putting the given
- * expression into).
+ * 'is_text' is set if the element is extracted as text.  Returns false if the
+ * expression is not such a path.
  */
-bool
-mongo_is_foreign_param(PlannerInfo *root,
-				 RelOptInfo *baserel,
-				 Expr *expr)
+static bool
+mongo_append_json_path(StringInfo buf, Expr *expr, Oid relid, Index varno,
+					   bool *is_text)
 {
-	if (expr == NULL)
+	OpExpr	   *oe;
+	Const	   *key;
+	char	   *opname;
+	char	   *colname;
+	bool		is_inner_text;
+
+	*is_text = false;
+
+	while (IsA(expr, RelabelType))
+		expr = ((RelabelType *) expr)->arg;
+
+	if (IsA(expr, Var))
+	{
+		Var		   *var = (Var *) expr;
+
+		if ((varno != 0 && var->varno != varno) || var->varlevelsup != 0 ||
+			var->varattno <= 0 ||
+			(var->vartype != JSONBOID && var->vartype != JSONOID))
+			return false;
+
+		/* The fields of the __doc column are those of the document itself */
+		colname = get_attname(relid, var->varattno, false);
+		if (strcmp(colname, "__doc") != 0)
+			appendStringInfoString(buf, colname);
+		return true;
+	}
+
+	if (!IsA(expr, OpExpr) || list_length(((OpExpr *) expr)->args) != 2)
 		return false;
 
-	switch (nodeTag(expr))
+	oe = (OpExpr *) expr;
+	if (!IsA(lsecond(oe->args), Const) ||
+		((Const *) lsecond(oe->args))->constisnull)
+		return false;
+	key = (Const *) lsecond(oe->args);
+
+	opname = get_opname(oe->opno);
+	if (opname == NULL)
+		return false;
+	if (strcmp(opname, "->>") == 0 || strcmp(opname, "#>>") == 0)
+		*is_text = true;
+	else if (strcmp(opname, "->") != 0 && strcmp(opname, "#>") != 0)
+		return false;
+
+	if (!mongo_append_json_path(buf, (Expr *) linitial(oe->args), relid,
+								varno, &is_inner_text) || is_inner_text)
+		return false;
+
+	switch (key->consttype)
 	{
-		case T_Var:
+		case TEXTOID:
 			{
-				/* It would have to be sent unless it's a foreign Var */
-				Var		   *var = (Var *) expr;
-				MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) (baserel->fdw_private);
-				Relids		relids;
+				char	   *name = TextDatumGetCString(key->constvalue);
 
-				if (IS_UPPER_REL(baserel))
-					relids = fpinfo->outerrel->relids;
-				else
-					relids = baserel->relids;
+				if (!mongo_json_path_key_ok(name))
+					return false;
+				appendStringInfo(buf, "%s%s", buf->len > 0 ? "." : "", name);
+			}
+			break;
+		case INT4OID:
+			/* An array subscript, which MongoDB also takes in a path */
+			if (DatumGetInt32(key->constvalue) < 0)
+				return false;
+			appendStringInfo(buf, "%s%d", buf->len > 0 ? "." : "",
+							 DatumGetInt32(key->constvalue));
+			break;
+		case TEXTARRAYOID:
+			{
+				Datum	   *elems;
+				bool	   *nulls;
+				int			nelems;
+				int			i;
 
-				if (bms_is_member(var->varno, relids) && var->varlevelsup == 0)
-					return false;	/* foreign Var, so not a param */
-				else
-					return true;	/* it'd have to be a param */
-				break;
+				deconstruct_array(DatumGetArrayTypeP(key->constvalue),
+								  TEXTOID, -1, false, TYPALIGN_INT,
+								  &elems, &nulls, &nelems);
+
+				for (i = 0; i < nelems; i++)
+				{
+					char	   *name;
+
+					if (nulls[i])
+						return false;
+
+					name = TextDatumGetCString(elems[i]);
+					if (!mongo_json_path_key_ok(name))
+						return false;
+					appendStringInfo(buf, "%s%s", buf->len > 0 ? "." : "",
+									 name);
+				}
 			}
-		case T_Param:
-			/* Params always have to be sent to the foreign server */
-			return true;
-		default:
 			break;
+		default:
+			return false;
 	}
-	return false;
+
+	return true;
 }
 
 /*
- * Build the targetlist for given relation to be deparsed as SELECT clause.
- *
- * The output targetlist contains the columns that need to be fetched from the
- * foreign server for the given relation.  If foreignrel is an upper relation,
- * then the output targetlist can also contain expressions to be evaluated on
- * foreign server.
+ * mongo_json_path_key_ok
+ *		A key can be a step of a field path unless it is empty, has a dot
+ *		or starts with "$".
  */
-List *
-mongo_build_tlist_to_deparse(RelOptInfo *foreignrel)
+static bool
+mongo_json_path_key_ok(const char *key)
 {
-	List	   *tlist = NIL;
-	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) foreignrel->fdw_private;
-	ListCell   *lc;
+	return key[0] != '\0' && key[0] != '$' && strchr(key, '.') == NULL;
+}
 
-	/*
-	 * For an upper relation, we have already built the target list while
-	 * checking shippability, so just return that.
-	 */
-	if (IS_UPPER_REL(foreignrel))
-		return fpinfo->grouped_tlist;
+/*
+ * mongo_append_json_filter_conds
+ *		Append the conditions of a jsonb filter on the field 'path' to the
+ *		array 'conds', or only count them if 'conds' is NULL.
+ *
+ * Equality with a string is:
+ *		{ "c1.a": { $eq: "x" } }
+ * Text that a JSON number, boolean, object or array gives is not compared,
+ * since MongoDB does not match those with a string.  A key exists if it is
+ * in an object, or is a string in an array or the string itself:
+ *		{ $or: [{ "c1.a": { $exists: true } }, { c1: "a" }] }
+ * The paths of the __doc column start at the document, so that
+ * __doc ->> 'a' = 'x' is { a: { $eq: "x" } }.
+ * See mongo_append_jsonb_contains_conds for containment.
+ *
+ * Returns the number of conditions.
+ */
+static int
+mongo_append_json_filter_conds(BSON *conds, OpExpr *node, const char *path,
+							   Const *value)
+{
+	BSON		cond_doc, field_doc, or_array, exists_doc, key_doc;
+	char	   *str;
 
-	/*
-	 * We require columns specified in foreignrel->reltarget->exprs and those
-	 * required for evaluating the local conditions.
-	 */
-	tlist = add_to_flat_tlist(tlist,
-							  pull_var_clause((Node *) foreignrel->reltarget->exprs,
-											  PVC_RECURSE_PLACEHOLDERS));
-	foreach(lc, fpinfo->local_conds)
+	if (node->opno != TextEqualOperator &&
+		exprType((Node *) value) == JSONBOID)
 	{
-		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+		Jsonb	   *jb = DatumGetJsonbP(value->constvalue);
 
-		tlist = add_to_flat_tlist(tlist,
-								  pull_var_clause((Node *) rinfo->clause,
-												  PVC_RECURSE_PLACEHOLDERS));
+		return mongo_append_jsonb_contains_conds(conds, path, &jb->root);
 	}
 
-	return tlist;
-}
+	str = TextDatumGetCString(value->constvalue);
 
+	if (node->opno == TextEqualOperator)
+	{
+		if (str[0] == '{' || str[0] == '[' ||
+			strcmp(str, "true") == 0 || strcmp(str, "false") == 0 ||
+			(str[strspn(str, "0123456789+-.eE")] == '\0' &&
+			 strpbrk(str, "0123456789") != NULL))
+			return 0;
 
-/*
- * mongo_pull_func_clause_walker
- *
- * Recursively search for functions within a clause.
- */
-static bool
-mongo_pull_func_clause_walker(Node *node, pull_aggref_list_context *context)
-{
-	if (node == NULL)
-		return false;
-	if (IsA(node, Aggref))
+		if (conds)
+		{
+			bsonAppendStartObject (conds, "0", &cond_doc);
+			bsonAppendStartObject (&cond_doc, (char *) path, &field_doc);
+			bsonAppendUTF8 (&field_doc, "$eq", str);
+			bsonAppendFinishObject (&cond_doc, &field_doc);
+			bsonAppendFinishObject (conds, &cond_doc);
+		}
+		return 1;
+	}
+
+	/* A key existence test */
+	if (!mongo_json_path_key_ok(str))
+		return 0;
+
+	/* The document of the __doc column is an object, with an empty path */
+	if (conds && path[0] == '\0')
 	{
-		context->aggref_list = lappend(context->aggref_list, node);
-		return false;
+		bsonAppendStartObject (conds, "0", &cond_doc);
+		bsonAppendStartObject (&cond_doc, str, &exists_doc);
+		bsonAppendBool (&exists_doc, "$exists", true);
+		bsonAppendFinishObject (&cond_doc, &exists_doc);
+		bsonAppendFinishObject (conds, &cond_doc);
+	}
+	else if (conds)
+	{
+		bsonAppendStartObject (conds, "0", &cond_doc);
+		bsonAppendStartArray (&cond_doc, "$or", &or_array);
+		bsonAppendStartObject (&or_array, "0", &key_doc);
+		bsonAppendStartObject (&key_doc, psprintf("%s.%s", path, str),
+							   &exists_doc);
+		bsonAppendBool (&exists_doc, "$exists", true);
+		bsonAppendFinishObject (&key_doc, &exists_doc);
+		bsonAppendFinishObject (&or_array, &key_doc);
+		bsonAppendStartObject (&or_array, "1", &key_doc);
+		bsonAppendUTF8 (&key_doc, path, str);
+		bsonAppendFinishObject (&or_array, &key_doc);
+		bsonAppendFinishArray (&cond_doc, &or_array);
+		bsonAppendFinishObject (conds, &cond_doc);
 	}
-
-	return expression_tree_walker(node, mongo_pull_func_clause_walker,
-								  (void *) context);
+	return 1;
 }
 
 /*
- * pull_func_clause
+ * mongo_append_jsonb_contains_conds
+ *		Append the conditions for a jsonb value to contain 'container' at the
+ *		field 'path' to the array 'conds', or only count them if 'conds' is
+ *		NULL.
  *
- * Pull out function from a clause and then add to target list
+ * The keys of an object are followed down to its scalars, which are compared
+ * by equality.  The scalars of an array are matched by "$all", and each of
+ * its objects by "$elemMatch" with the conditions of its keys:
+ *		c1 @> '{"a": 1, "b": ["x", {"c": 2}]}'
+ *		{ "c1.a": 1 }, { "c1.b": { $all: ["x"] } },
+ *		{ "c1.b": { $elemMatch: { $and: [{ c: 2 }] } } }
+ * Values that cannot be matched like this, such as nested arrays, keys that
+ * cannot be in a path and numbers with a fraction, are left out.  The local
+ * check of the clause still applies them.
+ *
+ * Returns the number of conditions.
  */
-List *
-mongo_pull_func_clause(Node *node)
+static int
+mongo_append_jsonb_contains_conds(BSON *conds, const char *path,
+								  JsonbContainer *container)
 {
-	pull_aggref_list_context context;
-	context.aggref_list = NIL;
+	JsonbIterator *it;
+	JsonbIteratorToken r;
+	JsonbValue	v;
+	List	   *scalars = NIL;
+	List	   *objects = NIL;
+	ListCell   *lc;
+	int			count = 0;
 
-	mongo_pull_func_clause_walker(node, &context);
+	it = JsonbIteratorInit(container);
+	r = JsonbIteratorNext(&it, &v, true);
 
-	return context.aggref_list;
-}
+	if (r == WJB_BEGIN_ARRAY && v.val.array.rawScalar)
+	{
+		r = JsonbIteratorNext(&it, &v, true);
+		Assert(r == WJB_ELEM);
 
-/*
- * Deparse given operator expression.   To avoid problems around
- * priority of operations, we always parenthesize the arguments.
- */
-static void
-mongo_deparseOpExpr(OpExpr *node, deparse_expr_cxt *deparse_context)
-{
-	StringInfo	buf = deparse_context->buf;
-	char	   *opname;
-	ListCell   *arg;
+		return mongo_append_jsonb_scalar_cond(conds, path, &v);
+	}
 
-	/* Sanity check. */
-	Assert(list_length(node->args) == 2);
+	if (r == WJB_BEGIN_OBJECT)
+	{
+		while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+		{
+			char	   *key;
+			char	   *key_path;
 
-	/* Deparse left operand. */
-	arg = list_head(node->args);
-	mongo_deparseExpr(lfirst(arg), deparse_context);
+			if (r != WJB_KEY)
+				continue;
 
-	/* Deparse operator name. */
-	opname = get_opname(node->opno);
-	if (opname == NULL)
-		elog(ERROR, "No such operator name for operator OID %u", node->opno);
+			key = pnstrdup(v.val.string.val, v.val.string.len);
+			r = JsonbIteratorNext(&it, &v, true);
+			Assert(r == WJB_VALUE);
 
-	if (strcmp(opname, "->") == 0)
-		appendStringInfoChar(buf, '.');
-	else
-		ereport(ERROR, \
-				(errcode(ERRCODE_FDW_ERROR), \
-				errmsg("Can not deparse %s operator", opname), \
-				errhint("Only support deparse JSON arrow operators: \"->\""))); \
+			if (!mongo_json_path_key_ok(key))
+				continue;
 
-	/* Deparse right operand. */
-	arg = list_tail(node->args);
-	mongo_deparseExpr(lfirst(arg), deparse_context);
-}
+			/* The conditions of "$elemMatch" are on the element itself */
+			key_path = (path[0] != '\0') ? psprintf("%s.%s", path, key) : key;
 
-/*
- * Deparse given Var node into deparse_context->buf.
- *
- * If the Var belongs to the foreign relation, just print its remote name.
- * Otherwise, it's effectively a Param (and will in fact be a Param at
- * run time).  Handle it the same way we handle plain Params --- see
- * deparseParam for comments.
- */
-static void
-mongo_deparseVar(Var *node, deparse_expr_cxt *deparse_context)
-{
-	char	   *colname = NULL;
+			/* Nested containers are returned unexpanded */
+			if (v.type == jbvBinary)
+				count += mongo_append_jsonb_contains_conds(conds, key_path,
+														   v.val.binary.data);
+			else
+				count += mongo_append_jsonb_scalar_cond(conds, key_path, &v);
+		}
 
-	if (node->varattno <= 0)
-		elog(ERROR, "Could not support system attribute and whole row reference");
+		return count;
+	}
 
-	colname = get_attname(deparse_context->qdoc_ctx->rel_oid, node->varattno, false);
+	/* An array, and its elements against those of the array stored */
+	if (path[0] == '\0')
+		return 0;
 
-	appendStringInfoString(deparse_context->buf, colname);
-}
+	while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (r != WJB_ELEM)
+			continue;
 
-/*
- * Deparse given constant value into deparse_context->buf.
- *
- * This function has to be kept in sync with ruleutils.c's get_const_expr.
- * As for that function, showtype can be -1 to never show "::typename" decoration,
- * or +1 to always show it, or 0 to show it only if the constant wouldn't be assumed
- * to be the right type by default.
- */
-static void
-mongo_deparseConst(Const *node, deparse_expr_cxt *deparse_context)
-{
-	Oid			typoutput;
-	bool		typIsVarlena;
-	char	   *extval;
+		if (v.type != jbvBinary)
+		{
+			if (mongo_jsonb_scalar_ok(&v))
+			{
+				JsonbValue *scalar = palloc(sizeof(JsonbValue));
 
-	if (node->constisnull)
-	{
-		appendStringInfoString(deparse_context->buf, "null");
-		return;
+				*scalar = v;
+				scalars = lappend(scalars, scalar);
+			}
+		}
+		else if (JsonContainerIsObject(v.val.binary.data) &&
+				 mongo_append_jsonb_contains_conds(NULL, "",
+												   v.val.binary.data) > 0)
+			objects = lappend(objects, v.val.binary.data);
 	}
 
-	getTypeOutputInfo(node->consttype,
-					  &typoutput, &typIsVarlena);
-	extval = OidOutputFunctionCall(typoutput, node->constvalue);
+	if (conds)
+	{
+		BSON		cond_doc, field_doc, all_array, and_array;
+		int			index = 0;
 
-	appendStringInfoString(deparse_context->buf, extval);
+		if (scalars)
+		{
+			bsonAppendStartObject (conds, "0", &cond_doc);
+			bsonAppendStartObject (&cond_doc, (char *) path, &field_doc);
+			bsonAppendStartArray (&field_doc, "$all", &all_array);
+			foreach(lc, scalars)
+			{
+				char		indexString[16];
 
-	pfree(extval);
+				snprintf(indexString, sizeof(indexString), "%d", index++);
+				append_jsonb_scalar(&all_array, indexString,
+									(JsonbValue *) lfirst(lc));
+			}
+			bsonAppendFinishArray (&field_doc, &all_array);
+			bsonAppendFinishObject (&cond_doc, &field_doc);
+			bsonAppendFinishObject (conds, &cond_doc);
+		}
 
-	return;
-}
+		foreach(lc, objects)
+		{
+			BSON		match_doc;
+
+			bsonAppendStartObject (conds, "0", &cond_doc);
+			bsonAppendStartObject (&cond_doc, (char *) path, &field_doc);
+			bsonAppendStartObject (&field_doc, "$elemMatch", &match_doc);
+			bsonAppendStartArray (&match_doc, "$and", &and_array);
+			mongo_append_jsonb_contains_conds(&and_array, "",
+											  (JsonbContainer *) lfirst(lc));
+			bsonAppendFinishArray (&match_doc, &and_array);
+			bsonAppendFinishObject (&field_doc, &match_doc);
+			bsonAppendFinishObject (&cond_doc, &field_doc);
+			bsonAppendFinishObject (conds, &cond_doc);
+		}
+	}
 
-/*
- * Deparse a RelabelType (binary-compatible cast) node.
- * 	Discard explicit cast type.
- */
-static void
-mongo_deparseRelabelType(RelabelType *node, deparse_expr_cxt *deparse_context)
-{
-	mongo_deparseExpr(node->arg, deparse_context);
+	return (scalars != NIL ? 1 : 0) + list_length(objects);
 }
 
 /*
- * Deparse given expression into deparse_context->buf.
- *
- * This function must support all the same node types that foreign_expr_walker
- * accepts.
- *
- * Note: unlike ruleutils.c, we just use a simple hard-wired parenthesization
- * scheme: anything more complex than a Var, Const, function call or cast
- * should be self-parenthesized.
+ * mongo_append_jsonb_scalar_cond
+ *		Append the equality of the field 'path' with a jsonb scalar to the
+ *		array 'conds', or only count it if 'conds' is NULL.
  */
-static void
-mongo_deparseExpr(Expr *node, deparse_expr_cxt *deparse_context)
+static int
+mongo_append_jsonb_scalar_cond(BSON *conds, const char *path,
+							   JsonbValue *value)
 {
-	if (node == NULL)
-		return;
+	BSON		cond_doc;
 
-	switch (nodeTag(node))
+	if (path[0] == '\0' || !mongo_jsonb_scalar_ok(value))
+		return 0;
+
+	if (conds)
 	{
-		case T_Var:
-			mongo_deparseVar((Var *) node, deparse_context);
-			break;
-		case T_Const:
-			mongo_deparseConst((Const *) node, deparse_context);
-			break;
-		case T_OpExpr:
-			mongo_deparseOpExpr((OpExpr *) node, deparse_context);
-			break;
-		case T_RelabelType:
-			mongo_deparseRelabelType((RelabelType *)node, deparse_context);
-			break;
-		default:
-			elog(ERROR, "unsupported expression type for deparse: %d",
-				 (int) nodeTag(node));
-			break;
+		bsonAppendStartObject (conds, "0", &cond_doc);
+		append_jsonb_scalar(&cond_doc, path, value);
+		bsonAppendFinishObject (conds, &cond_doc);
 	}
+	return 1;
 }
 
 /*
- * mongo_tlist_has_jsonb_arrow_op.
- *
- * Determine whether target list has Jsonb arrow operator
- * that is safe to pushdown.
+ * mongo_jsonb_scalar_ok
+ *		A jsonb scalar can be matched by equality unless it is a number with a
+ *		fraction, which may be stored with more digits than its text shows.
  */
-bool
-mongo_tlist_has_jsonb_arrow_op(PlannerInfo *root, RelOptInfo *baserel, List *tlist)
+static bool
+mongo_jsonb_scalar_ok(JsonbValue *value)
 {
-	MongoOperatorsSupport opkind;
-	List	 *input_tlist;
-	ListCell *lc;
-	bool	 json_op_safe = false;
-
-	if (!IS_SIMPLE_REL(baserel))
-		return false;
-
-	input_tlist = (tlist) ? tlist : baserel->reltarget->exprs;
-
-	/* Check Jsonb arrow operator "->" */
-	foreach(lc, input_tlist)
-	{
-		Node *node = lfirst(lc);
+	Datum		num;
 
-		if (IsA(node, TargetEntry))
-			node = (Node *) ((TargetEntry *) node)->expr;
+	if (value->type != jbvNumeric)
+		return true;
 
-		/*
-		 * If any target expression is not pushdown, then we cannot
-		 * push down Json arrow operator to the foreign server.
-		 */
-		if (!mongo_is_foreign_expr(root, baserel, (Expr *)node))
-			return false;
+	num = NumericGetDatum(value->val.numeric);
+	if (!mongo_numeric_float8_ok(num))
+		return false;
 
-		if (IsA(node, OpExpr))
-		{
-			OpExpr *oe = (OpExpr *) node;
+	return DatumGetBool(DirectFunctionCall2(numeric_eq, num,
+											DirectFunctionCall2(numeric_trunc,
+																num,
+																Int32GetDatum(0))));
+}
 
-			opkind = mongo_validateOperatorName(oe->opno, NULL, NULL);
+/*
+ *	Build a jsonb filter in BSON query document, as the conditions of
+ *	mongo_append_json_filter_conds:
+ *		{ $and: [{ "c1.a": { $eq: "x" } }, ...] }
+ */
+static void
+mongo_build_json_filter_doc(BSON *qdoc, OpExpr *node, const char *path,
+							Const *value, qdoc_expr_cxt *context)
+{
+	BSON		field_doc, and_array;
+	BSON	   *ptr_qdoc = qdoc;
 
-			if (opkind == OP_JSON)
-				json_op_safe = true;
-			else
-				return false;
-		}
+	if (context->conds_num > 1)
+	{
+		bsonAppendStartObject (qdoc, (char *) path, &field_doc);
+		ptr_qdoc = &field_doc;
 	}
 
-	return json_op_safe;
+	bsonAppendStartArray (ptr_qdoc, "$and", &and_array);
+	mongo_append_json_filter_conds(&and_array, node, path, value);
+	bsonAppendFinishArray (ptr_qdoc, &and_array);
+
+	if (context->conds_num > 1)
+		bsonAppendFinishObject (qdoc, &field_doc);
 }
 
 /*
@@ -3397,15 +8255,19 @@ BSON* mongo_build_bson_query_document(EState *estate, TupleDesc tupdesc, MongoPl
 	context.bs_key = NULL;
 	context.need_aggexpr_syntax = false;
 	context.agg_ref_list = NIL;
+	context.final_agg_list = NIL;
 	context.count_boolexpr = 0;
 	context.innerel_name = NULL;
 	context.outerrel_name = NULL;
 	context.innerel_name_list = NIL;
 	context.is_join_expr = false;
 	context.inner_pipeline_ref_list = NIL;
-	context.inner_rtindex = 0;
+	context.inner_rtindex_list = NIL;
 	context.is_in_grouping_clause = false;
 	context.rte_index_offset = 0;
+	context.param_exprs = plannerInfo->param_exprs;
+	context.param_values = plannerInfo->param_values;
+	context.param_isnulls = plannerInfo->param_isnulls;
 
 	mongo_aggregate_pipeline_query(estate, tupdesc, plannerInfo, &context, queryDocument);
 
@@ -3470,7 +8332,8 @@ static void fetch_executor_relation_offset(MongoPlanerJoinInfo *join_info, qdoc_
 	int inner_rte_index_offset = 0;
 	int i;
 
-	for (i = 1; i<= context->estate->es_range_table_size; ++i)
+	for (i = 1; join_info->outerrel_relid > 0 &&
+		 i <= context->estate->es_range_table_size; ++i)
 	{
 		rte = exec_rt_fetch(i, context->estate);
 		if (join_info->outerrel_oid == rte->relid &&
@@ -3494,8 +8357,130 @@ static void fetch_executor_relation_offset(MongoPlanerJoinInfo *join_info, qdoc_
 		}
 	}
 
-	if (outer_rte_index_offset != inner_rte_index_offset)
+	/* The outer relation of a nested join is a lower join, found already */
+	if (join_info->outerrel_relid > 0 &&
+		outer_rte_index_offset != inner_rte_index_offset)
 		elog(ERROR,"outer_rte_index_offset must match with inner_rte_index_offset \n");
 
 	context->rte_index_offset = outer_rte_index_offset = inner_rte_index_offset;
+}
+
+/*
+ * Get the name under which the documents of an inner relation of a join are
+ * nested, or NULL if the relation is not one.
+ */
+static char *
+mongo_get_inner_rel_name(Index varno, qdoc_expr_cxt *context)
+{
+	ListCell   *lc_rtindex;
+	ListCell   *lc_name;
+
+	forboth(lc_rtindex, context->inner_rtindex_list,
+			lc_name, context->innerel_name_list)
+	{
+		if (lfirst_int(lc_rtindex) == varno)
+			return strVal(lfirst(lc_name));
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the fields of the outer and the inner documents which are compared by
+ * the first equality of an outer and an inner column of the same type in the
+ * join clauses.  Returns false if there is none, or if the server is not
+ * known to be MongoDB 5.0 or later, which first takes these fields along with
+ * a pipeline.
+ */
+static bool
+mongo_get_lookup_fields(MongoPlanerJoinInfo *join_info, List *tlist,
+						qdoc_expr_cxt *context, char **local_field,
+						char **foreign_field)
+{
+	ListCell   *lc;
+
+	if (!join_info->lookup_fields)
+		return false;
+
+	foreach(lc, join_info->joinclauses)
+	{
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+		OpExpr	   *op = (OpExpr *) rinfo->clause;
+		Var		   *outer_var;
+		Var		   *inner_var;
+		RangeTblEntry *rte;
+		char	   *opname;
+		char	   *inner_name;
+
+		if (!IsA(op, OpExpr) || list_length(op->args) != 2)
+			continue;
+
+		opname = get_opname(op->opno);
+		if (opname == NULL || strcmp(opname, "=") != 0)
+			continue;
+
+		outer_var = (Var *) linitial(op->args);
+		inner_var = (Var *) lsecond(op->args);
+		if (!IsA(outer_var, Var) || !IsA(inner_var, Var) ||
+			outer_var->vartype != inner_var->vartype)
+			continue;
+
+		if (outer_var->varno == join_info->innerrel_relid)
+		{
+			Var		   *tmp = outer_var;
+
+			outer_var = inner_var;
+			inner_var = tmp;
+		}
+		if (inner_var->varno != join_info->innerrel_relid ||
+			outer_var->varno == join_info->innerrel_relid)
+			continue;
+
+		/* A column of a lower inner relation is in its nested documents */
+		inner_name = mongo_get_inner_rel_name(outer_var->varno, context);
+		if (inner_name != NULL)
+			*local_field = psprintf("%s.ref%d", inner_name,
+									mongo_get_tlist_index(tlist, (Expr *) outer_var));
+		else
+		{
+			rte = exec_rt_fetch(outer_var->varno + context->rte_index_offset,
+								context->estate);
+			*local_field = mongo_get_column_name(rte->relid,
+												 outer_var->varattno);
+		}
+
+		rte = exec_rt_fetch(inner_var->varno + context->rte_index_offset,
+							context->estate);
+		*foreign_field = mongo_get_column_name(rte->relid,
+											   inner_var->varattno);
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Get the index of a column in the target list of a join relation.
+ */
+static int
+mongo_get_tlist_index(List *tlist, Expr *expr)
+{
+	ListCell   *lc;
+	int			i = 0;
+
+	foreach(lc, tlist)
+	{
+		Node	   *node = (Node *) lfirst(lc);
+
+		if (IsA(node, TargetEntry))
+			node = (Node *) ((TargetEntry *) node)->expr;
+
+		if (equal(node, expr))
+			return i;
+		i++;
+	}
+
+	elog(ERROR, "could not find the column of inner relation in target list");
+	return -1;					/* keep compiler quiet */
 }
\ No newline at end of file
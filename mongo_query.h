@@ -41,7 +41,9 @@ extern bool mongo_is_foreign_param(PlannerInfo *root,
 							 Expr *expr);
 extern List *mongo_build_tlist_to_deparse(RelOptInfo *foreignrel);
 extern List *mongo_pull_func_clause(Node *node);
+extern List *mongo_pull_param_exprs(List *remote_exprs, Index relid);
 extern bool mongo_tlist_has_jsonb_arrow_op(PlannerInfo *root, RelOptInfo *baserel, List *tlist);
+extern bool mongo_is_finalized_aggref(Aggref *agg);
 /* Functions to be used in deparse.c */
 extern char *mongo_operator_name(const char *operatorName);
 extern void append_constant_value(BSON *queryDocument, const char *keyName,
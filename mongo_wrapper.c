@@ -70,8 +70,19 @@ mongoDisconnect(MONGO_CONN *conn)
 	mongo_dealloc(conn);
 }
 
+/*
+ * The legacy driver has no per-operation write options, so writes always use
+ * the connection defaults.
+ */
+BSON *
+mongoWriteOptsCreate(MongoFdwOptions *opt)
+{
+	return NULL;
+}
+
 bool
-mongoInsert(MONGO_CONN *conn, char *database, char *collection, bson *b)
+mongoInsert(MONGO_CONN *conn, char *database, char *collection, bson *b,
+			BSON *opts)
 {
 	char		qual[QUAL_STRING_LEN];
 
@@ -86,7 +97,7 @@ mongoInsert(MONGO_CONN *conn, char *database, char *collection, bson *b)
 
 bool
 mongoUpdate(MONGO_CONN *conn, char *database, char *collection, BSON *b,
-			BSON *op)
+			BSON *op, BSON *opts)
 {
 	char		qual[QUAL_STRING_LEN];
 
@@ -100,7 +111,8 @@ mongoUpdate(MONGO_CONN *conn, char *database, char *collection, BSON *b,
 }
 
 bool
-mongoDelete(MONGO_CONN *conn, char *database, char *collection, BSON *b)
+mongoDelete(MONGO_CONN *conn, char *database, char *collection, BSON *b,
+			BSON *opts)
 {
 	char		qual[QUAL_STRING_LEN];
 
@@ -114,7 +126,8 @@ mongoDelete(MONGO_CONN *conn, char *database, char *collection, BSON *b)
 }
 
 MONGO_CURSOR *
-mongoCursorCreate(MONGO_CONN *conn, char *database, char *collection, BSON *q, bool is_scan_query)
+mongoCursorCreate(MONGO_CONN *conn, char *database, char *collection, BSON *q,
+				  BSON *opts, bool is_scan_query)
 {
 	MONGO_CURSOR *c;
 	char		qual[QUAL_STRING_LEN];
@@ -33,13 +33,31 @@ MONGO_CONN *mongoConnect(MongoFdwOptions *opt);
 MONGO_CONN *mongoConnect(MongoFdwOptions *opt);
 #endif
 void mongoDisconnect(MONGO_CONN *conn);
-bool mongoInsert(MONGO_CONN *conn, char *database, char *collection, BSON *b);
+BSON *mongoWriteOptsCreate(MongoFdwOptions *opt);
+bool mongoInsert(MONGO_CONN *conn, char *database, char *collection, BSON *b,
+				 BSON *opts);
 bool mongoUpdate(MONGO_CONN *conn, char *database, char *collection, BSON *b,
-				 BSON *op);
+				 BSON *op, BSON *opts);
 bool mongoDelete(MONGO_CONN *conn, char *database, char *collection,
-				 BSON *b);
+				 BSON *b, BSON *opts);
+#ifdef META_DRIVER
+MONGO_BULK *mongoBulkCreate(MONGO_CONN *conn, char *database,
+							char *collection, BSON *opts);
+void mongoBulkInsert(MONGO_BULK *bulk, BSON *doc);
+void mongoBulkReplace(MONGO_BULK *bulk, BSON *selector, BSON *doc,
+					  bool upsert);
+void mongoBulkUpdate(MONGO_BULK *bulk, BSON *selector, BSON *update,
+					 bool upsert);
+void mongoBulkDelete(MONGO_BULK *bulk, BSON *selector);
+int64 mongoBulkExecute(MONGO_BULK *bulk);
+void mongoBulkDestroy(MONGO_BULK *bulk);
+void mongoTruncate(MONGO_CONN *conn, char *database, char *collection,
+				   bool drop, BSON *opts);
+List *mongoListIndexes(MONGO_CONN *conn, char *database, char *collection);
+#endif
 MONGO_CURSOR *mongoCursorCreate(MONGO_CONN *conn, char *database,
-								char *collection, BSON *q, bool is_scan_query);
+								char *collection, BSON *q, BSON *opts,
+								bool is_scan_query);
 const BSON *mongoCursorBson(MONGO_CURSOR *c);
 bool mongoCursorNext(MONGO_CURSOR *c, BSON *b);
 void mongoCursorDestroy(MONGO_CURSOR *c);
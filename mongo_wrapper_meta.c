@@ -168,12 +168,67 @@ mongoDisconnect(MONGO_CONN *conn)
 		mongoc_client_destroy(conn);
 }
 
+/*
+ * mongoWriteOptsCreate
+ *		Build the options document sent along with each write, carrying the
+ *		write concern and the bypassDocumentValidation flag.
+ *
+ * Returns NULL when neither is configured, so that the client defaults are
+ * used.
+ */
+BSON *
+mongoWriteOptsCreate(MongoFdwOptions *opt)
+{
+	BSON	   *opts;
+
+	if (opt->writeConcern == NULL && !opt->bypass_document_validation)
+		return NULL;
+
+	opts = bsonCreate();
+
+	if (opt->writeConcern != NULL)
+	{
+		MongoWriteConcern wc;
+		BSON		wc_doc;
+		const char *problem;
+
+		problem = mongo_parse_write_concern(opt->writeConcern, &wc);
+		if (problem)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+					 errmsg("invalid write concern \"%s\"", opt->writeConcern),
+					 errdetail("%s", problem)));
+
+		bsonAppendStartObject(opts, "writeConcern", &wc_doc);
+		if (wc.w != NULL)
+		{
+			if (strspn(wc.w, "0123456789") > 0)
+				bsonAppendInt32(&wc_doc, "w", atoi(wc.w));
+			else
+				bsonAppendUTF8(&wc_doc, "w", wc.w);
+		}
+		if (wc.journal >= 0)
+			bsonAppendBool(&wc_doc, "j", wc.journal == 1);
+		if (wc.wtimeout >= 0)
+			bsonAppendInt32(&wc_doc, "wtimeout", wc.wtimeout);
+		bsonAppendFinishObject(opts, &wc_doc);
+	}
+
+	if (opt->bypass_document_validation)
+		bsonAppendBool(opts, "bypassDocumentValidation", true);
+
+	bsonFinish(opts);
+
+	return opts;
+}
+
 /*
  * mongoInsert
  *		Insert a document 'b' into MongoDB.
  */
 bool
-mongoInsert(MONGO_CONN *conn, char *database, char *collection, BSON *b)
+mongoInsert(MONGO_CONN *conn, char *database, char *collection, BSON *b,
+			BSON *opts)
 {
 	mongoc_collection_t *c;
 	bson_error_t error;
@@ -181,7 +236,7 @@ mongoInsert(MONGO_CONN *conn, char *database, char *collection, BSON *b)
 
 	c = mongoc_client_get_collection(conn, database, collection);
 
-	r = mongoc_collection_insert(c, MONGOC_INSERT_NONE, b, NULL, &error);
+	r = mongoc_collection_insert_one(c, b, opts, NULL, &error);
 	mongoc_collection_destroy(c);
 	if (!r)
 		ereport(ERROR,
@@ -197,7 +252,7 @@ mongoInsert(MONGO_CONN *conn, char *database, char *collection, BSON *b)
  */
 bool
 mongoUpdate(MONGO_CONN *conn, char *database, char *collection, BSON *b,
-			BSON *op)
+			BSON *op, BSON *opts)
 {
 	mongoc_collection_t *c;
 	bson_error_t error;
@@ -205,7 +260,7 @@ mongoUpdate(MONGO_CONN *conn, char *database, char *collection, BSON *b,
 
 	c = mongoc_client_get_collection(conn, database, collection);
 
-	r = mongoc_collection_update(c, MONGOC_UPDATE_NONE, b, op, NULL, &error);
+	r = mongoc_collection_update_one(c, b, op, opts, NULL, &error);
 	mongoc_collection_destroy(c);
 	if (!r)
 		ereport(ERROR,
@@ -220,17 +275,28 @@ mongoUpdate(MONGO_CONN *conn, char *database, char *collection, BSON *b,
  *		Delete MongoDB's document.
  */
 bool
-mongoDelete(MONGO_CONN *conn, char *database, char *collection, BSON *b)
+mongoDelete(MONGO_CONN *conn, char *database, char *collection, BSON *b,
+			BSON *opts)
 {
 	mongoc_collection_t *c;
 	bson_error_t error;
+	BSON	   *delete_opts = NULL;
 	bool		r = false;
 
+	/* The delete command does not accept bypassDocumentValidation */
+	if (opts)
+	{
+		delete_opts = bsonCreate();
+		bson_copy_to_excluding_noinit(opts, delete_opts,
+									  "bypassDocumentValidation", NULL);
+	}
+
 	c = mongoc_client_get_collection(conn, database, collection);
 
-	r = mongoc_collection_remove(c, MONGOC_DELETE_SINGLE_REMOVE, b, NULL,
-								 &error);
+	r = mongoc_collection_delete_one(c, b, delete_opts, NULL, &error);
 	mongoc_collection_destroy(c);
+	if (delete_opts)
+		bsonDestroy(delete_opts);
 	if (!r)
 		ereport(ERROR,
 				(errmsg("failed to delete row"),
@@ -239,13 +305,388 @@ mongoDelete(MONGO_CONN *conn, char *database, char *collection, BSON *b)
 	return true;
 }
 
+/*
+ * mongoTruncate
+ *		Remove all documents of a collection.
+ *
+ * Unless 'drop' is true this is a single deleteMany({}).  Otherwise the
+ * collection is dropped and created again with the same options and
+ * secondary indexes, which is cheaper for large collections.  'opts' is as
+ * built by mongoWriteOptsCreate, possibly with a session appended.
+ */
+void
+mongoTruncate(MONGO_CONN *conn, char *database, char *collection, bool drop,
+			  BSON *opts)
+{
+	mongoc_collection_t *c;
+	mongoc_database_t *db;
+	mongoc_cursor_t *cursor;
+	bson_error_t error;
+	const BSON *doc;
+	BSON	   *write_opts;
+	BSON	   *coll_opts = NULL;
+	BSON	   *command;
+	BSON		indexes;
+	uint32		nindexes = 0;
+	char		numstr[16];
+
+	/* Neither command accepts bypassDocumentValidation */
+	write_opts = bsonCreate();
+	if (opts)
+		bson_copy_to_excluding_noinit(opts, write_opts,
+									  "bypassDocumentValidation", NULL);
+
+	c = mongoc_client_get_collection(conn, database, collection);
+
+	if (!drop)
+	{
+		BSON	   *selector = bsonCreate();
+		bool		r;
+
+		r = mongoc_collection_delete_many(c, selector, write_opts, NULL,
+										  &error);
+		bsonDestroy(selector);
+		bsonDestroy(write_opts);
+		mongoc_collection_destroy(c);
+		if (!r)
+			ereport(ERROR,
+					(errmsg("failed to truncate collection \"%s\"",
+							collection),
+					 errhint("Mongo error: \"%s\"", error.message)));
+		return;
+	}
+
+	/* Remember the collection options, such as a validator or capped size */
+	db = mongoc_client_get_database(conn, database);
+	command = BCON_NEW("filter", "{", "name", BCON_UTF8(collection), "}");
+	cursor = mongoc_database_find_collections_with_opts(db, command);
+	bsonDestroy(command);
+	while (mongoc_cursor_next(cursor, &doc))
+	{
+		bson_iter_t it;
+		uint32_t	len;
+		const uint8_t *data;
+
+		if (bson_iter_init_find(&it, doc, "options") &&
+			BSON_ITER_HOLDS_DOCUMENT(&it))
+		{
+			bson_iter_document(&it, &len, &data);
+			coll_opts = bson_new_from_data(data, len);
+		}
+	}
+	if (mongoc_cursor_error(cursor, &error))
+		ereport(ERROR,
+				(errmsg("failed to list collection \"%s\"", collection),
+				 errhint("Mongo error: \"%s\"", error.message)));
+	mongoc_cursor_destroy(cursor);
+
+	/* Collect the secondary index specifications */
+	command = bsonCreate();
+	bsonAppendUTF8(command, "createIndexes", collection);
+	bsonAppendStartArray(command, "indexes", &indexes);
+	cursor = mongoc_collection_find_indexes_with_opts(c, NULL);
+	while (mongoc_cursor_next(cursor, &doc))
+	{
+		bson_iter_t it;
+		BSON		spec;
+
+		if (bson_iter_init_find(&it, doc, "name") &&
+			strcmp(bson_iter_utf8(&it, NULL), "_id_") == 0)
+			continue;
+
+		snprintf(numstr, sizeof(numstr), "%u", nindexes++);
+		bsonAppendStartObject(&indexes, numstr, &spec);
+		bson_copy_to_excluding_noinit(doc, &spec, "ns", NULL);
+		bsonAppendFinishObject(&indexes, &spec);
+	}
+	if (mongoc_cursor_error(cursor, &error))
+		ereport(ERROR,
+				(errmsg("failed to list indexes of collection \"%s\"",
+						collection),
+				 errhint("Mongo error: \"%s\"", error.message)));
+	mongoc_cursor_destroy(cursor);
+	bsonAppendFinishArray(command, &indexes);
+
+	/* A collection that does not exist yet is already empty */
+	if (!mongoc_collection_drop_with_opts(c, write_opts, &error) &&
+		error.code != 26)		/* NamespaceNotFound */
+		ereport(ERROR,
+				(errmsg("failed to drop collection \"%s\"", collection),
+				 errhint("Mongo error: \"%s\"", error.message)));
+
+	if (coll_opts != NULL && !bson_empty(coll_opts))
+	{
+		mongoc_collection_t *newc;
+
+		newc = mongoc_database_create_collection(db, collection, coll_opts,
+												 &error);
+		if (newc == NULL)
+			ereport(ERROR,
+					(errmsg("failed to create collection \"%s\"",
+							collection),
+					 errhint("Mongo error: \"%s\"", error.message)));
+		mongoc_collection_destroy(newc);
+	}
+
+	if (nindexes > 0 &&
+		!mongoc_collection_write_command_with_opts(c, command, write_opts,
+												   NULL, &error))
+		ereport(ERROR,
+				(errmsg("failed to recreate indexes of collection \"%s\"",
+						collection),
+				 errhint("Mongo error: \"%s\"", error.message)));
+
+	if (coll_opts)
+		bsonDestroy(coll_opts);
+	bsonDestroy(command);
+	bsonDestroy(write_opts);
+	mongoc_collection_destroy(c);
+	mongoc_database_destroy(db);
+}
+
+/*
+ * mongoListIndexes
+ *		Returns the indexes of a collection as a list of MongoIndexInfo.
+ *
+ * Only indexes holding every document in plain key order are returned;
+ * sparse, partial, hidden and collated indexes as well as text, hashed and
+ * geospatial ones are left out.  The result merely guides planning, so a
+ * failure is reported at DEBUG1 and yields no indexes.
+ */
+List *
+mongoListIndexes(MONGO_CONN *conn, char *database, char *collection)
+{
+	mongoc_collection_t *c;
+	mongoc_cursor_t *cursor;
+	bson_error_t error;
+	const BSON *doc;
+	List	   *indexes = NIL;
+
+	c = mongoc_client_get_collection(conn, database, collection);
+	cursor = mongoc_collection_find_indexes_with_opts(c, NULL);
+	while (mongoc_cursor_next(cursor, &doc))
+	{
+		bson_iter_t it;
+		bson_iter_t key_it;
+		MongoIndexInfo *index;
+		bool		usable = true;
+
+		if ((bson_iter_init_find(&it, doc, "sparse") &&
+			 bson_iter_as_bool(&it)) ||
+			(bson_iter_init_find(&it, doc, "hidden") &&
+			 bson_iter_as_bool(&it)) ||
+			bson_iter_init_find(&it, doc, "partialFilterExpression") ||
+			bson_iter_init_find(&it, doc, "collation"))
+			continue;
+
+		if (!bson_iter_init_find(&it, doc, "key") ||
+			!BSON_ITER_HOLDS_DOCUMENT(&it) ||
+			!bson_iter_recurse(&it, &key_it))
+			continue;
+
+		index = (MongoIndexInfo *) palloc0(sizeof(MongoIndexInfo));
+		while (bson_iter_next(&key_it))
+		{
+			/* Special index types have a string in place of a direction */
+			if (!BSON_ITER_HOLDS_NUMBER(&key_it))
+			{
+				usable = false;
+				break;
+			}
+
+			index->fields = lappend(index->fields,
+									makeString(pstrdup(bson_iter_key(&key_it))));
+			index->directions = lappend_int(index->directions,
+											bson_iter_as_int64(&key_it) < 0 ? -1 : 1);
+		}
+
+		if (bson_iter_init_find(&it, doc, "name") && BSON_ITER_HOLDS_UTF8(&it))
+			index->name = pstrdup(bson_iter_utf8(&it, NULL));
+
+		if (usable && index->fields != NIL)
+			indexes = lappend(indexes, index);
+	}
+
+	if (mongoc_cursor_error(cursor, &error))
+	{
+		ereport(DEBUG1,
+				(errmsg("could not retrieve indexes of collection \"%s\"",
+						collection),
+				 errhint("Mongo error: \"%s\"", error.message)));
+		indexes = NIL;
+	}
+
+	mongoc_cursor_destroy(cursor);
+	mongoc_collection_destroy(c);
+
+	return indexes;
+}
+
+/*
+ * mongoBulkCreate
+ *		Start an unordered bulk write against the given collection.
+ *
+ * The write concern and bypassDocumentValidation flag are taken from 'opts',
+ * as built by mongoWriteOptsCreate, and so is the session of a transaction.
+ */
+MONGO_BULK *
+mongoBulkCreate(MONGO_CONN *conn, char *database, char *collection,
+				BSON *opts)
+{
+	mongoc_collection_t *c;
+	MONGO_BULK *bulk;
+	BSON	   *bulk_opts;
+	bson_iter_t it;
+
+	bulk_opts = bsonCreate();
+	bsonAppendBool(bulk_opts, "ordered", false);
+	if (opts && bson_iter_init_find(&it, opts, "writeConcern"))
+		bson_append_iter(bulk_opts, "writeConcern", -1, &it);
+	if (opts && bson_iter_init_find(&it, opts, "sessionId"))
+		bson_append_iter(bulk_opts, "sessionId", -1, &it);
+	bsonFinish(bulk_opts);
+
+	c = mongoc_client_get_collection(conn, database, collection);
+	bulk = mongoc_collection_create_bulk_operation_with_opts(c, bulk_opts);
+	mongoc_collection_destroy(c);
+	bsonDestroy(bulk_opts);
+
+	if (opts && bson_iter_init_find(&it, opts, "bypassDocumentValidation"))
+		mongoc_bulk_operation_set_bypass_document_validation(bulk,
+															 bson_iter_as_bool(&it));
+
+	return bulk;
+}
+
+/*
+ * mongoBulkInsert
+ *		Queue the insertion of document 'doc'.
+ */
+void
+mongoBulkInsert(MONGO_BULK *bulk, BSON *doc)
+{
+	bson_error_t error;
+
+	if (!mongoc_bulk_operation_insert_with_opts(bulk, doc, NULL, &error))
+		ereport(ERROR,
+				(errmsg("failed to queue insert of row"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+}
+
+/*
+ * mongoBulkReplace
+ *		Queue the replacement of the document matching 'selector' by 'doc',
+ *		inserting it when there is none and 'upsert' is true.
+ */
+void
+mongoBulkReplace(MONGO_BULK *bulk, BSON *selector, BSON *doc, bool upsert)
+{
+	bson_error_t error;
+	BSON	   *opts;
+	bool		r;
+
+	opts = bsonCreate();
+	bsonAppendBool(opts, "upsert", upsert);
+	bsonFinish(opts);
+
+	r = mongoc_bulk_operation_replace_one_with_opts(bulk, selector, doc, opts,
+													&error);
+	bsonDestroy(opts);
+	if (!r)
+		ereport(ERROR,
+				(errmsg("failed to queue replacement of row"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+}
+
+/*
+ * mongoBulkUpdate
+ *		Queue the update 'update' of the document matching 'selector'.
+ */
+void
+mongoBulkUpdate(MONGO_BULK *bulk, BSON *selector, BSON *update, bool upsert)
+{
+	bson_error_t error;
+	BSON	   *opts;
+	bool		r;
+
+	opts = bsonCreate();
+	bsonAppendBool(opts, "upsert", upsert);
+	bsonFinish(opts);
+
+	r = mongoc_bulk_operation_update_one_with_opts(bulk, selector, update,
+												   opts, &error);
+	bsonDestroy(opts);
+	if (!r)
+		ereport(ERROR,
+				(errmsg("failed to queue update of row"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+}
+
+/*
+ * mongoBulkDelete
+ *		Queue the deletion of the document matching 'selector'.
+ */
+void
+mongoBulkDelete(MONGO_BULK *bulk, BSON *selector)
+{
+	bson_error_t error;
+
+	if (!mongoc_bulk_operation_remove_one_with_opts(bulk, selector, NULL,
+													&error))
+		ereport(ERROR,
+				(errmsg("failed to queue delete of row"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+}
+
+/*
+ * mongoBulkExecute
+ *		Send all queued writes to the server and destroy the bulk write.
+ *
+ * Returns the number of documents inserted by upserts, as counted by the
+ * reply.  The bulk write must not be empty.
+ */
+int64
+mongoBulkExecute(MONGO_BULK *bulk)
+{
+	bson_error_t error;
+	bson_t		reply;
+	bson_iter_t it;
+	uint32_t	r;
+	int64		nupserted = 0;
+
+	r = mongoc_bulk_operation_execute(bulk, &reply, &error);
+	if (r != 0 && bson_iter_init_find(&it, &reply, "nUpserted"))
+		nupserted = bson_iter_as_int64(&it);
+	bson_destroy(&reply);
+	mongoc_bulk_operation_destroy(bulk);
+	if (r == 0)
+		ereport(ERROR,
+				(errmsg("failed to execute bulk write"),
+				 errhint("Mongo error: \"%s\"", error.message)));
+
+	return nupserted;
+}
+
+/*
+ * mongoBulkDestroy
+ *		Throw away a bulk write without executing it.
+ */
+void
+mongoBulkDestroy(MONGO_BULK *bulk)
+{
+	mongoc_bulk_operation_destroy(bulk);
+}
+
 /*
  * mongoCursorCreate
  *		Performs a query against the configured MongoDB server and return
  *		cursor which can be destroyed by calling mongoc_cursor_current.
+ *
+ * 'opts' may carry a session, to read inside a remote transaction.
  */
 MONGO_CURSOR *
-mongoCursorCreate(MONGO_CONN *conn, char *database, char *collection, BSON *q, bool is_scan_query)
+mongoCursorCreate(MONGO_CONN *conn, char *database, char *collection, BSON *q,
+				  BSON *opts, bool is_scan_query)
 {
 	mongoc_collection_t *c;
 	MONGO_CURSOR *cur;
@@ -254,9 +695,9 @@ mongoCursorCreate(MONGO_CONN *conn, char *database, char *collection, BSON *q, b
 	c = mongoc_client_get_collection(conn, database, collection);
 	if (is_scan_query)
 		cur = mongoc_collection_aggregate (
-				c, MONGOC_QUERY_NONE, q, NULL, NULL);
+				c, MONGOC_QUERY_NONE, q, opts, NULL);
 	else
-		cur = mongoc_collection_find_with_opts(c, q, NULL, NULL);
+		cur = mongoc_collection_find_with_opts(c, q, opts, NULL);
 
 	mongoc_cursor_error(cur, &error);
 	if (!cur)
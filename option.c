@@ -16,7 +16,8 @@
 #include "postgres.h"
 
 #include "miscadmin.h"
-#if PG_VERSION_NUM >= 160000
+#include "parser/scansup.h"
+#if PG_VERSION_NUM >= 100000
 #include "utils/varlena.h"
 #endif
 #include "mongo_wrapper.h"
@@ -130,13 +131,66 @@ mongo_fdw_validator(PG_FUNCTION_ARGS)
 				 || strcmp(optionName, OPTION_NAME_ENABLE_JOIN_PUSHDOWN) == 0
 #ifdef META_DRIVER
 				 || strcmp(optionName, OPTION_NAME_WEAK_CERT) == 0 ||
-				 strcmp(optionName, OPTION_NAME_SSL) == 0
+				 strcmp(optionName, OPTION_NAME_SSL) == 0 ||
+				 strcmp(optionName, OPTION_NAME_BYPASS_DOC_VALIDATION) == 0 ||
+				 strcmp(optionName, OPTION_NAME_UPSERT) == 0
 #endif
 				 )
 		{
 			/* These accept only boolean values */
 			(void) defGetBoolean(optionDef);
 		}
+#ifdef META_DRIVER
+		else if (strcmp(optionName, OPTION_NAME_WRITE_CONCERN) == 0)
+		{
+			MongoWriteConcern wc;
+			char	   *value = defGetString(optionDef);
+			const char *problem;
+
+			problem = mongo_parse_write_concern(value, &wc);
+			if (problem)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"%s\": \"%s\"",
+								optionName, value),
+						 errdetail("%s", problem)));
+		}
+		else if (strcmp(optionName, OPTION_NAME_BATCH_SIZE) == 0)
+		{
+			long		batch_size;
+			char	   *intString = defGetString(optionDef);
+			char	   *endp;
+
+			batch_size = strtol(intString, &endp, 10);
+			if (*endp != '\0' || batch_size <= 0 || batch_size > INT_MAX)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("\"%s\" must be an integer value greater than zero",
+								optionName)));
+		}
+		else if (strcmp(optionName, OPTION_NAME_TRUNCATE_MODE) == 0)
+		{
+			char	   *value = defGetString(optionDef);
+
+			if (strcmp(value, "delete") != 0 && strcmp(value, "drop") != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"%s\": \"%s\"",
+								optionName, value),
+						 errhint("Valid values are \"delete\" and \"drop\".")));
+		}
+		else if (strcmp(optionName, OPTION_NAME_SERVER_VERSION) == 0)
+		{
+			char	   *value = defGetString(optionDef);
+
+			if (mongo_parse_server_version(value) < 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"%s\": \"%s\"",
+								optionName, value),
+						 errhint("The value must be a version number like \"5.0\".")));
+		}
+#endif
 	}
 
 	PG_RETURN_VOID();
@@ -207,6 +261,10 @@ mongo_get_options(Oid foreignTableId, Oid userid)
 #ifdef META_DRIVER
 	options->ssl = false;
 	options->weak_cert_validation = false;
+	options->bypass_document_validation = false;
+	options->upsert = false;
+	options->batch_size = DEFAULT_BATCH_SIZE;
+	options->truncate_drop = false;
 #endif
 
 	/* Loop through the options */
@@ -245,6 +303,24 @@ mongo_get_options(Oid foreignTableId, Oid userid)
 		else if (strcmp(def->defname, OPTION_NAME_WEAK_CERT) == 0)
 			options->weak_cert_validation = defGetBoolean(def);
 
+		else if (strcmp(def->defname, OPTION_NAME_WRITE_CONCERN) == 0)
+			options->writeConcern = defGetString(def);
+
+		else if (strcmp(def->defname, OPTION_NAME_BYPASS_DOC_VALIDATION) == 0)
+			options->bypass_document_validation = defGetBoolean(def);
+
+		else if (strcmp(def->defname, OPTION_NAME_UPSERT) == 0)
+			options->upsert = defGetBoolean(def);
+
+		else if (strcmp(def->defname, OPTION_NAME_BATCH_SIZE) == 0)
+			options->batch_size = atoi(defGetString(def));
+
+		else if (strcmp(def->defname, OPTION_NAME_TRUNCATE_MODE) == 0)
+			options->truncate_drop = strcmp(defGetString(def), "drop") == 0;
+
+		else if (strcmp(def->defname, OPTION_NAME_SERVER_VERSION) == 0)
+			options->svr_version = mongo_parse_server_version(defGetString(def));
+
 		else /* This is for continuation */
 #endif
 
@@ -289,9 +365,179 @@ mongo_get_options(Oid foreignTableId, Oid userid)
 	if (!options->collectionName)
 		options->collectionName= get_rel_name(foreignTableId);
 
+#ifdef META_DRIVER
+	/*
+	 * The session-level write concern overrides the one given for the
+	 * server, but not the one given for the foreign table itself.
+	 */
+	if (mongo_fdw_write_concern && mongo_fdw_write_concern[0] != '\0')
+	{
+		bool		table_level = false;
+
+		foreach(lc, foreignTable->options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, OPTION_NAME_WRITE_CONCERN) == 0)
+				table_level = true;
+		}
+
+		if (!table_level)
+			options->writeConcern = pstrdup(mongo_fdw_write_concern);
+	}
+#endif
+
 	return options;
 }
 
+/*
+ * mongo_parse_write_concern
+ *		Parses a write concern given as a comma-separated list of "w=<value>",
+ *		"j=<bool>" and "wtimeout=<milliseconds>" items into 'wc'.
+ *
+ * Returns NULL on success, otherwise a message describing the problem.  The
+ * caller reports it, so that this can serve both the option validator and
+ * the check hook of the mongo_fdw.write_concern GUC.
+ */
+const char *
+mongo_parse_write_concern(const char *value, MongoWriteConcern *wc)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *lc;
+
+	wc->w = NULL;
+	wc->journal = -1;
+	wc->wtimeout = -1;
+
+	rawstring = pstrdup(value);
+	if (!SplitGUCList(rawstring, ',', &elemlist))
+		return "List syntax is invalid.";
+
+	foreach(lc, elemlist)
+	{
+		char	   *item = (char *) lfirst(lc);
+		char	   *val = strchr(item, '=');
+		char	   *end;
+
+		if (val == NULL)
+			return psprintf("\"%s\" is not of the form name=value.", item);
+
+		/*
+		 * The list items come trimmed of white space by SplitGUCList.  Trim
+		 * the name and the value around "=" the same way.
+		 */
+		for (end = val; end > item && scanner_isspace(end[-1]); end--)
+			;
+		for (val++; scanner_isspace(*val); val++)
+			;
+
+		if (end == item || val[0] == '\0')
+			return psprintf("\"%s\" is not of the form name=value.", item);
+		*end = '\0';
+
+		if (strcmp(item, "w") == 0)
+		{
+			/* Numbers must be plain non-negative integers */
+			if (strspn(val, "0123456789") > 0 &&
+				strspn(val, "0123456789") != strlen(val))
+				return psprintf("Invalid value for \"w\": \"%s\".", val);
+			wc->w = val;
+		}
+		else if (strcmp(item, "j") == 0)
+		{
+			bool		journal;
+
+			if (!parse_bool(val, &journal))
+				return psprintf("Invalid value for \"j\": \"%s\".", val);
+			wc->journal = journal ? 1 : 0;
+		}
+		else if (strcmp(item, "wtimeout") == 0)
+		{
+			long		wtimeout;
+			char	   *endp;
+
+			errno = 0;
+			wtimeout = strtol(val, &endp, 10);
+			if (*endp != '\0' || errno != 0 || wtimeout < 0 ||
+				wtimeout > INT_MAX)
+				return psprintf("Invalid value for \"wtimeout\": \"%s\".",
+								val);
+			wc->wtimeout = (int) wtimeout;
+		}
+		else
+			return psprintf("Unrecognized write concern field \"%s\".", item);
+	}
+
+	return NULL;
+}
+
+/*
+ * mongo_parse_server_version
+ *		Parses a MongoDB version given as "<major>[.<minor>[.<patch>]]".
+ *
+ * Returns major * 100 + minor, or -1 if the value is not of that form.
+ */
+int
+mongo_parse_server_version(const char *value)
+{
+	long		version[3] = {0, 0, 0};
+	const char *p = value;
+	int			i;
+
+	for (i = 0; i < 3; i++)
+	{
+		char	   *endp;
+
+		if (*p < '0' || *p > '9')
+			return -1;
+
+		errno = 0;
+		version[i] = strtol(p, &endp, 10);
+		if (errno != 0 || version[i] > 9999)
+			return -1;
+
+		p = endp;
+		if (*p == '\0')
+			break;
+		if (*p != '.' || i == 2)
+			return -1;
+		p++;
+	}
+
+	if (version[1] > 99)
+		return -1;
+
+	return (int) (version[0] * 100 + version[1]);
+}
+
+/*
+ * mongo_get_server_version
+ *		Returns the server_version option of the given foreign server, as
+ *		major * 100 + minor, or 0 if it is not set.
+ *
+ * A join or an upper relation has the server of its base relations, which
+ * is how the planner checks the features of the server for any relation.
+ */
+int
+mongo_get_server_version(Oid serverid)
+{
+#ifdef META_DRIVER
+	ForeignServer *server = GetForeignServer(serverid);
+	ListCell   *lc;
+
+	foreach(lc, server->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, OPTION_NAME_SERVER_VERSION) == 0)
+			return mongo_parse_server_version(defGetString(def));
+	}
+#endif
+
+	return 0;
+}
+
 void
 mongo_free_options(MongoFdwOptions *options)
 {
@@ -0,0 +1,176 @@
+-- Before running this file User must create database mongo_fdw_regress on
+-- MongoDB with all permission for MONGO_USER_NAME user with MONGO_PASS
+-- password and ran mongodb_init.sh file to load collections.
+\set ECHO none
+\ir sql/parameters.conf
+\set ECHO all
+\c contrib_regression
+--Testcase 1:
+CREATE EXTENSION IF NOT EXISTS mongo_fdw;
+--Testcase 2:
+CREATE SERVER mongo_server FOREIGN DATA WRAPPER mongo_fdw
+  OPTIONS (address :MONGO_HOST, port :MONGO_PORT);
+--Testcase 3:
+CREATE USER MAPPING FOR public SERVER mongo_server;
+
+--Testcase 4:
+CREATE SERVER mongo_server1 FOREIGN DATA WRAPPER mongo_fdw
+  OPTIONS (address :MONGO_HOST, port :MONGO_PORT);
+--Testcase 5:
+CREATE USER MAPPING FOR public SERVER mongo_server1;
+
+-- Create foreign tables.
+--Testcase 6:
+CREATE FOREIGN TABLE f_test_tbl1 (_id NAME, c1 INTEGER, c2 TEXT, c3 CHAR(9), c4 INTEGER, c5 pg_catalog.Date, c6 DECIMAL, c7 INTEGER, c8 INTEGER)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl1');
+--Testcase 7:
+CREATE FOREIGN TABLE f_test_tbl2 (_id NAME, c1 INTEGER, c2 TEXT, c3 TEXT)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl2');
+--Testcase 8:
+CREATE FOREIGN TABLE f_test_tbl3 (_id NAME, c1 INTEGER, c2 TEXT, c3 TEXT)
+  SERVER mongo_server1 OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl2');
+
+--Testcase 9:
+INSERT INTO f_test_tbl1 VALUES (0, 1500, 'EMP15', 'FINANCE', 1300, '2000-12-25', 950.0, 400, 60);
+--Testcase 10:
+INSERT INTO f_test_tbl1 VALUES (0, 1600, 'EMP16', 'ADMIN', 600);
+--Testcase 11:
+INSERT INTO f_test_tbl2 VALUES (0, 50, 'TESTING', 'NASHIK');
+--Testcase 12:
+INSERT INTO f_test_tbl2 VALUES (0);
+
+--Testcase 13:
+SET datestyle TO ISO;
+
+-- ORDER BY on a column of the inner relation of a join, which is sorted
+-- within the looked up documents.
+--Testcase 14:
+EXPLAIN (COSTS FALSE, VERBOSE)
+SELECT d.c1, e.c1
+  FROM f_test_tbl2 d JOIN f_test_tbl1 e ON d.c1 = e.c8 ORDER BY e.c1 DESC NULLS LAST;
+--Testcase 15:
+SELECT d.c1, e.c1
+  FROM f_test_tbl2 d JOIN f_test_tbl1 e ON d.c1 = e.c8 ORDER BY e.c1 DESC NULLS LAST;
+
+-- A join that is not pushed down still filters the documents of a foreign
+-- table by the restrictions on the column it is joined to.  A list of
+-- consecutive integers is sent as a range.
+--Testcase 28:
+SELECT d.c1, e.c1
+  FROM f_test_tbl3 d JOIN f_test_tbl1 e ON d.c1 = e.c8 WHERE d.c1 IN (10, 30)
+  ORDER BY 1, 2;
+--Testcase 29:
+SELECT d.c1, e.c1
+  FROM f_test_tbl3 d JOIN f_test_tbl1 e ON d.c1 = e.c8 WHERE d.c1 IN (19, 20, 21)
+  ORDER BY 1, 2;
+--Testcase 30:
+SET mongo_fdw.key_filter_limit TO 0;
+--Testcase 31:
+SELECT d.c1, e.c1
+  FROM f_test_tbl3 d JOIN f_test_tbl1 e ON d.c1 = e.c8 WHERE d.c1 IN (10, 30)
+  ORDER BY 1, 2;
+--Testcase 32:
+RESET mongo_fdw.key_filter_limit;
+
+-- Joins of three tables, looking up the same collection twice.  The rows
+-- without a match, or with a null or missing join column, are kept by LEFT
+-- JOIN.
+--Testcase 33:
+SELECT d.c1, e.c1, f.c1
+  FROM f_test_tbl2 d LEFT JOIN f_test_tbl1 e ON d.c1 = e.c8
+  LEFT JOIN f_test_tbl1 f ON e.c4 = f.c1
+  ORDER BY 1, 2;
+
+-- EXISTS, NOT EXISTS and IN subqueries are pushed down as semi and anti
+-- joins.  A null join column never matches.
+--Testcase 34:
+EXPLAIN (COSTS FALSE, VERBOSE)
+SELECT d.c1 FROM f_test_tbl2 d
+  WHERE EXISTS (SELECT 1 FROM f_test_tbl1 e WHERE d.c1 = e.c8);
+--Testcase 35:
+SELECT d.c1 FROM f_test_tbl2 d
+  WHERE EXISTS (SELECT 1 FROM f_test_tbl1 e WHERE d.c1 = e.c8)
+  ORDER BY 1;
+--Testcase 36:
+EXPLAIN (COSTS FALSE, VERBOSE)
+SELECT d.c1 FROM f_test_tbl2 d
+  WHERE NOT EXISTS (SELECT 1 FROM f_test_tbl1 e WHERE d.c1 = e.c8);
+--Testcase 37:
+SELECT d.c1 FROM f_test_tbl2 d
+  WHERE NOT EXISTS (SELECT 1 FROM f_test_tbl1 e WHERE d.c1 = e.c8)
+  ORDER BY 1;
+--Testcase 38:
+SELECT d.c1 FROM f_test_tbl2 d
+  WHERE d.c1 IN (SELECT e.c8 FROM f_test_tbl1 e) ORDER BY 1;
+
+-- From MongoDB 5.0 on, the $lookup stage of an equality join also names the
+-- joined fields.  Only the plan is shown, as older servers reject the stage.
+--Testcase 39:
+ALTER SERVER mongo_server OPTIONS (ADD server_version 'five');
+--Testcase 40:
+ALTER SERVER mongo_server OPTIONS (ADD server_version '5.0');
+--Testcase 41:
+EXPLAIN (COSTS FALSE, VERBOSE)
+SELECT d.c1, e.c1 FROM f_test_tbl2 d JOIN f_test_tbl1 e ON d.c1 = e.c8;
+--Testcase 42:
+ALTER SERVER mongo_server OPTIONS (DROP server_version);
+
+-- With use_remote_estimate, pushed down joins are costed, and either
+-- relation of an inner join may drive the $lookup.
+--Testcase 43:
+ALTER SERVER mongo_server OPTIONS (ADD use_remote_estimate 'true');
+--Testcase 44:
+SELECT d.c1, e.c1
+  FROM f_test_tbl2 d JOIN f_test_tbl1 e ON d.c1 = e.c8 WHERE e.c1 < 600
+  ORDER BY 1, 2;
+--Testcase 45:
+SELECT d.c1, e.c1
+  FROM f_test_tbl1 e JOIN f_test_tbl2 d ON d.c1 = e.c8 WHERE e.c1 < 600
+  ORDER BY 1, 2;
+--Testcase 46:
+SELECT d.c1, e.c1
+  FROM f_test_tbl2 d LEFT JOIN f_test_tbl1 e ON d.c1 = e.c8 AND e.c1 < 300
+  ORDER BY 1, 2;
+--Testcase 47:
+ALTER SERVER mongo_server OPTIONS (DROP use_remote_estimate);
+
+-- The conditions on either relation of a join are applied before the
+-- documents are joined.
+--Testcase 48:
+EXPLAIN (COSTS FALSE, VERBOSE)
+SELECT d.c1, e.c1
+  FROM f_test_tbl2 d JOIN f_test_tbl1 e ON d.c1 = e.c8 WHERE d.c1 > 10 AND e.c1 < 600;
+--Testcase 49:
+SELECT d.c1, e.c1
+  FROM f_test_tbl2 d JOIN f_test_tbl1 e ON d.c1 = e.c8 WHERE d.c1 > 10 AND e.c1 < 600
+  ORDER BY 1, 2;
+--Testcase 50:
+SELECT d.c1, e.c1
+  FROM f_test_tbl2 d LEFT JOIN f_test_tbl1 e ON d.c1 = e.c8 WHERE d.c1 >= 30
+  ORDER BY 1, 2;
+
+-- Cleanup
+--Testcase 16:
+DELETE FROM f_test_tbl1 WHERE c8 IS NULL;
+--Testcase 17:
+DELETE FROM f_test_tbl1 WHERE c8 = 60;
+--Testcase 18:
+DELETE FROM f_test_tbl2 WHERE c1 IS NULL;
+--Testcase 19:
+DELETE FROM f_test_tbl2 WHERE c1 = 50;
+--Testcase 20:
+DROP FOREIGN TABLE f_test_tbl1;
+--Testcase 21:
+DROP FOREIGN TABLE f_test_tbl2;
+--Testcase 22:
+DROP FOREIGN TABLE f_test_tbl3;
+--Testcase 23:
+DROP USER MAPPING FOR public SERVER mongo_server1;
+--Testcase 24:
+DROP SERVER mongo_server1;
+--Testcase 25:
+DROP USER MAPPING FOR public SERVER mongo_server;
+--Testcase 26:
+DROP SERVER mongo_server;
+--Testcase 27:
+DROP EXTENSION mongo_fdw;
@@ -0,0 +1,316 @@
+-- Before running this file User must create database mongo_fdw_regress on
+-- MongoDB with all permission for MONGO_USER_NAME user with MONGO_PASS
+-- password and ran mongodb_init.sh file to load collections.
+\set ECHO none
+\ir sql/parameters.conf
+\set ECHO all
+\c contrib_regression
+--Testcase 1:
+CREATE EXTENSION IF NOT EXISTS mongo_fdw;
+--Testcase 2:
+CREATE SERVER mongo_server FOREIGN DATA WRAPPER mongo_fdw
+  OPTIONS (address :MONGO_HOST, port :MONGO_PORT);
+--Testcase 3:
+CREATE USER MAPPING FOR public SERVER mongo_server;
+
+-- Create foreign tables
+--Testcase 4:
+CREATE FOREIGN TABLE f_test_tbl1 (_id name, c1 INTEGER, c2 VARCHAR(10), c3 CHAR(9), c4 INTEGER, c5 pg_catalog.Date, c6 DECIMAL, c7 INTEGER, c8 INTEGER)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl1');
+--Testcase 5:
+CREATE FOREIGN TABLE f_test_tbl3 (_id name, name TEXT, marks FLOAT ARRAY, pass BOOLEAN)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl3');
+
+--Testcase 6:
+SET datestyle TO ISO;
+
+-- A numeric constant beyond the float8 range is not pushed down.
+--Testcase 7:
+SELECT count(*) FROM f_test_tbl1 WHERE c6 < 1e400;
+
+-- ORDER BY pushdown.  MongoDB sorts nulls first, so a null key is sorted
+-- first where nulls go last, unless the column cannot be null.
+--Testcase 13:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, c4 FROM f_test_tbl1 ORDER BY c4, c1;
+--Testcase 14:
+SELECT c1, c4 FROM f_test_tbl1 ORDER BY c4, c1;
+--Testcase 15:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, c4 FROM f_test_tbl1 WHERE c4 > 600 ORDER BY c4 DESC, c1 DESC NULLS LAST;
+--Testcase 16:
+SELECT c1, c4 FROM f_test_tbl1 WHERE c4 > 600 ORDER BY c4 DESC, c1 DESC NULLS LAST;
+
+-- MongoDB sorts NaN below all other numbers, so a numeric key is sorted
+-- locally.
+--Testcase 100:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, c6 FROM f_test_tbl1 WHERE c1 = 800 ORDER BY c6;
+
+-- With use_remote_estimate, the indexes of the collection are fetched to
+-- plan ordered scans.  ASC NULLS FIRST is MongoDB's own ordering, which an
+-- index can serve.
+--Testcase 17:
+ALTER SERVER mongo_server OPTIONS (ADD use_remote_estimate 'true');
+--Testcase 18:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, c8 FROM f_test_tbl1 ORDER BY c8 NULLS FIRST, c1 NULLS FIRST;
+--Testcase 19:
+SELECT c1, c8 FROM f_test_tbl1 ORDER BY c8 NULLS FIRST, c1 NULLS FIRST;
+--Testcase 20:
+ALTER SERVER mongo_server OPTIONS (DROP use_remote_estimate);
+
+-- A comparison with a null parameter matches no document, not those where
+-- the field is null or missing.
+--Testcase 21:
+SET plan_cache_mode TO force_generic_plan;
+--Testcase 22:
+PREPARE cmp_param(int) AS
+  SELECT c1, c4 FROM f_test_tbl1 WHERE c4 = $1 ORDER BY c1;
+--Testcase 23:
+EXPLAIN (VERBOSE, COSTS FALSE) EXECUTE cmp_param(NULL);
+--Testcase 24:
+EXECUTE cmp_param(NULL);
+--Testcase 25:
+EXECUTE cmp_param(400);
+--Testcase 26:
+DEALLOCATE cmp_param;
+--Testcase 27:
+RESET plan_cache_mode;
+
+-- A parameterized scan is scanned again for each outer row, including
+-- repeated and null join keys.
+--Testcase 28:
+SELECT t.x, e.c2 FROM (VALUES (100), (100), (900), (NULL::int)) t(x)
+  LEFT JOIN LATERAL (SELECT c2 FROM f_test_tbl1 WHERE c1 = t.x) e ON true
+  ORDER BY 1, 2;
+
+-- DISTINCT and aggregates with DISTINCT are computed by the $group stage,
+-- which leaves the null values out of count(DISTINCT).
+--Testcase 29:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT DISTINCT c8 FROM f_test_tbl1;
+--Testcase 30:
+SELECT DISTINCT c8 FROM f_test_tbl1 ORDER BY 1;
+--Testcase 31:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c8, count(DISTINCT c4) FROM f_test_tbl1 GROUP BY c8;
+--Testcase 32:
+SELECT c8, count(DISTINCT c4), count(c4), count(*) FROM f_test_tbl1
+  GROUP BY c8 ORDER BY 1;
+
+-- array_agg keeps the null values, which string_agg and bool_and skip.
+-- "$sortArray" needs MongoDB 5.2 for the ORDER BY inside the aggregates.
+--Testcase 98:
+ALTER SERVER mongo_server OPTIONS (ADD server_version '5.2');
+--Testcase 33:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c8, array_agg(c4 ORDER BY c1), string_agg(c2, ',' ORDER BY c1)
+  FROM f_test_tbl1 GROUP BY c8;
+--Testcase 34:
+SELECT c8, array_agg(c4 ORDER BY c1), string_agg(c2, ',' ORDER BY c1)
+  FROM f_test_tbl1 GROUP BY c8 ORDER BY 1;
+--Testcase 99:
+ALTER SERVER mongo_server OPTIONS (DROP server_version);
+--Testcase 35:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT bool_and(pass), bool_or(pass) FROM f_test_tbl3;
+--Testcase 36:
+SELECT bool_and(pass), bool_or(pass) FROM f_test_tbl3;
+-- A comparison of a null c4 is null, not false, so this is computed locally.
+--Testcase 37:
+SELECT c8, bool_and(c4 > 500) FROM f_test_tbl1 GROUP BY c8 ORDER BY 1;
+
+-- A sum is null for a group without any value.
+--Testcase 38:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, sum(c4) FROM f_test_tbl1 WHERE c1 >= 800 AND c1 <= 900 GROUP BY c1;
+--Testcase 39:
+SELECT c1, sum(c4) FROM f_test_tbl1 WHERE c1 >= 800 AND c1 <= 900
+  GROUP BY c1 ORDER BY 1;
+
+-- Window functions need MongoDB 5.0, so they are computed locally unless
+-- server_version says the server has "$setWindowFields".
+--Testcase 90:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, count(*) OVER () FROM f_test_tbl1 WHERE c1 = 800;
+--Testcase 91:
+ALTER SERVER mongo_server OPTIONS (ADD server_version '5.0');
+-- A window sum is null for a frame without any value.
+--Testcase 40:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, sum(c4) OVER (PARTITION BY c4) FROM f_test_tbl1
+  WHERE c1 >= 800 AND c1 <= 1300;
+--Testcase 41:
+SELECT c1, sum(c4) OVER (PARTITION BY c4) FROM f_test_tbl1
+  WHERE c1 >= 800 AND c1 <= 1300 ORDER BY 1;
+--Testcase 92:
+ALTER SERVER mongo_server OPTIONS (DROP server_version);
+
+-- Each grouping set is grouped in a $facet of its own, and the column it
+-- leaves out is null.
+--Testcase 42:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c8, count(*) FROM f_test_tbl1 GROUP BY ROLLUP (c8);
+--Testcase 43:
+SELECT c8, count(*) FROM f_test_tbl1 GROUP BY ROLLUP (c8) ORDER BY 1;
+
+-- Date/time functions of a timestamp.  The date of a missing field is null,
+-- which matches no comparison.
+--Testcase 44:
+CREATE FOREIGN TABLE f_test_ts (_id name, c1 int, c5 timestamp, c9 timestamp)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl1');
+--Testcase 45:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_ts WHERE date_part('year', c5) = 1987;
+--Testcase 46:
+SELECT c1 FROM f_test_ts WHERE date_part('year', c5) = 1987 ORDER BY 1;
+--Testcase 47:
+SELECT c1 FROM f_test_ts WHERE date_part('year', c9) < 2000;
+-- $divide does not truncate integers, so this is evaluated locally.
+--Testcase 48:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_tbl1 WHERE c1 / 300 = 1;
+--Testcase 49:
+SELECT c1 FROM f_test_tbl1 WHERE c1 / 300 = 1 ORDER BY 1;
+
+-- $dateTrunc and $dateAdd need MongoDB 5.0, so date_trunc and interval
+-- arithmetic are evaluated locally unless server_version says so.
+--Testcase 93:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_ts WHERE date_part('month', date_trunc('quarter', c5)) = 4;
+--Testcase 94:
+ALTER SERVER mongo_server OPTIONS (ADD server_version '5.0');
+--Testcase 95:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_ts WHERE date_part('month', date_trunc('quarter', c5)) = 4;
+--Testcase 96:
+SELECT c1 FROM f_test_ts WHERE date_part('month', date_trunc('quarter', c5)) = 4 ORDER BY 1;
+--Testcase 97:
+ALTER SERVER mongo_server OPTIONS (DROP server_version);
+
+-- A LIKE pattern with a literal prefix is an anchored $regex.  A text
+-- constant of an aggregate expression is a $literal, not a field path.
+--Testcase 51:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1, c2 FROM f_test_tbl1 WHERE c2 LIKE 'EMP1%';
+--Testcase 52:
+SELECT c1, c2 FROM f_test_tbl1 WHERE c2 LIKE 'EMP1%' ORDER BY 1;
+--Testcase 53:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_tbl1 WHERE c2 || '$' = 'EMP1$';
+--Testcase 54:
+SELECT c1 FROM f_test_tbl1 WHERE c2 || '$' = 'EMP1$';
+--Testcase 55:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_tbl1 WHERE btrim(c2) LIKE '$c3';
+--Testcase 56:
+SELECT c1 FROM f_test_tbl1 WHERE btrim(c2) LIKE '$c3';
+
+-- COALESCE takes a missing field as null, and a CASE condition on a null
+-- value is false.
+--Testcase 57:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_tbl1 WHERE COALESCE(c4, 0) < 500;
+--Testcase 58:
+SELECT c1 FROM f_test_tbl1 WHERE COALESCE(c4, 0) < 500 ORDER BY 1;
+--Testcase 59:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c8, sum(CASE WHEN c4 > 900 THEN c4 END) FROM f_test_tbl1 GROUP BY c8;
+--Testcase 60:
+SELECT c8, sum(CASE WHEN c4 > 900 THEN c4 END) FROM f_test_tbl1
+  GROUP BY c8 ORDER BY 1;
+
+-- Boolean columns and tests.  The column done is missing from all the
+-- documents, so it is null.
+--Testcase 61:
+CREATE FOREIGN TABLE f_test_bool (_id name, name text, pass boolean, done boolean)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl3');
+--Testcase 62:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT name FROM f_test_bool WHERE NOT pass;
+--Testcase 63:
+SELECT name FROM f_test_bool WHERE NOT pass;
+--Testcase 64:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT name FROM f_test_bool WHERE pass IS NOT TRUE AND done IS UNKNOWN;
+--Testcase 65:
+SELECT name FROM f_test_bool WHERE pass IS NOT TRUE AND done IS UNKNOWN;
+--Testcase 66:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT name FROM f_test_bool WHERE NOT pass OR done;
+--Testcase 67:
+SELECT name FROM f_test_bool WHERE NOT pass OR done;
+-- Neither a missing field nor its negation is true.
+--Testcase 68:
+SELECT name FROM f_test_bool WHERE done OR NOT done;
+--Testcase 69:
+SELECT name FROM f_test_bool WHERE done IS NOT FALSE AND pass IS NOT FALSE;
+
+-- jsonb filters.  MongoDB returns the documents that may match, and the
+-- filter is checked on them.
+--Testcase 71:
+CREATE FOREIGN TABLE f_test_json (_id name, c1 int, doc jsonb)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl6');
+--Testcase 72:
+CREATE FOREIGN TABLE f_test_json_doc (__doc jsonb)
+  SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'test_tbl6');
+--Testcase 73:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_json WHERE doc ->> 'status' = 'open';
+--Testcase 74:
+SELECT c1 FROM f_test_json WHERE doc ->> 'status' = 'open';
+-- A string that reads as a number is not given to MongoDB.
+--Testcase 75:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_json WHERE doc ->> 'status' = '1';
+--Testcase 76:
+SELECT c1 FROM f_test_json WHERE doc ->> 'status' = '1';
+--Testcase 77:
+SELECT c1 FROM f_test_json WHERE doc ->> 'missing' = 'open';
+-- MongoDB also matches the path in the array of c1 = 2.
+--Testcase 78:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_json WHERE doc #>> '{a,b}' = 'x';
+--Testcase 79:
+SELECT c1 FROM f_test_json WHERE doc #>> '{a,b}' = 'x';
+--Testcase 80:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_json WHERE doc ? 'status';
+--Testcase 81:
+SELECT c1 FROM f_test_json WHERE doc ? 'status' ORDER BY 1;
+--Testcase 82:
+SELECT c1 FROM f_test_json WHERE doc ? 'tags' ORDER BY 1;
+--Testcase 83:
+EXPLAIN (VERBOSE, COSTS FALSE)
+SELECT c1 FROM f_test_json WHERE doc @> '{"tags": ["x"], "items": [{"k": 1}]}';
+--Testcase 84:
+SELECT c1 FROM f_test_json WHERE doc @> '{"tags": ["x"], "items": [{"k": 1}]}';
+-- MongoDB also matches the string of c1 = 5.
+--Testcase 85:
+SELECT c1 FROM f_test_json WHERE doc @> '{"tags": ["x"]}' ORDER BY 1;
+-- The paths of __doc start at the document.
+--Testcase 86:
+SELECT count(*) FROM f_test_json_doc WHERE __doc -> 'doc' ->> 'status' = 'open';
+--Testcase 87:
+SELECT count(*) FROM f_test_json_doc WHERE __doc ? 'doc';
+
+-- Cleanup
+--Testcase 8:
+DROP FOREIGN TABLE f_test_tbl1;
+--Testcase 9:
+DROP FOREIGN TABLE f_test_tbl3;
+--Testcase 50:
+DROP FOREIGN TABLE f_test_ts;
+--Testcase 70:
+DROP FOREIGN TABLE f_test_bool;
+--Testcase 88:
+DROP FOREIGN TABLE f_test_json;
+--Testcase 89:
+DROP FOREIGN TABLE f_test_json_doc;
+--Testcase 10:
+DROP USER MAPPING FOR public SERVER mongo_server;
+--Testcase 11:
+DROP SERVER mongo_server;
+--Testcase 12:
+DROP EXTENSION mongo_fdw;
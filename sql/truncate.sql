@@ -0,0 +1,53 @@
+-- Before running this file User must create database mongo_fdw_regress on
+-- MongoDB with all permission for MONGO_USER_NAME user with MONGO_PASS
+-- password and ran mongodb_init.sh file to load collections.
+\set ECHO none
+\ir sql/parameters.conf
+\set ECHO all
+\c contrib_regression
+--Testcase 1:
+CREATE EXTENSION IF NOT EXISTS mongo_fdw;
+--Testcase 2:
+CREATE SERVER mongo_server FOREIGN DATA WRAPPER mongo_fdw
+  OPTIONS (address :MONGO_HOST, port :MONGO_PORT);
+--Testcase 3:
+CREATE USER MAPPING FOR public SERVER mongo_server;
+
+-- Create foreign tables
+--Testcase 4:
+CREATE FOREIGN TABLE f_mongo_test7 (_id name, a int, b varchar) SERVER mongo_server
+  OPTIONS (database 'mongo_fdw_regress', collection 'mongo_test7');
+
+--Testcase 5:
+INSERT INTO f_mongo_test7 VALUES ('0', 1, 'One');
+--Testcase 6:
+INSERT INTO f_mongo_test7 VALUES ('0', 2, 'Two');
+
+-- TRUNCATE empties the collection, by deleting all the documents or by
+-- dropping and creating it again.  It needs PostgreSQL 14 or later.
+--Testcase 7:
+TRUNCATE f_mongo_test7;
+--Testcase 8:
+SELECT a, b FROM f_mongo_test7 ORDER BY a;
+--Testcase 9:
+INSERT INTO f_mongo_test7 VALUES ('0', 21, 'Twenty-one');
+--Testcase 10:
+ALTER FOREIGN TABLE f_mongo_test7 OPTIONS (ADD truncate_mode 'remove');
+--Testcase 11:
+ALTER FOREIGN TABLE f_mongo_test7 OPTIONS (ADD truncate_mode 'drop');
+--Testcase 12:
+TRUNCATE f_mongo_test7;
+--Testcase 13:
+SELECT a, b FROM f_mongo_test7 ORDER BY a;
+--Testcase 14:
+DELETE FROM f_mongo_test7;
+
+-- Cleanup
+--Testcase 15:
+DROP FOREIGN TABLE f_mongo_test7;
+--Testcase 16:
+DROP USER MAPPING FOR public SERVER mongo_server;
+--Testcase 17:
+DROP SERVER mongo_server;
+--Testcase 18:
+DROP EXTENSION mongo_fdw;
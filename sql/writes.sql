@@ -0,0 +1,146 @@
+-- Before running this file User must create database mongo_fdw_regress on
+-- MongoDB with all permission for MONGO_USER_NAME user with MONGO_PASS
+-- password and ran mongodb_init.sh file to load collections.
+\set ECHO none
+\ir sql/parameters.conf
+\set ECHO all
+\c contrib_regression
+--Testcase 1:
+CREATE EXTENSION IF NOT EXISTS mongo_fdw;
+--Testcase 2:
+CREATE SERVER mongo_server FOREIGN DATA WRAPPER mongo_fdw
+  OPTIONS (address :MONGO_HOST, port :MONGO_PORT);
+--Testcase 3:
+CREATE USER MAPPING FOR public SERVER mongo_server;
+
+-- Create foreign tables
+--Testcase 4:
+CREATE FOREIGN TABLE f_mongo_test5 (_id name, a int, b varchar) SERVER mongo_server
+  OPTIONS (database 'mongo_fdw_regress', collection 'mongo_test5');
+
+-- write_concern takes a list of w, j and wtimeout items, white space allowed
+-- around "=".
+--Testcase 5:
+ALTER SERVER mongo_server
+  OPTIONS (ADD write_concern 'w = majority, j = true, wtimeout = 1000');
+--Testcase 6:
+ALTER SERVER mongo_server OPTIONS (SET write_concern 'w=1, j');
+--Testcase 7:
+ALTER SERVER mongo_server OPTIONS (SET write_concern 'w=1x');
+--Testcase 8:
+ALTER SERVER mongo_server OPTIONS (SET write_concern 'wtimeout=-5');
+--Testcase 9:
+ALTER SERVER mongo_server OPTIONS (SET write_concern 'fsync=true');
+--Testcase 10:
+SET mongo_fdw.write_concern = 'w=2x';
+-- The table option wins over the server option.
+--Testcase 11:
+ALTER FOREIGN TABLE f_mongo_test5 OPTIONS (ADD write_concern 'w=1, j=false');
+--Testcase 12:
+ALTER FOREIGN TABLE f_mongo_test5 OPTIONS (ADD bypass_document_validation 'abc');
+--Testcase 13:
+ALTER FOREIGN TABLE f_mongo_test5 OPTIONS (ADD bypass_document_validation 'true');
+--Testcase 14:
+INSERT INTO f_mongo_test5 VALUES ('0', 3, 'write concern');
+--Testcase 15:
+SELECT a, b FROM f_mongo_test5 ORDER BY 1, 2;
+--Testcase 16:
+DELETE FROM f_mongo_test5 WHERE a = 3;
+--Testcase 17:
+ALTER FOREIGN TABLE f_mongo_test5
+  OPTIONS (DROP write_concern, DROP bypass_document_validation);
+--Testcase 18:
+ALTER SERVER mongo_server OPTIONS (DROP write_concern);
+
+-- INSERT ... ON CONFLICT DO NOTHING only inserts, and returns, the rows
+-- whose _id is not taken yet.
+--Testcase 24:
+INSERT INTO f_mongo_test5
+  VALUES ('000000000000000000000001', 1, 'One'),
+         ('000000000000000000000002', 2, 'Two')
+  ON CONFLICT DO NOTHING;
+--Testcase 25:
+INSERT INTO f_mongo_test5
+  VALUES ('000000000000000000000001', 1, 'One again'),
+         ('000000000000000000000003', 3, 'Three')
+  ON CONFLICT DO NOTHING RETURNING _id, a, b;
+--Testcase 26:
+SELECT _id, a, b FROM f_mongo_test5 ORDER BY a;
+-- ON CONFLICT DO UPDATE needs a unique index, which a foreign table can't
+-- have.
+--Testcase 27:
+INSERT INTO f_mongo_test5 VALUES ('000000000000000000000001', 1, 'One')
+  ON CONFLICT (_id) DO UPDATE SET b = 'One updated';
+-- With the upsert option, a row with an _id replaces the document.
+--Testcase 28:
+ALTER FOREIGN TABLE f_mongo_test5 OPTIONS (ADD upsert 'true');
+--Testcase 29:
+INSERT INTO f_mongo_test5 VALUES ('000000000000000000000002', 20, 'Two replaced');
+--Testcase 30:
+ALTER FOREIGN TABLE f_mongo_test5 OPTIONS (DROP upsert);
+--Testcase 31:
+SELECT _id, a, b FROM f_mongo_test5 ORDER BY a;
+
+-- With mongo_fdw.deferred_writes, writes are kept back until commit.  Those
+-- of a subtransaction that rolls back, or of an aborted transaction, are
+-- dropped.
+--Testcase 32:
+SET mongo_fdw.deferred_writes TO on;
+--Testcase 33:
+BEGIN;
+--Testcase 34:
+INSERT INTO f_mongo_test5 VALUES ('0', 4, 'Four');
+--Testcase 35:
+SAVEPOINT s1;
+--Testcase 36:
+UPDATE f_mongo_test5 SET b = 'One updated' WHERE a = 1;
+--Testcase 37:
+INSERT INTO f_mongo_test5 VALUES ('0', 5, 'Five');
+--Testcase 38:
+ROLLBACK TO SAVEPOINT s1;
+--Testcase 39:
+COMMIT;
+--Testcase 40:
+SELECT a, b FROM f_mongo_test5 ORDER BY a;
+--Testcase 41:
+BEGIN;
+--Testcase 42:
+DELETE FROM f_mongo_test5 WHERE a = 4;
+--Testcase 43:
+ROLLBACK;
+--Testcase 44:
+SELECT a, b FROM f_mongo_test5 ORDER BY a;
+--Testcase 45:
+RESET mongo_fdw.deferred_writes;
+
+-- jsonb values are written as BSON documents, keeping integral numbers
+-- beyond the int32 range exact.
+--Testcase 46:
+CREATE FOREIGN TABLE f_mongo_test6 (_id name, a int, j jsonb) SERVER mongo_server
+  OPTIONS (database 'mongo_fdw_regress', collection 'mongo_test6');
+--Testcase 47:
+INSERT INTO f_mongo_test6 VALUES ('0', 1,
+  '{"n": 1, "big": 5000000000, "f": 1.5, "s": "x", "t": true, "z": null, "arr": [1, "two", {"k": 3}]}');
+--Testcase 48:
+SELECT a, j FROM f_mongo_test6;
+--Testcase 49:
+SELECT a, j->'big' AS big FROM f_mongo_test6;
+-- A number beyond the range of a double can't be stored.
+--Testcase 52:
+INSERT INTO f_mongo_test6 VALUES ('0', 2, '{"huge": 1e400}');
+--Testcase 50:
+DELETE FROM f_mongo_test6;
+
+-- Cleanup
+--Testcase 19:
+DELETE FROM f_mongo_test5;
+--Testcase 20:
+DROP FOREIGN TABLE f_mongo_test5;
+--Testcase 51:
+DROP FOREIGN TABLE f_mongo_test6;
+--Testcase 21:
+DROP USER MAPPING FOR public SERVER mongo_server;
+--Testcase 22:
+DROP SERVER mongo_server;
+--Testcase 23:
+DROP EXTENSION mongo_fdw;